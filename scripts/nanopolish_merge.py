@@ -59,13 +59,11 @@ def merge_into_consensus(consensus, incoming, overlap_length):
 
     return merged
 
-# Do not change, must match nanopolish_makerange.py segment lengths
-SEGMENT_LENGTH = 50000
-OVERLAP_LENGTH = 200
-
 segments_by_name = dict()
 
-# Load the polished segments into a dictionary keyed by the start coordinate
+# Load the polished segments into a dictionary keyed by the start coordinate.
+# The segments may have any length, as written by nanopolish_makerange.py or
+# nanopolish partition, so the end coordinate is kept to find the overlap
 for fn in sys.argv[1:]:
     for rec in SeqIO.parse(open(fn), "fasta"):
         (contig, segment_range) = rec.name.split(":")
@@ -76,22 +74,25 @@ for fn in sys.argv[1:]:
         segment_start, segment_end = segment_range.split("-")
 
         sys.stderr.write('Insert %s %s\n' % (contig, segment_start))
-        segments_by_name[contig][int(segment_start)] = str(rec.seq)
+        segments_by_name[contig][int(segment_start)] = (int(segment_end), str(rec.seq))
 
 # Assemble while making sure every segment is present
 for contig_name in sorted(segments_by_name.keys()):
     assembly = ""
-    prev_segment = None
+    prev_segment_end = None
     for segment_start in sorted(segments_by_name[contig_name]):
 
         sys.stderr.write('Merging %s %d\n' % (contig_name, segment_start))
+        (segment_end, sequence) = segments_by_name[contig_name][segment_start]
+
         # Ensure the segments overlap
-        assert(prev_segment is None or prev_segment + SEGMENT_LENGTH + OVERLAP_LENGTH > segment_start)
-                
-        sequence = segments_by_name[contig_name][segment_start]
+        overlap_length = 0
+        if prev_segment_end is not None:
+            overlap_length = prev_segment_end - segment_start
+            assert(overlap_length > 0)
 
-        assembly = merge_into_consensus(assembly, sequence, OVERLAP_LENGTH)
-        prev_segment = segment_start
+        assembly = merge_into_consensus(assembly, sequence, overlap_length)
+        prev_segment_end = segment_end
 
     # Write final assembly
     print(">%s\n%s" % (contig_name, assembly))
@@ -8,6 +8,7 @@
 //
 #include <assert.h>
 #include <algorithm>
+#include <set>
 #include "nanopolish_alignment_db.h"
 #include "htslib/faidx.h"
 #include "htslib/hts.h"
@@ -85,6 +86,7 @@ AlignmentDB::AlignmentDB(const std::string& reads_file,
                             m_reference_file(reference_file),
                             m_sequence_bam(sequence_bam),
                             m_event_bam(event_bam),
+                            m_alternative_basecalls_index(NULL),
                             m_fast5_name_map(reads_file),
                             m_calibrate_on_load(calibrate_reads)
 {
@@ -99,6 +101,9 @@ AlignmentDB::~AlignmentDB()
 void AlignmentDB::set_alternative_basecalls_bam(const std::string& alternative_basecalls_bam)
 {
     m_alternative_basecalls_bam = alternative_basecalls_bam;
+
+    // the index is built once per process and shared by every window
+    m_alternative_basecalls_index = &BamNameIndex::get(alternative_basecalls_bam);
 }
 
 bool AlignmentDB::are_coordinates_valid(const std::string& contig,
@@ -347,6 +352,59 @@ std::vector<Variant> AlignmentDB::get_variants_in_region(const std::string& cont
     return variants;
 }
 
+std::vector<double> AlignmentDB::get_base_disagreement(const std::string& contig,
+                                                       int start_position,
+                                                       int stop_position) const
+{
+    assert(m_region_contig == contig);
+    assert(m_region_start <= start_position);
+    assert(m_region_end >= stop_position);
+
+    size_t n = stop_position - start_position + 1;
+    std::vector<int> depth(n, 0);
+    std::vector<int> disagree(n, 0);
+
+    for(size_t i = 0; i < m_sequence_records.size(); ++i) {
+        const SequenceAlignmentRecord& record = m_sequence_records[i];
+        if(record.aligned_bases.empty())
+            continue;
+
+        AlignedPairRefLBComp lb_comp;
+        AlignedPairConstIter start_iter = std::lower_bound(record.aligned_bases.begin(),
+                                                           record.aligned_bases.end(),
+                                                           start_position, lb_comp);
+
+        for(; start_iter != record.aligned_bases.end(); ++start_iter) {
+            int rp = start_iter->ref_pos;
+            if(rp > stop_position) {
+                break;
+            }
+
+            size_t idx = rp - start_position;
+            depth[idx]++;
+
+            char rb = m_region_ref_sequence[rp - m_region_start];
+            char ab = record.sequence[start_iter->read_pos];
+
+            // a gap in either coordinate before the next aligned pair is an indel
+            auto next_iter = start_iter + 1;
+            bool is_gap = next_iter != record.aligned_bases.end() &&
+                            (next_iter->ref_pos != rp + 1 ||
+                                next_iter->read_pos != start_iter->read_pos + 1);
+
+            if(rb != ab || is_gap) {
+                disagree[idx]++;
+            }
+        }
+    }
+
+    std::vector<double> out(n, 0.0f);
+    for(size_t i = 0; i < n; ++i) {
+        out[i] = depth[i] > 0 ? (double)disagree[i] / depth[i] : 0.0f;
+    }
+    return out;
+}
+
 void AlignmentDB::load_region(const std::string& contig,
                               int start_position,
                               int stop_position)
@@ -382,7 +440,7 @@ void AlignmentDB::load_region(const std::string& contig,
     // If an alternative basecall set was provided, load it
     // intentially overwriting the current records
     if(!m_alternative_basecalls_bam.empty()) {
-        m_sequence_records = _load_sequence_by_region(m_alternative_basecalls_bam);
+        m_sequence_records = _load_alternative_sequence_by_name(m_sequence_records);
     }
 
     //_debug_print_alignments();
@@ -471,6 +529,55 @@ std::vector<SequenceAlignmentRecord> AlignmentDB::_load_sequence_by_region(const
     return records;
 }
 
+std::vector<SequenceAlignmentRecord> AlignmentDB::_load_alternative_sequence_by_name(const std::vector<SequenceAlignmentRecord>& region_records)
+{
+    assert(m_alternative_basecalls_index != NULL);
+    const BamNameIndex& index = *m_alternative_basecalls_index;
+
+    htsFile* bam_fh = sam_open(index.get_filename().c_str(), "r");
+    assert(bam_fh != NULL);
+    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
+    int contig_id = bam_name2id(hdr, m_region_contig.c_str());
+
+    // Select the records of these reads that a query of the region would return and
+    // that pass the same mapping quality filter as _load_sequence_by_region
+    std::vector<const BamNameIndexEntry*> selected;
+    std::set<std::string> seen_reads;
+    for(const SequenceAlignmentRecord& seq_record : region_records) {
+        if(!seen_reads.insert(seq_record.read_name).second) {
+            continue;
+        }
+
+        const std::vector<BamNameIndexEntry>* entries = index.find(seq_record.read_name);
+        for(size_t i = 0; entries != NULL && i < entries->size(); ++i) {
+            const BamNameIndexEntry& entry = (*entries)[i];
+            if(entry.tid == contig_id && entry.pos < m_region_end && entry.end_pos > m_region_start && entry.mapq >= 20) {
+                selected.push_back(&entry);
+            }
+        }
+    }
+
+    // read the records in file order, so the seeks only move forward. For a sorted
+    // bam this is also the order that a query of the region returns them in
+    std::sort(selected.begin(), selected.end(), [](const BamNameIndexEntry* a, const BamNameIndexEntry* b) {
+        return a->offset < b->offset;
+    });
+
+    std::vector<SequenceAlignmentRecord> records;
+    bam1_t* bam_record = bam_init1();
+    for(const BamNameIndexEntry* entry : selected) {
+        BamNameIndex::read_record(bam_fh, hdr, entry->offset, bam_record);
+        records.emplace_back(bam_record);
+    }
+
+    // cleanup
+    bam_destroy1(bam_record);
+    bam_hdr_destroy(hdr);
+    sam_close(bam_fh);
+
+    return records;
+}
+
 std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_bam(const std::string& event_bam)
 {
     BamHandles handles = _initialize_bam_itr(event_bam, m_region_contig, m_region_start, m_region_end);
@@ -509,15 +616,6 @@ std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_bam(c
         event_record.stride = event_stride;
         event_record.strand = is_template ? T_IDX : C_IDX;
         records.push_back(event_record);
-        
-        if(m_calibrate_on_load) {
-            std::vector<EventAlignment> event_alignment = _build_event_alignment(event_record);
-            fprintf(stderr, "Rescale for %s strand: %d rc: %d\n", event_record.sr->read_name.c_str(), event_record.strand, event_record.rc);
-            event_record.sr->print_scaling_parameters(stderr, event_record.strand);
-            fprintf(stderr, "recal events: %zu\n", event_alignment.size());
-            recalibrate_model(*event_record.sr, event_record.strand, event_alignment, &gDNAAlphabet, true, false);
-            event_record.sr->print_scaling_parameters(stderr, event_record.strand);
-        }
 
         /*
         printf("event_record[%zu] name: %s stride: %d align bounds [%d %d] [%d %d]\n", 
@@ -535,10 +633,51 @@ std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_bam(c
     sam_itr_destroy(handles.itr);
     bam_destroy1(handles.bam_record);
     sam_close(handles.bam_fh);
+
+    if(m_calibrate_on_load) {
+        _calibrate_records(records);
+    }
     
     return records;
 }
 
+void AlignmentDB::_calibrate_records(const std::vector<EventAlignmentRecord>& records)
+{
+    // a strand with several records in the region is calibrated
+    // once, from its last record, so every job is a distinct strand
+    std::map<std::pair<SquiggleRead*, int>, size_t> last_record;
+    for(size_t i = 0; i < records.size(); ++i) {
+        last_record[std::make_pair(records[i].sr, (int)records[i].strand)] = i;
+    }
+
+    std::vector<size_t> record_indices;
+    for(auto& lr : last_record) {
+        record_indices.push_back(lr.second);
+    }
+    std::sort(record_indices.begin(), record_indices.end());
+
+    std::vector<std::vector<EventAlignment>> event_alignments(record_indices.size());
+    std::vector<CalibrationJob> jobs(record_indices.size());
+    for(size_t i = 0; i < record_indices.size(); ++i) {
+        const EventAlignmentRecord& event_record = records[record_indices[i]];
+        event_alignments[i] = _build_event_alignment(event_record);
+        jobs[i].sr = event_record.sr;
+        jobs[i].strand_idx = event_record.strand;
+        jobs[i].alignment = &event_alignments[i];
+        jobs[i].alphabet = &gDNAAlphabet;
+
+        fprintf(stderr, "Rescale for %s strand: %d rc: %d\n", event_record.sr->read_name.c_str(), event_record.strand, event_record.rc);
+        event_record.sr->print_scaling_parameters(stderr, event_record.strand);
+        fprintf(stderr, "recal events: %zu\n", event_alignments[i].size());
+    }
+
+    recalibrate_models(jobs, true, false);
+
+    for(size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].sr->print_scaling_parameters(stderr, jobs[i].strand_idx);
+    }
+}
+
 std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_read(const std::vector<SequenceAlignmentRecord>& sequence_records)
 {
     std::vector<EventAlignmentRecord> records;
@@ -614,8 +753,8 @@ std::vector<EventAlignment> AlignmentDB::_build_event_alignment(const EventAlign
 {
     std::vector<EventAlignment> alignment;
     const SquiggleRead* sr = event_record.sr;
-    const Alphabet* alphabet = sr->pore_model[event_record.strand].pmalphabet;
     size_t k = sr->pore_model[event_record.strand].k;
+    alignment.reserve(event_record.aligned_events.size());
 
     for(const auto& ap : event_record.aligned_events) { 
 
@@ -627,16 +766,19 @@ std::vector<EventAlignment> AlignmentDB::_build_event_alignment(const EventAlign
 
         ea.event_idx = ap.read_pos;
 
-        std::string kmer = get_reference_substring(m_region_contig, ea.ref_position, ea.ref_position + k - 1);
-        assert(kmer.size() == k);
+        // the k-mers are ranked in the nucleotide alphabet the records are calibrated with
+        size_t offset = ea.ref_position - m_region_start;
+        assert(offset + k <= m_region_ref_sequence.size());
+        uint32_t rank = gDNAAlphabet.kmer_rank(m_region_ref_sequence.c_str() + offset, k);
 
         // ref data
-        ea.ref_name = "read"; // not needed
+        ea.ref_id = -1; // not needed
         ea.read_idx = -1; // not needed
-        ea.ref_kmer = kmer;
+        ea.ref_kmer_rank = rank;
         ea.strand_idx = event_record.strand;
         ea.rc = event_record.rc;
-        ea.model_kmer = kmer;
+        ea.model_kmer_rank = rank;
+        ea.posterior = 1.0f;
         ea.hmm_state = 'M';
         alignment.push_back(ea);
     }
@@ -14,6 +14,7 @@
 #include <map>
 #include "nanopolish_anchor.h"
 #include "nanopolish_variant.h"
+#include "nanopolish_bam_name_index.h"
 
 #define MAX_EVENT_TO_BP_RATIO 20
 
@@ -91,6 +92,13 @@ class AlignmentDB
                                                     double min_frequency,
                                                     int min_depth) const;
 
+        // Return, for every reference position in [start_position, stop_position],
+        // the fraction of base-space reads that disagree with the reference there
+        // (mismatch, or an insertion/deletion starting at the position)
+        std::vector<double> get_base_disagreement(const std::string& contig,
+                                                  int start_position,
+                                                  int stop_position) const;
+
         const std::vector<EventAlignmentRecord>& get_eventalignment_records() const { return m_event_records; }
 
         // reference metadata
@@ -118,10 +126,17 @@ class AlignmentDB
     private:
         
         std::vector<SequenceAlignmentRecord> _load_sequence_by_region(const std::string& sequence_bam);
+
+        // load the records of the alternative basecalls bam for the reads in
+        // region_records, by looking them up in the name index of the bam
+        std::vector<SequenceAlignmentRecord> _load_alternative_sequence_by_name(const std::vector<SequenceAlignmentRecord>& region_records);
         std::vector<EventAlignmentRecord> _load_events_by_region_from_bam(const std::string& event_bam);
         std::vector<EventAlignmentRecord> _load_events_by_region_from_read(const std::vector<SequenceAlignmentRecord>& sequence_records);
         void _load_squiggle_read(const std::string& read_name);
 
+        // recalibrate the pore models of the loaded reads in one batch
+        void _calibrate_records(const std::vector<EventAlignmentRecord>& records);
+
         void _clear_region();
 
         void _debug_print_alignments();
@@ -136,6 +151,7 @@ class AlignmentDB
         std::string m_sequence_bam;
         std::string m_event_bam;
         std::string m_alternative_basecalls_bam;
+        const BamNameIndex* m_alternative_basecalls_index;
 
         // parameters
         bool m_calibrate_on_load;
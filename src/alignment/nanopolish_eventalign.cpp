@@ -13,10 +13,12 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <algorithm>
 #include <sstream>
 #include <set>
+#include <map>
 #include <omp.h>
 #include <getopt.h>
 #include <iterator>
@@ -31,10 +33,17 @@
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_hmm_input_sequence.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_calibration_store.h"
+#include "nanopolish_bam_processor.h"
+#include "nanopolish_parallel.h"
+#include "nanopolish_output_buffer.h"
 #include "H5pubconf.h"
 #include "profiler.h"
 #include "progress.h"
 
+// The longest k-mer that can be written out
+#define MAX_EVENTALIGN_K 16
+
 //
 // Getopt
 //
@@ -59,13 +68,17 @@ static const char *EVENTALIGN_USAGE_MESSAGE =
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
 "  -g, --genome=FILE                    the genome we are computing a consensus for is in FILE\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
+"      --numa                           pin threads across NUMA nodes and report per-node throughput\n"
 "      --scale-events                   scale events to the model, rather than vice-versa\n"
 "      --progress                       print out a progress message\n"
 "  -n, --print-read-names               print read names instead of indexes\n"
 "      --summary=FILE                   summarize the alignment of each read/strand in FILE\n"
 "      --stdv                           enable stdv modelling\n"
 "      --samples                        write the raw samples for the event to the tsv output\n"
+"      --posterior                      write the posterior probability of each event's alignment to the tsv output (R9 models only, nan otherwise)\n"
+"      --bgzf                           compress the tsv output into BGZF blocks, using the --threads threads\n"
 "      --models-fofn=FILE               read alternative k-mer models from FILE\n"
+"      --calibrations=FILE              reuse the read calibrations stored in FILE and add new ones to it\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -77,19 +90,23 @@ namespace opt
     static std::string region;
     static std::string summary_file;
     static std::string models_fofn;
+    static std::string calibrations_file;
     static int output_sam = 0;
     static int progress = 0;
     static int num_threads = 1;
+    static int numa = 0;
     static int scale_events = 0;
     static int batch_size = 128;
     static bool print_read_names;
     static bool full_output;
     static bool write_samples = false;
+    static bool write_posterior = false;
+    static bool bgzf_output = false;
 }
 
 static const char* shortopts = "r:b:g:t:w:vn";
 
-enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_SAM, OPT_SUMMARY, OPT_SCALE_EVENTS, OPT_STDV, OPT_MODELS_FOFN, OPT_SAMPLES };
+enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_SAM, OPT_SUMMARY, OPT_SCALE_EVENTS, OPT_STDV, OPT_MODELS_FOFN, OPT_SAMPLES, OPT_POSTERIOR, OPT_NUMA, OPT_CALIBRATIONS, OPT_BGZF };
 
 static const struct option longopts[] = {
     { "verbose",          no_argument,       NULL, 'v' },
@@ -100,12 +117,16 @@ static const struct option longopts[] = {
     { "threads",          required_argument, NULL, 't' },
     { "summary",          required_argument, NULL, OPT_SUMMARY },
     { "models-fofn",      required_argument, NULL, OPT_MODELS_FOFN },
+    { "calibrations",     required_argument, NULL, OPT_CALIBRATIONS },
     { "print-read-names", no_argument,       NULL, 'n' },
     { "stdv",             no_argument,       NULL, OPT_STDV },
     { "samples",          no_argument,       NULL, OPT_SAMPLES },
+    { "posterior",        no_argument,       NULL, OPT_POSTERIOR },
+    { "bgzf",             no_argument,       NULL, OPT_BGZF },
     { "scale-events",     no_argument,       NULL, OPT_SCALE_EVENTS },
     { "sam",              no_argument,       NULL, OPT_SAM },
     { "progress",         no_argument,       NULL, OPT_PROGRESS },
+    { "numa",             no_argument,       NULL, OPT_NUMA },
     { "help",             no_argument,       NULL, OPT_HELP },
     { "version",          no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
@@ -114,7 +135,7 @@ static const struct option longopts[] = {
 // convenience wrapper for the two output modes
 struct EventalignWriter
 {
-    FILE* tsv_fp;
+    OutputWriter* tsv_writer;
     htsFile* sam_fp;
     FILE* summary_fp;
 };
@@ -206,17 +227,21 @@ std::string get_reference_region_ts(const faidx_t* fai, const char* ref_name, in
 //
 //
 
-void emit_tsv_header(FILE* fp)
+void emit_tsv_header(OutputBuffer& out)
 {
-    fprintf(fp, "%s\t%s\t%s\t%s\t%s\t", "contig", "position", "reference_kmer",
-            (not opt::print_read_names? "read_index" : "read_name"), "strand");
-    fprintf(fp, "%s\t%s\t%s\t%s\t", "event_index", "event_level_mean", "event_stdv", "event_length");
-    fprintf(fp, "%s\t%s\t%s\t%s", "model_kmer", "model_mean", "model_stdv", "standardized_level");
+    out.append("contig\tposition\treference_kmer\t");
+    out.append(not opt::print_read_names ? "read_index" : "read_name").append("\tstrand\t");
+    out.append("event_index\tevent_level_mean\tevent_stdv\tevent_length\t");
+    out.append("model_kmer\tmodel_mean\tmodel_stdv\tstandardized_level");
+
+    if(opt::write_posterior) {
+        out.append("\tposterior");
+    }
 
     if(opt::write_samples) {
-        fprintf(fp, "\t%s", "samples");
+        out.append("\tsamples");
     }
-    fprintf(fp, "\n");
+    out.append('\n');
 }
 
 void emit_sam_header(samFile* fp, const bam_hdr_t* hdr)
@@ -364,42 +389,41 @@ void emit_event_alignment_sam(htsFile* fp,
     bam_destroy1(event_record); // automatically frees malloc'd segment
 }
 
-void emit_event_alignment_tsv(FILE* fp,
+void emit_event_alignment_tsv(OutputBuffer& out,
                               const SquiggleRead& sr,
                               uint32_t strand_idx,
                               const EventAlignmentParameters& params,
                               const std::vector<EventAlignment>& alignments)
 {
     uint32_t k = sr.pore_model[strand_idx].k;
+    assert(k <= MAX_EVENTALIGN_K);
+    char ref_kmer[MAX_EVENTALIGN_K + 1];
+    char model_kmer[MAX_EVENTALIGN_K + 1];
+
     for(size_t i = 0; i < alignments.size(); ++i) {
 
         const EventAlignment& ea = alignments[i];
+        params.alphabet->kmer_from_rank(ea.ref_kmer_rank, k, ref_kmer);
 
         // basic information
+        out.append(get_ref_name(params.hdr, ea)).append('\t');
+        out.append_int(ea.ref_position).append('\t');
+        out.append(ref_kmer).append('\t');
         if (not opt::print_read_names)
         {
-            fprintf(fp, "%s\t%d\t%s\t%zu\t%c\t",
-                    ea.ref_name.c_str(),
-                    ea.ref_position,
-                    ea.ref_kmer.c_str(),
-                    ea.read_idx,
-                    "tc"[ea.strand_idx]);
+            out.append_int(ea.read_idx).append('\t');
         }
         else
         {
-            fprintf(fp, "%s\t%d\t%s\t%s\t%c\t",
-                    ea.ref_name.c_str(),
-                    ea.ref_position,
-                    ea.ref_kmer.c_str(),
-                    sr.read_name.c_str(),
-                    "tc"[ea.strand_idx]);
+            out.append(sr.read_name).append('\t');
         }
+        out.append("tc"[ea.strand_idx]).append('\t');
 
         // event information
         float event_mean = sr.get_drift_corrected_level(ea.event_idx, ea.strand_idx);
         float event_stdv = sr.get_stdv(ea.event_idx, ea.strand_idx);
         float event_duration = sr.get_duration(ea.event_idx, ea.strand_idx);
-        uint32_t rank = params.alphabet->kmer_rank(ea.model_kmer.c_str(), k);
+        uint32_t rank = ea.model_kmer_rank;
         float model_mean = 0.0;
         float model_stdv = 0.0;
 
@@ -425,23 +449,39 @@ void emit_event_alignment_tsv(FILE* fp,
         }
 
         float standard_level = (event_mean - model_mean) / (sqrt(sr.pore_model[ea.strand_idx].var) * model_stdv);
-        fprintf(fp, "%d\t%.2lf\t%.3lf\t%.5lf\t", ea.event_idx, event_mean, event_stdv, event_duration);
-        fprintf(fp, "%s\t%.2lf\t%.2lf\t%.2lf", ea.model_kmer.c_str(),
-                                               model_mean,
-                                               model_stdv,
-                                               standard_level);
+        out.append_int(ea.event_idx).append('\t');
+        out.append_fixed(event_mean, 2).append('\t');
+        out.append_fixed(event_stdv, 3).append('\t');
+        out.append_fixed(event_duration, 5).append('\t');
+        if(ea.hmm_state != 'B') {
+            params.alphabet->kmer_from_rank(ea.model_kmer_rank, k, model_kmer);
+        } else {
+            memset(model_kmer, 'N', k);
+            model_kmer[k] = '\0';
+        }
+
+        out.append(model_kmer).append('\t');
+        out.append_fixed(model_mean, 2).append('\t');
+        out.append_fixed(model_stdv, 2).append('\t');
+        out.append_fixed(standard_level, 2);
+
+        if(opt::write_posterior) {
+            out.append('\t').append_fixed(ea.posterior, 4);
+        }
 
         if(opt::write_samples) {
             std::vector<float> samples = sr.get_scaled_samples_for_event(ea.strand_idx, ea.event_idx);
-            std::stringstream sample_ss;
-            std::copy(samples.begin(), samples.end(), std::ostream_iterator<float>(sample_ss, ","));
 
-            // remove training comma
-            std::string sample_str = sample_ss.str();
-            sample_str.resize(sample_str.size() - 1);
-            fprintf(fp, "\t%s", sample_str.c_str());
+            // comma-separated, formatted as an ostream formats them
+            out.append('\t');
+            for(size_t si = 0; si < samples.size(); ++si) {
+                if(si > 0) {
+                    out.append(',');
+                }
+                out.append_general(samples[si]);
+            }
         }
-        fprintf(fp, "\n");
+        out.append('\n');
     }
 }
 
@@ -452,8 +492,6 @@ EventalignSummary summarize_alignment(const SquiggleRead& sr,
 {
     EventalignSummary summary;
 
-    uint32_t k = sr.pore_model[strand_idx].k;
-
     size_t prev_ref_pos = std::string::npos;
 
     // the number of unique reference positions seen in the alignment
@@ -480,8 +518,7 @@ EventalignSummary summarize_alignment(const SquiggleRead& sr,
         if(ea.hmm_state == 'M') {
             summary.num_matches += 1;
             
-            uint32_t rank = params.alphabet->kmer_rank(ea.model_kmer.c_str(), k);
-            GaussianParameters model = sr.pore_model[ea.strand_idx].get_scaled_parameters(rank);
+            GaussianParameters model = sr.pore_model[ea.strand_idx].get_scaled_parameters(ea.model_kmer_rank);
             float event_mean = sr.get_drift_corrected_level(ea.event_idx, ea.strand_idx);
             double z = (event_mean - model.mean) / model.stdv;
             summary.sum_z_score += z;
@@ -514,6 +551,7 @@ void realign_read(EventalignWriter writer,
 
     // load read
     SquiggleRead sr(read_name, fast5_path, opt::write_samples ? SRF_LOAD_RAW_SAMPLES : 0);
+    OutputBuffer output;
 
     if(opt::verbose > 1) {
         fprintf(stderr, "Realigning %s [%zu %zu]\n", 
@@ -533,6 +571,7 @@ void realign_read(EventalignWriter writer,
         params.hdr = hdr;
         params.record = record;
         params.strand_idx = strand_idx;
+        params.compute_posterior = opt::write_posterior;
         
         params.read_idx = read_idx;
         params.region_start = region_start;
@@ -545,71 +584,52 @@ void realign_read(EventalignWriter writer,
             summary = summarize_alignment(sr, strand_idx, params, alignment);
         }
 
+        // the records are formatted by this thread, so only writing them is serialized
+        if(!opt::output_sam) {
+            output.clear();
+            emit_event_alignment_tsv(output, sr, strand_idx, params, alignment);
+        }
+
+        OutputBuffer summary_output;
+        if(writer.summary_fp != NULL && summary.num_events > 0) {
+            PoreModel& pore_model = sr.pore_model[strand_idx];
+            summary_output.append_uint(read_idx).append('\t').append(read_name).append('\t');
+            summary_output.append(sr.fast5_path).append('\t');
+            summary_output.append(pore_model.name).append('\t').append(strand_idx == 0 ? "template" : "complement").append('\t');
+            summary_output.append_int(summary.num_events).append('\t').append_int(summary.num_matches).append('\t');
+            summary_output.append_int(summary.num_skips).append('\t').append_int(summary.num_stays).append('\t');
+            summary_output.append_fixed(summary.sum_duration, 2).append('\t').append_fixed(pore_model.shift, 3).append('\t');
+            summary_output.append_fixed(pore_model.scale, 3).append('\t').append_fixed(pore_model.drift, 3).append('\t');
+            summary_output.append_fixed(pore_model.var, 3).append('\n');
+        }
+
         // write to disk
         #pragma omp critical
         {
             if(opt::output_sam) {
                 emit_event_alignment_sam(writer.sam_fp, sr, hdr, record, alignment);
             } else {
-                emit_event_alignment_tsv(writer.tsv_fp, sr, strand_idx, params, alignment);
+                writer.tsv_writer->write(output);
             }
 
-            if(writer.summary_fp != NULL && summary.num_events > 0) {
-
-                PoreModel& pore_model = sr.pore_model[strand_idx];
-                fprintf(writer.summary_fp, "%zu\t%s\t%s\t", read_idx, read_name.c_str(), sr.fast5_path.c_str());
-                fprintf(writer.summary_fp, "%s\t%s\t", pore_model.name.c_str(), strand_idx == 0 ? "template" : "complement");
-                fprintf(writer.summary_fp, "%d\t%d\t%d\t%d\t", summary.num_events, summary.num_matches, summary.num_skips, summary.num_stays);
-                fprintf(writer.summary_fp, "%.2lf\t%.3lf\t%.3lf\t%.3lf\t%.3lf\n", summary.sum_duration, pore_model.shift, pore_model.scale, pore_model.drift, pore_model.var);
+            if(!summary_output.empty()) {
+                fwrite(summary_output.data(), 1, summary_output.size(), writer.summary_fp);
             }
         }
     }
 }
 
-std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& params)
+// Align the events of the read that fall between the first and last
+// aligned pair to the reference, segment by segment
+std::vector<EventAlignment> align_read_to_ref_chunk(const EventAlignmentParameters& params,
+                                                    const std::string& ref_seq,
+                                                    const std::string& rc_ref_seq,
+                                                    int ref_offset,
+                                                    const std::vector<AlignedPair>& aligned_pairs)
 {
-    // Sanity check input parameters
-    assert(params.sr != NULL);
-    assert(params.fai != NULL);
-    assert(params.hdr != NULL);
-    assert(params.record != NULL);
-    assert(params.strand_idx < NUM_STRANDS);
-    assert( (params.region_start == -1 && params.region_end == -1) || (params.region_start <= params.region_end));
-
     std::vector<EventAlignment> alignment_output;
-
-    // Extract the reference subsequence for the entire alignment
-    int fetched_len = 0;
-    int ref_offset = params.record->core.pos;
-    std::string ref_name(params.hdr->target_name[params.record->core.tid]);
-    std::string ref_seq = get_reference_region_ts(params.fai, ref_name.c_str(), ref_offset, 
-                                                  bam_endpos(params.record), &fetched_len);
-
-    // k from read pore model
     const uint32_t k = params.sr->pore_model[params.strand_idx].k;
 
-    // If the reference sequence contains ambiguity codes
-    // switch them to the lexicographically lowest base
-    ref_seq = params.alphabet->disambiguate(ref_seq);
-    std::string rc_ref_seq = params.alphabet->reverse_complement(ref_seq);
-
-    if(ref_offset == 0)
-        return alignment_output;
-
-    // Make a vector of aligned (ref_pos, read_pos) pairs
-    std::vector<AlignedPair> aligned_pairs = get_aligned_pairs(params.record);
-
-    if(params.region_start != -1 && params.region_end != -1) {
-        trim_aligned_pairs_to_ref_region(aligned_pairs, params.region_start, params.region_end);
-    }
-
-    // Trim the aligned pairs to be within the range of the maximum kmer index
-    int max_kmer_idx = params.sr->read_sequence.size() - k;
-    trim_aligned_pairs_to_kmer(aligned_pairs, max_kmer_idx);
-
-    if(aligned_pairs.empty())
-        return alignment_output;
-
     bool do_base_rc = bam_is_rev(params.record);
     bool rc_flags[2] = { do_base_rc, !do_base_rc }; // indexed by strand
     const int align_stride = 100; // approximately how many reference bases to align to at once
@@ -631,6 +651,9 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
     int last_event = params.sr->get_closest_event_to(read_kidx_end, params.strand_idx);
     bool forward = first_event < last_event;
 
+    // each event is output at most once
+    alignment_output.reserve(abs(last_event - first_event) + 1);
+
     int curr_start_event = first_event;
     int curr_start_ref = aligned_pairs.front().ref_pos;
     int curr_pair_idx = 0;
@@ -681,7 +704,8 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
         input.event_stride = input.event_start_idx < input.event_stop_idx ? 1 : -1;
         input.rc = rc_flags[params.strand_idx];
 
-        std::vector<HMMAlignmentState> event_alignment = profile_hmm_align(hmm_sequence, input);
+        uint32_t alignment_flags = params.compute_posterior ? HAF_COMPUTE_POSTERIOR : 0;
+        std::vector<HMMAlignmentState> event_alignment = profile_hmm_align(hmm_sequence, input, alignment_flags);
         
         // Output alignment
         size_t num_output = 0;
@@ -719,9 +743,9 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
                 EventAlignment ea;
                 
                 // ref
-                ea.ref_name = ref_name;
+                ea.ref_id = params.record->core.tid;
                 ea.ref_position = curr_start_ref + as.kmer_idx;
-                ea.ref_kmer = ref_seq.substr(ea.ref_position - ref_offset, k);
+                ea.ref_kmer_rank = params.alphabet->kmer_rank(ref_seq.c_str() + ea.ref_position - ref_offset, k);
 
                 // event
                 ea.read_idx = params.read_idx;
@@ -732,11 +756,8 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
                 // hmm
                 ea.hmm_state = as.state;
 
-                if(ea.hmm_state != 'B') {
-                    ea.model_kmer = hmm_sequence.get_kmer(as.kmer_idx, k, input.rc);
-                } else {
-                    ea.model_kmer = std::string(k, 'N');
-                }
+                ea.model_kmer_rank = ea.hmm_state != 'B' ? hmm_sequence.get_kmer_rank(as.kmer_idx, k, input.rc) : 0;
+                ea.posterior = params.compute_posterior ? exp(as.l_posterior) : 1.0f;
 
                 // store
                 alignment_output.push_back(ea);
@@ -769,6 +790,152 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
     return alignment_output;
 }
 
+std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& params)
+{
+    // Sanity check input parameters
+    assert(params.sr != NULL);
+    assert(params.fai != NULL);
+    assert(params.hdr != NULL);
+    assert(params.record != NULL);
+    assert(params.strand_idx < NUM_STRANDS);
+    assert( (params.region_start == -1 && params.region_end == -1) || (params.region_start <= params.region_end));
+
+    std::vector<EventAlignment> alignment_output;
+
+    // Extract the reference subsequence for the entire alignment
+    int fetched_len = 0;
+    int ref_offset = params.record->core.pos;
+    std::string ref_name(params.hdr->target_name[params.record->core.tid]);
+    std::string ref_seq = get_reference_region_ts(params.fai, ref_name.c_str(), ref_offset, 
+                                                  bam_endpos(params.record), &fetched_len);
+
+    // k from read pore model
+    const uint32_t k = params.sr->pore_model[params.strand_idx].k;
+
+    // If the reference sequence contains ambiguity codes
+    // switch them to the lexicographically lowest base
+    ref_seq = params.alphabet->disambiguate(ref_seq);
+    std::string rc_ref_seq = params.alphabet->reverse_complement(ref_seq);
+
+    if(ref_offset == 0)
+        return alignment_output;
+
+    // Make a vector of aligned (ref_pos, read_pos) pairs
+    std::vector<AlignedPair> aligned_pairs = get_aligned_pairs(params.record);
+
+    if(params.region_start != -1 && params.region_end != -1) {
+        trim_aligned_pairs_to_ref_region(aligned_pairs, params.region_start, params.region_end);
+    }
+
+    // Trim the aligned pairs to be within the range of the maximum kmer index
+    int max_kmer_idx = params.sr->read_sequence.size() - k;
+    trim_aligned_pairs_to_kmer(aligned_pairs, max_kmer_idx);
+
+    if(aligned_pairs.empty())
+        return alignment_output;
+
+    // Split long alignments into chunks at aligned pairs roughly EVENTALIGN_CHUNK_SIZE
+    // reference bases apart. Each chunk is extended by EVENTALIGN_CHUNK_OVERLAP bases on
+    // both sides so the alignment has settled by the time it reaches the boundary.
+    std::vector<int> boundary_refs;
+    std::vector<std::pair<size_t, size_t>> chunk_pairs;
+    int chunk_start_ref = aligned_pairs.front().ref_pos;
+    for(size_t i = 0; i < aligned_pairs.size(); ++i) {
+        if(aligned_pairs[i].ref_pos - chunk_start_ref >= EVENTALIGN_CHUNK_SIZE &&
+           aligned_pairs.back().ref_pos - aligned_pairs[i].ref_pos >= EVENTALIGN_CHUNK_SIZE / 2) {
+            chunk_start_ref = aligned_pairs[i].ref_pos;
+            boundary_refs.push_back(chunk_start_ref);
+        }
+    }
+
+    // Short alignments are aligned in one pass
+    if(boundary_refs.empty()) {
+        return align_read_to_ref_chunk(params, ref_seq, rc_ref_seq, ref_offset, aligned_pairs);
+    }
+
+    size_t num_chunks = boundary_refs.size() + 1;
+    std::vector<std::vector<EventAlignment>> chunk_output(num_chunks);
+    for(size_t ci = 0; ci < num_chunks; ++ci) {
+        int start_ref = ci == 0 ? aligned_pairs.front().ref_pos : boundary_refs[ci - 1] - EVENTALIGN_CHUNK_OVERLAP;
+        int end_ref = ci == num_chunks - 1 ? aligned_pairs.back().ref_pos : boundary_refs[ci] + EVENTALIGN_CHUNK_OVERLAP;
+
+        AlignedPairRefLBComp lb_comp;
+        AlignedPairRefUBComp ub_comp;
+        size_t first = std::lower_bound(aligned_pairs.begin(), aligned_pairs.end(), start_ref, lb_comp) - aligned_pairs.begin();
+        size_t last = std::upper_bound(aligned_pairs.begin(), aligned_pairs.end(), end_ref, ub_comp) - aligned_pairs.begin();
+        chunk_pairs.push_back(std::make_pair(first, last));
+    }
+
+    // Each chunk is an independent task. When called from within a parallel loop
+    // over reads, threads that have finished their own reads pick up these tasks.
+    parallel_for(num_chunks, [&](size_t ci) {
+        std::vector<AlignedPair> sub_pairs(aligned_pairs.begin() + chunk_pairs[ci].first,
+                                           aligned_pairs.begin() + chunk_pairs[ci].second);
+        chunk_output[ci] = align_read_to_ref_chunk(params, ref_seq, rc_ref_seq, ref_offset, sub_pairs);
+    }, "eventalign_chunk");
+
+    // Stitch the chunks together at a seam past each boundary: the first event of
+    // the next chunk that the previous chunk aligned to the same k-mer. Joining
+    // where the chunks agree means no event is repeated or dropped. If they never
+    // agree in the overlap the next chunk picks up after the last event output
+    // before the boundary.
+    alignment_output = chunk_output[0];
+    for(size_t ci = 1; ci < num_chunks; ++ci) {
+        const std::vector<EventAlignment>& next = chunk_output[ci];
+        int boundary_ref = boundary_refs[ci - 1];
+
+        // the events the output so far aligned in the overlap
+        std::map<int32_t, size_t> overlap_events;
+        for(size_t ai = alignment_output.size(); ai > 0; --ai) {
+            const EventAlignment& ea = alignment_output[ai - 1];
+            if(ea.ref_position < boundary_ref - EVENTALIGN_CHUNK_OVERLAP) {
+                break;
+            }
+            overlap_events[ea.event_idx] = ai - 1;
+        }
+
+        size_t seam_output = SIZE_MAX;
+        size_t seam_next = SIZE_MAX;
+        for(size_t ai = 0; ai < next.size() && seam_next == SIZE_MAX; ++ai) {
+            if(next[ai].ref_position < boundary_ref) {
+                continue;
+            }
+
+            auto iter = overlap_events.find(next[ai].event_idx);
+            if(iter != overlap_events.end() &&
+               alignment_output[iter->second].ref_position == next[ai].ref_position &&
+               alignment_output[iter->second].hmm_state == next[ai].hmm_state) {
+                seam_output = iter->second;
+                seam_next = ai;
+            }
+        }
+
+        if(seam_next != SIZE_MAX) {
+            alignment_output.resize(seam_output + 1);
+            alignment_output.insert(alignment_output.end(), next.begin() + seam_next + 1, next.end());
+            continue;
+        }
+
+        while(!alignment_output.empty() && alignment_output.back().ref_position >= boundary_ref) {
+            alignment_output.pop_back();
+        }
+
+        bool forward = next.empty() || next.front().event_idx <= next.back().event_idx;
+        for(size_t ai = 0; ai < next.size(); ++ai) {
+            const EventAlignment& ea = next[ai];
+            if(!alignment_output.empty()) {
+                const EventAlignment& prev = alignment_output.back();
+                bool after_prev = forward ? ea.event_idx > prev.event_idx : ea.event_idx < prev.event_idx;
+                if(!after_prev || ea.ref_position < prev.ref_position) {
+                    continue;
+                }
+            }
+            alignment_output.push_back(ea);
+        }
+    }
+    return alignment_output;
+}
+
 void parse_eventalign_options(int argc, char** argv)
 {
     bool die = false;
@@ -784,12 +951,16 @@ void parse_eventalign_options(int argc, char** argv)
             case 'f': opt::full_output = true; break;
             case OPT_STDV: model_stdv() = true; break;
             case OPT_SAMPLES: opt::write_samples = true; break;
+            case OPT_POSTERIOR: opt::write_posterior = true; break;
+            case OPT_BGZF: opt::bgzf_output = true; break;
             case 'v': opt::verbose++; break;
             case OPT_MODELS_FOFN: arg >> opt::models_fofn; break;
+            case OPT_CALIBRATIONS: arg >> opt::calibrations_file; break;
             case OPT_SCALE_EVENTS: opt::scale_events = true; break;
             case OPT_SUMMARY: arg >> opt::summary_file; break;
             case OPT_SAM: opt::output_sam = true; break;
             case OPT_PROGRESS: opt::progress = true; break;
+            case OPT_NUMA: opt::numa = 1; break;
             case OPT_HELP:
                 std::cout << EVENTALIGN_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -813,6 +984,11 @@ void parse_eventalign_options(int argc, char** argv)
         die = true;
     }
 
+    if(opt::bgzf_output && opt::output_sam) {
+        std::cerr << SUBPROGRAM ": --bgzf only applies to the tsv output, not --sam\n";
+        die = true;
+    }
+
     if(opt::reads_file.empty()) {
         std::cerr << SUBPROGRAM ": a --reads file must be provided\n";
         die = true;
@@ -833,6 +1009,10 @@ void parse_eventalign_options(int argc, char** argv)
         PoreModelSet::initialize(opt::models_fofn);
     }
 
+    if(!opt::calibrations_file.empty()) {
+        CalibrationStore::initialize(opt::calibrations_file);
+    }
+
     if (die) 
     {
         std::cout << "\n" << EVENTALIGN_USAGE_MESSAGE;
@@ -843,7 +1023,8 @@ void parse_eventalign_options(int argc, char** argv)
 int eventalign_main(int argc, char** argv)
 {
     parse_eventalign_options(argc, argv);
-    omp_set_num_threads(opt::num_threads);
+    set_parallel_num_threads(opt::num_threads);
+    set_parallel_numa_binding(opt::numa);
 
     Fast5Map name_map(opt::reads_file);
     
@@ -895,8 +1076,10 @@ int eventalign_main(int argc, char** argv)
         writer.sam_fp = hts_open("-", "w");
         emit_sam_header(writer.sam_fp, hdr);
     } else {
-        writer.tsv_fp = stdout;
-        emit_tsv_header(writer.tsv_fp);
+        writer.tsv_writer = opt::bgzf_output ? new OutputWriter(stdout, opt::num_threads) : new OutputWriter(stdout);
+        OutputBuffer header;
+        emit_tsv_header(header);
+        writer.tsv_writer->write(header);
     }
 
     if(!opt::summary_file.empty()) {
@@ -926,14 +1109,16 @@ int eventalign_main(int argc, char** argv)
         num_records_buffered += result >= 0;
         // realign if we've hit the max buffer size or reached the end of file
         if(num_records_buffered == records.size() || result < 0) {
-            #pragma omp parallel for            
-            for(size_t i = 0; i < num_records_buffered; ++i) {
+            std::vector<size_t> order = get_records_by_decreasing_cost(records, num_records_buffered);
+
+            parallel_for(num_records_buffered, [&](size_t j) {
+                size_t i = order[j];
                 bam1_t* record = records[i];
                 size_t read_idx = num_reads_realigned + i;
                 if( (record->core.flag & BAM_FUNMAP) == 0) {
                     realign_read(writer, name_map, fai, hdr, record, read_idx, clip_start, clip_end);
                 }
-            }
+            }, "eventalign");
 
             num_reads_realigned += num_records_buffered;
             num_records_buffered = 0;
@@ -945,6 +1130,7 @@ int eventalign_main(int argc, char** argv)
     } while(result >= 0);
  
     assert(num_records_buffered == 0);
+    print_parallel_numa_summary(stderr);
 
     // cleanup records
     for(size_t i = 0; i < records.size(); ++i) {
@@ -962,8 +1148,15 @@ int eventalign_main(int argc, char** argv)
         hts_close(writer.sam_fp);
     }
 
+    if(writer.tsv_writer != NULL) {
+        writer.tsv_writer->close();
+        delete writer.tsv_writer;
+    }
+
     if(writer.summary_fp != NULL) {
         fclose(writer.summary_fp);
     }
+
+    CalibrationStore::write();
     return EXIT_SUCCESS;
 }
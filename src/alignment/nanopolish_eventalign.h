@@ -9,10 +9,12 @@
 #ifndef NANOPOLISH_EVENTALIGN_H
 #define NANOPOLISH_EVENTALIGN_H
 
+#include <assert.h>
 #include "htslib/faidx.h"
 #include "htslib/sam.h"
 #include "nanopolish_alphabet.h"
 #include "nanopolish_common.h"
+#include "nanopolish_output_buffer.h"
 
 //
 // Structs
@@ -28,6 +30,7 @@ struct EventAlignmentParameters
         strand_idx = NUM_STRANDS;
         
         alphabet = &gDNAAlphabet;
+        compute_posterior = false;
         read_idx = -1;
         region_start = -1;
         region_end = -1;
@@ -42,39 +45,62 @@ struct EventAlignmentParameters
     
     // optional
     const Alphabet* alphabet;
+    bool compute_posterior;
     int read_idx;
     int region_start;
     int region_end;
 };
 
+// An event aligned to a k-mer of the reference. The contig is stored as its
+// target id in the BAM header and the k-mers as lexicographic ranks in the
+// alphabet the alignment was made with, so a read's alignment is a flat array.
+// Strings are only made when the alignment is written out.
 struct EventAlignment
 {
     // ref data
-    std::string ref_name;
-    std::string ref_kmer;
-    int ref_position;
+    int32_t ref_id; // -1 when the events were aligned to the read itself
+    int32_t ref_position;
+    uint32_t ref_kmer_rank;
+
+    // hmm data, the k-mer on the sequencing strand
+    // the rank is 0 for events in the 'B' state
+    uint32_t model_kmer_rank;
+
+    // the posterior probability of the event being in hmm_state,
+    // 1 unless the alignment was made with compute_posterior and
+    // NaN when the HMM of the read's model can't compute it (R7)
+    float posterior;
 
     // event data
-    size_t read_idx;
-    int strand_idx;
-    int event_idx;
+    int32_t read_idx;
+    int32_t event_idx;
+    uint8_t strand_idx;
     bool rc;
-
-    // hmm data
-    std::string model_kmer;
     char hmm_state;
 };
 
 // Entry point from nanopolish.cpp
 int eventalign_main(int argc, char** argv);
 
-// print the alignment as a tab-separated table
-void emit_event_alignment_tsv(FILE* fp,
+// the name of the contig the events were aligned to
+inline const char* get_ref_name(const bam_hdr_t* hdr, const EventAlignment& ea)
+{
+    assert(ea.ref_id >= 0 && ea.ref_id < hdr->n_targets);
+    return hdr->target_name[ea.ref_id];
+}
+
+// format the alignment as a tab-separated table
+void emit_event_alignment_tsv(OutputBuffer& out,
                               const SquiggleRead& sr,
                               uint32_t strand_idx,
                               const EventAlignmentParameters& params,
                               const std::vector<EventAlignment>& alignments);
 
+// Alignments spanning more than this many reference bases are split into
+// chunks that are aligned as separate tasks
+#define EVENTALIGN_CHUNK_SIZE 20000
+#define EVENTALIGN_CHUNK_OVERLAP 500
+
 // The main function to realign a read
 std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& params);
 
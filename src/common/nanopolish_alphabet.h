@@ -9,6 +9,7 @@
 #define NANOPOLISH_ALPHABET_H
 
 #include <string>
+#include <vector>
 #include <cstring>
 #include <inttypes.h>
 #include <assert.h>
@@ -87,7 +88,28 @@ class Alphabet
             }
             return r;
         }
-        
+
+        // write the kmer of length k with the given lexicographic rank to out,
+        // which must have room for k + 1 characters
+        inline void kmer_from_rank(uint32_t r, uint32_t k, char* out) const
+        {
+            for(uint32_t i = 0; i < k; ++i) {
+                out[k - i - 1] = base(r % size());
+                r /= size();
+            }
+            out[k] = '\0';
+        }
+
+        inline std::string kmer_from_rank(uint32_t r, uint32_t k) const
+        {
+            std::string out(k, 'A');
+            for(uint32_t i = 0; i < k; ++i) {
+                out[k - i - 1] = base(r % size());
+                r /= size();
+            }
+            return out;
+        }
+
         // Increment the input string to be the next sequence in lexicographic order
         inline void lexicographic_next(std::string& str) const
         {
@@ -361,6 +383,7 @@ extern MethylCpGAlphabet gMCpGAlphabet;
 extern MethylDamAlphabet gMethylDamAlphabet;
 extern MethylDcmAlphabet gMethylDcmAlphabet;
 
+std::vector<const Alphabet*> get_alphabet_list();
 const Alphabet* best_alphabet(const char *bases);
 const Alphabet* get_alphabet_by_name(const std::string& name);
 
@@ -0,0 +1,84 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_bam_name_index -- the file offsets of the
+// records of each read in a bam file, to fetch the
+// alignments of a read by name
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <memory>
+#include "htslib/bgzf.h"
+#include "nanopolish_bam_name_index.h"
+
+const BamNameIndex& BamNameIndex::get(const std::string& bam_filename)
+{
+    static std::map<std::string, std::unique_ptr<BamNameIndex> > indices;
+    BamNameIndex* index = NULL;
+
+    // the index is built while holding the lock, the
+    // other threads that need it have to wait for it anyway
+    #pragma omp critical(bam_name_index)
+    {
+        std::unique_ptr<BamNameIndex>& slot = indices[bam_filename];
+        if(!slot) {
+            slot.reset(new BamNameIndex(bam_filename));
+        }
+        index = slot.get();
+    }
+    return *index;
+}
+
+BamNameIndex::BamNameIndex(const std::string& bam_filename) : m_filename(bam_filename), m_num_records(0)
+{
+    htsFile* bam_fh = sam_open(bam_filename.c_str(), "r");
+    if(bam_fh == NULL) {
+        fprintf(stderr, "Error: could not open %s\n", bam_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    // the offsets are only meaningful for bgzf compressed files
+    if(hts_get_format(bam_fh)->format != bam) {
+        fprintf(stderr, "Error: %s is not a bam file, reads can only be looked up by name in a bam file\n", bam_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
+    bam1_t* record = bam_init1();
+
+    int64_t offset = bgzf_tell(bam_fh->fp.bgzf);
+    while(sam_read1(bam_fh, hdr, record) >= 0) {
+        if((record->core.flag & BAM_FUNMAP) == 0) {
+            BamNameIndexEntry entry;
+            entry.offset = offset;
+            entry.tid = record->core.tid;
+            entry.pos = record->core.pos;
+            entry.end_pos = bam_endpos(record);
+            entry.mapq = record->core.qual;
+            m_records[bam_get_qname(record)].push_back(entry);
+            m_num_records += 1;
+        }
+        offset = bgzf_tell(bam_fh->fp.bgzf);
+    }
+
+    bam_destroy1(record);
+    bam_hdr_destroy(hdr);
+    sam_close(bam_fh);
+}
+
+const std::vector<BamNameIndexEntry>* BamNameIndex::find(const std::string& read_name) const
+{
+    auto iter = m_records.find(read_name);
+    return iter != m_records.end() ? &iter->second : NULL;
+}
+
+void BamNameIndex::read_record(htsFile* bam_fh, bam_hdr_t* hdr, int64_t offset, bam1_t* record)
+{
+    if(bgzf_seek(bam_fh->fp.bgzf, offset, SEEK_SET) != 0 || sam_read1(bam_fh, hdr, record) < 0) {
+        fprintf(stderr, "Error: could not read the bam record at offset %lld, was the file changed after it was indexed?\n", (long long)offset);
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,67 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_bam_name_index -- the file offsets of the
+// records of each read in a bam file, to fetch the
+// alignments of a read by name
+//
+#ifndef NANOPOLISH_BAM_NAME_INDEX_H
+#define NANOPOLISH_BAM_NAME_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "htslib/hts.h"
+#include "htslib/sam.h"
+
+// The location of a mapped record in a bam file
+struct BamNameIndexEntry
+{
+    int64_t offset; // the bgzf virtual offset of the record
+    int32_t tid;
+    int32_t pos;
+    int32_t end_pos;
+    uint8_t mapq;
+};
+
+class BamNameIndex
+{
+    public:
+
+        //
+        // return the index of the bam file, which is built by a single pass over
+        // the file the first time it is requested and shared by all callers after that
+        //
+        static const BamNameIndex& get(const std::string& bam_filename);
+
+        //
+        // the mapped records of a read, in file order, or NULL if there are none
+        //
+        const std::vector<BamNameIndexEntry>* find(const std::string& read_name) const;
+
+        //
+        // read the record at offset of the open bam file into record.
+        // The file must have been opened from the indexed filename.
+        //
+        static void read_record(htsFile* bam_fh, bam_hdr_t* hdr, int64_t offset, bam1_t* record);
+
+        const std::string& get_filename() const { return m_filename; }
+        size_t get_num_records() const { return m_num_records; }
+
+    private:
+
+        BamNameIndex(const std::string& bam_filename);
+
+        // do not allow copies of this class
+        BamNameIndex(BamNameIndex const&) = delete;
+        void operator=(BamNameIndex const&) = delete;
+
+        std::string m_filename;
+        size_t m_num_records;
+        std::unordered_map<std::string, std::vector<BamNameIndexEntry> > m_records;
+};
+
+#endif
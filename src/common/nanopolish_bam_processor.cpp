@@ -8,17 +8,16 @@
 // on each aligned read in parallel
 //
 #include "nanopolish_bam_processor.h"
+#include "nanopolish_parallel.h"
 #include <assert.h>
-#include <omp.h>
 #include <vector>
+#include <algorithm>
 #include <hdf5.h>
 
 BamProcessor::BamProcessor(const std::string& bam_file,
-                           const std::string& region,
-                           const int num_threads) :
+                           const std::string& region) :
                             m_bam_file(bam_file),
-                            m_region(region),
-                            m_num_threads(num_threads)
+                            m_region(region)
 
 {
     // load bam file
@@ -66,16 +65,12 @@ void BamProcessor::parallel_run( std::function<void(const bam_hdr_t* hdr,
     }
 
 #ifndef H5_HAVE_THREADSAFE
-    if(m_num_threads > 1) {
+    if(get_parallel_num_threads() > 1) {
         fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
         fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
         exit(1);
     }
 #endif
-    
-    // store number of threads so we can restore it after we're done
-    int prev_num_threads = omp_get_num_threads();
-    omp_set_num_threads(m_num_threads);
 
     // Initialize iteration
     std::vector<bam1_t*> records(m_batch_size, NULL);
@@ -96,14 +91,16 @@ void BamProcessor::parallel_run( std::function<void(const bam_hdr_t* hdr,
 
         // realign if we've hit the max buffer size or reached the end of file
         if(num_records_buffered == records.size() || result < 0 || (num_records_buffered + num_reads_realigned == m_max_reads)) {
-            #pragma omp parallel for
-            for(size_t i = 0; i < num_records_buffered; ++i) {
+            std::vector<size_t> order = get_records_by_decreasing_cost(records, num_records_buffered);
+
+            parallel_for(num_records_buffered, [&](size_t j) {
+                size_t i = order[j];
                 bam1_t* record = records[i];
                 size_t read_idx = num_reads_realigned + i;
                 if( (record->core.flag & BAM_FUNMAP) == 0) {
                     func(m_hdr, record, read_idx, clip_start, clip_end);
                 }
-            }
+            }, "bam_processor");
 
             num_reads_realigned += num_records_buffered;
             num_records_buffered = 0;
@@ -112,9 +109,6 @@ void BamProcessor::parallel_run( std::function<void(const bam_hdr_t* hdr,
 
     assert(num_records_buffered == 0);
 
-    // restore number of threads
-    omp_set_num_threads(prev_num_threads);
- 
     // cleanup   
     for(size_t i = 0; i < records.size(); ++i) {
         bam_destroy1(records[i]);
@@ -122,3 +116,25 @@ void BamProcessor::parallel_run( std::function<void(const bam_hdr_t* hdr,
 
     sam_itr_destroy(itr);
 }
+
+std::vector<size_t> get_records_by_decreasing_cost(const std::vector<bam1_t*>& records, size_t n)
+{
+    assert(n <= records.size());
+    std::vector<size_t> cost(n, 0);
+    for(size_t i = 0; i < n; ++i) {
+        const bam1_t* record = records[i];
+        if( (record->core.flag & BAM_FUNMAP) == 0) {
+            // the events of the whole read are loaded and aligned along the reference span
+            size_t ref_span = bam_endpos(record) - record->core.pos;
+            cost[i] = ref_span + record->core.l_qseq;
+        }
+    }
+
+    std::vector<size_t> order(n);
+    for(size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&cost](size_t a, size_t b) { return cost[a] > cost[b]; });
+    return order;
+}
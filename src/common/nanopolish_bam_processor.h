@@ -12,6 +12,7 @@
 
 #include <functional>
 #include <string>
+#include <vector>
 #include "htslib/hts.h"
 #include "htslib/sam.h"
 
@@ -19,9 +20,9 @@ class BamProcessor
 {
 
     public:
+        // the records are processed by the threads of parallel_for
         BamProcessor(const std::string& bam_filename, 
-                     const std::string& region,
-                     const int num_threads);
+                     const std::string& region);
 
         ~BamProcessor();
 
@@ -46,8 +47,13 @@ class BamProcessor
         bam_hdr_t* m_hdr;
 
         int m_batch_size = 128;
-        int m_num_threads = 1;
         size_t m_max_reads = -1;
 };
 
+// Return the indices of the first n records in decreasing order of the
+// expected work to process them, estimated from the aligned and query lengths.
+// Dispatching a batch in this order with a dynamic schedule keeps a few long
+// reads at the end of a batch from leaving the other threads idle.
+std::vector<size_t> get_records_by_decreasing_cost(const std::vector<bam1_t*>& records, size_t n);
+
 #endif
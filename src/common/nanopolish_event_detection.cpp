@@ -0,0 +1,174 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_event_detection -- segment the raw current
+// signal into events, for reads that were basecalled
+// without an event table
+//
+#include "nanopolish_event_detection.h"
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+void compute_tstat(const std::vector<double>& sum,
+                   const std::vector<double>& sumsq,
+                   uint32_t w,
+                   std::vector<float>& tstat)
+{
+    assert(w > 0);
+    assert(sum.size() == sumsq.size() && !sum.empty());
+
+    // sum[i] is the sum of the first i samples
+    size_t n = sum.size() - 1;
+    tstat.assign(n, 0.0f);
+    if(n < 2 * w) {
+        return;
+    }
+
+    // guard against windows of identical samples
+    const double min_var = 1e-8;
+    const double inv_w = 1.0 / w;
+    const double* s = sum.data();
+    const double* q = sumsq.data();
+    float* t = tstat.data();
+
+    // every position is independent so this loop is vectorized
+    #pragma omp simd
+    for(size_t i = w; i <= n - w; ++i) {
+        double mean1 = (s[i] - s[i - w]) * inv_w;
+        double mean2 = (s[i + w] - s[i]) * inv_w;
+        double var1 = (q[i] - q[i - w]) * inv_w - mean1 * mean1;
+        double var2 = (q[i + w] - q[i]) * inv_w - mean2 * mean2;
+        double combined_var = fmax(var1 + var2, min_var);
+
+        // Welch's t for two windows of the same size
+        t[i] = fabs(mean2 - mean1) / sqrt(combined_var * inv_w);
+    }
+}
+
+// The state of one t-statistic peak finder
+struct PeakDetector
+{
+    const std::vector<float>* tstat;
+    uint32_t window_length;
+    float threshold;
+
+    size_t masked_to;
+    int64_t peak_pos;
+    float peak_value;
+    bool valid_peak;
+};
+
+static const int64_t NO_PEAK = -1;
+static const float NO_PEAK_VALUE = 1e5f;
+
+// Find the positions of peaks in the t-statistic of either window. A peak
+// has to rise by peak_height from the preceding valley, exceed its detector's
+// threshold and fall again by peak_height. While the short window has a peak
+// above its threshold, the long window is suppressed around it.
+static std::vector<size_t> find_peaks(PeakDetector& short_detector, PeakDetector& long_detector, float peak_height)
+{
+    std::vector<size_t> peaks;
+    size_t n = short_detector.tstat->size();
+    PeakDetector* detectors[2] = { &short_detector, &long_detector };
+
+    for(size_t i = 0; i < n; ++i) {
+        for(size_t di = 0; di < 2; ++di) {
+            PeakDetector& d = *detectors[di];
+            if(d.masked_to >= i) {
+                continue;
+            }
+
+            float current_value = (*d.tstat)[i];
+            if(d.peak_pos == NO_PEAK) {
+                // follow the signal down into a valley, or start a peak once it rises
+                if(current_value < d.peak_value) {
+                    d.peak_value = current_value;
+                } else if(current_value - d.peak_value > peak_height) {
+                    d.peak_value = current_value;
+                    d.peak_pos = i;
+                }
+            } else {
+                if(current_value > d.peak_value) {
+                    d.peak_value = current_value;
+                    d.peak_pos = i;
+                }
+
+                if(&d == &short_detector && d.peak_value > d.threshold) {
+                    long_detector.masked_to = d.peak_pos + d.window_length;
+                    long_detector.peak_pos = NO_PEAK;
+                    long_detector.peak_value = NO_PEAK_VALUE;
+                    long_detector.valid_peak = false;
+                }
+
+                if(d.peak_value - current_value > peak_height && d.peak_value > d.threshold) {
+                    d.valid_peak = true;
+                }
+
+                // emit the peak once we are far enough past it
+                if(d.valid_peak && (i - d.peak_pos) > d.window_length / 2) {
+                    peaks.push_back(d.peak_pos);
+                    d.peak_pos = NO_PEAK;
+                    d.peak_value = current_value;
+                    d.valid_peak = false;
+                }
+            }
+        }
+    }
+
+    // the two detectors emit peaks with different delays
+    std::sort(peaks.begin(), peaks.end());
+    peaks.erase(std::unique(peaks.begin(), peaks.end()), peaks.end());
+    return peaks;
+}
+
+std::vector<DetectedEvent> detect_events(const std::vector<float>& samples,
+                                         const EventDetectionParameters& params)
+{
+    std::vector<DetectedEvent> events;
+    size_t n = samples.size();
+    if(n == 0) {
+        return events;
+    }
+
+    std::vector<double> sum(n + 1, 0.0);
+    std::vector<double> sumsq(n + 1, 0.0);
+    for(size_t i = 0; i < n; ++i) {
+        sum[i + 1] = sum[i] + samples[i];
+        sumsq[i + 1] = sumsq[i] + (double)samples[i] * samples[i];
+    }
+
+    std::vector<float> tstat1;
+    std::vector<float> tstat2;
+    compute_tstat(sum, sumsq, params.window_length1, tstat1);
+    compute_tstat(sum, sumsq, params.window_length2, tstat2);
+
+    PeakDetector short_detector = { &tstat1, params.window_length1, params.threshold1, 0, NO_PEAK, NO_PEAK_VALUE, false };
+    PeakDetector long_detector = { &tstat2, params.window_length2, params.threshold2, 0, NO_PEAK, NO_PEAK_VALUE, false };
+    std::vector<size_t> boundaries = find_peaks(short_detector, long_detector, params.peak_height);
+    boundaries.push_back(n);
+
+    events.reserve(boundaries.size());
+    size_t start = 0;
+    for(size_t bi = 0; bi < boundaries.size(); ++bi) {
+        size_t end = boundaries[bi];
+        if(end <= start) {
+            continue;
+        }
+
+        double length = end - start;
+        double mean = (sum[end] - sum[start]) / length;
+        double var = (sumsq[end] - sumsq[start]) / length - mean * mean;
+
+        DetectedEvent e;
+        e.start = start;
+        e.length = end - start;
+        e.mean = mean;
+        e.stdv = sqrt(std::max(var, 0.0));
+        events.push_back(e);
+        start = end;
+    }
+    return events;
+}
@@ -0,0 +1,51 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_event_detection -- segment the raw current
+// signal into events, for reads that were basecalled
+// without an event table
+//
+#ifndef NANOPOLISH_EVENT_DETECTION_H
+#define NANOPOLISH_EVENT_DETECTION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// A run of samples with approximately constant current
+struct DetectedEvent
+{
+    uint64_t start;  // index of the first sample
+    uint32_t length; // number of samples
+    float mean;
+    float stdv;
+};
+
+// A boundary is placed where a two-window t-statistic peaks. The short
+// window finds short events and masks the long window, which finds
+// boundaries between events with similar levels. The defaults are the
+// values the R9.4 basecallers use.
+struct EventDetectionParameters
+{
+    uint32_t window_length1 = 3;
+    uint32_t window_length2 = 6;
+    float threshold1 = 1.4f;
+    float threshold2 = 9.0f;
+    float peak_height = 0.2f;
+};
+
+// Compute the t-statistic for a boundary before each sample, comparing
+// the w samples before it to the w samples from it. Positions without a
+// full window on both sides are zero.
+void compute_tstat(const std::vector<double>& sum,
+                   const std::vector<double>& sumsq,
+                   uint32_t w,
+                   std::vector<float>& tstat);
+
+// Segment the samples, in picoamps, into events
+std::vector<DetectedEvent> detect_events(const std::vector<float>& samples,
+                                         const EventDetectionParameters& params = EventDetectionParameters());
+
+#endif
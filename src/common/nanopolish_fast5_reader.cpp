@@ -0,0 +1,1216 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_fast5_reader -- minimal read-only parser for
+// the parts of the HDF5 format used by fast5 files. It works
+// directly on a memory-mapped file so, unlike the HDF5 library,
+// any number of threads can decode files at the same time.
+// Every function returns false for layouts it does not
+// understand so the caller can fall back to the HDF5 library.
+//
+#include "nanopolish_fast5_reader.h"
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <sstream>
+
+// Object header message types
+#define F5_MSG_DATASPACE 0x01
+#define F5_MSG_LINK_INFO 0x02
+#define F5_MSG_DATATYPE 0x03
+#define F5_MSG_LINK 0x06
+#define F5_MSG_LAYOUT 0x08
+#define F5_MSG_FILTERS 0x0B
+#define F5_MSG_ATTRIBUTE 0x0C
+#define F5_MSG_CONTINUATION 0x10
+#define F5_MSG_SYMBOL_TABLE 0x11
+#define F5_MSG_ATTRIBUTE_INFO 0x15
+
+// Filter identifiers
+#define F5_FILTER_DEFLATE 1
+#define F5_FILTER_SHUFFLE 2
+#define F5_FILTER_FLETCHER32 3
+
+// Guard against cycles in corrupt files
+#define F5_MAX_DEPTH 32
+
+static const uint8_t HDF5_SIGNATURE[8] = { 0x89, 'H', 'D', 'F', '\r', '\n', 0x1a, '\n' };
+
+size_t Fast5Dataset::get_num_elements() const
+{
+    size_t n = 1;
+    for(size_t i = 0; i < dims.size(); ++i) {
+        n *= dims[i];
+    }
+    return n;
+}
+
+const Fast5Member* Fast5Dataset::get_member(const std::string& member) const
+{
+    for(size_t i = 0; i < type.members.size(); ++i) {
+        if(type.members[i].name == member) {
+            return &type.members[i];
+        }
+    }
+    return NULL;
+}
+
+// Convert a little-endian value of the given class and size to a double
+static bool convert_numeric(const uint8_t* p, int type_class, size_t size, bool is_signed, double& out)
+{
+    if(type_class == F5T_FLOAT && size == 4) {
+        float f;
+        memcpy(&f, p, 4);
+        out = f;
+    } else if(type_class == F5T_FLOAT && size == 8) {
+        memcpy(&out, p, 8);
+    } else if(type_class == F5T_FIXED && size >= 1 && size <= 8) {
+        uint64_t u = 0;
+        for(size_t i = 0; i < size; ++i) {
+            u |= (uint64_t)p[i] << (8 * i);
+        }
+
+        if(is_signed && size < 8 && (u >> (8 * size - 1)) & 1) {
+            u |= ~(uint64_t)0 << (8 * size);
+        }
+        out = is_signed ? (double)(int64_t)u : (double)u;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool Fast5Dataset::get_numeric_column(const std::string& member, std::vector<double>& out) const
+{
+    const Fast5Member* m = get_member(member);
+    if(m == NULL || m->offset + m->size > type.size) {
+        return false;
+    }
+
+    size_t n = get_num_elements();
+    if(data.size() < n * type.size) {
+        return false;
+    }
+
+    out.resize(n);
+    for(size_t i = 0; i < n; ++i) {
+        if(!convert_numeric(&data[i * type.size + m->offset], m->type_class, m->size, m->is_signed, out[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Fast5Reader::Fast5Reader() : m_fd(-1),
+                             m_data(NULL),
+                             m_size(0),
+                             m_base_address(0),
+                             m_root_address(0),
+                             m_offset_size(8),
+                             m_length_size(8)
+{
+
+}
+
+Fast5Reader::~Fast5Reader()
+{
+    close();
+}
+
+bool Fast5Reader::open(const std::string& filename)
+{
+    close();
+
+    m_fd = ::open(filename.c_str(), O_RDONLY);
+    if(m_fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(m_fd, &st) != 0 || st.st_size == 0) {
+        close();
+        return false;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if(p == MAP_FAILED) {
+        close();
+        return false;
+    }
+    m_data = (const uint8_t*)p;
+    m_size = st.st_size;
+
+    // The superblock is at 0 or a power of two >= 512 if there is a user block
+    uint64_t sb = 0;
+    while(in_bounds(sb, 8) && memcmp(m_data + sb, HDF5_SIGNATURE, 8) != 0) {
+        sb = sb == 0 ? 512 : sb * 2;
+    }
+
+    if(!in_bounds(sb, 8)) {
+        close();
+        return false;
+    }
+
+    sb += 8;
+    if(!in_bounds(sb, 1)) {
+        close();
+        return false;
+    }
+
+    uint8_t version = m_data[sb];
+    bool ok = true;
+    if(version == 0 || version == 1) {
+        ok = in_bounds(sb, 24);
+        if(ok) {
+            m_offset_size = m_data[sb + 5];
+            m_length_size = m_data[sb + 6];
+            uint64_t p = sb + 16 + (version == 1 ? 4 : 0);
+
+            // base, free-space, end-of-file and driver addresses, then the root symbol table entry
+            ok = m_offset_size >= 2 && m_offset_size <= 8 && in_bounds(p, 6 * m_offset_size);
+            if(ok) {
+                m_base_address = read_offset(p);
+                m_root_address = read_offset(p + 4 * m_offset_size + m_offset_size);
+            }
+        }
+    } else if(version == 2 || version == 3) {
+        ok = in_bounds(sb, 4);
+        if(ok) {
+            m_offset_size = m_data[sb + 1];
+            m_length_size = m_data[sb + 2];
+            uint64_t p = sb + 4;
+            ok = m_offset_size >= 2 && m_offset_size <= 8 && in_bounds(p, 4 * m_offset_size);
+            if(ok) {
+                m_base_address = read_offset(p);
+                m_root_address = read_offset(p + 3 * m_offset_size);
+            }
+        }
+    } else {
+        ok = false;
+    }
+
+    if(!ok || m_length_size < 2 || m_length_size > 8) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void Fast5Reader::close()
+{
+    if(m_data != NULL) {
+        munmap((void*)m_data, m_size);
+    }
+
+    if(m_fd >= 0) {
+        ::close(m_fd);
+    }
+
+    m_fd = -1;
+    m_data = NULL;
+    m_size = 0;
+    m_object_cache.clear();
+}
+
+uint64_t Fast5Reader::read_uint(uint64_t pos, size_t n) const
+{
+    assert(in_bounds(pos, n));
+    uint64_t v = 0;
+    for(size_t i = 0; i < n; ++i) {
+        v |= (uint64_t)m_data[pos + i] << (8 * i);
+    }
+    return v;
+}
+
+bool Fast5Reader::is_undefined(uint64_t address) const
+{
+    uint64_t undefined = m_offset_size == 8 ? ~(uint64_t)0 : ((uint64_t)1 << (8 * m_offset_size)) - 1;
+    return address == undefined;
+}
+
+//
+// Object headers
+//
+bool Fast5Reader::parse_message_block_v1(uint64_t start, uint64_t length,
+                                         std::vector<Message>& messages,
+                                         std::vector<std::pair<uint64_t, uint64_t> >& continuations) const
+{
+    if(!in_bounds(start, length)) {
+        return false;
+    }
+
+    uint64_t p = start;
+    uint64_t end = start + length;
+    while(p + 8 <= end) {
+        Message m;
+        m.type = read_uint(p, 2);
+        m.size = read_uint(p + 2, 2);
+        m.flags = m_data[p + 4];
+        m.offset = p + 8;
+        if(m.offset + m.size > end) {
+            return false;
+        }
+
+        if(m.type == F5_MSG_CONTINUATION) {
+            if(m.size < m_offset_size + m_length_size) {
+                return false;
+            }
+            continuations.push_back(std::make_pair(m_base_address + read_offset(m.offset),
+                                                   read_length(m.offset + m_offset_size)));
+        } else {
+            messages.push_back(m);
+        }
+        p = m.offset + m.size;
+    }
+    return true;
+}
+
+bool Fast5Reader::parse_message_block_v2(uint64_t start, uint64_t length, bool has_creation_order,
+                                         std::vector<Message>& messages,
+                                         std::vector<std::pair<uint64_t, uint64_t> >& continuations) const
+{
+    if(!in_bounds(start, length)) {
+        return false;
+    }
+
+    uint64_t header_size = has_creation_order ? 6 : 4;
+    uint64_t p = start;
+    uint64_t end = start + length;
+
+    // the remainder of a block too small for a message is a gap
+    while(p + header_size <= end) {
+        Message m;
+        m.type = m_data[p];
+        m.size = read_uint(p + 1, 2);
+        m.flags = m_data[p + 3];
+        m.offset = p + header_size;
+        if(m.offset + m.size > end) {
+            return false;
+        }
+
+        if(m.type == F5_MSG_CONTINUATION) {
+            if(m.size < m_offset_size + m_length_size) {
+                return false;
+            }
+            continuations.push_back(std::make_pair(m_base_address + read_offset(m.offset),
+                                                   read_length(m.offset + m_offset_size)));
+        } else {
+            messages.push_back(m);
+        }
+        p = m.offset + m.size;
+    }
+    return true;
+}
+
+bool Fast5Reader::read_object_header(uint64_t address, std::vector<Message>& messages) const
+{
+    messages.clear();
+    std::vector<std::pair<uint64_t, uint64_t> > continuations;
+
+    if(in_bounds(address, 16) && memcmp(m_data + address, "OHDR", 4) == 0) {
+        uint8_t flags = m_data[address + 5];
+        uint64_t p = address + 6;
+        if(flags & 0x20) {
+            p += 16; // access, modification, change and birth times
+        }
+        if(flags & 0x10) {
+            p += 4; // attribute storage phase change values
+        }
+
+        size_t size_bytes = (size_t)1 << (flags & 0x03);
+        if(!in_bounds(p, size_bytes)) {
+            return false;
+        }
+        uint64_t chunk_size = read_uint(p, size_bytes);
+        p += size_bytes;
+
+        bool has_creation_order = flags & 0x04;
+        if(!parse_message_block_v2(p, chunk_size, has_creation_order, messages, continuations)) {
+            return false;
+        }
+
+        // continuation blocks are "OCHK", messages, checksum
+        for(size_t ci = 0; ci < continuations.size(); ++ci) {
+            uint64_t c_start = continuations[ci].first;
+            uint64_t c_length = continuations[ci].second;
+            if(ci > F5_MAX_DEPTH || c_length < 8 || !in_bounds(c_start, c_length) || memcmp(m_data + c_start, "OCHK", 4) != 0) {
+                return false;
+            }
+            if(!parse_message_block_v2(c_start + 4, c_length - 8, has_creation_order, messages, continuations)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if(!in_bounds(address, 16) || m_data[address] != 1) {
+        return false;
+    }
+
+    uint64_t header_size = read_uint(address + 8, 4);
+    if(!parse_message_block_v1(address + 16, header_size, messages, continuations)) {
+        return false;
+    }
+
+    for(size_t ci = 0; ci < continuations.size(); ++ci) {
+        if(ci > F5_MAX_DEPTH ||
+           !parse_message_block_v1(continuations[ci].first, continuations[ci].second, messages, continuations)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// Groups
+//
+bool Fast5Reader::walk_group_btree(uint64_t node_address, uint64_t heap_data, LinkList& links, int depth) const
+{
+    if(depth > F5_MAX_DEPTH || !in_bounds(node_address, 8 + 2 * m_offset_size) ||
+       memcmp(m_data + node_address, "TREE", 4) != 0 || m_data[node_address + 4] != 0) {
+        return false;
+    }
+
+    uint8_t level = m_data[node_address + 5];
+    uint16_t entries = read_uint(node_address + 6, 2);
+
+    // keys and children alternate, starting and ending with a key
+    uint64_t p = node_address + 8 + 2 * m_offset_size;
+    uint64_t entry_size = m_length_size + m_offset_size;
+    if(!in_bounds(p, entries * entry_size + m_length_size)) {
+        return false;
+    }
+
+    for(size_t i = 0; i < entries; ++i) {
+        uint64_t child = m_base_address + read_offset(p + i * entry_size + m_length_size);
+        if(level > 0) {
+            if(!walk_group_btree(child, heap_data, links, depth + 1)) {
+                return false;
+            }
+            continue;
+        }
+
+        // symbol table node
+        if(!in_bounds(child, 8) || memcmp(m_data + child, "SNOD", 4) != 0) {
+            return false;
+        }
+
+        uint16_t num_symbols = read_uint(child + 6, 2);
+        uint64_t symbol_size = 2 * m_offset_size + 24;
+        if(!in_bounds(child + 8, num_symbols * symbol_size)) {
+            return false;
+        }
+
+        for(size_t si = 0; si < num_symbols; ++si) {
+            uint64_t e = child + 8 + si * symbol_size;
+            uint64_t name_pos = heap_data + read_offset(e);
+            uint64_t object_address = m_base_address + read_offset(e + m_offset_size);
+            if(!in_bounds(name_pos, 1)) {
+                return false;
+            }
+
+            const char* name = (const char*)m_data + name_pos;
+            size_t name_len = strnlen(name, m_size - name_pos);
+            links.push_back(std::make_pair(std::string(name, name_len), object_address));
+        }
+    }
+    return true;
+}
+
+bool Fast5Reader::get_links(uint64_t address, LinkList& links) const
+{
+    links.clear();
+    std::vector<Message> messages;
+    if(!read_object_header(address, messages)) {
+        return false;
+    }
+
+    for(size_t mi = 0; mi < messages.size(); ++mi) {
+        const Message& m = messages[mi];
+        uint64_t p = m.offset;
+        uint64_t end = m.offset + m.size;
+
+        if(m.type == F5_MSG_SYMBOL_TABLE) {
+            // old-style group: a B-tree of symbol table nodes and a local heap of names
+            if(m.size < 2 * m_offset_size) {
+                return false;
+            }
+            uint64_t btree = m_base_address + read_offset(p);
+            uint64_t heap = m_base_address + read_offset(p + m_offset_size);
+            if(!in_bounds(heap, 8 + 2 * m_length_size + m_offset_size) || memcmp(m_data + heap, "HEAP", 4) != 0) {
+                return false;
+            }
+            uint64_t heap_data = m_base_address + read_offset(heap + 8 + 2 * m_length_size);
+            if(!walk_group_btree(btree, heap_data, links, 0)) {
+                return false;
+            }
+        } else if(m.type == F5_MSG_LINK_INFO) {
+            // links stored in a fractal heap are not supported
+            if(m.size < 2) {
+                return false;
+            }
+            uint64_t q = p + 2 + ((m_data[p + 1] & 0x01) ? 8 : 0);
+            if(q + m_offset_size > end || !is_undefined(read_offset(q))) {
+                return false;
+            }
+        } else if(m.type == F5_MSG_LINK) {
+            // new-style compact group
+            if(m.size < 2) {
+                return false;
+            }
+            uint8_t flags = m_data[p + 1];
+            p += 2;
+            uint8_t link_type = 0;
+            if(flags & 0x08) {
+                link_type = m_data[p++];
+            }
+            if(flags & 0x04) {
+                p += 8;
+            }
+            if(flags & 0x10) {
+                p += 1;
+            }
+
+            size_t length_bytes = (size_t)1 << (flags & 0x03);
+            if(p + length_bytes > end) {
+                return false;
+            }
+            uint64_t name_len = read_uint(p, length_bytes);
+            p += length_bytes;
+            if(p + name_len > end) {
+                return false;
+            }
+            std::string name((const char*)m_data + p, name_len);
+            p += name_len;
+
+            // soft and external links are skipped
+            if(link_type == 0) {
+                if(p + m_offset_size > end) {
+                    return false;
+                }
+                links.push_back(std::make_pair(name, m_base_address + read_offset(p)));
+            }
+        }
+    }
+    return true;
+}
+
+bool Fast5Reader::find_object(const std::string& path, uint64_t& address)
+{
+    auto iter = m_object_cache.find(path);
+    if(iter != m_object_cache.end()) {
+        address = iter->second;
+        return true;
+    }
+
+    address = m_base_address + m_root_address;
+    std::stringstream parser(path);
+    std::string component;
+    LinkList links;
+    while(std::getline(parser, component, '/')) {
+        if(component.empty()) {
+            continue;
+        }
+
+        if(!get_links(address, links)) {
+            return false;
+        }
+
+        bool found = false;
+        for(size_t i = 0; i < links.size(); ++i) {
+            if(links[i].first == component) {
+                address = links[i].second;
+                found = true;
+                break;
+            }
+        }
+
+        if(!found) {
+            return false;
+        }
+    }
+
+    m_object_cache[path] = address;
+    return true;
+}
+
+bool Fast5Reader::list_group(const std::string& path, std::vector<std::string>& names)
+{
+    names.clear();
+    uint64_t address;
+    LinkList links;
+    if(!is_open() || !find_object(path, address) || !get_links(address, links)) {
+        return false;
+    }
+
+    for(size_t i = 0; i < links.size(); ++i) {
+        names.push_back(links[i].first);
+    }
+    std::sort(names.begin(), names.end());
+    return true;
+}
+
+//
+// Datatypes and dataspaces
+//
+bool Fast5Reader::parse_datatype(uint64_t pos, uint64_t end, Fast5Type& type, uint64_t& consumed) const
+{
+    if(pos + 8 > end || !in_bounds(pos, 8)) {
+        return false;
+    }
+
+    uint8_t class_version = m_data[pos];
+    int type_class = class_version & 0x0F;
+    int version = class_version >> 4;
+    uint8_t bits0 = m_data[pos + 1];
+    uint8_t bits1 = m_data[pos + 2];
+
+    type.type_class = F5T_OTHER;
+    type.size = read_uint(pos + 4, 4);
+    type.is_signed = false;
+    type.big_endian = false;
+    type.vlen_string = false;
+    type.members.clear();
+
+    uint64_t p = pos + 8;
+    switch(type_class) {
+        case 0: // fixed-point
+            type.type_class = F5T_FIXED;
+            type.big_endian = bits0 & 0x01;
+            type.is_signed = bits0 & 0x08;
+            p += 4;
+            break;
+        case 1: // floating-point
+            type.type_class = F5T_FLOAT;
+            type.big_endian = bits0 & 0x01;
+            p += 12;
+            break;
+        case 2: // time
+            p += 2;
+            break;
+        case 3: // string
+            type.type_class = F5T_STRING;
+            break;
+        case 4: // bitfield
+            p += 4;
+            break;
+        case 5: // opaque, the tag is padded to a multiple of 8
+            p += bits0;
+            break;
+        case 6: { // compound
+            type.type_class = F5T_COMPOUND;
+            size_t num_members = bits0 | (bits1 << 8);
+            for(size_t i = 0; i < num_members; ++i) {
+                if(p >= end || !in_bounds(p, end - p)) {
+                    return false;
+                }
+
+                const char* name = (const char*)m_data + p;
+                size_t name_len = strnlen(name, end - p);
+                if(name_len == end - p) {
+                    return false;
+                }
+
+                Fast5Member member;
+                member.name = std::string(name, name_len);
+                if(version < 3) {
+                    p += (name_len + 8) & ~(uint64_t)7;
+                    if(p + 4 > end) {
+                        return false;
+                    }
+                    member.offset = read_uint(p, 4);
+                    p += 4;
+                } else {
+                    p += name_len + 1;
+                    size_t offset_bytes = type.size < 256 ? 1 : type.size < 65536 ? 2 : type.size < 16777216 ? 3 : 4;
+                    if(p + offset_bytes > end) {
+                        return false;
+                    }
+                    member.offset = read_uint(p, offset_bytes);
+                    p += offset_bytes;
+                }
+
+                bool is_array = false;
+                if(version == 1) {
+                    if(p + 28 > end) {
+                        return false;
+                    }
+                    is_array = m_data[p] != 0;
+                    p += 28;
+                }
+
+                Fast5Type member_type;
+                uint64_t member_consumed;
+                if(!parse_datatype(p, end, member_type, member_consumed)) {
+                    return false;
+                }
+                p += member_consumed;
+
+                bool simple = member_type.type_class == F5T_FIXED ||
+                              member_type.type_class == F5T_FLOAT ||
+                              member_type.type_class == F5T_STRING;
+                member.type_class = simple && !is_array && !member_type.big_endian ? member_type.type_class : F5T_OTHER;
+                member.size = member_type.size;
+                member.is_signed = member_type.is_signed;
+                type.members.push_back(member);
+            }
+            break;
+        }
+        case 7: // reference
+            break;
+        case 8: { // enumeration: base type, names, values
+            Fast5Type base;
+            uint64_t base_consumed;
+            if(!parse_datatype(p, end, base, base_consumed)) {
+                return false;
+            }
+            p += base_consumed;
+
+            size_t num_members = bits0 | (bits1 << 8);
+            for(size_t i = 0; i < num_members; ++i) {
+                if(p >= end || !in_bounds(p, end - p)) {
+                    return false;
+                }
+                size_t name_len = strnlen((const char*)m_data + p, end - p);
+                p += version < 3 ? (name_len + 8) & ~(uint64_t)7 : name_len + 1;
+            }
+            p += num_members * base.size;
+            break;
+        }
+        case 9: { // variable-length
+            Fast5Type base;
+            uint64_t base_consumed;
+            if(!parse_datatype(p, end, base, base_consumed)) {
+                return false;
+            }
+            p += base_consumed;
+            type.type_class = F5T_VLEN;
+            type.vlen_string = (bits0 & 0x0F) == 1;
+            break;
+        }
+        case 10: { // array
+            if(p + 4 > end) {
+                return false;
+            }
+            uint8_t ndims = m_data[p];
+            p += version < 3 ? 4 + 8 * ndims : 1 + 4 * ndims;
+            Fast5Type base;
+            uint64_t base_consumed;
+            if(!parse_datatype(p, end, base, base_consumed)) {
+                return false;
+            }
+            p += base_consumed;
+            break;
+        }
+        default:
+            return false;
+    }
+
+    if(p > end) {
+        return false;
+    }
+    consumed = p - pos;
+    return true;
+}
+
+bool Fast5Reader::parse_dataspace(uint64_t pos, uint64_t end, std::vector<uint64_t>& dims) const
+{
+    dims.clear();
+    if(pos + 4 > end) {
+        return false;
+    }
+
+    uint8_t version = m_data[pos];
+    uint8_t rank = m_data[pos + 1];
+    uint64_t p;
+    if(version == 1) {
+        p = pos + 8;
+    } else if(version == 2) {
+        // null dataspaces have no elements
+        if(m_data[pos + 3] == 2) {
+            dims.push_back(0);
+            return true;
+        }
+        p = pos + 4;
+    } else {
+        return false;
+    }
+
+    if(p + rank * m_length_size > end) {
+        return false;
+    }
+
+    for(size_t i = 0; i < rank; ++i) {
+        dims.push_back(read_length(p + i * m_length_size));
+    }
+    return true;
+}
+
+//
+// Chunked storage
+//
+static bool apply_filters_reverse(std::vector<uint8_t>& buffer,
+                                  uint32_t filter_mask,
+                                  size_t expected_size,
+                                  size_t element_size,
+                                  const std::vector<uint16_t>& filters,
+                                  const std::vector<uint32_t>& filter_params)
+{
+    for(size_t fi = filters.size(); fi-- > 0; ) {
+        if(filter_mask & (1 << fi)) {
+            continue;
+        }
+
+        if(filters[fi] == F5_FILTER_DEFLATE) {
+            std::vector<uint8_t> out(expected_size);
+            uLongf out_size = expected_size;
+            if(uncompress(out.data(), &out_size, buffer.data(), buffer.size()) != Z_OK || out_size != expected_size) {
+                return false;
+            }
+            buffer.swap(out);
+        } else if(filters[fi] == F5_FILTER_SHUFFLE) {
+            size_t es = filter_params[fi] > 0 ? filter_params[fi] : element_size;
+            size_t n = buffer.size() / es;
+            std::vector<uint8_t> out(buffer);
+            for(size_t b = 0; b < es; ++b) {
+                for(size_t i = 0; i < n; ++i) {
+                    out[i * es + b] = buffer[b * n + i];
+                }
+            }
+            buffer.swap(out);
+        } else if(filters[fi] == F5_FILTER_FLETCHER32) {
+            if(buffer.size() < 4) {
+                return false;
+            }
+            buffer.resize(buffer.size() - 4);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Fast5Reader::read_chunk_btree(uint64_t node_address, size_t ndims, const std::vector<uint32_t>& chunk_dims,
+                                   const std::vector<uint16_t>& filters, const std::vector<uint32_t>& filter_params,
+                                   Fast5Dataset& out, int depth) const
+{
+    if(depth > F5_MAX_DEPTH || !in_bounds(node_address, 8 + 2 * m_offset_size) ||
+       memcmp(m_data + node_address, "TREE", 4) != 0 || m_data[node_address + 4] != 1) {
+        return false;
+    }
+
+    uint8_t level = m_data[node_address + 5];
+    uint16_t entries = read_uint(node_address + 6, 2);
+
+    // key: chunk size, filter mask, then one 64-bit offset per dimension
+    uint64_t key_size = 8 + 8 * ndims;
+    uint64_t entry_size = key_size + m_offset_size;
+    uint64_t p = node_address + 8 + 2 * m_offset_size;
+    if(!in_bounds(p, entries * entry_size + key_size)) {
+        return false;
+    }
+
+    size_t element_size = out.type.size;
+    size_t chunk_elements = chunk_dims[0];
+    size_t total_elements = out.dims[0];
+
+    for(size_t i = 0; i < entries; ++i) {
+        uint64_t key = p + i * entry_size;
+        uint64_t child = m_base_address + read_offset(key + key_size);
+
+        if(level > 0) {
+            if(!read_chunk_btree(child, ndims, chunk_dims, filters, filter_params, out, depth + 1)) {
+                return false;
+            }
+            continue;
+        }
+
+        uint32_t chunk_size = read_uint(key, 4);
+        uint32_t filter_mask = read_uint(key + 4, 4);
+        uint64_t chunk_start = read_uint(key + 8, 8);
+        if(!in_bounds(child, chunk_size) || chunk_start >= total_elements) {
+            return false;
+        }
+
+        std::vector<uint8_t> buffer(m_data + child, m_data + child + chunk_size);
+        if(!apply_filters_reverse(buffer, filter_mask, chunk_elements * element_size, element_size, filters, filter_params)) {
+            return false;
+        }
+
+        // the last chunk extends past the end of the dataset
+        size_t n = std::min(chunk_elements, (size_t)(total_elements - chunk_start));
+        if(buffer.size() < n * element_size) {
+            return false;
+        }
+        memcpy(&out.data[chunk_start * element_size], buffer.data(), n * element_size);
+    }
+    return true;
+}
+
+bool Fast5Reader::read_chunked(uint64_t btree_address, const std::vector<uint32_t>& chunk_dims,
+                               const std::vector<uint16_t>& filters, const std::vector<uint32_t>& filter_params,
+                               Fast5Dataset& out) const
+{
+    // fast5 tables and signals are one-dimensional
+    if(out.dims.size() != 1 || chunk_dims.size() != 2 || chunk_dims[0] == 0) {
+        return false;
+    }
+
+    out.data.assign(out.get_num_elements() * out.type.size, 0);
+    if(is_undefined(btree_address)) {
+        return true;
+    }
+    return read_chunk_btree(m_base_address + btree_address, chunk_dims.size(), chunk_dims, filters, filter_params, out, 0);
+}
+
+//
+// Datasets
+//
+bool Fast5Reader::read_dataset(const std::string& path, Fast5Dataset& out)
+{
+    uint64_t address;
+    std::vector<Message> messages;
+    if(!is_open() || !find_object(path, address) || !read_object_header(address, messages)) {
+        return false;
+    }
+
+    bool have_type = false;
+    bool have_space = false;
+    const Message* layout = NULL;
+    std::vector<uint16_t> filters;
+    std::vector<uint32_t> filter_params;
+
+    for(size_t mi = 0; mi < messages.size(); ++mi) {
+        const Message& m = messages[mi];
+        uint64_t end = m.offset + m.size;
+
+        // shared (committed) datatypes and dataspaces are not supported
+        if((m.type == F5_MSG_DATATYPE || m.type == F5_MSG_DATASPACE) && (m.flags & 0x02)) {
+            return false;
+        }
+
+        if(m.type == F5_MSG_DATATYPE) {
+            uint64_t consumed;
+            have_type = parse_datatype(m.offset, end, out.type, consumed);
+        } else if(m.type == F5_MSG_DATASPACE) {
+            have_space = parse_dataspace(m.offset, end, out.dims);
+        } else if(m.type == F5_MSG_LAYOUT) {
+            layout = &m;
+        } else if(m.type == F5_MSG_FILTERS) {
+            if(m.size < 2) {
+                return false;
+            }
+            uint8_t version = m_data[m.offset];
+            uint8_t num_filters = m_data[m.offset + 1];
+            uint64_t p = m.offset + (version == 1 ? 8 : 2);
+            for(size_t fi = 0; fi < num_filters; ++fi) {
+                if(p + 2 > end) {
+                    return false;
+                }
+                uint16_t id = read_uint(p, 2);
+                p += 2;
+
+                uint16_t name_len = 0;
+                if(version == 1 || id >= 256) {
+                    if(p + 2 > end) {
+                        return false;
+                    }
+                    name_len = read_uint(p, 2);
+                    p += 2;
+                }
+
+                if(p + 4 > end) {
+                    return false;
+                }
+                uint16_t num_values = read_uint(p + 2, 2);
+                p += 4 + name_len;
+                if(p + 4 * num_values > end) {
+                    return false;
+                }
+
+                filters.push_back(id);
+                filter_params.push_back(num_values > 0 ? read_uint(p, 4) : 0);
+                p += 4 * num_values;
+                if(version == 1 && (num_values % 2) == 1) {
+                    p += 4;
+                }
+            }
+        }
+    }
+
+    // variable-length data and big-endian values are left to the HDF5 library
+    if(!have_type || !have_space || layout == NULL ||
+       out.type.type_class == F5T_VLEN || out.type.type_class == F5T_OTHER || out.type.big_endian) {
+        return false;
+    }
+
+    uint64_t p = layout->offset;
+    uint64_t end = layout->offset + layout->size;
+    if(p + 2 > end) {
+        return false;
+    }
+
+    size_t num_bytes = out.get_num_elements() * out.type.size;
+    uint8_t version = m_data[p];
+    if(version == 3 || version == 4) {
+        uint8_t layout_class = m_data[p + 1];
+        p += 2;
+        if(layout_class == 0) {
+            if(p + 2 > end) {
+                return false;
+            }
+            uint64_t size = read_uint(p, 2);
+            if(size < num_bytes || p + 2 + size > end) {
+                return false;
+            }
+            out.data.assign(m_data + p + 2, m_data + p + 2 + num_bytes);
+            return true;
+        } else if(layout_class == 1) {
+            if(p + m_offset_size > end) {
+                return false;
+            }
+            uint64_t data_address = read_offset(p);
+            if(is_undefined(data_address)) {
+                out.data.assign(num_bytes, 0);
+                return true;
+            }
+            data_address += m_base_address;
+            if(!in_bounds(data_address, num_bytes)) {
+                return false;
+            }
+            out.data.assign(m_data + data_address, m_data + data_address + num_bytes);
+            return true;
+        } else if(layout_class == 2 && version == 3) {
+            if(p + 1 + m_offset_size > end) {
+                return false;
+            }
+            uint8_t ndims = m_data[p];
+            uint64_t btree_address = read_offset(p + 1);
+            p += 1 + m_offset_size;
+            if(p + 4 * ndims > end) {
+                return false;
+            }
+            std::vector<uint32_t> chunk_dims;
+            for(size_t i = 0; i < ndims; ++i) {
+                chunk_dims.push_back(read_uint(p + 4 * i, 4));
+            }
+            return read_chunked(btree_address, chunk_dims, filters, filter_params, out);
+        }
+        // version 4 chunk indices are not supported
+        return false;
+    } else if(version == 1 || version == 2) {
+        if(p + 8 > end) {
+            return false;
+        }
+        uint8_t ndims = m_data[p + 1];
+        uint8_t layout_class = m_data[p + 2];
+        p += 8;
+
+        uint64_t data_address = 0;
+        if(layout_class != 0) {
+            if(p + m_offset_size > end) {
+                return false;
+            }
+            data_address = read_offset(p);
+            p += m_offset_size;
+        }
+
+        if(p + 4 * ndims > end) {
+            return false;
+        }
+        std::vector<uint32_t> layout_dims;
+        for(size_t i = 0; i < ndims; ++i) {
+            layout_dims.push_back(read_uint(p + 4 * i, 4));
+        }
+        p += 4 * ndims;
+
+        if(layout_class == 0) {
+            if(p + 4 > end) {
+                return false;
+            }
+            uint64_t size = read_uint(p, 4);
+            if(size < num_bytes || p + 4 + size > end) {
+                return false;
+            }
+            out.data.assign(m_data + p + 4, m_data + p + 4 + num_bytes);
+            return true;
+        } else if(layout_class == 1) {
+            data_address += m_base_address;
+            if(!in_bounds(data_address, num_bytes)) {
+                return false;
+            }
+            out.data.assign(m_data + data_address, m_data + data_address + num_bytes);
+            return true;
+        } else if(layout_class == 2) {
+            // the element size is stored after the dimensions
+            if(layout_dims.size() == out.dims.size()) {
+                layout_dims.push_back(out.type.size);
+            }
+            return read_chunked(data_address, layout_dims, filters, filter_params, out);
+        }
+    }
+    return false;
+}
+
+//
+// Attributes
+//
+bool Fast5Reader::find_attribute(const std::string& path, const std::string& name,
+                                 Fast5Type& type, std::vector<uint64_t>& dims, uint64_t& data_pos)
+{
+    uint64_t address;
+    std::vector<Message> messages;
+    if(!is_open() || !find_object(path, address) || !read_object_header(address, messages)) {
+        return false;
+    }
+
+    for(size_t mi = 0; mi < messages.size(); ++mi) {
+        const Message& m = messages[mi];
+        uint64_t end = m.offset + m.size;
+
+        // attributes stored in a fractal heap are not supported, nor are
+        // truncated messages as they can't tell us where the attributes are
+        if(m.type == F5_MSG_ATTRIBUTE_INFO) {
+            if(m.size < 2) {
+                return false;
+            }
+            uint64_t p = m.offset + 2 + ((m_data[m.offset + 1] & 0x01) ? 2 : 0);
+            if(p + m_offset_size > end || !is_undefined(read_offset(p))) {
+                return false;
+            }
+            continue;
+        }
+
+        if(m.type != F5_MSG_ATTRIBUTE || m.size < 8) {
+            continue;
+        }
+
+        uint8_t version = m_data[m.offset];
+        uint64_t name_size = read_uint(m.offset + 2, 2);
+        uint64_t type_size = read_uint(m.offset + 4, 2);
+        uint64_t space_size = read_uint(m.offset + 6, 2);
+        uint64_t p = m.offset + (version == 3 ? 9 : 8);
+        bool padded = version == 1;
+        if(version < 1 || version > 3) {
+            return false;
+        }
+
+        if(p + name_size > end) {
+            return false;
+        }
+        std::string attribute_name((const char*)m_data + p, strnlen((const char*)m_data + p, name_size));
+        p += padded ? (name_size + 7) & ~(uint64_t)7 : name_size;
+        if(attribute_name != name) {
+            continue;
+        }
+
+        // shared datatypes in attributes are not supported
+        if(version >= 2 && (m_data[m.offset + 1] & 0x03) != 0) {
+            return false;
+        }
+
+        uint64_t consumed;
+        if(!parse_datatype(p, std::min(end, p + type_size), type, consumed)) {
+            return false;
+        }
+        p += padded ? (type_size + 7) & ~(uint64_t)7 : type_size;
+
+        if(!parse_dataspace(p, std::min(end, p + space_size), dims)) {
+            return false;
+        }
+        p += padded ? (space_size + 7) & ~(uint64_t)7 : space_size;
+
+        data_pos = p;
+        size_t n = 1;
+        for(size_t i = 0; i < dims.size(); ++i) {
+            n *= dims[i];
+        }
+
+        // vlen elements are stored as a length, a global heap address and an index
+        size_t element_size = type.type_class == F5T_VLEN ? 4 + m_offset_size + 4 : type.size;
+        return n >= 1 && p + n * element_size <= end;
+    }
+    return false;
+}
+
+bool Fast5Reader::decode_vlen_string(uint64_t pos, std::string& out) const
+{
+    if(!in_bounds(pos, 4 + m_offset_size + 4)) {
+        return false;
+    }
+
+    uint64_t length = read_uint(pos, 4);
+    uint64_t collection = m_base_address + read_offset(pos + 4);
+    uint32_t index = read_uint(pos + 4 + m_offset_size, 4);
+
+    // global heap collection: "GCOL", version, reserved, size, then the objects
+    if(!in_bounds(collection, 8 + m_length_size) || memcmp(m_data + collection, "GCOL", 4) != 0) {
+        return false;
+    }
+
+    uint64_t collection_size = read_length(collection + 8);
+    uint64_t end = collection + collection_size;
+    uint64_t p = collection + 8 + m_length_size;
+    if(!in_bounds(collection, collection_size)) {
+        return false;
+    }
+
+    uint64_t object_header = 8 + m_length_size;
+    while(p + object_header <= end) {
+        uint16_t object_index = read_uint(p, 2);
+        uint64_t object_size = read_length(p + 8);
+        if(object_index == 0) {
+            break; // free space
+        }
+
+        if(object_index == index) {
+            if(p + object_header + object_size > end || length > object_size) {
+                return false;
+            }
+            const char* s = (const char*)m_data + p + object_header;
+            out.assign(s, strnlen(s, length));
+            return true;
+        }
+        p += object_header + ((object_size + 7) & ~(uint64_t)7);
+    }
+    return false;
+}
+
+bool Fast5Reader::read_string_attribute(const std::string& path, const std::string& name, std::string& out)
+{
+    Fast5Type type;
+    std::vector<uint64_t> dims;
+    uint64_t data_pos;
+    if(!find_attribute(path, name, type, dims, data_pos)) {
+        return false;
+    }
+
+    if(type.type_class == F5T_VLEN && type.vlen_string) {
+        return decode_vlen_string(data_pos, out);
+    } else if(type.type_class == F5T_STRING) {
+        // fixed-length strings are null or space padded
+        const char* s = (const char*)m_data + data_pos;
+        out.assign(s, strnlen(s, type.size));
+        out.erase(out.find_last_not_of(' ') + 1);
+        return true;
+    }
+    return false;
+}
+
+bool Fast5Reader::read_numeric_attribute(const std::string& path, const std::string& name, double& out)
+{
+    Fast5Type type;
+    std::vector<uint64_t> dims;
+    uint64_t data_pos;
+    if(!find_attribute(path, name, type, dims, data_pos) || type.big_endian) {
+        return false;
+    }
+    return convert_numeric(m_data + data_pos, type.type_class, type.size, type.is_signed, out);
+}
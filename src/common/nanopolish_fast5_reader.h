@@ -0,0 +1,140 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_fast5_reader -- minimal read-only parser for
+// the parts of the HDF5 format used by fast5 files. It works
+// directly on a memory-mapped file so, unlike the HDF5 library,
+// any number of threads can decode files at the same time.
+// Every function returns false for layouts it does not
+// understand so the caller can fall back to the HDF5 library.
+//
+#ifndef NANOPOLISH_FAST5_READER_H
+#define NANOPOLISH_FAST5_READER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+// HDF5 datatype classes
+enum Fast5TypeClass
+{
+    F5T_FIXED = 0,
+    F5T_FLOAT = 1,
+    F5T_STRING = 3,
+    F5T_COMPOUND = 6,
+    F5T_VLEN = 9,
+    F5T_OTHER = 255
+};
+
+// A member of a compound datatype. Nested compound
+// or array members are recorded as F5T_OTHER.
+struct Fast5Member
+{
+    std::string name;
+    size_t offset;
+    int type_class;
+    size_t size;
+    bool is_signed;
+};
+
+struct Fast5Type
+{
+    int type_class;
+    size_t size;
+    bool is_signed;
+    bool big_endian;
+    bool vlen_string;
+    std::vector<Fast5Member> members;
+};
+
+struct Fast5Dataset
+{
+    std::vector<uint64_t> dims;
+    Fast5Type type;
+    std::vector<uint8_t> data;
+
+    size_t get_num_elements() const;
+
+    // Convert a numeric member of a compound dataset to doubles
+    bool get_numeric_column(const std::string& member, std::vector<double>& out) const;
+
+    // Find a member of a compound dataset
+    const Fast5Member* get_member(const std::string& member) const;
+};
+
+class Fast5Reader
+{
+    public:
+        Fast5Reader();
+        ~Fast5Reader();
+
+        bool open(const std::string& filename);
+        void close();
+        bool is_open() const { return m_data != NULL; }
+
+        // Names of the links in the group at path
+        bool list_group(const std::string& path, std::vector<std::string>& names);
+
+        // Decode the dataset at path, including chunked and deflated layouts
+        bool read_dataset(const std::string& path, Fast5Dataset& out);
+
+        // Read a scalar attribute of the object at path
+        bool read_string_attribute(const std::string& path, const std::string& name, std::string& out);
+        bool read_numeric_attribute(const std::string& path, const std::string& name, double& out);
+
+    private:
+
+        struct Message
+        {
+            uint16_t type;
+            uint8_t flags;
+            size_t offset;
+            size_t size;
+        };
+
+        typedef std::vector<std::pair<std::string, uint64_t> > LinkList;
+
+        // bounds-checked access to the mapped file
+        bool in_bounds(uint64_t pos, uint64_t n) const { return pos <= m_size && n <= m_size - pos; }
+        uint64_t read_uint(uint64_t pos, size_t n) const;
+        uint64_t read_offset(uint64_t pos) const { return read_uint(pos, m_offset_size); }
+        uint64_t read_length(uint64_t pos) const { return read_uint(pos, m_length_size); }
+        bool is_undefined(uint64_t address) const;
+
+        bool read_object_header(uint64_t address, std::vector<Message>& messages) const;
+        bool parse_message_block_v1(uint64_t start, uint64_t length, std::vector<Message>& messages,
+                                    std::vector<std::pair<uint64_t, uint64_t> >& continuations) const;
+        bool parse_message_block_v2(uint64_t start, uint64_t length, bool has_creation_order,
+                                    std::vector<Message>& messages,
+                                    std::vector<std::pair<uint64_t, uint64_t> >& continuations) const;
+
+        bool find_object(const std::string& path, uint64_t& address);
+        bool get_links(uint64_t address, LinkList& links) const;
+        bool walk_group_btree(uint64_t node_address, uint64_t heap_data, LinkList& links, int depth) const;
+
+        bool parse_datatype(uint64_t pos, uint64_t end, Fast5Type& type, uint64_t& consumed) const;
+        bool parse_dataspace(uint64_t pos, uint64_t end, std::vector<uint64_t>& dims) const;
+        bool read_chunked(uint64_t btree_address, const std::vector<uint32_t>& chunk_dims,
+                          const std::vector<uint16_t>& filters, const std::vector<uint32_t>& filter_params,
+                          Fast5Dataset& out) const;
+        bool read_chunk_btree(uint64_t node_address, size_t ndims, const std::vector<uint32_t>& chunk_dims,
+                              const std::vector<uint16_t>& filters, const std::vector<uint32_t>& filter_params,
+                              Fast5Dataset& out, int depth) const;
+        bool decode_vlen_string(uint64_t pos, std::string& out) const;
+        bool find_attribute(const std::string& path, const std::string& name,
+                            Fast5Type& type, std::vector<uint64_t>& dims, uint64_t& data_pos);
+
+        int m_fd;
+        const uint8_t* m_data;
+        uint64_t m_size;
+        uint64_t m_base_address;
+        uint64_t m_root_address;
+        size_t m_offset_size;
+        size_t m_length_size;
+        std::map<std::string, uint64_t> m_object_cache;
+};
+
+#endif
@@ -0,0 +1,334 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_lease_queue -- distribute shards of work
+// between processes on any number of hosts through
+// lease files in a shared directory
+//
+#include "nanopolish_lease_queue.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+static void make_directory(const std::string& path)
+{
+    if(mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "[lease] error: could not create directory %s: %s\n", path.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static bool file_exists(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// Write a file under a temporary name then move it into place, so
+// readers on other hosts never see a partially written file
+static void write_file_atomic(const std::string& path, const std::string& tmp_path, const std::string& contents)
+{
+    FILE* fp = fopen(tmp_path.c_str(), "w");
+    if(fp == NULL) {
+        fprintf(stderr, "[lease] error: could not write %s: %s\n", tmp_path.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fputs(contents.c_str(), fp);
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+
+    if(rename(tmp_path.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "[lease] error: could not rename %s: %s\n", tmp_path.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+LeaseQueue::LeaseQueue(const std::string& directory, double lease_seconds) : m_directory(directory),
+                                                                             m_lease_seconds(lease_seconds),
+                                                                             m_heartbeat_running(false)
+{
+    assert(m_lease_seconds > 0);
+    char hostname[256];
+    if(gethostname(hostname, sizeof(hostname)) != 0) {
+        strcpy(hostname, "localhost");
+    }
+    hostname[sizeof(hostname) - 1] = '\0';
+    m_worker_id = std::string(hostname) + "-" + std::to_string(getpid());
+}
+
+LeaseQueue::~LeaseQueue()
+{
+    stop_heartbeat();
+}
+
+void LeaseQueue::initialize(const std::vector<std::string>& shards)
+{
+    make_directory(m_directory);
+    make_directory(m_directory + "/leases");
+    make_directory(m_directory + "/done");
+    make_directory(m_directory + "/output");
+
+    if(!shards.empty()) {
+        // link() fails if the list already exists so exactly one worker's list is used
+        std::string shards_path = m_directory + "/shards.txt";
+        std::string tmp_path = shards_path + "." + m_worker_id;
+        std::string contents;
+        for(size_t i = 0; i < shards.size(); ++i) {
+            contents += shards[i] + "\n";
+        }
+        write_file_atomic(tmp_path, tmp_path + ".tmp", contents);
+
+        if(link(tmp_path.c_str(), shards_path.c_str()) != 0 && errno != EEXIST) {
+            fprintf(stderr, "[lease] error: could not create %s: %s\n", shards_path.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        unlink(tmp_path.c_str());
+    }
+
+    load();
+
+    if(!shards.empty() && shards != m_shards) {
+        fprintf(stderr, "[lease] error: the shards in %s do not match the shards of this worker\n", m_directory.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+void LeaseQueue::load()
+{
+    std::string shards_path = m_directory + "/shards.txt";
+    std::ifstream in_file(shards_path.c_str());
+    if(!in_file.good()) {
+        fprintf(stderr, "[lease] error: could not read %s\n", shards_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    m_shards.clear();
+    std::string line;
+    while(getline(in_file, line)) {
+        if(!line.empty()) {
+            m_shards.push_back(line);
+        }
+    }
+}
+
+std::string LeaseQueue::get_lease_path(size_t idx, int generation) const
+{
+    return m_directory + "/leases/" + std::to_string(idx) + "." + std::to_string(generation);
+}
+
+std::string LeaseQueue::get_manifest_path(size_t idx) const
+{
+    return m_directory + "/done/" + std::to_string(idx) + ".manifest";
+}
+
+std::string LeaseQueue::get_output_path(size_t idx, const std::string& type) const
+{
+    // the worker is part of the name so a reclaimed shard never overwrites the files of the
+    // worker it was taken from, which may still be running
+    return m_directory + "/output/" + std::to_string(idx) + "." + m_worker_id + "." + type;
+}
+
+int LeaseQueue::get_current_generation(size_t idx) const
+{
+    int generation = -1;
+    while(file_exists(get_lease_path(idx, generation + 1))) {
+        generation += 1;
+    }
+    return generation;
+}
+
+bool LeaseQueue::try_claim(size_t idx)
+{
+    if(file_exists(get_manifest_path(idx))) {
+        return false;
+    }
+
+    // the shard is leased, only take it over if the holder has stopped heartbeating
+    int generation = get_current_generation(idx);
+    if(generation >= 0) {
+        ShardStatus status = get_status(idx);
+        if(status.state != SS_EXPIRED) {
+            return false;
+        }
+    }
+
+    std::string lease_path = get_lease_path(idx, generation + 1);
+    int fd = open(lease_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) {
+        // another worker won the race
+        return false;
+    }
+
+    std::string contents = m_worker_id + "\n";
+    if(write(fd, contents.c_str(), contents.size()) != (ssize_t)contents.size()) {
+        fprintf(stderr, "[lease] warning: could not write %s: %s\n", lease_path.c_str(), strerror(errno));
+    }
+    close(fd);
+
+    if(generation >= 0) {
+        fprintf(stderr, "[lease] %s reclaimed expired shard %zu (%s)\n", m_worker_id.c_str(), idx, m_shards[idx].c_str());
+    }
+
+    m_lease_path = lease_path;
+    return true;
+}
+
+bool LeaseQueue::claim(size_t& idx)
+{
+    assert(m_lease_path.empty());
+
+    // poll for expired leases a few times per lease period
+    double poll_seconds = std::max(1.0, std::min(m_lease_seconds / 4, 30.0));
+    while(true) {
+        bool all_complete = true;
+        for(size_t i = 0; i < m_shards.size(); ++i) {
+            if(file_exists(get_manifest_path(i))) {
+                continue;
+            }
+
+            all_complete = false;
+            if(try_claim(i)) {
+                idx = i;
+                start_heartbeat();
+                return true;
+            }
+        }
+
+        if(all_complete) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(poll_seconds));
+    }
+}
+
+void LeaseQueue::complete(size_t idx, const std::vector<ShardOutput>& outputs)
+{
+    assert(!m_lease_path.empty());
+    stop_heartbeat();
+
+    std::stringstream manifest;
+    manifest << "shard\t" << m_shards[idx] << "\n";
+    manifest << "worker\t" << m_worker_id << "\n";
+    for(size_t i = 0; i < outputs.size(); ++i) {
+        manifest << "output\t" << outputs[i].type << "\t" << outputs[i].path << "\n";
+    }
+
+    // if the shard was reclaimed and both workers finish, either manifest is complete and correct
+    std::string manifest_path = get_manifest_path(idx);
+    write_file_atomic(manifest_path, manifest_path + "." + m_worker_id, manifest.str());
+    m_lease_path.clear();
+}
+
+ShardStatus LeaseQueue::get_status(size_t idx) const
+{
+    ShardStatus status;
+    status.state = SS_PENDING;
+    status.heartbeat_age = 0.0;
+
+    if(file_exists(get_manifest_path(idx))) {
+        status.state = SS_COMPLETE;
+        return status;
+    }
+
+    int generation = get_current_generation(idx);
+    if(generation < 0) {
+        return status;
+    }
+
+    std::string lease_path = get_lease_path(idx, generation);
+    std::ifstream in_file(lease_path.c_str());
+    getline(in_file, status.holder);
+
+    // the heartbeat is the modification time set by the file server, so the
+    // lease time should be much longer than any clock skew between hosts
+    struct stat st;
+    if(stat(lease_path.c_str(), &st) == 0) {
+        status.heartbeat_age = difftime(time(NULL), st.st_mtime);
+    }
+    status.state = status.heartbeat_age > m_lease_seconds ? SS_EXPIRED : SS_LEASED;
+    return status;
+}
+
+bool LeaseQueue::read_manifest(size_t idx, std::vector<ShardOutput>& outputs) const
+{
+    std::ifstream in_file(get_manifest_path(idx).c_str());
+    if(!in_file.good()) {
+        return false;
+    }
+
+    outputs.clear();
+    std::string line;
+    while(getline(in_file, line)) {
+        std::stringstream parser(line);
+        std::string tag;
+        ShardOutput output;
+        if(parser >> tag >> output.type >> output.path && tag == "output") {
+            outputs.push_back(output);
+        }
+    }
+    return true;
+}
+
+void LeaseQueue::start_heartbeat()
+{
+    assert(!m_heartbeat_running);
+    m_heartbeat_running = true;
+    m_heartbeat_thread = std::thread(&LeaseQueue::run_heartbeat, this);
+}
+
+void LeaseQueue::stop_heartbeat()
+{
+    if(!m_heartbeat_running) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_heartbeat_mutex);
+        m_heartbeat_running = false;
+    }
+    m_heartbeat_cv.notify_one();
+    m_heartbeat_thread.join();
+}
+
+void LeaseQueue::run_heartbeat()
+{
+    std::chrono::duration<double> interval(m_lease_seconds / 4);
+    std::unique_lock<std::mutex> lock(m_heartbeat_mutex);
+    while(!m_heartbeat_cv.wait_for(lock, interval, [this] { return !m_heartbeat_running; })) {
+        if(utime(m_lease_path.c_str(), NULL) != 0) {
+            fprintf(stderr, "[lease] warning: could not update the heartbeat of %s: %s\n", m_lease_path.c_str(), strerror(errno));
+        }
+    }
+}
+
+std::vector<std::string> read_shard_file(const std::string& filename)
+{
+    std::ifstream in_file(filename.c_str());
+    if(!in_file.good()) {
+        fprintf(stderr, "[lease] error: could not read shards from %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::string> shards;
+    std::string line;
+    while(getline(in_file, line)) {
+        if(!line.empty() && line[0] != '#') {
+            shards.push_back(line);
+        }
+    }
+    return shards;
+}
@@ -0,0 +1,119 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_lease_queue -- distribute shards of work
+// between processes on any number of hosts through
+// lease files in a shared directory
+//
+// The directory holds:
+//   shards.txt          the list of shards, one region per line
+//   leases/<i>.<gen>    a lease on shard i, its mtime is the heartbeat
+//   done/<i>.manifest   written once shard i is finished, lists its outputs
+//   output/             the output files of the shards
+//
+// A lease is taken by creating its file with O_EXCL, so only one worker
+// can succeed. A lease whose heartbeat is older than the lease time is
+// reclaimed by creating the next generation of the lease file.
+//
+#ifndef NANOPOLISH_LEASE_QUEUE_H
+#define NANOPOLISH_LEASE_QUEUE_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Where a shard is in its life
+enum ShardState
+{
+    SS_PENDING,
+    SS_LEASED,
+    SS_EXPIRED,
+    SS_COMPLETE
+};
+
+struct ShardStatus
+{
+    ShardState state;
+    std::string holder;
+    double heartbeat_age;
+};
+
+// An output written by a completed shard, e.g. ("vcf", "output/3.host-1234.vcf")
+struct ShardOutput
+{
+    std::string type;
+    std::string path;
+};
+
+class LeaseQueue
+{
+    public:
+        LeaseQueue(const std::string& directory, double lease_seconds);
+        ~LeaseQueue();
+
+        // Set up the directory. The first worker to arrive records the shard
+        // list; the others check that theirs agrees. An empty list joins an
+        // existing queue.
+        void initialize(const std::vector<std::string>& shards);
+
+        // Load the shard list written by initialize
+        void load();
+
+        size_t get_num_shards() const { return m_shards.size(); }
+        const std::string& get_shard(size_t idx) const { return m_shards[idx]; }
+
+        // Claim the next pending or expired shard. Returns false once every
+        // shard is complete. While the remaining shards are leased by live
+        // workers this waits so that a lease that expires can be taken over.
+        bool claim(size_t& idx);
+
+        // The path a worker should write its output of the given type to
+        std::string get_output_path(size_t idx, const std::string& type) const;
+
+        // Record the outputs of the claimed shard and release the lease
+        void complete(size_t idx, const std::vector<ShardOutput>& outputs);
+
+        // Inspect the queue without taking any leases
+        ShardStatus get_status(size_t idx) const;
+        bool read_manifest(size_t idx, std::vector<ShardOutput>& outputs) const;
+
+        // The identifier of this process in lease files, host-pid
+        const std::string& get_worker_id() const { return m_worker_id; }
+
+    private:
+
+        std::string get_lease_path(size_t idx, int generation) const;
+        std::string get_manifest_path(size_t idx) const;
+
+        // the highest generation lease file of the shard, or -1 if it has never been leased
+        int get_current_generation(size_t idx) const;
+
+        bool try_claim(size_t idx);
+        void start_heartbeat();
+        void stop_heartbeat();
+        void run_heartbeat();
+
+        std::string m_directory;
+        std::string m_worker_id;
+        double m_lease_seconds;
+        std::vector<std::string> m_shards;
+
+        // the lease currently held by this worker
+        std::string m_lease_path;
+
+        std::thread m_heartbeat_thread;
+        std::mutex m_heartbeat_mutex;
+        std::condition_variable m_heartbeat_cv;
+        bool m_heartbeat_running;
+};
+
+// Read a list of shard regions, one per line, as written by
+// nanopolish partition --regions-only or nanopolish_makerange.py
+std::vector<std::string> read_shard_file(const std::string& filename);
+
+#endif
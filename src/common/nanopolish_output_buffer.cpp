@@ -0,0 +1,165 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_output_buffer -- format output records into
+// a buffer without printf, so that threads can format
+// their records in parallel and write them in one call
+//
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include "htslib/bgzf.h"
+#include "nanopolish_output_buffer.h"
+
+static const double powers_of_ten[MAX_FAST_FIXED_PRECISION + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+OutputBuffer& OutputBuffer::append_uint(uint64_t value)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+
+    while(n > 0) {
+        m_buffer.push_back(digits[--n]);
+    }
+    return *this;
+}
+
+OutputBuffer& OutputBuffer::append_int(int64_t value)
+{
+    if(value < 0) {
+        m_buffer.push_back('-');
+        return append_uint(-(uint64_t)value);
+    }
+    return append_uint(value);
+}
+
+OutputBuffer& OutputBuffer::append_fixed(double value, int precision)
+{
+    assert(precision >= 0);
+    if(precision <= MAX_FAST_FIXED_PRECISION && isfinite(value)) {
+
+        // The product has a relative error of at most 2^-53. Unless the exact
+        // product is within that error of a half, it rounds to the same integer
+        double scaled = fabs(value) * powers_of_ten[precision];
+        double integral = floor(scaled);
+        double fraction = scaled - integral;
+        if(scaled < 9007199254740992.0 && fabs(fraction - 0.5) > scaled * 2.3e-16) {
+            uint64_t rounded = (uint64_t)integral + (fraction > 0.5);
+            uint64_t scale = (uint64_t)powers_of_ten[precision];
+
+            // printf keeps the sign of values that round to zero, and of -0.0
+            if(signbit(value)) {
+                m_buffer.push_back('-');
+            }
+            append_uint(rounded / scale);
+
+            if(precision > 0) {
+                m_buffer.push_back('.');
+                uint64_t decimals = rounded % scale;
+                size_t end = m_buffer.size() + precision;
+                m_buffer.resize(end);
+                for(int i = 1; i <= precision; ++i) {
+                    m_buffer[end - i] = '0' + decimals % 10;
+                    decimals /= 10;
+                }
+            }
+            return *this;
+        }
+    }
+
+    char buffer[512];
+    int n = snprintf(buffer, sizeof(buffer), "%.*f", precision, value);
+    if(n >= (int)sizeof(buffer)) {
+        std::string large(n + 1, '\0');
+        snprintf(&large[0], large.size(), "%.*f", precision, value);
+        m_buffer.append(large.c_str(), n);
+    } else {
+        m_buffer.append(buffer, n);
+    }
+    return *this;
+}
+
+OutputBuffer& OutputBuffer::append_general(double value)
+{
+    // at most 6 significant digits, so the output is short
+    char buffer[32];
+    int n = snprintf(buffer, sizeof(buffer), "%g", value);
+    m_buffer.append(buffer, n);
+    return *this;
+}
+
+//
+// OutputWriter
+//
+OutputWriter::OutputWriter(FILE* fp) : m_fp(fp), m_bgzf(NULL)
+{
+
+}
+
+OutputWriter::OutputWriter(FILE* fp, int num_threads) : m_fp(NULL), m_bgzf(NULL)
+{
+    // the stream may already have buffered output, e.g. a header
+    fflush(fp);
+    m_bgzf = bgzf_dopen(dup(fileno(fp)), "w");
+    if(m_bgzf == NULL) {
+        fprintf(stderr, "Error: could not open the compressed output stream\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(num_threads > 1) {
+        bgzf_mt(m_bgzf, num_threads, 256);
+    }
+}
+
+OutputWriter::~OutputWriter()
+{
+    close();
+}
+
+void OutputWriter::write(const OutputBuffer& buffer)
+{
+    if(buffer.empty()) {
+        return;
+    }
+
+    bool failed = false;
+    #pragma omp critical(output_writer)
+    {
+        if(m_bgzf != NULL) {
+            failed = bgzf_write(m_bgzf, buffer.data(), buffer.size()) != (ssize_t)buffer.size();
+        } else {
+            assert(m_fp != NULL);
+            failed = fwrite(buffer.data(), 1, buffer.size(), m_fp) != buffer.size();
+        }
+    }
+
+    if(failed) {
+        fprintf(stderr, "Error: could not write output\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void OutputWriter::close()
+{
+    if(m_bgzf != NULL) {
+        if(bgzf_close(m_bgzf) != 0) {
+            fprintf(stderr, "Error: could not write the compressed output stream\n");
+            exit(EXIT_FAILURE);
+        }
+        m_bgzf = NULL;
+    }
+
+    if(m_fp != NULL) {
+        fflush(m_fp);
+        m_fp = NULL;
+    }
+}
@@ -0,0 +1,86 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_output_buffer -- format output records into
+// a buffer without printf, so that threads can format
+// their records in parallel and write them in one call
+//
+#ifndef NANOPOLISH_OUTPUT_BUFFER_H
+#define NANOPOLISH_OUTPUT_BUFFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+
+// forward declare
+struct BGZF;
+
+// The largest precision append_fixed formats without printf
+#define MAX_FAST_FIXED_PRECISION 9
+
+class OutputBuffer
+{
+    public:
+        OutputBuffer() {}
+
+        void clear() { m_buffer.clear(); }
+        bool empty() const { return m_buffer.empty(); }
+        size_t size() const { return m_buffer.size(); }
+        const char* data() const { return m_buffer.data(); }
+
+        OutputBuffer& append(char c) { m_buffer.push_back(c); return *this; }
+        OutputBuffer& append(const char* str) { m_buffer.append(str); return *this; }
+        OutputBuffer& append(const std::string& str) { m_buffer.append(str); return *this; }
+
+        // the same characters as printf's %d/%u
+        OutputBuffer& append_int(int64_t value);
+        OutputBuffer& append_uint(uint64_t value);
+
+        // the same characters as printf("%.<precision>f", value). The value is
+        // rounded with a single multiplication, which is exact unless the value
+        // is close to halfway between two outputs; those values, and precisions
+        // above MAX_FAST_FIXED_PRECISION, are formatted by snprintf instead.
+        OutputBuffer& append_fixed(double value, int precision);
+
+        // the same characters as printf("%g", value), which is also how
+        // iostreams write floating point values by default
+        OutputBuffer& append_general(double value);
+
+    private:
+        std::string m_buffer;
+};
+
+// Where formatted records are written, either a plain stream or BGZF
+// blocks that are compressed in parallel by htslib's thread pool. The
+// records are written whole, so records written from different threads
+// are never interleaved.
+class OutputWriter
+{
+    public:
+        // write to fp, which is not closed by the writer
+        OutputWriter(FILE* fp);
+
+        // write BGZF blocks to fp, compressed by num_threads threads
+        OutputWriter(FILE* fp, int num_threads);
+
+        ~OutputWriter();
+
+        // write the buffer, threadsafe
+        void write(const OutputBuffer& buffer);
+
+        // write all compressed blocks, after which nothing more can be written
+        void close();
+
+    private:
+
+        // do not allow copies of this class
+        OutputWriter(OutputWriter const&) = delete;
+        void operator=(OutputWriter const&) = delete;
+
+        FILE* m_fp;
+        BGZF* m_bgzf;
+};
+
+#endif
@@ -0,0 +1,237 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_parallel -- a single entry point for
+// parallel loops that composes when nested
+//
+#include "nanopolish_parallel.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <omp.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+static int g_num_threads = 1;
+static ParallelTimingHook g_timing_hook = NULL;
+
+static bool g_numa_binding = false;
+static double g_numa_start_time = 0.0;
+static std::vector<std::vector<int> > g_node_cpus;
+static std::vector<size_t> g_node_iterations;
+static std::vector<double> g_node_seconds;
+
+// The node each worker thread was pinned to at the start of the current team
+static thread_local int t_numa_node = 0;
+
+// Read the cpus of each node from sysfs, e.g. node1/cpulist = "16-31,48-63"
+static void load_node_cpus()
+{
+    g_node_cpus.clear();
+    for(int node = 0; ; ++node) {
+        std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        FILE* fp = fopen(path.c_str(), "r");
+        if(fp == NULL) {
+            break;
+        }
+
+        std::vector<int> cpus;
+        int first, last;
+        char sep;
+        while(fscanf(fp, "%d", &first) == 1) {
+            last = first;
+            if(fscanf(fp, "%c", &sep) == 1 && sep == '-') {
+                if(fscanf(fp, "%d", &last) != 1) {
+                    break;
+                }
+                fscanf(fp, "%c", &sep);
+            }
+
+            for(int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        fclose(fp);
+
+        // memory-only nodes have an empty cpulist and can't run threads
+        if(!cpus.empty()) {
+            g_node_cpus.push_back(cpus);
+        }
+    }
+}
+
+// Pin the calling thread of the team to the cpus of one node. Threads
+// are dealt out round-robin so consecutive threads land on different nodes.
+static void pin_team_thread()
+{
+#ifdef __linux__
+    int node = omp_get_thread_num() % g_node_cpus.size();
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for(size_t i = 0; i < g_node_cpus[node].size(); ++i) {
+        CPU_SET(g_node_cpus[node][i], &mask);
+    }
+
+    if(sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+        fprintf(stderr, "Error: could not pin thread %d to NUMA node %d\n", omp_get_thread_num(), node);
+        exit(EXIT_FAILURE);
+    }
+    t_numa_node = node;
+#endif
+}
+
+void set_parallel_numa_binding(bool enable)
+{
+    g_numa_binding = enable;
+    if(!enable) {
+        return;
+    }
+
+#ifdef __linux__
+    load_node_cpus();
+#endif
+    if(g_node_cpus.empty()) {
+        fprintf(stderr, "Error: --numa requires the NUMA topology in /sys/devices/system/node\n");
+        exit(EXIT_FAILURE);
+    }
+
+    g_node_iterations.assign(g_node_cpus.size(), 0);
+    g_node_seconds.assign(g_node_cpus.size(), 0.0);
+    g_numa_start_time = omp_get_wtime();
+}
+
+void print_parallel_numa_summary(FILE* fp)
+{
+    if(!g_numa_binding) {
+        return;
+    }
+
+    double elapsed = omp_get_wtime() - g_numa_start_time;
+    for(size_t node = 0; node < g_node_iterations.size(); ++node) {
+        fprintf(fp, "[parallel] node: %zu items: %zu busy: %.1lfs throughput: %.2lf items/s\n",
+            node, g_node_iterations[node], g_node_seconds[node],
+            elapsed > 0.0 ? g_node_iterations[node] / elapsed : 0.0);
+    }
+}
+
+void set_parallel_num_threads(int num_threads)
+{
+    assert(num_threads > 0);
+    g_num_threads = num_threads;
+    omp_set_num_threads(num_threads);
+}
+
+int get_parallel_num_threads()
+{
+    return g_num_threads;
+}
+
+void set_parallel_timing_hook(ParallelTimingHook hook)
+{
+    g_timing_hook = hook;
+}
+
+// Each worker task repeatedly claims the next unprocessed index
+static void run_parallel_worker(std::atomic<size_t>& next,
+                                size_t n,
+                                const std::function<void(size_t)>& func,
+                                const char* name,
+                                bool top_level)
+{
+    ParallelTimingHook hook = name != NULL ? g_timing_hook : NULL;
+    bool count_node = top_level && g_numa_binding;
+    for(size_t i = next++; i < n; i = next++) {
+        if(hook != NULL || count_node) {
+            double start = omp_get_wtime();
+            func(i);
+            double seconds = omp_get_wtime() - start;
+            if(hook != NULL) {
+                hook(name, seconds);
+            }
+
+            if(count_node) {
+                int node = t_numa_node;
+                #pragma omp atomic
+                g_node_iterations[node] += 1;
+                #pragma omp atomic
+                g_node_seconds[node] += seconds;
+            }
+        } else {
+            func(i);
+        }
+    }
+}
+
+// Spawn one worker task per thread of the current team then wait
+// for them. The waiting thread executes queued tasks, including
+// those spawned by nested loops, until its own workers are done.
+static void spawn_parallel_workers(size_t n,
+                                   const std::function<void(size_t)>& func,
+                                   const char* name,
+                                   bool top_level)
+{
+    std::atomic<size_t> next(0);
+    size_t num_workers = std::min(n, (size_t)omp_get_num_threads());
+    for(size_t wi = 0; wi < num_workers; ++wi) {
+        #pragma omp task default(shared)
+        run_parallel_worker(next, n, func, name, top_level);
+    }
+    #pragma omp taskwait
+}
+
+void parallel_for(size_t n, const std::function<void(size_t)>& func, const char* name)
+{
+    if(n == 0) {
+        return;
+    }
+
+    if(omp_in_parallel()) {
+        spawn_parallel_workers(n, func, name, false);
+    } else if(g_num_threads == 1 || n == 1) {
+        std::atomic<size_t> next(0);
+        run_parallel_worker(next, n, func, name, true);
+    } else if(g_numa_binding) {
+        // proc_bind has no effect without OMP_PLACES so each thread pins itself
+        // before the workers start. The runtime may hand us different threads
+        // for each team, so this is repeated for every top-level loop.
+        #pragma omp parallel num_threads(g_num_threads)
+        {
+            pin_team_thread();
+            #pragma omp barrier
+            #pragma omp single
+            spawn_parallel_workers(n, func, name, true);
+        }
+    } else {
+        #pragma omp parallel num_threads(g_num_threads)
+        #pragma omp single
+        spawn_parallel_workers(n, func, name, true);
+    }
+}
+
+static std::map<std::string, std::pair<size_t, double> > g_loop_timing;
+
+void accumulate_parallel_timing(const char* name, double seconds)
+{
+    #pragma omp critical(parallel_timing)
+    {
+        std::pair<size_t, double>& t = g_loop_timing[name];
+        t.first += 1;
+        t.second += seconds;
+    }
+}
+
+void print_parallel_timing(FILE* fp)
+{
+    for(const auto& t : g_loop_timing) {
+        fprintf(fp, "[parallel] loop: %s iterations: %zu total: %.2lfs avg: %.1lfus\n",
+            t.first.c_str(), t.second.first, t.second.second, 1000000.0 * t.second.second / t.second.first);
+    }
+}
@@ -0,0 +1,48 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_parallel -- a single entry point for
+// parallel loops that composes when nested
+//
+#ifndef NANOPOLISH_PARALLEL_H
+#define NANOPOLISH_PARALLEL_H
+
+#include <stdio.h>
+#include <functional>
+
+// Set the number of worker threads used by every parallel loop.
+// This should be called once, from the --threads option.
+void set_parallel_num_threads(int num_threads);
+int get_parallel_num_threads();
+
+// Run func(i) for every i in [0, n), handing out indices in increasing
+// order to whichever thread is free next. At the top level this starts
+// the worker team. When called from within another parallel loop the
+// work is submitted as tasks to the existing team, so nested loops share
+// the same threads rather than oversubscribing or running serially.
+// The optional name labels the loop for the timing hook.
+void parallel_for(size_t n, const std::function<void(size_t)>& func, const char* name = NULL);
+
+// Called after every iteration of a named parallel loop
+// with its duration. The hook must be threadsafe.
+typedef void (*ParallelTimingHook)(const char* name, double seconds);
+void set_parallel_timing_hook(ParallelTimingHook hook);
+
+// Pin the worker threads, spread evenly over the NUMA nodes of the machine, and
+// count the top-level loop iterations completed on each node. The work for one
+// iteration (e.g. loading, calibrating and aligning a read) runs on the thread
+// that claimed it, so its allocations are placed on that node by first-touch.
+// Thread i of each team is bound with sched_setaffinity to the cpus of node
+// i % num_nodes, as read from sysfs; OMP_PLACES is not needed. The calling
+// thread is thread 0 so it stays on the first node after the loop returns.
+// Exits with an error if the node topology can't be read.
+void set_parallel_numa_binding(bool enable);
+void print_parallel_numa_summary(FILE* fp);
+
+// A hook that accumulates the count and total time of each named loop
+void accumulate_parallel_timing(const char* name, double seconds);
+void print_parallel_timing(FILE* fp);
+
+#endif
@@ -0,0 +1,66 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_sample_sheet -- the inputs of each sample
+// when several samples are called in one run
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <set>
+#include "nanopolish_common.h"
+#include "nanopolish_sample_sheet.h"
+
+std::vector<SampleInput> read_sample_sheet(const std::string& filename)
+{
+    std::ifstream in_file(filename.c_str());
+    if(!in_file.good()) {
+        fprintf(stderr, "[samples] error: could not read samples from %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<SampleInput> samples;
+    std::set<std::string> names;
+    std::string line;
+    size_t line_number = 0;
+    while(getline(in_file, line)) {
+        line_number += 1;
+        if(line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::vector<std::string> fields = split(line, '\t');
+        if(fields.size() != 3 && fields.size() != 4) {
+            fprintf(stderr, "[samples] error: line %zu of %s has %zu fields, expected name, reads, bam and optionally an event bam\n",
+                line_number, filename.c_str(), fields.size());
+            exit(EXIT_FAILURE);
+        }
+
+        SampleInput sample;
+        sample.name = fields[0];
+        sample.reads_file = fields[1];
+        sample.bam_file = fields[2];
+        if(fields.size() == 4) {
+            sample.event_bam_file = fields[3];
+        }
+
+        if(sample.name.empty() || sample.reads_file.empty() || sample.bam_file.empty()) {
+            fprintf(stderr, "[samples] error: line %zu of %s has an empty field\n", line_number, filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        if(!names.insert(sample.name).second) {
+            fprintf(stderr, "[samples] error: sample %s is listed more than once in %s\n", sample.name.c_str(), filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+        samples.push_back(sample);
+    }
+
+    if(samples.empty()) {
+        fprintf(stderr, "[samples] error: no samples in %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return samples;
+}
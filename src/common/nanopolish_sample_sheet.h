@@ -0,0 +1,31 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_sample_sheet -- the inputs of each sample
+// when several samples are called in one run
+//
+#ifndef NANOPOLISH_SAMPLE_SHEET_H
+#define NANOPOLISH_SAMPLE_SHEET_H
+
+#include <string>
+#include <vector>
+
+struct SampleInput
+{
+    std::string name;
+    std::string reads_file;
+    std::string bam_file;
+
+    // optional, only used by nanopolish variants
+    std::string event_bam_file;
+};
+
+// Read a tab-separated file with one sample per line:
+// name reads_file bam_file [event_bam_file]
+// Empty lines and lines starting with '#' are skipped.
+// Exits if a line is malformed or a sample name is repeated.
+std::vector<SampleInput> read_sample_sheet(const std::string& filename);
+
+#endif
@@ -14,9 +14,18 @@
 #include "nanopolish_haplotype.h"
 #include "nanopolish_model_names.h"
 #include "nanopolish_variant_db.h"
+#include "nanopolish_parallel.h"
 
 //#define DEBUG_HAPLOTYPE_SELECTION 1
 
+// Haplotypes with less posterior read support than this are not enumerated
+// when genotyping with ploidy > 1
+#define MIN_GENOTYPE_HAPLOTYPE_SUPPORT 1.0
+
+// Below this the per-read genotype likelihood, relative to the read's best
+// haplotype, is recomputed in log space as the linear sum has lost precision
+#define MIN_LINEAR_GENOTYPE_LIK 1e-250
+
 std::string Variant::make_vcf_tag_string(const std::string& tag,
                                          const std::string& id,
                                          int count,
@@ -30,14 +39,104 @@ std::string Variant::make_vcf_tag_string(const std::string& tag,
 }
 
 void Variant::write_vcf_header(FILE* fp,
-                               const std::vector<std::string>& tag_lines)
+                               const std::vector<std::string>& tag_lines,
+                               const std::vector<std::string>& sample_names)
 {
 
     fprintf(fp, "##fileformat=VCFv4.2\n");
     for(const std::string& line : tag_lines) {
         fprintf(fp, "%s\n", line.c_str());
     }
-    fprintf(fp, "#CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO	FORMAT	sample\n");
+    fprintf(fp, "#CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO	FORMAT");
+    for(const std::string& name : sample_names) {
+        fprintf(fp, "\t%s", name.c_str());
+    }
+    fprintf(fp, "\n");
+}
+
+void write_multi_sample_vcf(FILE* fp, const std::vector<std::vector<Variant> >& sample_calls, bool write_reference_sites)
+{
+    // A distinct variant, the highest quality of its calls with the
+    // alternative allele and the index of the call in each sample
+    struct Site
+    {
+        const Variant* variant;
+        std::vector<int> calls;
+        bool has_alt;
+        double quality;
+    };
+
+    std::map<std::string, Site> sites;
+    for(size_t si = 0; si < sample_calls.size(); ++si) {
+        for(size_t vi = 0; vi < sample_calls[si].size(); ++vi) {
+            const Variant& v = sample_calls[si][vi];
+            auto iter = sites.find(v.key());
+            if(iter == sites.end()) {
+                Site site = { &v, std::vector<int>(sample_calls.size(), -1), false, 0.0 };
+                iter = sites.insert(std::make_pair(v.key(), site)).first;
+            }
+            iter->second.calls[si] = vi;
+
+            if(v.genotype.find('1') != std::string::npos) {
+                iter->second.quality = iter->second.has_alt ? std::max(iter->second.quality, v.quality) : v.quality;
+                iter->second.has_alt = true;
+            }
+        }
+    }
+
+    // output in position order, sites at the same position are in key order
+    std::vector<const Site*> order;
+    for(const auto& kv : sites) {
+        if(kv.second.has_alt || write_reference_sites) {
+            order.push_back(&kv.second);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [](const Site* a, const Site* b) {
+        return sortByPosition(*a->variant, *b->variant);
+    });
+
+    OutputBuffer out;
+    for(const Site* site : order) {
+
+        // the INFO fields are summed over the samples
+        Variant v = *site->variant;
+        v.quality = site->quality;
+        v.info.clear();
+        int total_reads = 0;
+        double supporting_reads = 0.0;
+        int allele_count = 0;
+        for(size_t si = 0; si < site->calls.size(); ++si) {
+            if(site->calls[si] != -1) {
+                const Variant& call = sample_calls[si][site->calls[si]];
+                total_reads += call.total_reads;
+                supporting_reads += call.total_reads * call.support_fraction;
+                allele_count += call.allele_count;
+            }
+        }
+        v.add_info("TotalReads", total_reads);
+        v.add_info("AlleleCount", allele_count);
+        v.add_info("SupportFraction", total_reads > 0 ? supporting_reads / total_reads : 0.0);
+
+        v.format_vcf_site(out);
+        out.append("\tGT:DP:SF:SQ");
+        for(size_t si = 0; si < site->calls.size(); ++si) {
+            int vi = site->calls[si];
+            out.append('\t');
+
+            // a sample without reads spanning the site has no genotype
+            const Variant* call = vi != -1 ? &sample_calls[si][vi] : NULL;
+            if(call == NULL || call->genotype.empty() || call->total_reads == 0) {
+                out.append(".:.:.:.");
+                continue;
+            }
+
+            out.append(call->genotype).append(':').append_int(call->total_reads).append(':');
+            out.append_fixed(call->support_fraction, 3).append(':');
+            out.append_fixed(call->quality, 1);
+        }
+        out.append('\n');
+    }
+    fwrite(out.data(), 1, out.size(), fp);
 }
 
 // return a new copy of the string with gap symbols removed
@@ -214,8 +313,7 @@ void score_variant_group(VariantGroup& variant_group,
     std::vector<double> read_sum(input.size(), -INFINITY);
 */
   
-    #pragma omp parallel for
-    for(size_t ri = 0; ri < input.size(); ++ri) {
+    parallel_for(input.size(), [&](size_t ri) {
         for(size_t hi = 0; hi < haplotypes.size(); ++hi) {
             const auto& current = haplotypes[hi];
             double score = profile_hmm_score(current.first.get_sequence(), input[ri], alignment_flags);
@@ -227,7 +325,7 @@ void score_variant_group(VariantGroup& variant_group,
 //                read_sum[ri] = add_logs(read_sum[ri], score);
             }
         }
-    }
+    }, "score_variant_group");
 
 #if 0
 #endif
@@ -243,8 +341,6 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
     std::vector<size_t> best_set;
     std::vector<size_t> base_set;
 
-    double log_2 = log(2);
-
 #ifdef DEBUG_HAPLOTYPE_SELECTION 
     fprintf(stderr, "Selecting haplotypes\n");
 #endif
@@ -258,7 +354,53 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
         return std::vector<Variant>();
     }
 
-    Combinations vc_sets(variant_combos_in_group, ploidy, CO_WITH_REPLACEMENT);
+    // Copy the read-haplotype scores out of the group into a dense matrix, stored
+    // haplotype-major so the per-read sums for a genotype are contiguous additions.
+    // Each read is shifted by its maximum score so the sums can be done in linear space.
+    size_t num_reads = group_reads.size();
+    size_t num_haplotypes = variant_combos_in_group;
+    std::vector<double> read_max(num_reads, -INFINITY);
+    std::vector<double> log_lik(num_haplotypes * num_reads);
+    for(size_t hi = 0; hi < num_haplotypes; ++hi) {
+        for(size_t ri = 0; ri < num_reads; ++ri) {
+            double score = variant_group.get_combination_read_score(hi, group_reads[ri].first);
+            log_lik[hi * num_reads + ri] = score;
+            read_max[ri] = std::max(read_max[ri], score);
+        }
+    }
+
+    std::vector<double> shifted_lik(num_haplotypes * num_reads);
+    std::vector<double> haplotype_support(num_haplotypes, 0.0f);
+    double sum_read_max = 0.0f;
+    for(size_t ri = 0; ri < num_reads; ++ri) {
+        sum_read_max += read_max[ri];
+    }
+
+    for(size_t hi = 0; hi < num_haplotypes; ++hi) {
+        for(size_t ri = 0; ri < num_reads; ++ri) {
+            double score = log_lik[hi * num_reads + ri];
+            shifted_lik[hi * num_reads + ri] = exp(score - read_max[ri]);
+            haplotype_support[hi] += exp(score - group_reads[ri].second);
+        }
+    }
+
+    // Genotypes containing a haplotype that no read supports cannot be the best
+    // explanation of the data so only the supported haplotypes are enumerated.
+    // The haplotype without variants is always kept as it is the baseline for the call.
+    std::vector<size_t> candidate_haplotypes;
+    std::vector<bool> is_base_haplotype(num_haplotypes, false);
+    for(size_t hi = 0; hi < num_haplotypes; ++hi) {
+        const VariantCombination& vc = variant_group.get_combination(hi);
+        is_base_haplotype[hi] = vc.get_num_variants() == 0;
+        if(ploidy == 1 || is_base_haplotype[hi] || haplotype_support[hi] >= MIN_GENOTYPE_HAPLOTYPE_SUPPORT) {
+            candidate_haplotypes.push_back(hi);
+        }
+    }
+
+    double log_ploidy = log(ploidy);
+    std::vector<double> genotype_lik(num_reads);
+
+    Combinations vc_sets(candidate_haplotypes.size(), ploidy, CO_WITH_REPLACEMENT);
     while(!vc_sets.done()) {
 
         // The current combination is represented as a vector of haplotype IDs
@@ -267,35 +409,37 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
         // Check if the current set consists of entirely of haplotypes without variants
         bool is_base_set = true;
         for(size_t i = 0; i < current_set.size(); ++i) {
-            const VariantCombination& vc = variant_group.get_combination(current_set[i]);
-            is_base_set = is_base_set && (variant_group.get_variants(vc).size() == 0);
+            current_set[i] = candidate_haplotypes[current_set[i]];
+            is_base_set = is_base_set && is_base_haplotype[current_set[i]];
         }
 
-        double set_score = 0.0f;
-        std::vector<double> read_support(current_set.size(), 0.0f);
-
-        for(size_t ri = 0; ri < group_reads.size(); ++ri) {
-            const std::string& read_id = group_reads[ri].first;
-
-            double set_sum = -INFINITY;
-            for(size_t j = 0; j < current_set.size(); ++j) {
-                size_t vc_id = current_set[j];
-                double rhs = variant_group.get_combination_read_score(vc_id, read_id);
-                /*
-                fprintf(stderr, "\t\tread-haplotype: %s %zu %s %.2lf\n", read_id.c_str(), 
-                                                                         variant_group.get(0).ref_position, // hack
-                                                                         variant_group.get_vc_allele_string(vc_id).c_str(), rhs); 
-                */
-                set_sum = add_logs(set_sum, rhs - log_2);
-                read_support[j] += exp(rhs - group_reads[ri].second);
+        // P(read | genotype) is the mean of P(read | haplotype) over the haplotypes of the genotype
+        std::fill(genotype_lik.begin(), genotype_lik.end(), 0.0f);
+        for(size_t j = 0; j < current_set.size(); ++j) {
+            const double* column = &shifted_lik[current_set[j] * num_reads];
+            for(size_t ri = 0; ri < num_reads; ++ri) {
+                genotype_lik[ri] += column[ri];
             }
+        }
 
-            /*
-            fprintf(stderr, "\t\tread-genotype: %s %zu %.2lf\n", read_id.c_str(), 
-                                                                         variant_group.get(0).ref_position, // hack
-                                                                         set_sum); 
-            */
-            set_score += set_sum;
+        double set_score = sum_read_max - num_reads * log_ploidy;
+        for(size_t ri = 0; ri < num_reads; ++ri) {
+            if(genotype_lik[ri] >= MIN_LINEAR_GENOTYPE_LIK) {
+                set_score += log(genotype_lik[ri]);
+            } else {
+                // every haplotype of the set is far below this read's best so the
+                // linear sum has underflowed, redo it in log space relative to the set's max
+                double set_max = -INFINITY;
+                for(size_t j = 0; j < current_set.size(); ++j) {
+                    set_max = std::max(set_max, log_lik[current_set[j] * num_reads + ri]);
+                }
+
+                double sum = 0.0;
+                for(size_t j = 0; j < current_set.size(); ++j) {
+                    sum += exp(log_lik[current_set[j] * num_reads + ri] - set_max);
+                }
+                set_score += set_max - read_max[ri] + log(sum);
+            }
         }
         
         if(is_base_set) {
@@ -306,7 +450,7 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
 #ifdef DEBUG_HAPLOTYPE_SELECTION 
         fprintf(stderr, "Current set score: %.5lf\t", set_score);
         for(size_t i = 0; i < current_set.size(); ++i) {
-            fprintf(stderr, "\t%zu:%.2lf", current_set[i], read_support[i]);
+            fprintf(stderr, "\t%zu:%.2lf", current_set[i], haplotype_support[current_set[i]]);
         }
         fprintf(stderr, "\n");
 #endif
@@ -326,18 +470,9 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
     // Calculate the number of reads that support each variant allele
     std::vector<double> read_variant_support(variant_group.get_num_variants(), 0.0f);
     for(size_t vc_id = 0; vc_id < variant_group.get_num_combinations(); ++vc_id) {
-
         const VariantCombination& vc = variant_group.get_combination(vc_id);
-        
-        for(size_t ri = 0; ri < group_reads.size(); ++ri) {
-            const std::string& read_id = group_reads[ri].first;
-            double read_sum = group_reads[ri].second;
-            double read_haplotype_score = variant_group.get_combination_read_score(vc_id, read_id);
-            double posterior_read_from_haplotype = exp(read_haplotype_score - read_sum);
-
-            for(size_t var_idx = 0; var_idx < vc.get_num_variants(); ++var_idx) {
-                read_variant_support[vc.get_variant_id(var_idx)] += posterior_read_from_haplotype;
-            }
+        for(size_t var_idx = 0; var_idx < vc.get_num_variants(); ++var_idx) {
+            read_variant_support[vc.get_variant_id(var_idx)] += haplotype_support[vc_id];
         }
     }
 
@@ -363,9 +498,12 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
         } else {
             v.quality = 0.0;
         }
-        v.add_info("TotalReads", group_reads.size());
-        v.add_info("AlleleCount", var_count);
-        v.add_info("SupportFraction", read_variant_support[vi] / group_reads.size());
+        v.total_reads = group_reads.size();
+        v.allele_count = var_count;
+        v.support_fraction = read_variant_support[vi] / group_reads.size();
+        v.add_info("TotalReads", v.total_reads);
+        v.add_info("AlleleCount", v.allele_count);
+        v.add_info("SupportFraction", v.support_fraction);
         v.genotype = make_genotype(var_count, ploidy);
         output_variants.push_back(v);
     }
@@ -651,14 +789,13 @@ std::vector<Variant> select_positive_scoring_variants(std::vector<Variant>& cand
 {
     std::vector<Variant> selected_variants;
     double base_score = 0.0f;
-    #pragma omp parallel for
-    for(size_t j = 0; j < input.size(); ++j) {
+    parallel_for(input.size(), [&](size_t j) {
 
         double score = profile_hmm_score(base_haplotype.get_sequence(), input[j], alignment_flags);
 
         #pragma omp atomic
         base_score += score;
-    }
+    });
 
     for(size_t vi = 0; vi < candidate_variants.size(); ++vi) {
 
@@ -666,13 +803,12 @@ std::vector<Variant> select_positive_scoring_variants(std::vector<Variant>& cand
         current_haplotype.apply_variant(candidate_variants[vi]);
         
         double haplotype_score = 0.0f;
-        #pragma omp parallel for
-        for(size_t j = 0; j < input.size(); ++j) {
+        parallel_for(input.size(), [&](size_t j) {
             double score = profile_hmm_score(current_haplotype.get_sequence(), input[j], alignment_flags);
 
             #pragma omp atomic
             haplotype_score += score;
-        }
+        });
 
         if(haplotype_score > base_score) {
             candidate_variants[vi].quality = haplotype_score - base_score;
@@ -695,8 +831,7 @@ Variant score_variant_thresholded(const Variant& input_variant,
     variant_haplotype.apply_variant(input_variant);
 
     double total_score = 0.0f;
-    #pragma omp parallel for
-    for(size_t j = 0; j < input.size(); ++j) {
+    parallel_for(input.size(), [&](size_t j) {
 
         if(fabs(total_score) < score_threshold) {
             double base_score = profile_hmm_score(base_haplotype.get_sequence(), input[j], alignment_flags);
@@ -705,7 +840,7 @@ Variant score_variant_thresholded(const Variant& input_variant,
             #pragma omp atomic
             total_score += (variant_score - base_score);
         }
-    }
+    }, "score_variant_thresholded");
 
     out_variant.quality = total_score;
     return out_variant;
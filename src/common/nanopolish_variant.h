@@ -11,6 +11,7 @@
 #include <sstream>
 #include "stdaln.h"
 #include "nanopolish_common.h"
+#include "nanopolish_output_buffer.h"
 
 // forward declare
 class Haplotype;
@@ -19,7 +20,8 @@ class VariantGroup;
 struct Variant
 {
     static void write_vcf_header(FILE* fp, 
-                                 const std::vector<std::string>& tag_lines = std::vector<std::string>());
+                                 const std::vector<std::string>& tag_lines = std::vector<std::string>(),
+                                 const std::vector<std::string>& sample_names = std::vector<std::string>(1, "sample"));
 
     static std::string make_vcf_tag_string(const std::string& tag,
                                            const std::string& id,
@@ -27,8 +29,8 @@ struct Variant
                                            const std::string& type,
                                            const std::string& description);
 
-    Variant() { }
-    Variant(const std::string& line) { read_vcf(line); }
+    Variant() : total_reads(0), support_fraction(0.0), allele_count(0) { }
+    Variant(const std::string& line) : total_reads(0), support_fraction(0.0), allele_count(0) { read_vcf(line); }
 
     // generate a unique identifier for this variant
     std::string key() const
@@ -38,15 +40,28 @@ struct Variant
         return out.str();
     }
 
+    // format the first eight columns of the vcf record, up to INFO
+    void format_vcf_site(OutputBuffer& out) const
+    {
+        out.append(ref_name).append('\t').append_uint(ref_position + 1).append("\t.\t");
+        out.append(ref_seq).append('\t').append(alt_seq).append('\t').append_fixed(quality, 1).append('\t');
+        out.append("PASS\t").append(info);
+    }
+
+    void format_vcf(OutputBuffer& out) const
+    {
+        // without a genotype the record has the "(null)" that glibc's printf wrote for the missing fields
+        format_vcf_site(out);
+        out.append('\t').append(genotype.empty() ? "(null)" : "GT");
+        out.append('\t').append(genotype.empty() ? "(null)" : genotype).append('\n');
+    }
+
     void write_vcf(FILE* fp) const
     {
         assert(fp != NULL);
-        const char* gt_def = genotype.empty() ? NULL : "GT";
-        const char* gt_str = genotype.empty() ? NULL : genotype.c_str();
-
-        fprintf(fp, "%s\t%zu\t%s\t", ref_name.c_str(), ref_position + 1, ".");
-        fprintf(fp, "%s\t%s\t%.1lf\t", ref_seq.c_str(), alt_seq.c_str(), quality);
-        fprintf(fp, "%s\t%s\t%s\t%s\n", "PASS", info.c_str(), gt_def, gt_str);
+        OutputBuffer out;
+        format_vcf(out);
+        fwrite(out.data(), 1, out.size(), fp);
     }
 
     void read_vcf(const std::string& line)
@@ -96,6 +111,11 @@ struct Variant
     double quality;
     std::string info;
     std::string genotype;
+
+    // the read support of a genotyped call, also written to INFO
+    int total_reads;
+    double support_fraction;
+    int allele_count;
 };
 
 inline bool sortByPosition(const Variant& a, const Variant& b) 
@@ -114,6 +134,18 @@ class VariantKeyComp
         }
 };
 
+// Write the calls made in each sample as multi-sample VCF records, one
+// per distinct variant in position order. The samples are in the order
+// of the header columns and each call has the FORMAT fields GT:DP:SF:SQ,
+// the genotype, reads, support fraction and quality in that sample.
+// Every sample should have a call, possibly homozygous reference, for each
+// candidate it was genotyped at; samples without a call or without reads
+// at the site are written as missing. The site's QUAL is that of its
+// highest-quality call with the alternative allele and its INFO sums the
+// reads and allele counts of the samples. Sites where no sample has the alternative allele are only written
+// with write_reference_sites.
+void write_multi_sample_vcf(FILE* fp, const std::vector<std::vector<Variant> >& sample_calls, bool write_reference_sites);
+
 // Read a collection of variants from a VCF file
 std::vector<Variant> read_variants_from_file(const std::string& filename);
 std::vector<Variant> read_variants_for_region(const std::string& filename,
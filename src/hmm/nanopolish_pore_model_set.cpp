@@ -13,6 +13,9 @@
 //
 PoreModelSet::PoreModelSet()
 {
+    size_t n_slots = NUM_KITS * get_alphabet_list().size() * 3 * (MAX_INDEXED_MODEL_K + 1);
+    metadata_index.resize(n_slots, INVALID_PORE_MODEL_HANDLE);
+
     // Copy the built-in models into the map
     for(auto p : builtin_models) {
         register_model(p);
@@ -46,26 +49,55 @@ std::vector<std::string> PoreModelSet::initialize(const std::string& fofn_filena
         // read the model
         PoreModel p(model_filename);
 
-        // add the model and push the new reference to it to the output
-        const PoreModel& imported = model_set.register_model(p);
-        out.push_back(model_set.get_model_key(imported));
+        // add the model and push the key of it to the output
+        model_set.register_model(p);
+        out.push_back(model_set.get_model_key(p));
     }
     return out;
 }
 
-PoreModel& PoreModelSet::register_model(const PoreModel& p)
+// FNV-1a hash of the primary parameters of each state
+static uint64_t fingerprint_states(const PoreModel& p)
 {
-    // Check that this model doesn't exist already
-    std::string key = get_model_key(p);
-    auto iter = model_map.find(key);
-    if(iter != model_map.end()) {
-        fprintf(stderr, "Warning: overwriting model %s\n", key.c_str());
+    uint64_t h = 14695981039346656037ULL;
+    for(const PoreModelStateParams& s : p.states) {
+        double values[4] = { s.level_mean, s.level_stdv, s.sd_mean, s.sd_stdv };
+        const unsigned char* bytes = (const unsigned char*)values;
+        for(size_t i = 0; i < sizeof(values); ++i) {
+            h = (h ^ bytes[i]) * 1099511628211ULL;
+        }
     }
-    
+    return h;
+}
+
+PoreModelHandle PoreModelSet::register_model(const PoreModel& p)
+{
+    PoreModelHandle handle;
+    std::string key = get_model_key(p);
+    uint64_t fingerprint = fingerprint_states(p);
+
     #pragma omp critical
-    model_map[key] = p;
+    {
+        // Overwrite an existing model in place so its handle remains valid
+        auto iter = key_map.find(key);
+        if(iter != key_map.end()) {
+            fprintf(stderr, "Warning: overwriting model %s\n", key.c_str());
+            handle = iter->second;
+            models[handle] = p;
+            fingerprints[handle] = fingerprint;
+        } else {
+            handle = models.size();
+            models.push_back(p);
+            fingerprints.push_back(fingerprint);
+            key_map[key] = handle;
+        }
 
-    return model_map[key];
+        int slot = get_metadata_index_slot(p.metadata.kit, p.pmalphabet, p.metadata.model_idx, p.k);
+        if(slot >= 0) {
+            metadata_index[slot] = handle;
+        }
+    }
+    return handle;
 }
 
 void PoreModelSet::add_model(const PoreModel& p)
@@ -82,8 +114,8 @@ bool PoreModelSet::has_model(const std::string& kit_name,
 {
     PoreModelSet& model_set = getInstance();
     std::string model_key = model_set.get_model_key(kit_name, alphabet, strand, k);
-    auto iter = model_set.model_map.find(model_key);
-    return iter != model_set.model_map.end();
+    auto iter = model_set.key_map.find(model_key);
+    return iter != model_set.key_map.end();
 }
 
 //
@@ -99,8 +131,24 @@ const PoreModel& PoreModelSet::get_model(const std::string& kit_name,
 const PoreModel& PoreModelSet::get_model_by_key(const std::string& key)
 {
     PoreModelSet& model_set = getInstance();
-    auto iter = model_set.model_map.find(key);
-    if(iter == model_set.model_map.end()) {
+    auto iter = model_set.key_map.find(key);
+    if(iter == model_set.key_map.end()) {
+        fprintf(stderr, "Error: cannot find model with key %s\n", key.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return model_set.models[iter->second];
+}
+
+//
+PoreModelHandle PoreModelSet::get_model_handle(const std::string& kit_name,
+                                               const std::string& alphabet,
+                                               const std::string& strand,
+                                               size_t k)
+{
+    PoreModelSet& model_set = getInstance();
+    std::string key = get_model_key(kit_name, alphabet, strand, k);
+    auto iter = model_set.key_map.find(key);
+    if(iter == model_set.key_map.end()) {
         fprintf(stderr, "Error: cannot find model with key %s\n", key.c_str());
         exit(EXIT_FAILURE);
     }
@@ -108,18 +156,49 @@ const PoreModel& PoreModelSet::get_model_by_key(const std::string& key)
 }
 
 //
-PoreModelMap PoreModelSet::copy_strand_models(const std::string& kit_name,
-                                              const std::string& alphabet,
+PoreModelHandle PoreModelSet::find_model(KitVersion kit,
+                                         const Alphabet* alphabet,
+                                         size_t model_idx,
+                                         size_t k)
+{
+    const PoreModelSet& model_set = getInstance();
+    int slot = get_metadata_index_slot(kit, alphabet, model_idx, k);
+    return slot >= 0 ? model_set.metadata_index[slot] : INVALID_PORE_MODEL_HANDLE;
+}
+
+//
+int PoreModelSet::get_metadata_index_slot(KitVersion kit,
+                                          const Alphabet* alphabet,
+                                          size_t model_idx,
+                                          size_t k)
+{
+    static const std::vector<const Alphabet*> alphabets = get_alphabet_list();
+
+    // the alphabets are global objects so they can be compared by address
+    size_t alphabet_idx = 0;
+    while(alphabet_idx < alphabets.size() && alphabets[alphabet_idx] != alphabet) {
+        alphabet_idx += 1;
+    }
+
+    if(kit >= NUM_KITS || alphabet_idx == alphabets.size() || model_idx >= 3 || k > MAX_INDEXED_MODEL_K) {
+        return -1;
+    }
+    return ((kit * alphabets.size() + alphabet_idx) * 3 + model_idx) * (MAX_INDEXED_MODEL_K + 1) + k;
+}
+
+//
+PoreModelMap PoreModelSet::copy_strand_models(KitVersion kit,
+                                              const Alphabet* alphabet,
                                               size_t k)
 {
     PoreModelMap out;
     PoreModelSet& model_set = getInstance();
-    for(const auto& kv : model_set.model_map) {
-        const PoreModel& model = kv.second;
-        if(model.metadata.get_kit_name() == kit_name &&
-           model.pmalphabet->get_name() == alphabet &&
+    for(const auto& kv : model_set.key_map) {
+        const PoreModel& model = model_set.models[kv.second];
+        if(model.metadata.kit == kit &&
+           model.pmalphabet == alphabet &&
            model.k == k) {
-            out.insert(kv);
+            out.insert(std::make_pair(kv.first, model));
         }
     }
     return out;
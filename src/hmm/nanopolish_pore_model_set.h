@@ -11,12 +11,23 @@
 #define NANOPOLISH_PORE_MODEL_SET_H
 
 #include <map>
+#include <deque>
+#include <stdint.h>
 #include "nanopolish_poremodel.h"
 
 #define DEFAULT_MODEL_TYPE "ONT"
 
 typedef std::map<std::string, PoreModel> PoreModelMap;
 
+// Models are interned into the set and referred to by their index. The
+// handle of a model stays valid for the lifetime of the program, even
+// when the model is overwritten by a newer version with the same key.
+typedef uint32_t PoreModelHandle;
+#define INVALID_PORE_MODEL_HANDLE UINT32_MAX
+
+// The largest k that can be found by find_model
+#define MAX_INDEXED_MODEL_K 12
+
 class PoreModelSet
 {
     public:
@@ -50,11 +61,52 @@ class PoreModelSet
 
         static const PoreModel& get_model_by_key(const std::string& key);
 
+        //
+        // resolve a model to its handle, exits if the model does not exist.
+        // This builds the model key so should be called once, up front,
+        // rather than for every read.
+        //
+        static PoreModelHandle get_model_handle(const std::string& kit_name,
+                                                const std::string& alphabet,
+                                                const std::string& strand,
+                                                size_t k);
+
+        //
+        // find the handle of a model from its metadata without building a key.
+        // model_idx is the strand model index of ModelMetadata.
+        // Returns INVALID_PORE_MODEL_HANDLE if there is no such model.
+        //
+        static PoreModelHandle find_model(KitVersion kit,
+                                          const Alphabet* alphabet,
+                                          size_t model_idx,
+                                          size_t k);
+
+        //
+        // get a model by its handle. This does not lock so can be called
+        // from any thread, as long as models are not being added concurrently.
+        //
+        static const PoreModel& get_model(PoreModelHandle handle)
+        {
+            const PoreModelSet& model_set = getInstance();
+            assert(handle < model_set.models.size());
+            return model_set.models[handle];
+        }
+
+        //
+        // a hash of the states of a model, to detect when a model has changed
+        //
+        static uint64_t get_model_fingerprint(PoreModelHandle handle)
+        {
+            const PoreModelSet& model_set = getInstance();
+            assert(handle < model_set.fingerprints.size());
+            return model_set.fingerprints[handle];
+        }
+
         //
         // get all the models for the combination of parameters
         //
-        static PoreModelMap copy_strand_models(const std::string& kit_name,
-                                               const std::string& alphabet,
+        static PoreModelMap copy_strand_models(KitVersion kit,
+                                               const Alphabet* alphabet,
                                                size_t k);
 
         //
@@ -75,8 +127,14 @@ class PoreModelSet
         }
 
         // Internal function for adding this model into the collection
-        // Returns a reference to the model in the map
-        PoreModel& register_model(const PoreModel& p);
+        // Returns the handle of the model
+        PoreModelHandle register_model(const PoreModel& p);
+
+        // Position of a model in metadata_index, or -1 if it cannot be indexed
+        static int get_metadata_index_slot(KitVersion kit,
+                                           const Alphabet* alphabet,
+                                           size_t model_idx,
+                                           size_t k);
 
         // Build a unique identify string
         static std::string get_model_key(const std::string& kit_name,
@@ -90,8 +148,18 @@ class PoreModelSet
         PoreModelSet(PoreModelSet const&) = delete;
         void operator=(PoreModelSet const&) = delete;
 
-        // map from a string representing a pore model to the actual model
-        std::map<std::string, PoreModel> model_map;
+        // the models, indexed by handle. A deque never moves its
+        // elements so references to the models stay valid as it grows.
+        std::deque<PoreModel> models;
+
+        // the fingerprints of the models, indexed by handle
+        std::vector<uint64_t> fingerprints;
+
+        // map from a string representing a pore model to its handle
+        std::map<std::string, PoreModelHandle> key_map;
+
+        // handles indexed by kit, alphabet, strand model and k
+        std::vector<PoreModelHandle> metadata_index;
 };
 
 #endif
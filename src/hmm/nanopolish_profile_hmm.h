@@ -24,14 +24,16 @@
 float profile_hmm_score(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
 float profile_hmm_score(const HMMInputSequence& sequence, const std::vector<HMMInputData>& data, const uint32_t flags = 0);
 
-// Run viterbi to align events to kmers
+// Run viterbi to align events to kmers. With HAF_COMPUTE_POSTERIOR the
+// posterior probability of each state on the path is also computed.
 std::vector<HMMAlignmentState> profile_hmm_align(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags = 0);
 
 // Flags to modify the behaviour of the HMM
 enum HMMAlignmentFlags
 {
     HAF_ALLOW_PRE_CLIP = 1, // allow events to go unmatched before the aligning region
-    HAF_ALLOW_POST_CLIP = 2 // allow events to go unmatched after the aligning region
+    HAF_ALLOW_POST_CLIP = 2, // allow events to go unmatched after the aligning region
+    HAF_COMPUTE_POSTERIOR = 4 // set l_posterior of the aligned states (R9 only, otherwise it is NaN)
 };
 
 #endif
@@ -136,7 +136,7 @@ std::vector<HMMAlignmentState> profile_hmm_align_r7(const HMMInputSequence& sequ
         HMMAlignmentState as;
         as.event_idx = event_idx;
         as.kmer_idx = kmer_idx;
-        as.l_posterior = -INFINITY; // not computed
+        as.l_posterior = NAN; // not computed
         as.l_fm = get(vm, row, col);
         as.log_transition_probability = -INFINITY; // not computed
         as.state = ps2char(curr_ps);
@@ -57,6 +57,107 @@ float profile_hmm_score_r9(const HMMInputSequence& sequence, const HMMInputData&
     return score;
 }
 
+void profile_hmm_backward_r9(const HMMInputSequence& _sequence, const HMMInputData& _data, const uint32_t flags, FloatMatrix& bm)
+{
+    HMMInputSequence sequence = _sequence;
+    HMMInputData data = _data;
+    assert( (data.rc && data.event_stride == -1) || (!data.rc && data.event_stride == 1));
+
+#if HMM_REVERSE_FIX
+    if(data.event_stride == -1) {
+        sequence.swap();
+        uint32_t tmp = data.event_stop_idx;
+        data.event_stop_idx = data.event_start_idx;
+        data.event_start_idx = tmp;
+        data.event_stride = 1;
+        data.rc = false;
+    }
+#endif
+
+    uint32_t e_start = data.event_start_idx;
+    uint32_t num_blocks = bm.n_cols / PSR9_NUM_STATES;
+    uint32_t num_kmers = num_blocks - 2; // two terminal blocks
+    uint32_t last_kmer_idx = num_kmers - 1;
+    uint32_t last_event_row_idx = bm.n_rows - 1;
+    size_t num_events = bm.n_rows - 1;
+
+    std::vector<BlockTransitions> transitions = calculate_transitions(num_kmers, sequence, data);
+
+    uint32_t k = data.read->pore_model[data.strand].k;
+    assert( data.read->pore_model[data.strand].states.size() == sequence.get_num_kmer_ranks(k) );
+    std::vector<uint32_t> kmer_ranks(num_kmers);
+    for(size_t ki = 0; ki < num_kmers; ++ki)
+        kmer_ranks[ki] = sequence.get_kmer_rank(ki, k, data.rc);
+
+    std::vector<float> post_flank = make_post_flanking(data, e_start, num_events);
+    float lp_ms = 0.0f; // as in the forward algorithm
+    float lp_emission_b = 0.0f;
+
+    // Per-block terms of the row after the current one: the emission of the
+    // next event by the match state plus the backward value of that state,
+    // and the backward value of the bad event state
+    std::vector<float> next_m(num_blocks, -INFINITY);
+    std::vector<float> next_b(num_blocks, -INFINITY);
+
+    for(uint32_t ri = 0; ri < bm.n_rows; ++ri) {
+        for(uint32_t si = 0; si < bm.n_cols; ++si) {
+            set(bm, ri, si, -INFINITY);
+        }
+    }
+
+    for(uint32_t row = last_event_row_idx; row >= 1; --row) {
+
+        if(row < last_event_row_idx) {
+            uint32_t next_event_idx = e_start + row * data.event_stride;
+            for(uint32_t block = 1; block < num_blocks - 1; ++block) {
+                uint32_t offset = PSR9_NUM_STATES * block;
+                float lp_emission_m = log_probability_match_r9(*data.read, kmer_ranks[block - 1], next_event_idx, data.strand);
+                next_m[block] = lp_emission_m + get(bm, row + 1, offset + PSR9_MATCH);
+                next_b[block] = lp_emission_b + get(bm, row + 1, offset + PSR9_BAD_EVENT);
+            }
+        }
+
+        // blocks are visited from the last so the silent skip state of the
+        // next block, which is in the same row, is already filled in
+        for(uint32_t block = num_blocks - 2; block >= 1; --block) {
+            uint32_t kmer_idx = block - 1;
+            uint32_t offset = PSR9_NUM_STATES * block;
+            const BlockTransitions& bt = transitions[kmer_idx];
+
+            // moving to the next block uses its transitions; there are
+            // none out of the last k-mer except to the end state
+            bool has_next = kmer_idx < last_kmer_idx;
+            const BlockTransitions& nt = transitions[has_next ? kmer_idx + 1 : kmer_idx];
+            float next_block_m = has_next ? next_m[block + 1] : -INFINITY;
+            float next_block_k = has_next ? get(bm, row, offset + PSR9_NUM_STATES + PSR9_KMER_SKIP) : -INFINITY;
+
+            float lp_end = -INFINITY;
+            if(kmer_idx == last_kmer_idx && ( (flags & HAF_ALLOW_POST_CLIP) || row == last_event_row_idx)) {
+                lp_end = lp_ms + post_flank[row - 1];
+            }
+
+            float m = lp_end;
+            m = add_logs(m, bt.lp_mm_self + next_m[block]);
+            m = add_logs(m, nt.lp_mm_next + next_block_m);
+            m = add_logs(m, bt.lp_mb + next_b[block]);
+            m = add_logs(m, nt.lp_mk + next_block_k);
+            set(bm, row, offset + PSR9_MATCH, m);
+
+            float b = lp_end;
+            b = add_logs(b, bt.lp_bm_self + next_m[block]);
+            b = add_logs(b, nt.lp_bm_next + next_block_m);
+            b = add_logs(b, bt.lp_bb + next_b[block]);
+            b = add_logs(b, nt.lp_bk + next_block_k);
+            set(bm, row, offset + PSR9_BAD_EVENT, b);
+
+            float s = lp_end;
+            s = add_logs(s, nt.lp_km + next_block_m);
+            s = add_logs(s, nt.lp_kk + next_block_k);
+            set(bm, row, offset + PSR9_KMER_SKIP, s);
+        }
+    }
+}
+
 void profile_hmm_viterbi_initialize_r9(FloatMatrix& m)
 {
     // Same as forward initialization
@@ -94,6 +195,22 @@ std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequence& sequ
     profile_hmm_viterbi_initialize_r9(vm);
     profile_hmm_fill_generic_r9(sequence, data, e_start, flags, output);
 
+    // Optionally run forward-backward to get the posterior probability of
+    // each state on the viterbi path
+    bool compute_posterior = flags & HAF_COMPUTE_POSTERIOR;
+    FloatMatrix fm;
+    FloatMatrix bkm;
+    float lp_forward = -INFINITY;
+    if(compute_posterior) {
+        allocate_matrix(fm, n_rows, n_states);
+        profile_hmm_forward_initialize_r9(fm);
+        ProfileHMMForwardOutputR9 forward_output(&fm);
+        lp_forward = profile_hmm_fill_generic_r9(sequence, data, e_start, flags, forward_output);
+
+        allocate_matrix(bkm, n_rows, n_states);
+        profile_hmm_backward_r9(sequence, data, flags, bkm);
+    }
+
     // Traverse the backtrack matrix to compute the results
     int traversal_stride = data.event_stride;
 
@@ -127,7 +244,7 @@ std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequence& sequ
         HMMAlignmentState as;
         as.event_idx = event_idx;
         as.kmer_idx = kmer_idx;
-        as.l_posterior = -INFINITY; // not computed
+        as.l_posterior = compute_posterior ? std::min(get(fm, row, col) + get(bkm, row, col) - lp_forward, 0.0f) : NAN;
         as.l_fm = get(vm, row, col);
         as.log_transition_probability = -INFINITY; // not computed
         as.state = ps2char(curr_ps);
@@ -192,6 +309,10 @@ std::vector<HMMAlignmentState> profile_hmm_align_r9(const HMMInputSequence& sequ
     //
     free_matrix(vm);
     free_matrix(bm);
+    if(compute_posterior) {
+        free_matrix(fm);
+        free_matrix(bkm);
+    }
 
     return alignment;
 }
@@ -41,6 +41,17 @@ void profile_hmm_forward_initialize_r9(FloatMatrix& fm);
 // Terminate the forward algorithm
 float profile_hmm_forward_terminate_r9(const FloatMatrix& fm, uint32_t row);
 
+//
+// Backward algorithm
+//
+
+// Fill bm, which has the dimensions of the forward matrix, with the log
+// probability of the events after each row given that the HMM is in the
+// state of the column after that row's event. It uses the transitions and
+// emissions of the forward algorithm so fm + bm - score is the log posterior
+// of each state.
+void profile_hmm_backward_r9(const HMMInputSequence& sequence, const HMMInputData& data, const uint32_t flags, FloatMatrix& bm);
+
 //
 // Viterbi
 //
@@ -9,11 +9,15 @@
 #include <map>
 #include <functional>
 #include "logsum.h"
+#include "profiler.h"
+#include "nanopolish_parallel.h"
 #include "nanopolish_extract.h"
 #include "nanopolish_call_variants.h"
 #include "nanopolish_consensus.h"
 #include "nanopolish_eventalign.h"
 #include "nanopolish_getmodel.h"
+#include "nanopolish_partition.h"
+#include "nanopolish_merge.h"
 #include "nanopolish_methyltrain.h"
 #include "nanopolish_call_methylation.h"
 #include "nanopolish_scorereads.h"
@@ -31,6 +35,8 @@ static std::map< std::string, std::function<int(int, char**)> > programs = {
     {"consensus",   consensus_main},
     {"eventalign",  eventalign_main},
     {"getmodel",    getmodel_main},
+    {"partition",   partition_main},
+    {"merge",       merge_main},
     {"variants",    call_variants_main},
     {"methyltrain", methyltrain_main},
     {"scorereads",  scorereads_main} ,
@@ -64,6 +70,10 @@ int print_version(int, char **)
 int main(int argc, char** argv)
 {
     int ret = 0;
+#if USE_PROFILER
+    set_parallel_timing_hook(accumulate_parallel_timing);
+#endif
+
     if(argc <= 1) {
         printf("error: no command provided\n");
         print_usage(argc - 1 , argv + 1);
@@ -85,5 +95,9 @@ int main(int argc, char** argv)
     if(g_total_reads > 0) {
         fprintf(stderr, "[post-run summary] total reads: %d unparseable: %d qc fail: %d could not calibrate: %d\n", g_total_reads, g_unparseable_reads, g_qc_fail_reads, g_failed_calibration_reads);
     }
+
+#if USE_PROFILER
+    print_parallel_timing(stderr);
+#endif
     return ret;
 }
@@ -0,0 +1,378 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_calibration -- fit the shift, scale, drift
+// and variance scaling of a pore model to the events of
+// a read strand
+//
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include "nanopolish_calibration.h"
+#include "nanopolish_parallel.h"
+
+// Reads with fewer matched events than this keep their current parameters
+static const size_t MIN_EVENTS_TO_RESCALE = 200;
+
+// The rank of the reverse complement of the k-mer with the given rank, computed
+// without building the k-mer. Only valid for alphabets without methylation
+// recognition sites, whose complement does not depend on context.
+static inline uint32_t reverse_complement_rank(const Alphabet* alphabet, uint32_t rank, uint32_t k)
+{
+    uint32_t r = 0;
+    for(uint32_t i = 0; i < k; ++i) {
+        char b = alphabet->base(rank % alphabet->size());
+        r = r * alphabet->size() + alphabet->rank(alphabet->complement(b));
+        rank /= alphabet->size();
+    }
+    return r;
+}
+
+void extract_calibration_data(const SquiggleRead& sr,
+                              const int strand_idx,
+                              const std::vector<EventAlignment>& alignment,
+                              const Alphabet* alphabet,
+                              CalibrationData& data)
+{
+    const PoreModel& pore_model = sr.pore_model[strand_idx];
+    uint32_t k = pore_model.k;
+    bool context_free_complement = alphabet->num_recognition_sites() == 0;
+
+    if(data.level.size() < alignment.size()) {
+        data.level.resize(alignment.size());
+        data.time.resize(alignment.size());
+        data.mean.resize(alignment.size());
+        data.inv_var.resize(alignment.size());
+    }
+
+    size_t n = 0;
+    for(size_t ei = 0; ei < alignment.size(); ++ei) {
+        const EventAlignment& ea = alignment[ei];
+        if(ea.hmm_state != 'M') {
+            continue;
+        }
+
+        uint32_t rank;
+        if(!ea.rc) {
+            rank = ea.ref_kmer_rank;
+        } else if(context_free_complement) {
+            rank = reverse_complement_rank(alphabet, ea.ref_kmer_rank, k);
+        } else {
+            std::string model_kmer = alphabet->reverse_complement(alphabet->kmer_from_rank(ea.ref_kmer_rank, k));
+            rank = alphabet->kmer_rank(model_kmer.c_str(), k);
+        }
+
+        const PoreModelStateParams& state = pore_model.states[rank];
+        data.level[n] = sr.get_uncorrected_level(ea.event_idx, strand_idx);
+        data.time[n] = sr.get_time(ea.event_idx, strand_idx);
+        data.mean[n] = state.level_mean;
+        data.inv_var[n] = 1.0 / (state.level_stdv * state.level_stdv);
+        n += 1;
+    }
+    data.n = n;
+}
+
+bool parse_calibration_loss(const std::string& name, CalibrationLoss& loss)
+{
+    if(name == "ls") {
+        loss = CL_LEAST_SQUARES;
+    } else if(name == "huber") {
+        loss = CL_HUBER;
+    } else if(name == "t") {
+        loss = CL_STUDENT_T;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The weighted sums the normal equations and the residual are built from.
+// w is the inverse variance of the model level times the robust weight.
+struct NormalEquationSums
+{
+    double w, wm, wmm, wt, wmt, wtt, we, wme, wte, wee;
+
+    // the sum of the robust weights alone
+    double robust;
+};
+
+// Accumulate the sums in one pass over the events. Without a previous fit the
+// robust weights are all one; otherwise they are computed from the residuals
+// of the previous fit, in standard deviations.
+static void accumulate_normal_equations(const CalibrationData& data,
+                                        const CalibrationOptions& options,
+                                        const CalibrationParameters* prev,
+                                        NormalEquationSums& sums)
+{
+    const size_t n = data.n;
+    const float* level = data.level.data();
+    const float* time = data.time.data();
+    const float* mean = data.mean.data();
+    const float* inv_var = data.inv_var.data();
+
+    double s_w = 0.0, s_wm = 0.0, s_wmm = 0.0, s_wt = 0.0, s_wmt = 0.0, s_wtt = 0.0;
+    double s_we = 0.0, s_wme = 0.0, s_wte = 0.0, s_wee = 0.0, s_robust = 0.0;
+
+    const bool robust = prev != NULL && options.loss != CL_LEAST_SQUARES;
+    const bool huber = options.loss == CL_HUBER;
+    const double shift = robust ? prev->shift : 0.0;
+    const double scale = robust ? prev->scale : 0.0;
+    const double drift = robust ? prev->drift : 0.0;
+    const double inv_sd = robust ? 1.0 / prev->var : 0.0;
+    const double huber_k = options.huber_k;
+    const double t_dof = options.t_dof;
+
+    #pragma omp simd reduction(+:s_w,s_wm,s_wmm,s_wt,s_wmt,s_wtt,s_we,s_wme,s_wte,s_wee,s_robust)
+    for(size_t i = 0; i < n; ++i) {
+        double m = mean[i];
+        double t = time[i];
+        double e = level[i];
+
+        double rw = 1.0;
+        if(robust) {
+            double u = (e - shift - scale * m - drift * t) * sqrt((double)inv_var[i]) * inv_sd;
+            double au = fabs(u);
+            rw = huber ? (au <= huber_k ? 1.0 : huber_k / au) : (t_dof + 1.0) / (t_dof + u * u);
+        }
+
+        double w = inv_var[i] * rw;
+        s_robust += rw;
+        s_w += w;
+        s_wm += w * m;
+        s_wmm += w * m * m;
+        s_wt += w * t;
+        s_wmt += w * m * t;
+        s_wtt += w * t * t;
+        s_we += w * e;
+        s_wme += w * m * e;
+        s_wte += w * t * e;
+        s_wee += w * e * e;
+    }
+
+    sums.w = s_w; sums.wm = s_wm; sums.wmm = s_wmm; sums.wt = s_wt; sums.wmt = s_wmt; sums.wtt = s_wtt;
+    sums.we = s_we; sums.wme = s_wme; sums.wte = s_wte; sums.wee = s_wee;
+    sums.robust = s_robust;
+}
+
+// Solve the normal equations, returns false if they are singular
+static bool solve_normal_equations(const NormalEquationSums& s, bool scale_drift, CalibrationParameters& out)
+{
+    double shift, scale, drift = 0.0;
+    if(scale_drift) {
+        // Cramer's rule on the symmetric 3x3 system
+        double c00 = s.wmm * s.wtt - s.wmt * s.wmt;
+        double c01 = s.wmt * s.wt - s.wm * s.wtt;
+        double c02 = s.wm * s.wmt - s.wmm * s.wt;
+        double det = s.w * c00 + s.wm * c01 + s.wt * c02;
+        if(!(det > 0.0) || !std::isfinite(det)) {
+            return false;
+        }
+
+        double c11 = s.w * s.wtt - s.wt * s.wt;
+        double c12 = s.wm * s.wt - s.w * s.wmt;
+        double c22 = s.w * s.wmm - s.wm * s.wm;
+        shift = (c00 * s.we + c01 * s.wme + c02 * s.wte) / det;
+        scale = (c01 * s.we + c11 * s.wme + c12 * s.wte) / det;
+        drift = (c02 * s.we + c12 * s.wme + c22 * s.wte) / det;
+    } else {
+        double det = s.w * s.wmm - s.wm * s.wm;
+        if(!(det > 0.0) || !std::isfinite(det)) {
+            return false;
+        }
+        shift = (s.wmm * s.we - s.wm * s.wme) / det;
+        scale = (s.w * s.wme - s.wm * s.we) / det;
+    }
+
+    out.shift = shift;
+    out.scale = scale;
+    out.drift = drift;
+    return true;
+}
+
+// The standard deviation scaling of the model implied by the sums and the fitted parameters
+static double residual_scale(const NormalEquationSums& s, const CalibrationParameters& p, double denominator)
+{
+    // sum w (e - shift - scale m - drift t)^2, expanded in terms of the sums above
+    double ss = s.wee
+              - 2.0 * (p.shift * s.we + p.scale * s.wme + p.drift * s.wte)
+              + p.shift * p.shift * s.w + p.scale * p.scale * s.wmm + p.drift * p.drift * s.wtt
+              + 2.0 * (p.shift * p.scale * s.wm + p.shift * p.drift * s.wt + p.scale * p.drift * s.wmt);
+    return sqrt(std::max(ss, 0.0) / denominator);
+}
+
+static void compute_residual_statistics(const CalibrationData& data,
+                                        const CalibrationParameters& p,
+                                        CalibrationResiduals& residuals)
+{
+    const size_t n = data.n;
+    const float* level = data.level.data();
+    const float* time = data.time.data();
+    const float* mean = data.mean.data();
+    const float* inv_var = data.inv_var.data();
+    const double inv_sd = 1.0 / p.var;
+
+    double sum_abs = 0.0, n_outliers = 0.0;
+    #pragma omp simd reduction(+:sum_abs,n_outliers)
+    for(size_t i = 0; i < n; ++i) {
+        double u = (level[i] - p.shift - p.scale * mean[i] - p.drift * time[i]) * sqrt((double)inv_var[i]) * inv_sd;
+        double au = fabs(u);
+        sum_abs += au;
+        n_outliers += au > OUTLIER_RESIDUAL ? 1.0 : 0.0;
+    }
+
+    residuals.n_events = n;
+    residuals.mean_abs_residual = sum_abs / n;
+    residuals.outlier_fraction = n_outliers / n;
+}
+
+bool fit_calibration(const CalibrationData& data,
+                     const CalibrationOptions& options,
+                     CalibrationParameters& out,
+                     CalibrationResiduals* residuals)
+{
+    const size_t n = data.n;
+    if(n < MIN_EVENTS_TO_RESCALE) {
+        return false;
+    }
+
+    // The least squares fit, which starts the robust fit. The sums include the
+    // weighted sum of squared levels, which gives the residual without a
+    // second pass over the events.
+    NormalEquationSums sums;
+    accumulate_normal_equations(data, options, NULL, sums);
+
+    CalibrationParameters params;
+    if(!solve_normal_equations(sums, options.scale_drift, params)) {
+        return false;
+    }
+    params.var = residual_scale(sums, params, n);
+
+    // the typical model level and time, to measure the change in the fitted levels
+    const double mean_level = sums.wm / sums.w;
+    const double mean_time = sums.wt / sums.w;
+
+    int iteration = 1;
+    bool converged = true;
+    if(options.loss != CL_LEAST_SQUARES) {
+        converged = false;
+        while(iteration < options.max_iterations && params.var > 0.0) {
+            accumulate_normal_equations(data, options, &params, sums);
+
+            CalibrationParameters next;
+            if(!solve_normal_equations(sums, options.scale_drift, next)) {
+                break;
+            }
+
+            // the Student-t scale is the EM update, the Huber
+            // scale is normalized by the total robust weight
+            next.var = residual_scale(sums, next, options.loss == CL_STUDENT_T ? n : sums.robust);
+            iteration += 1;
+
+            double level_change = fabs(next.shift - params.shift) +
+                                  fabs(next.scale - params.scale) * mean_level +
+                                  fabs(next.drift - params.drift) * mean_time;
+            double var_change = fabs(next.var - params.var);
+            params = next;
+
+            if(level_change < options.tolerance * params.var && var_change < options.tolerance * params.var) {
+                converged = true;
+                break;
+            }
+        }
+    }
+
+    if(residuals != NULL) {
+        residuals->iterations = iteration;
+        residuals->converged = converged;
+        if(params.var > 0.0) {
+            compute_residual_statistics(data, params, *residuals);
+        } else {
+            residuals->n_events = n;
+            residuals->mean_abs_residual = 0.0;
+            residuals->outlier_fraction = 0.0;
+        }
+    }
+
+    out.shift = params.shift;
+    out.scale = params.scale;
+    out.drift = params.drift;
+    if(options.scale_var) {
+        out.var = params.var; // 'var' is really the scaling for std dev.
+    }
+    return true;
+}
+
+bool fit_calibration(const CalibrationData& data,
+                     bool scale_var,
+                     bool scale_drift,
+                     CalibrationParameters& out)
+{
+    CalibrationOptions options;
+    options.scale_var = scale_var;
+    options.scale_drift = scale_drift;
+    return fit_calibration(data, options, out);
+}
+
+bool calibration_is_stable(const CalibrationResiduals& residuals, double max_outlier_fraction)
+{
+    return residuals.converged && residuals.outlier_fraction <= max_outlier_fraction;
+}
+
+static void apply_calibration(SquiggleRead& sr, int strand_idx, const CalibrationParameters& params, bool scale_var)
+{
+    PoreModel& pore_model = sr.pore_model[strand_idx];
+    pore_model.shift = params.shift;
+    pore_model.scale = params.scale;
+    pore_model.drift = params.drift;
+    if(scale_var) {
+        pore_model.var = params.var;
+    }
+
+    if(pore_model.is_scaled) {
+        pore_model.bake_gaussian_parameters();
+    }
+}
+
+bool recalibrate_model(SquiggleRead &sr,
+                       const int strand_idx,
+                       const std::vector<EventAlignment> &alignment_output,
+                       const Alphabet* alphabet,
+                       const CalibrationOptions& options,
+                       CalibrationResiduals* residuals)
+{
+    static thread_local CalibrationData data;
+    extract_calibration_data(sr, strand_idx, alignment_output, alphabet, data);
+
+    CalibrationParameters params;
+    if(!fit_calibration(data, options, params, residuals)) {
+        return false;
+    }
+    apply_calibration(sr, strand_idx, params, options.scale_var);
+    return true;
+}
+
+bool recalibrate_model(SquiggleRead &sr,
+                       const int strand_idx,
+                       const std::vector<EventAlignment> &alignment_output,
+                       const Alphabet* alphabet,
+                       const bool scale_var,
+                       const bool scale_drift)
+{
+    CalibrationOptions options;
+    options.scale_var = scale_var;
+    options.scale_drift = scale_drift;
+    return recalibrate_model(sr, strand_idx, alignment_output, alphabet, options);
+}
+
+void recalibrate_models(std::vector<CalibrationJob>& jobs,
+                        bool scale_var,
+                        bool scale_drift)
+{
+    parallel_for(jobs.size(), [&](size_t i) {
+        CalibrationJob& job = jobs[i];
+        assert(job.sr != NULL && job.alignment != NULL);
+        job.calibrated = recalibrate_model(*job.sr, job.strand_idx, *job.alignment, job.alphabet, scale_var, scale_drift);
+    }, "recalibrate_models");
+}
@@ -0,0 +1,155 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_calibration -- fit the shift, scale, drift
+// and variance scaling of a pore model to the events of
+// a read strand
+//
+#ifndef NANOPOLISH_CALIBRATION_H
+#define NANOPOLISH_CALIBRATION_H
+
+#include <string>
+#include <vector>
+#include "nanopolish_eventalign.h"
+#include "nanopolish_squiggle_read.h"
+
+// The matched events of a read strand in the columns the fit reads, so
+// that the normal equations are accumulated in one contiguous pass.
+// The buffers are reused between reads and only grow.
+struct CalibrationData
+{
+    std::vector<float> level;   // the event level, without drift correction
+    std::vector<float> time;    // seconds since the first event of the strand
+    std::vector<float> mean;    // the model level of the aligned k-mer
+    std::vector<float> inv_var; // the inverse variance of the model level
+    size_t n;
+
+    CalibrationData() : n(0) {}
+};
+
+struct CalibrationParameters
+{
+    double shift;
+    double scale;
+    double drift;
+    double var;
+};
+
+// How the residuals of the fit are weighted. The robust losses are fit by
+// iteratively reweighted least squares on the fixed alignment, which limits
+// the pull of events that are misaligned or do not fit the model.
+enum CalibrationLoss
+{
+    CL_LEAST_SQUARES,
+    CL_HUBER,
+    CL_STUDENT_T
+};
+
+struct CalibrationOptions
+{
+    CalibrationOptions() : loss(CL_LEAST_SQUARES),
+                           scale_var(true),
+                           scale_drift(true),
+                           max_iterations(20),
+                           tolerance(1e-3),
+                           huber_k(1.345),
+                           t_dof(4.0) {}
+
+    CalibrationLoss loss;
+    bool scale_var;
+    bool scale_drift;
+
+    // the robust fit stops once the fitted levels and the standard deviation
+    // change by less than tolerance standard deviations between iterations
+    int max_iterations;
+    double tolerance;
+
+    // the residual, in standard deviations, beyond which Huber weights decay
+    double huber_k;
+
+    // the degrees of freedom of the Student-t loss
+    double t_dof;
+};
+
+// How well the fitted parameters explain the matched events
+struct CalibrationResiduals
+{
+    size_t n_events;
+    int iterations;
+    bool converged;
+
+    // mean absolute standardized residual, about 0.8 for a good fit
+    double mean_abs_residual;
+
+    // the fraction of events more than OUTLIER_RESIDUAL standard deviations from the model
+    double outlier_fraction;
+};
+
+#define OUTLIER_RESIDUAL 3.0
+
+// Parse ls, huber or t into a loss, returns false for other names
+bool parse_calibration_loss(const std::string& name, CalibrationLoss& loss);
+
+// A read strand to recalibrate in a batch
+struct CalibrationJob
+{
+    SquiggleRead* sr;
+    int strand_idx;
+    const std::vector<EventAlignment>* alignment;
+    const Alphabet* alphabet;
+
+    // set by recalibrate_models
+    bool calibrated;
+};
+
+// Copy the match states of the alignment into data. The k-mer ranks
+// of the alignment must be in the given alphabet.
+void extract_calibration_data(const SquiggleRead& sr,
+                              const int strand_idx,
+                              const std::vector<EventAlignment>& alignment,
+                              const Alphabet* alphabet,
+                              CalibrationData& data);
+
+// Fit level = shift + scale * mean + drift * time by weighted least squares.
+// The normal equations are solved in closed form. Returns false if there are
+// too few events or the system is singular, in which case out is unchanged.
+// The residual statistics are written to residuals when it is not NULL.
+bool fit_calibration(const CalibrationData& data,
+                     const CalibrationOptions& options,
+                     CalibrationParameters& out,
+                     CalibrationResiduals* residuals = NULL);
+
+bool fit_calibration(const CalibrationData& data,
+                     bool scale_var,
+                     bool scale_drift,
+                     CalibrationParameters& out);
+
+// Whether a calibration can be used without realigning the read to
+// the updated model: the fit converged and few events are outliers
+bool calibration_is_stable(const CalibrationResiduals& residuals, double max_outlier_fraction = 0.05);
+
+// recalculate shift, scale, drift, scale_sd from an alignment and the read
+// returns true if the recalibration was performed
+bool recalibrate_model(SquiggleRead &sr,
+                       const int strand_idx,
+                       const std::vector<EventAlignment> &alignment_output,
+                       const Alphabet* alphabet,
+                       bool scale_var=true,
+                       bool scale_drift=true);
+
+bool recalibrate_model(SquiggleRead &sr,
+                       const int strand_idx,
+                       const std::vector<EventAlignment> &alignment_output,
+                       const Alphabet* alphabet,
+                       const CalibrationOptions& options,
+                       CalibrationResiduals* residuals = NULL);
+
+// Recalibrate many read strands in parallel. Each job must be a
+// different strand; calibrated is set on each job.
+void recalibrate_models(std::vector<CalibrationJob>& jobs,
+                        bool scale_var=true,
+                        bool scale_drift=true);
+
+#endif
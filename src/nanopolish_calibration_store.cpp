@@ -0,0 +1,234 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_calibration_store -- a file of the per-strand
+// calibrations computed when reads are loaded, so that
+// later runs can reuse them instead of recalibrating
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fstream>
+#include "nanopolish_common.h"
+#include "nanopolish_calibration_store.h"
+
+// The file has one tab-separated line per strand:
+// read_name strand kit model_fingerprint n_events read_length calibrated model_idx
+// events_per_base shift scale drift var scale_sd var_sd
+#define CALIBRATION_STORE_FIELDS 15
+
+//
+bool StoredCalibration::matches(KitVersion kit, uint64_t model_fingerprint, uint32_t n_events, uint32_t read_length) const
+{
+    return this->kit == kit &&
+           this->model_fingerprint == model_fingerprint &&
+           this->n_events == n_events &&
+           this->read_length == read_length;
+}
+
+// Take a lock on the whole file, shared for reading or exclusive for appending
+static void lock_calibration_file(int fd, int operation, const std::string& filename)
+{
+    while(flock(fd, operation) != 0) {
+        if(errno != EINTR) {
+            fprintf(stderr, "Error: could not lock calibration file %s: %s\n", filename.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// A process killed while appending can leave a partial last line,
+// cut the file back to its last newline before appending to it
+static void truncate_partial_line(int fd, const std::string& filename)
+{
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        return;
+    }
+
+    char buffer[4096];
+    off_t end = st.st_size;
+    while(end > 0) {
+        off_t start = end > (off_t)sizeof(buffer) ? end - sizeof(buffer) : 0;
+        ssize_t n = pread(fd, buffer, end - start, start);
+        if(n != end - start) {
+            fprintf(stderr, "Error: could not read calibration file %s: %s\n", filename.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for(ssize_t i = n - 1; i >= 0; --i) {
+            if(buffer[i] == '\n') {
+                off_t length = start + i + 1;
+                if(length != st.st_size && ftruncate(fd, length) != 0) {
+                    fprintf(stderr, "Error: could not truncate calibration file %s: %s\n", filename.c_str(), strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                return;
+            }
+        }
+        end = start;
+    }
+
+    // no complete line at all
+    if(ftruncate(fd, 0) != 0) {
+        fprintf(stderr, "Error: could not truncate calibration file %s: %s\n", filename.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+//
+void CalibrationStore::initialize(const std::string& filename)
+{
+    CalibrationStore& store = getInstance();
+    store.filename = filename;
+    store.calibrations.clear();
+    store.added.clear();
+
+    // a missing file is not an error, it is created by write()
+    int fd = filename.empty() ? -1 : open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return;
+    }
+
+    // wait for any append in progress to finish
+    lock_calibration_file(fd, LOCK_SH, filename);
+    std::ifstream reader(filename);
+
+    std::string line;
+    size_t line_number = 0;
+    while(getline(reader, line)) {
+        line_number += 1;
+
+        // a line without a newline was cut short by a process that was killed while appending
+        if(reader.eof()) {
+            break;
+        }
+
+        std::vector<std::string> fields = split(line, '\t');
+        if(fields.size() != CALIBRATION_STORE_FIELDS) {
+            fprintf(stderr, "Error: line %zu of calibration file %s has %zu fields, expected %d\n",
+                line_number, filename.c_str(), fields.size(), CALIBRATION_STORE_FIELDS);
+            exit(EXIT_FAILURE);
+        }
+
+        size_t strand_idx = atoi(fields[1].c_str());
+        int kit = atoi(fields[2].c_str());
+        int model_idx = atoi(fields[7].c_str());
+        if(strand_idx > 1 || kit < 0 || kit >= NUM_KITS || model_idx < 0 || model_idx > 2) {
+            fprintf(stderr, "Error: line %zu of calibration file %s is invalid\n", line_number, filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        StoredCalibration c;
+        c.kit = (KitVersion)kit;
+        c.model_fingerprint = strtoull(fields[3].c_str(), NULL, 16);
+        c.n_events = strtoul(fields[4].c_str(), NULL, 10);
+        c.read_length = strtoul(fields[5].c_str(), NULL, 10);
+        c.calibrated = fields[6] == "1";
+        c.model_idx = model_idx;
+        c.events_per_base = atof(fields[8].c_str());
+        c.shift = atof(fields[9].c_str());
+        c.scale = atof(fields[10].c_str());
+        c.drift = atof(fields[11].c_str());
+        c.var = atof(fields[12].c_str());
+        c.scale_sd = atof(fields[13].c_str());
+        c.var_sd = atof(fields[14].c_str());
+
+        // later lines replace earlier ones for the same strand
+        ReadCalibrations& rc = store.calibrations[fields[0]];
+        rc.has_strand[strand_idx] = true;
+        rc.strands[strand_idx] = c;
+    }
+    close(fd);
+}
+
+//
+bool CalibrationStore::find(const std::string& read_name, size_t strand_idx, StoredCalibration& out)
+{
+    assert(strand_idx < 2);
+    CalibrationStore& store = getInstance();
+    bool found = false;
+
+    #pragma omp critical(calibration_store)
+    {
+        auto iter = store.calibrations.find(read_name);
+        if(iter != store.calibrations.end() && iter->second.has_strand[strand_idx]) {
+            out = iter->second.strands[strand_idx];
+            found = true;
+        }
+    }
+    return found;
+}
+
+//
+void CalibrationStore::add(const std::string& read_name, size_t strand_idx, const StoredCalibration& calibration)
+{
+    assert(strand_idx < 2);
+    CalibrationStore& store = getInstance();
+
+    #pragma omp critical(calibration_store)
+    {
+        ReadCalibrations& rc = store.calibrations[read_name];
+        rc.has_strand[strand_idx] = true;
+        rc.strands[strand_idx] = calibration;
+        store.added.push_back(std::make_pair(read_name, strand_idx));
+    }
+}
+
+//
+void CalibrationStore::write()
+{
+    CalibrationStore& store = getInstance();
+    if(store.filename.empty() || store.added.empty()) {
+        return;
+    }
+
+    // Format all of the lines first so they are appended while holding the lock
+    std::string out;
+    char buffer[1024];
+    for(const auto& key : store.added) {
+        const StoredCalibration& c = store.calibrations[key.first].strands[key.second];
+        snprintf(buffer, sizeof(buffer), "\t%zu\t%d\t%016" PRIx64 "\t%u\t%u\t%d\t%d\t%.9g\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\n",
+            key.second, (int)c.kit, c.model_fingerprint, c.n_events, c.read_length,
+            (int)c.calibrated, (int)c.model_idx, c.events_per_base,
+            c.shift, c.scale, c.drift, c.var, c.scale_sd, c.var_sd);
+        out += key.first;
+        out += buffer;
+    }
+
+    // Several processes may share the file so the append is made under an
+    // exclusive lock, as a large write can be split into several by the kernel
+    int fd = open(store.filename.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "Error: could not open calibration file %s: %s\n", store.filename.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    lock_calibration_file(fd, LOCK_EX, store.filename);
+    truncate_partial_line(fd, store.filename);
+
+    size_t written = 0;
+    while(written < out.size()) {
+        ssize_t n = ::write(fd, out.data() + written, out.size() - written);
+        if(n < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: could not write calibrations to %s: %s\n", store.filename.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        written += n > 0 ? n : 0;
+    }
+
+    // closing the file releases the lock
+    if(close(fd) != 0) {
+        fprintf(stderr, "Error: could not write calibrations to %s: %s\n", store.filename.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    store.added.clear();
+}
@@ -0,0 +1,109 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_calibration_store -- a file of the per-strand
+// calibrations computed when reads are loaded, so that
+// later runs can reuse them instead of recalibrating
+//
+#ifndef NANOPOLISH_CALIBRATION_STORE_H
+#define NANOPOLISH_CALIBRATION_STORE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "nanopolish_model_names.h"
+
+// The calibration of one strand of a read. The read's event count, its
+// 1D sequence length and the fingerprint of the candidate models identify
+// the data it was computed from; a stored calibration is only reused when
+// all of them match the read being loaded.
+struct StoredCalibration
+{
+    // the data the calibration was computed from
+    KitVersion kit;
+    uint64_t model_fingerprint;
+    uint32_t n_events;
+    uint32_t read_length;
+
+    // false if no model fit the strand well enough, in which case the strand is dropped
+    bool calibrated;
+    uint8_t model_idx;
+    float events_per_base;
+
+    double shift;
+    double scale;
+    double drift;
+    double var;
+    double scale_sd;
+    double var_sd;
+
+    // true if this calibration was computed from the given data
+    bool matches(KitVersion kit, uint64_t model_fingerprint, uint32_t n_events, uint32_t read_length) const;
+};
+
+class CalibrationStore
+{
+    public:
+
+        //
+        // load the calibrations in filename, if it exists, replacing any
+        // loaded before. Calibrations added after this are appended to the
+        // same file by write(). An empty filename disables the store.
+        //
+        static void initialize(const std::string& filename);
+
+        //
+        // returns true if initialize() has been called
+        //
+        static bool is_enabled() { return !getInstance().filename.empty(); }
+
+        //
+        // look up the calibration of a strand of a read
+        //
+        static bool find(const std::string& read_name, size_t strand_idx, StoredCalibration& out);
+
+        //
+        // add the calibration of a strand of a read
+        //
+        static void add(const std::string& read_name, size_t strand_idx, const StoredCalibration& calibration);
+
+        //
+        // append the calibrations added since initialization to the file. The
+        // file is locked while appending so processes can share it.
+        //
+        static void write();
+
+    private:
+
+        // singleton accessor function
+        static CalibrationStore& getInstance()
+        {
+            static CalibrationStore instance;
+            return instance;
+        }
+
+        CalibrationStore() {}
+
+        // do not allow copies of this classs
+        CalibrationStore(CalibrationStore const&) = delete;
+        void operator=(CalibrationStore const&) = delete;
+
+        // the calibrations of each read, indexed by strand
+        struct ReadCalibrations
+        {
+            ReadCalibrations() { has_strand[0] = has_strand[1] = false; }
+            bool has_strand[2];
+            StoredCalibration strands[2];
+        };
+
+        std::string filename;
+        std::unordered_map<std::string, ReadCalibrations> calibrations;
+
+        // the calibrations that are not in the file yet
+        std::vector<std::pair<std::string, size_t>> added;
+};
+
+#endif
@@ -18,6 +18,8 @@
 #include <fstream>
 #include <sstream>
 #include <set>
+#include <map>
+#include <limits.h>
 #include <omp.h>
 #include <getopt.h>
 #include "htslib/faidx.h"
@@ -31,20 +33,30 @@
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_methyltrain.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_calibration_store.h"
 #include "nanopolish_bam_processor.h"
 #include "nanopolish_alignment_db.h"
+#include "nanopolish_parallel.h"
+#include "nanopolish_lease_queue.h"
+#include "nanopolish_sample_sheet.h"
+#include "nanopolish_output_buffer.h"
 #include "H5pubconf.h"
 #include "profiler.h"
 #include "progress.h"
 
-using namespace std::placeholders;
+// Reads spanning more than this many reference bases have their
+// CpG groups scored in chunks, as separate tasks
+#define METHYLATION_CHUNK_SIZE 20000
+
+#define DEFAULT_METHYLATION_MOTIFS "cpg"
 
 //
 // Structs
 //
 struct OutputHandles
 {
-    FILE* site_writer;
+    // one writer per motif, in the order of mtest_alphabets
+    std::vector<FILE*> site_writers;
 };
 
 struct ScoredSite
@@ -61,7 +73,7 @@ struct ScoredSite
     std::string chromosome;
     int start_position;
     int end_position;
-    int n_cpg;
+    int n_sites;
     std::string sequence;
 
     // scores per strand
@@ -74,8 +86,12 @@ struct ScoredSite
 
 };
 
-//
-Alphabet* mtest_alphabet = &gMCpGAlphabet;
+// The motifs to call, set by --methylation
+std::vector<const Alphabet*> mtest_alphabets;
+
+// The samples to call, set by --samples. Without --samples this is the
+// single unnamed sample given by --reads and --bam.
+std::vector<SampleInput> input_samples;
 
 //
 // Getopt
@@ -97,9 +113,18 @@ static const char *CALL_METHYLATION_USAGE_MESSAGE =
 "      --help                           display this help and exit\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"      --samples=FILE                   call the samples in FILE in one run, instead of -r/-b, and add a sample column to the output.\n"
+"                                       FILE has one tab-separated line per sample: name, reads and bam\n"
 "  -g, --genome=FILE                    the genome we are computing a consensus for is in FILE\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
 "      --progress                       print out a progress message\n"
+"  -q, --methylation=LIST               call the comma-separated motifs in LIST, any of cpg, dam, dcm (default: " DEFAULT_METHYLATION_MOTIFS ")\n"
+"  -o, --output-prefix=PREFIX           write the calls of each motif to PREFIX.<motif>.tsv instead of stdout,\n"
+"                                       required when calling more than one motif\n"
+"      --lease-dir=DIR                  run as one of many workers sharing the shards in DIR, see nanopolish merge\n"
+"      --shards=FILE                    with --lease-dir, the non-overlapping regions to call, one per line\n"
+"      --lease-time=SECONDS             reclaim a shard when its worker has not sent a heartbeat for SECONDS (default: 600)\n"
+"      --calibrations=FILE              reuse the read calibrations stored in FILE and add new ones to it\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -109,16 +134,23 @@ namespace opt
     static std::string bam_file;
     static std::string genome_file;
     static std::string models_fofn;
+    static std::string calibrations_file;
+    static std::string samples_file;
     static std::string region;
+    static std::string lease_dir;
+    static std::string shards_file;
+    static std::string methylation_motifs = DEFAULT_METHYLATION_MOTIFS;
+    static std::string output_prefix;
+    static double lease_seconds = 600;
     static std::string cpg_methylation_model_type = "reftrained";
     static int progress = 0;
     static int num_threads = 1;
     static int batch_size = 128;
 }
 
-static const char* shortopts = "r:b:g:t:w:m:vn";
+static const char* shortopts = "r:b:g:t:w:m:q:o:vn";
 
-enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS };
+enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_LEASE_DIR, OPT_SHARDS, OPT_LEASE_TIME, OPT_CALIBRATIONS, OPT_SAMPLES };
 
 static const struct option longopts[] = {
     { "verbose",          no_argument,       NULL, 'v' },
@@ -128,14 +160,50 @@ static const struct option longopts[] = {
     { "window",           required_argument, NULL, 'w' },
     { "threads",          required_argument, NULL, 't' },
     { "models-fofn",      required_argument, NULL, 'm' },
+    { "methylation",      required_argument, NULL, 'q' },
+    { "output-prefix",    required_argument, NULL, 'o' },
     { "progress",         no_argument,       NULL, OPT_PROGRESS },
+    { "lease-dir",        required_argument, NULL, OPT_LEASE_DIR },
+    { "shards",           required_argument, NULL, OPT_SHARDS },
+    { "lease-time",       required_argument, NULL, OPT_LEASE_TIME },
+    { "calibrations",     required_argument, NULL, OPT_CALIBRATIONS },
+    { "samples",          required_argument, NULL, OPT_SAMPLES },
     { "help",             no_argument,       NULL, OPT_HELP },
     { "version",          no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
 };
 
-// Test CpG sites in this read for methylation
+// Find the sites of the motif in seq. The position of a site is its
+// methylated base, so CpG sites are reported at the C as before.
+std::vector<int> find_methylation_sites(const std::string& seq, const Alphabet* alphabet)
+{
+    std::vector<int> sites;
+    size_t rl = alphabet->recognition_length();
+    for(size_t i = 0; i + rl <= seq.size(); ++i) {
+        for(size_t j = 0; j < alphabet->num_recognition_sites(); ++j) {
+            if(seq.compare(i, rl, alphabet->get_recognition_site(j)) == 0) {
+                const char* methylated = alphabet->get_recognition_site_methylated(j);
+                sites.push_back(i + (strchr(methylated, 'M') - methylated));
+                break;
+            }
+        }
+    }
+    return sites;
+}
+
+// The sites of one motif, batched into groups that are scored together
+struct MotifSites
+{
+    std::vector<int> sites;
+    std::vector<std::pair<int, int>> groups;
+    std::vector<size_t> chunk_starts;
+};
+
+// Test the sites of every requested motif in this read for methylation.
+// The read, its reference sequence and its event alignment are loaded once
+// and shared by all motifs; only the pore model differs between them.
 void calculate_methylation_for_read(const OutputHandles& handles,
+                                    const std::string& sample_name,
                                     const Fast5Map& name_map,
                                     const faidx_t* fai,
                                     const bam_hdr_t* hdr,
@@ -149,175 +217,200 @@ void calculate_methylation_for_read(const OutputHandles& handles,
     std::string fast5_path = name_map.get_path(read_name);
     SquiggleRead sr(read_name, fast5_path);
 
-    // An output map from reference positions to scored CpG sites
-    std::map<int, ScoredSite> site_score_map;
-
-    for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
-        if(!sr.has_events_for_strand(strand_idx)) {
-            continue;
-        }
-
-        // replace the baked-in pore model with the methylation model
-        const PoreModel& curr_model = sr.pore_model[strand_idx];
-
-        // check if there is a cpg model for this strand
-        if(!PoreModelSet::has_model(curr_model.metadata.get_kit_name(),
-                                    "cpg",
-                                    curr_model.metadata.get_strand_model_name(),
-                                    curr_model.k))
-        {
-            continue;
-        }
-
-        sr.replace_strand_model(strand_idx,
-                                curr_model.metadata.get_kit_name(),
-                                "cpg",
-                                curr_model.k);
-
-        // Build the event-to-reference map for this read from the bam record
-        SequenceAlignmentRecord seq_align_record(record);
-        EventAlignmentRecord event_align_record(&sr, strand_idx, seq_align_record);
-
-        std::vector<double> site_scores;
-        std::vector<int> site_starts;
-        std::vector<int> site_ends;
-        std::vector<int> site_count;
-
-
-        size_t k = sr.pore_model[strand_idx].k;
-
-        std::string contig = hdr->target_name[record->core.tid];
-        int ref_start_pos = record->core.pos;
-        int ref_end_pos =  bam_endpos(record);
-
-        // Extract the reference sequence for this region
-        int fetched_len = 0;
-        assert(ref_end_pos >= ref_start_pos);
-        std::string ref_seq = get_reference_region_ts(fai, contig.c_str(), ref_start_pos, 
-                                                      ref_end_pos, &fetched_len);
-        
-        // Remove non-ACGT bases from this reference segment
-        ref_seq = gDNAAlphabet.disambiguate(ref_seq);
-
-        // Scan the sequence for CpGs
-        std::vector<int> cpg_sites;
-        assert(ref_seq.size() != 0);
-        for(size_t i = 0; i < ref_seq.size() - 1; ++i) {
-            if(ref_seq[i] == 'C' && ref_seq[i+1] == 'G') {
-                cpg_sites.push_back(i);
-            }
-        }
+    std::string contig = hdr->target_name[record->core.tid];
+    int ref_start_pos = record->core.pos;
+    int ref_end_pos =  bam_endpos(record);
 
-        // Batch the CpGs together into groups that are separated by some minimum distance
-        int min_separation = 10;
-        std::vector<std::pair<int, int>> groups;
-        
+    // Extract the reference sequence for this region
+    int fetched_len = 0;
+    assert(ref_end_pos >= ref_start_pos);
+    std::string ref_seq = get_reference_region_ts(fai, contig.c_str(), ref_start_pos, 
+                                                  ref_end_pos, &fetched_len);
+    
+    // Remove non-ACGT bases from this reference segment
+    ref_seq = gDNAAlphabet.disambiguate(ref_seq);
+    assert(ref_seq.size() != 0);
+
+    // Scan the sequence for the sites of each motif
+    int min_separation = 10;
+    const size_t n_motifs = mtest_alphabets.size();
+    std::vector<MotifSites> motif_sites(n_motifs);
+    for(size_t mi = 0; mi < n_motifs; ++mi) {
+        MotifSites& ms = motif_sites[mi];
+        ms.sites = find_methylation_sites(ref_seq, mtest_alphabets[mi]);
+
+        // Batch the sites together into groups that are separated by some minimum distance
         size_t curr_idx = 0;
-        while(curr_idx < cpg_sites.size()) {
+        while(curr_idx < ms.sites.size()) {
             // Find the endpoint of this group of sites
             size_t end_idx = curr_idx + 1;
-            while(end_idx < cpg_sites.size()) {
-                if(cpg_sites[end_idx] - cpg_sites[end_idx - 1] > min_separation)
+            while(end_idx < ms.sites.size()) {
+                if(ms.sites[end_idx] - ms.sites[end_idx - 1] > min_separation)
                     break;
                 end_idx += 1; 
             }
-            groups.push_back(std::make_pair(curr_idx, end_idx));
+            ms.groups.push_back(std::make_pair(curr_idx, end_idx));
             curr_idx = end_idx;
         }
 
-        for(size_t group_idx = 0; group_idx < groups.size(); ++group_idx) {
+        // Split the groups into chunks of roughly METHYLATION_CHUNK_SIZE reference bases.
+        // For ultra-long reads each chunk is scored as a separate task, which threads that
+        // have finished their own reads pick up. The scores are merged below in group order.
+        for(size_t group_idx = 0; group_idx < ms.groups.size(); ++group_idx) {
+            if(ms.chunk_starts.empty() ||
+               ms.sites[ms.groups[group_idx].first] - ms.sites[ms.groups[ms.chunk_starts.back()].first] >= METHYLATION_CHUNK_SIZE) {
+                ms.chunk_starts.push_back(group_idx);
+            }
+        }
+        ms.chunk_starts.push_back(ms.groups.size());
+    }
 
-            size_t start_idx = groups[group_idx].first;
-            size_t end_idx = groups[group_idx].second;
+    // An output map from reference positions to scored sites, per motif
+    std::vector<std::map<int, ScoredSite>> site_score_maps(n_motifs);
 
-            // the coordinates on the reference substring for this group of sites
-            int sub_start_pos = cpg_sites[start_idx] - min_separation;
-            int sub_end_pos = cpg_sites[end_idx - 1] + min_separation;
-            int span = cpg_sites[end_idx - 1] - cpg_sites[start_idx];
+    for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
+        if(!sr.has_events_for_strand(strand_idx)) {
+            continue;
+        }
 
-            // skip if too close to the start of the read alignment or
-            // if the reference range is too large to efficiently call
-            if(sub_start_pos <= min_separation || span > 200) {
-                continue;
-            }
+        // the baked-in pore model is replaced by each motif's methylation model in turn,
+        // so record what identifies it first
+        const PoreModel& curr_model = sr.pore_model[strand_idx];
+        KitVersion kit = curr_model.metadata.kit;
+        size_t model_idx = curr_model.metadata.model_idx;
+        size_t k = curr_model.k;
+
+        // Build the event-to-reference map for this read from the bam record
+        SequenceAlignmentRecord seq_align_record(record);
+        EventAlignmentRecord event_align_record(&sr, strand_idx, seq_align_record);
 
-            std::string subseq = ref_seq.substr(sub_start_pos, sub_end_pos - sub_start_pos + 1);
-            std::string rc_subseq = mtest_alphabet->reverse_complement(subseq);
-
-            int calling_start = sub_start_pos + ref_start_pos;
-            int calling_end = sub_end_pos + ref_start_pos;
-
-            // using the reference-to-event map, look up the event indices for this segment
-            int e1,e2;
-            bool bounded = AlignmentDB::_find_by_ref_bounds(event_align_record.aligned_events, 
-                                                            calling_start,
-                                                            calling_end,
-                                                            e1, 
-                                                            e2);
-
-            double ratio = fabs(e2 - e1) / (calling_start - calling_end); 
-            
-            // Only process this region if the the read is aligned within the boundaries
-            // and the span between the start/end is not unusually short
-            if(!bounded || abs(e2 - e1) <= 10 || ratio > MAX_EVENT_TO_BP_RATIO) {
+        for(size_t mi = 0; mi < n_motifs; ++mi) {
+            const Alphabet* mtest_alphabet = mtest_alphabets[mi];
+            const MotifSites& ms = motif_sites[mi];
+            if(ms.groups.empty()) {
                 continue;
             }
 
-            uint32_t hmm_flags = HAF_ALLOW_PRE_CLIP | HAF_ALLOW_POST_CLIP;
-
-            // Set up event data
-            HMMInputData data;
-            data.read = &sr;
-            data.anchor_index = -1; // unused
-            data.strand = strand_idx;
-            data.rc = event_align_record.rc;
-            data.event_start_idx = e1;
-            data.event_stop_idx = e2;
-            data.event_stride = data.event_start_idx <= data.event_stop_idx ? 1 : -1;
-         
-            // Calculate the likelihood of the unmethylated sequence
-            HMMInputSequence unmethylated(subseq, rc_subseq, mtest_alphabet);
-            double unmethylated_score = profile_hmm_score(unmethylated, data, hmm_flags);
-
-            // Methylate all CpGs in the sequence and score again
-            std::string mcpg_subseq = mtest_alphabet->methylate(subseq);
-            std::string rc_mcpg_subseq = mtest_alphabet->reverse_complement(mcpg_subseq);
-            
-            // Calculate the likelihood of the methylated sequence
-            HMMInputSequence methylated(mcpg_subseq, rc_mcpg_subseq, mtest_alphabet);
-            double methylated_score = profile_hmm_score(methylated, data, hmm_flags);
-
-            // Aggregate score
-            int start_position = cpg_sites[start_idx] + ref_start_pos;
-            auto iter = site_score_map.find(start_position);
-            if(iter == site_score_map.end()) {
-                // insert new score into the map
-                ScoredSite ss;
-                ss.chromosome = contig;
-                ss.start_position = start_position;
-                ss.end_position = cpg_sites[end_idx - 1] + ref_start_pos;
-                ss.n_cpg = end_idx - start_idx;
-
-                // extract the CpG site(s) with a k-mers worth of surrounding context
-                size_t site_output_start = cpg_sites[start_idx] - k + 1;
-                size_t site_output_end =  cpg_sites[end_idx - 1] + k;
-                ss.sequence = ref_seq.substr(site_output_start, site_output_end - site_output_start);
-            
-                // insert into the map    
-                iter = site_score_map.insert(std::make_pair(start_position, ss)).first;
+            // check if there is a model for this motif and strand
+            PoreModelHandle mtest_model = PoreModelSet::find_model(kit, mtest_alphabet, model_idx, k);
+            if(mtest_model == INVALID_PORE_MODEL_HANDLE) {
+                continue;
             }
-            
-            // set strand-specific score
-            // upon output below the strand scores will be summed
-            iter->second.ll_unmethylated[strand_idx] = unmethylated_score;
-            iter->second.ll_methylated[strand_idx] = methylated_score;
-            iter->second.strands_scored += 1;
-        } // for group
+            sr.replace_strand_model(strand_idx, mtest_model);
+
+            std::vector<int> group_scored(ms.groups.size(), 0);
+            std::vector<double> group_unmethylated_score(ms.groups.size(), 0.0f);
+            std::vector<double> group_methylated_score(ms.groups.size(), 0.0f);
+
+            parallel_for(ms.chunk_starts.size() - 1, [&](size_t ci) {
+                for(size_t group_idx = ms.chunk_starts[ci]; group_idx < ms.chunk_starts[ci + 1]; ++group_idx) {
+
+                    size_t start_idx = ms.groups[group_idx].first;
+                    size_t end_idx = ms.groups[group_idx].second;
+
+                    // the coordinates on the reference substring for this group of sites
+                    int sub_start_pos = ms.sites[start_idx] - min_separation;
+                    int sub_end_pos = ms.sites[end_idx - 1] + min_separation;
+                    int span = ms.sites[end_idx - 1] - ms.sites[start_idx];
+
+                    // skip if too close to the start of the read alignment or
+                    // if the reference range is too large to efficiently call
+                    if(sub_start_pos <= min_separation || span > 200) {
+                        continue;
+                    }
+
+                    std::string subseq = ref_seq.substr(sub_start_pos, sub_end_pos - sub_start_pos + 1);
+                    std::string rc_subseq = mtest_alphabet->reverse_complement(subseq);
+
+                    int calling_start = sub_start_pos + ref_start_pos;
+                    int calling_end = sub_end_pos + ref_start_pos;
+
+                    // using the reference-to-event map, look up the event indices for this segment
+                    int e1,e2;
+                    bool bounded = AlignmentDB::_find_by_ref_bounds(event_align_record.aligned_events, 
+                                                                    calling_start,
+                                                                    calling_end,
+                                                                    e1, 
+                                                                    e2);
+
+                    double ratio = fabs(e2 - e1) / (calling_start - calling_end); 
+                    
+                    // Only process this region if the the read is aligned within the boundaries
+                    // and the span between the start/end is not unusually short
+                    if(!bounded || abs(e2 - e1) <= 10 || ratio > MAX_EVENT_TO_BP_RATIO) {
+                        continue;
+                    }
+
+                    uint32_t hmm_flags = HAF_ALLOW_PRE_CLIP | HAF_ALLOW_POST_CLIP;
+
+                    // Set up event data
+                    HMMInputData data;
+                    data.read = &sr;
+                    data.anchor_index = -1; // unused
+                    data.strand = strand_idx;
+                    data.rc = event_align_record.rc;
+                    data.event_start_idx = e1;
+                    data.event_stop_idx = e2;
+                    data.event_stride = data.event_start_idx <= data.event_stop_idx ? 1 : -1;
+                 
+                    // Calculate the likelihood of the unmethylated sequence
+                    HMMInputSequence unmethylated(subseq, rc_subseq, mtest_alphabet);
+                    group_unmethylated_score[group_idx] = profile_hmm_score(unmethylated, data, hmm_flags);
+
+                    // Methylate all sites in the sequence and score again
+                    std::string m_subseq = mtest_alphabet->methylate(subseq);
+                    std::string rc_m_subseq = mtest_alphabet->reverse_complement(m_subseq);
+                    
+                    // Calculate the likelihood of the methylated sequence
+                    HMMInputSequence methylated(m_subseq, rc_m_subseq, mtest_alphabet);
+                    group_methylated_score[group_idx] = profile_hmm_score(methylated, data, hmm_flags);
+                    group_scored[group_idx] = 1;
+                }
+            }, "call_methylation_chunk");
+
+            std::map<int, ScoredSite>& site_score_map = site_score_maps[mi];
+            for(size_t group_idx = 0; group_idx < ms.groups.size(); ++group_idx) {
+                if(!group_scored[group_idx]) {
+                    continue;
+                }
+
+                size_t start_idx = ms.groups[group_idx].first;
+                size_t end_idx = ms.groups[group_idx].second;
+
+                // Aggregate score
+                int start_position = ms.sites[start_idx] + ref_start_pos;
+                auto iter = site_score_map.find(start_position);
+                if(iter == site_score_map.end()) {
+                    // insert new score into the map
+                    ScoredSite ss;
+                    ss.chromosome = contig;
+                    ss.start_position = start_position;
+                    ss.end_position = ms.sites[end_idx - 1] + ref_start_pos;
+                    ss.n_sites = end_idx - start_idx;
+
+                    // extract the site(s) with a k-mers worth of surrounding context
+                    size_t site_output_start = ms.sites[start_idx] - k + 1;
+                    size_t site_output_end =  ms.sites[end_idx - 1] + k;
+                    ss.sequence = ref_seq.substr(site_output_start, site_output_end - site_output_start);
+                
+                    // insert into the map    
+                    iter = site_score_map.insert(std::make_pair(start_position, ss)).first;
+                }
+                
+                // set strand-specific score
+                // upon output below the strand scores will be summed
+                iter->second.ll_unmethylated[strand_idx] = group_unmethylated_score[group_idx];
+                iter->second.ll_methylated[strand_idx] = group_methylated_score[group_idx];
+                iter->second.strands_scored += 1;
+            } // for group
+        } // for motifs
     } // for strands
     
-    #pragma omp critical(call_methylation_write)
-    {
-        // write all sites for this read
+    // format the sites of this read outside of the critical section
+    std::vector<OutputBuffer> motif_output(n_motifs);
+    for(size_t mi = 0; mi < n_motifs; ++mi) {
+        OutputBuffer& out = motif_output[mi];
+        const std::map<int, ScoredSite>& site_score_map = site_score_maps[mi];
         for(auto iter = site_score_map.begin(); iter != site_score_map.end(); ++iter) {
 
             const ScoredSite& ss = iter->second;
@@ -325,10 +418,95 @@ void calculate_methylation_for_read(const OutputHandles& handles,
             double sum_ll_u = ss.ll_unmethylated[0] + ss.ll_unmethylated[1];
             double diff = sum_ll_m - sum_ll_u;
 
-            fprintf(handles.site_writer, "%s\t%d\t%d\t", ss.chromosome.c_str(), ss.start_position, ss.end_position);
-            fprintf(handles.site_writer, "%s\t%.2lf\t", sr.read_name.c_str(), diff);
-            fprintf(handles.site_writer, "%.2lf\t%.2lf\t", sum_ll_m, sum_ll_u);
-            fprintf(handles.site_writer, "%d\t%d\t%s\n", ss.strands_scored, ss.n_cpg, ss.sequence.c_str());
+            out.append(ss.chromosome).append('\t').append_int(ss.start_position).append('\t').append_int(ss.end_position).append('\t');
+            out.append(sr.read_name).append('\t').append_fixed(diff, 2).append('\t');
+            out.append_fixed(sum_ll_m, 2).append('\t').append_fixed(sum_ll_u, 2).append('\t');
+            out.append_int(ss.strands_scored).append('\t').append_int(ss.n_sites).append('\t').append(ss.sequence);
+            if(!sample_name.empty()) {
+                out.append('\t').append(sample_name);
+            }
+            out.append('\n');
+        }
+    }
+
+    #pragma omp critical(call_methylation_write)
+    {
+        // write all sites for this read
+        for(size_t mi = 0; mi < n_motifs; ++mi) {
+            fwrite(motif_output[mi].data(), 1, motif_output[mi].size(), handles.site_writers[mi]);
+        }
+    }
+}
+
+// The count column keeps its original name for CpG so existing
+// scripts, e.g. calculate_methylation_frequency, read the output unchanged.
+// The sample column is last, and only written with --samples, for the same reason.
+void write_methylation_header(FILE* fp, const Alphabet* alphabet)
+{
+    fprintf(fp, "chromosome\tstart\tend\tread_name\t"
+                "log_lik_ratio\tlog_lik_methylated\tlog_lik_unmethylated\t"
+                "num_calling_strands\t%s\tsequence%s\n",
+                alphabet->get_name() == "cpg" ? "num_cpgs" : "num_sites",
+                opt::samples_file.empty() ? "" : "\tsample");
+}
+
+// Open the output file of a motif and write its header
+FILE* open_site_writer(const std::string& path, const Alphabet* alphabet)
+{
+    FILE* fp = fopen(path.c_str(), "w");
+    if(fp == NULL) {
+        fprintf(stderr, "[%s] error: could not write %s\n", SUBPROGRAM, path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    write_methylation_header(fp, alphabet);
+    return fp;
+}
+
+// Call the reads of every sample that are aligned to region, or all reads if
+// region is empty. Only reads whose alignment starts in [start, end) are called.
+// The samples are processed in a parallel loop so the batches of reads of
+// all samples are run on the same threads, and a sample whose last batch
+// has a few long reads does not leave the other threads idle.
+void call_samples_in_region(const OutputHandles& handles,
+                            const std::vector<Fast5Map>& name_maps,
+                            const faidx_t* fai,
+                            const std::string& region,
+                            int start = INT_MIN,
+                            int end = INT_MAX)
+{
+    parallel_for(input_samples.size(), [&](size_t si) {
+        const SampleInput& sample = input_samples[si];
+        auto f = [&](const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int region_start, int region_end) {
+            if(record->core.pos >= start && record->core.pos < end) {
+                calculate_methylation_for_read(handles, sample.name, name_maps[si], fai, hdr, record, read_idx, region_start, region_end);
+            }
+        };
+
+        BamProcessor processor(sample.bam_file, region);
+        processor.parallel_run(f);
+    }, "call_methylation_sample");
+}
+
+// Reads are assigned to the shard [start, end) their alignment starts in,
+// which is only a partition of the reads when the shards do not overlap
+void check_shards_disjoint(const std::vector<std::string>& shards)
+{
+    std::map<std::string, std::vector<std::pair<int, int> > > intervals;
+    for(size_t i = 0; i < shards.size(); ++i) {
+        std::string contig;
+        int start, end;
+        parse_region_string(shards[i], contig, start, end);
+        intervals[contig].push_back(std::make_pair(start, end));
+    }
+
+    for(auto& ci : intervals) {
+        std::sort(ci.second.begin(), ci.second.end());
+        for(size_t i = 1; i < ci.second.size(); ++i) {
+            if(ci.second[i].first < ci.second[i - 1].second) {
+                fprintf(stderr, "[%s] error: the shards overlap on %s at %d, partition with --overlap-length 0\n",
+                    SUBPROGRAM, ci.first.c_str(), ci.second[i].first);
+                exit(EXIT_FAILURE);
+            }
         }
     }
 }
@@ -346,8 +524,15 @@ void parse_call_methylation_options(int argc, char** argv)
             case 't': arg >> opt::num_threads; break;
             case 'm': arg >> opt::models_fofn; break;
             case 'w': arg >> opt::region; break;
+            case 'q': arg >> opt::methylation_motifs; break;
+            case 'o': arg >> opt::output_prefix; break;
             case 'v': opt::verbose++; break;
             case OPT_PROGRESS: opt::progress = true; break;
+            case OPT_LEASE_DIR: arg >> opt::lease_dir; break;
+            case OPT_CALIBRATIONS: arg >> opt::calibrations_file; break;
+            case OPT_SAMPLES: arg >> opt::samples_file; break;
+            case OPT_SHARDS: arg >> opt::shards_file; break;
+            case OPT_LEASE_TIME: arg >> opt::lease_seconds; break;
             case OPT_HELP:
                 std::cout << CALL_METHYLATION_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -371,7 +556,7 @@ void parse_call_methylation_options(int argc, char** argv)
         die = true;
     }
 
-    if(opt::reads_file.empty()) {
+    if(opt::samples_file.empty() && opt::reads_file.empty()) {
         std::cerr << SUBPROGRAM ": a --reads file must be provided\n";
         die = true;
     }
@@ -381,16 +566,81 @@ void parse_call_methylation_options(int argc, char** argv)
         die = true;
     }
 
-    if(opt::bam_file.empty()) {
+    if(opt::samples_file.empty() && opt::bam_file.empty()) {
         std::cerr << SUBPROGRAM ": a --bam file must be provided\n";
         die = true;
     }
 
+    input_samples.clear();
+    if(!opt::samples_file.empty()) {
+        if(!opt::reads_file.empty() || !opt::bam_file.empty()) {
+            std::cerr << SUBPROGRAM ": --reads and --bam cannot be used with --samples, each sample lists its own\n";
+            die = true;
+        }
+        input_samples = read_sample_sheet(opt::samples_file);
+    } else {
+        SampleInput sample;
+        sample.reads_file = opt::reads_file;
+        sample.bam_file = opt::bam_file;
+        input_samples.push_back(sample);
+    }
+
+    if(!opt::lease_dir.empty() && !opt::region.empty()) {
+        std::cerr << SUBPROGRAM ": a --window cannot be used with --lease-dir, the shards define the regions\n";
+        die = true;
+    }
+
+    if(opt::lease_dir.empty() && !opt::shards_file.empty()) {
+        std::cerr << SUBPROGRAM ": --shards requires --lease-dir\n";
+        die = true;
+    }
+
+    if(opt::lease_seconds <= 0) {
+        std::cerr << SUBPROGRAM ": invalid --lease-time: " << opt::lease_seconds << "\n";
+        die = true;
+    }
+
+    // resolve the motifs to alphabets, the dam and dcm models are only available through --models-fofn
+    mtest_alphabets.clear();
+    std::stringstream motif_parser(opt::methylation_motifs);
+    std::string motif;
+    while(getline(motif_parser, motif, ',')) {
+        if(motif != "cpg" && motif != "dam" && motif != "dcm") {
+            std::cerr << SUBPROGRAM ": unknown methylation motif: " << motif << "\n";
+            die = true;
+            continue;
+        }
+
+        const Alphabet* alphabet = get_alphabet_by_name(motif);
+        if(std::find(mtest_alphabets.begin(), mtest_alphabets.end(), alphabet) == mtest_alphabets.end()) {
+            mtest_alphabets.push_back(alphabet);
+        }
+    }
+
+    if(mtest_alphabets.empty()) {
+        std::cerr << SUBPROGRAM ": no motifs to call in --methylation\n";
+        die = true;
+    }
+
+    if(mtest_alphabets.size() > 1 && opt::output_prefix.empty() && opt::lease_dir.empty()) {
+        std::cerr << SUBPROGRAM ": an --output-prefix must be provided to call more than one motif\n";
+        die = true;
+    }
+
+    if(!opt::lease_dir.empty() && !opt::output_prefix.empty()) {
+        std::cerr << SUBPROGRAM ": an --output-prefix cannot be used with --lease-dir, see nanopolish merge\n";
+        die = true;
+    }
+
     if(!opt::models_fofn.empty()) {
         // initialize the model set from the fofn
         PoreModelSet::initialize(opt::models_fofn);
     }
 
+    if(!opt::calibrations_file.empty()) {
+        CalibrationStore::initialize(opt::calibrations_file);
+    }
+
     if (die)
     {
         std::cout << "\n" << CALL_METHYLATION_USAGE_MESSAGE;
@@ -401,7 +651,12 @@ void parse_call_methylation_options(int argc, char** argv)
 int call_methylation_main(int argc, char** argv)
 {
     parse_call_methylation_options(argc, argv);
-    Fast5Map name_map(opt::reads_file);
+    set_parallel_num_threads(opt::num_threads);
+
+    std::vector<Fast5Map> name_maps;
+    for(const SampleInput& sample : input_samples) {
+        name_maps.push_back(Fast5Map(sample.reads_file));
+    }
 
     // load reference fai file
     faidx_t *fai = fai_load(opt::genome_file.c_str());
@@ -416,27 +671,69 @@ int call_methylation_main(int argc, char** argv)
 
     // Initialize writers
     OutputHandles handles;
-    handles.site_writer = stdout;
-    
-    // Write header
-    fprintf(handles.site_writer, "chromosome\tstart\tend\tread_name\t"
-                                 "log_lik_ratio\tlog_lik_methylated\tlog_lik_unmethylated\t"
-                                 "num_calling_strands\tnum_cpgs\tsequence\n");
-
-    // the BamProcessor framework calls the input function with the 
-    // bam record, read index, etc passed as parameters
-    // bind the other parameters the worker function needs here
-    auto f = std::bind(calculate_methylation_for_read, std::ref(handles), name_map, fai, _1, _2, _3, _4, _5);
-    BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
-    processor.parallel_run(f);
+    handles.site_writers.assign(mtest_alphabets.size(), stdout);
+
+    // In lease mode, call shards claimed from the shared directory until all are complete
+    if(!opt::lease_dir.empty()) {
+        std::vector<std::string> shards;
+        if(!opt::shards_file.empty()) {
+            shards = read_shard_file(opt::shards_file);
+            check_shards_disjoint(shards);
+        }
+
+        LeaseQueue queue(opt::lease_dir, opt::lease_seconds);
+        queue.initialize(shards);
+
+        // each read is called by the shard that its alignment starts in, so every read is output once
+        std::string shard_contig;
+        int shard_start, shard_end;
+
+        size_t shard_idx;
+        while(queue.claim(shard_idx)) {
+            parse_region_string(queue.get_shard(shard_idx), shard_contig, shard_start, shard_end);
+
+            // a single motif keeps the plain tsv type, several are merged per motif with -t <motif>.tsv
+            std::vector<ShardOutput> outputs;
+            for(size_t mi = 0; mi < mtest_alphabets.size(); ++mi) {
+                std::string type = mtest_alphabets.size() == 1 ? "tsv" : mtest_alphabets[mi]->get_name() + ".tsv";
+                outputs.push_back({ type, queue.get_output_path(shard_idx, type) });
+                handles.site_writers[mi] = open_site_writer(outputs[mi].path, mtest_alphabets[mi]);
+            }
+
+            call_samples_in_region(handles, name_maps, fai, queue.get_shard(shard_idx), shard_start, shard_end);
+            for(size_t mi = 0; mi < mtest_alphabets.size(); ++mi) {
+                fclose(handles.site_writers[mi]);
+            }
+
+            CalibrationStore::write();
+            queue.complete(shard_idx, outputs);
+        }
+
+        fai_destroy(fai);
+        return EXIT_SUCCESS;
+    }
+
+    for(size_t mi = 0; mi < mtest_alphabets.size(); ++mi) {
+        if(opt::output_prefix.empty()) {
+            write_methylation_header(handles.site_writers[mi], mtest_alphabets[mi]);
+        } else {
+            std::string path = opt::output_prefix + "." + mtest_alphabets[mi]->get_name() + ".tsv";
+            handles.site_writers[mi] = open_site_writer(path, mtest_alphabets[mi]);
+        }
+    }
+
+    call_samples_in_region(handles, name_maps, fai, opt::region);
 
     // cleanup
-    if(handles.site_writer != stdout) {
-        fclose(handles.site_writer);
+    for(size_t mi = 0; mi < mtest_alphabets.size(); ++mi) {
+        if(handles.site_writers[mi] != stdout) {
+            fclose(handles.site_writers[mi]);
+        }
     }
 
     fai_destroy(fai);
 
+    CalibrationStore::write();
     return EXIT_SUCCESS;
 }
 
@@ -19,10 +19,12 @@
 #include <sstream>
 #include <fstream>
 #include <set>
+#include <memory>
 #include <omp.h>
 #include <getopt.h>
 #include <iterator>
 #include "htslib/faidx.h"
+#include "nanopolish_call_variants.h"
 #include "nanopolish_poremodel.h"
 #include "nanopolish_transition_parameters.h"
 #include "nanopolish_matrix.h"
@@ -34,8 +36,13 @@
 #include "nanopolish_variant.h"
 #include "nanopolish_haplotype.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_calibration_store.h"
 #include "nanopolish_duration_model.h"
 #include "nanopolish_variant_db.h"
+#include "nanopolish_candidate_store.h"
+#include "nanopolish_parallel.h"
+#include "nanopolish_lease_queue.h"
+#include "nanopolish_sample_sheet.h"
 #include "profiler.h"
 #include "progress.h"
 #include "stdaln.h"
@@ -57,6 +64,16 @@
 // Hack hack hack
 float g_p_skip, g_p_skip_self, g_p_bad, g_p_bad_self;
 
+// Consensus rounds only change the draft near the variants that changed in the
+// previous round. Screening a variant and calling a group of variants only depend
+// on the variants themselves (they are scored against the unmodified reference)
+// so the results are cached across rounds, keyed by the variant(s).
+typedef std::map<std::string, Variant> ScreenedVariantCache;
+typedef std::map<std::string, std::vector<Variant> > CalledGroupCache;
+
+// The samples to call together, set by --samples
+std::vector<SampleInput> input_samples;
+
 //
 // Getopt
 //
@@ -83,18 +100,30 @@ static const char *CONSENSUS_USAGE_MESSAGE =
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the reference genome are in bam FILE\n"
 "  -e, --event-bam=FILE                 the events aligned to the reference genome are in bam FILE\n"
+"      --samples=FILE                   call the samples in FILE together and write a multi-sample VCF, instead of -r/-b/-e.\n"
+"                                       FILE has one tab-separated line per sample: name, reads, bam and optionally an event bam\n"
 "  -g, --genome=FILE                    the reference genome is in FILE\n"
 "  -o, --outfile=FILE                   write result to FILE [default: stdout]\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
+"      --numa                           pin threads across NUMA nodes and report per-node throughput\n"
+"      --lease-dir=DIR                  run as one of many workers sharing the shards in DIR, see nanopolish merge\n"
+"      --shards=FILE                    with --lease-dir, the regions to call, one per line (e.g. from nanopolish partition --regions-only)\n"
+"      --lease-time=SECONDS             reclaim a shard when its worker has not sent a heartbeat for SECONDS (default: 600)\n"
 "  -m, --min-candidate-frequency=F      extract candidate variants from the aligned reads when the variant frequency is at least F (default 0.2)\n"
 "  -d, --min-candidate-depth=D          extract candidate variants from the aligned reads when the depth is at least D (default: 20)\n"
 "  -x, --max-haplotypes=N               consider at most N haplotype combinations (default: 1000)\n"
 "      --max-rounds=N                   perform N rounds of consensus sequence improvement (default: 50)\n"
+"      --candidate-residual=F           in consensus mode, only propose edits where the event/basecall residual is at least F\n"
+"                                       (default: 0, propose edits at every base)\n"
+"      --candidate-neighbourhood=N      also propose edits within N bases of a high-residual position (default: 3)\n"
 "  -c, --candidates=VCF                 read variant candidates from VCF, rather than discovering them from aligned reads\n"
 "  -a, --alternative-basecalls-bam=FILE if an alternative basecaller was used that does not output event annotations\n"
 "                                       then use basecalled sequences from FILE. The signal-level events will still be taken from the -b bam.\n"
+"                                       A read is dropped when its -b record in the region is missing or has mapping quality below 20,\n"
+"                                       as are its records in FILE with mapping quality below 20.\n"
 "      --calculate-all-support          when making a call, also calculate the support of the 3 other possible bases\n"
 "      --models-fofn=FILE               read alternative k-mer models from FILE\n"
+"      --calibrations=FILE              reuse the read calibrations stored in FILE and add new ones to it\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -107,8 +136,13 @@ namespace opt
     static std::string output_file;
     static std::string candidates_file;
     static std::string models_fofn;
+    static std::string calibrations_file;
+    static std::string samples_file;
     static std::string window;
     static std::string consensus_output;
+    static std::string lease_dir;
+    static std::string shards_file;
+    static double lease_seconds = 600;
     static std::string alternative_model_type = DEFAULT_MODEL_TYPE;
     static std::string alternative_basecalls_bam;
     static double min_candidate_frequency = 0.2f;
@@ -117,6 +151,7 @@ namespace opt
     static int snps_only = 0;
     static int show_progress = 0;
     static int num_threads = 1;
+    static int numa = 0;
     static int calibrate = 0;
     static int consensus_mode = 0;
     static int fix_homopolymers = 0;
@@ -127,6 +162,8 @@ namespace opt
     static int max_haplotypes = 1000;
     static int max_rounds = 50;
     static int screen_score_threshold = 100;
+    static double candidate_residual_threshold = 0.0;
+    static int candidate_neighbourhood = 3;
     static int debug_alignments = 0;
 }
 
@@ -142,13 +179,21 @@ enum { OPT_HELP = 1,
        OPT_FIX_HOMOPOLYMERS,
        OPT_GENOTYPE,
        OPT_MODELS_FOFN,
+       OPT_CALIBRATIONS,
        OPT_MAX_ROUNDS,
+       OPT_CANDIDATE_RESIDUAL,
+       OPT_CANDIDATE_NEIGHBOURHOOD,
        OPT_EFFORT,
        OPT_FASTER,
        OPT_P_SKIP,
        OPT_P_SKIP_SELF,
        OPT_P_BAD,
-       OPT_P_BAD_SELF };
+       OPT_P_BAD_SELF,
+       OPT_NUMA,
+       OPT_LEASE_DIR,
+       OPT_SHARDS,
+       OPT_LEASE_TIME,
+       OPT_SAMPLES };
 
 static const struct option longopts[] = {
     { "verbose",                   no_argument,       NULL, 'v' },
@@ -167,8 +212,11 @@ static const struct option longopts[] = {
     { "alternative-basecalls-bam", required_argument, NULL, 'a' },
     { "effort",                    required_argument, NULL, OPT_EFFORT },
     { "max-rounds",                required_argument, NULL, OPT_MAX_ROUNDS },
+    { "candidate-residual",        required_argument, NULL, OPT_CANDIDATE_RESIDUAL },
+    { "candidate-neighbourhood",   required_argument, NULL, OPT_CANDIDATE_NEIGHBOURHOOD },
     { "genotype",                  required_argument, NULL, OPT_GENOTYPE },
     { "models-fofn",               required_argument, NULL, OPT_MODELS_FOFN },
+    { "calibrations",              required_argument, NULL, OPT_CALIBRATIONS },
     { "p-skip",                    required_argument, NULL, OPT_P_SKIP },
     { "p-skip-self",               required_argument, NULL, OPT_P_SKIP_SELF },
     { "p-bad",                     required_argument, NULL, OPT_P_BAD },
@@ -179,6 +227,11 @@ static const struct option longopts[] = {
     { "calculate-all-support",     no_argument,       NULL, OPT_CALC_ALL_SUPPORT },
     { "snps",                      no_argument,       NULL, OPT_SNPS_ONLY },
     { "progress",                  no_argument,       NULL, OPT_PROGRESS },
+    { "numa",                      no_argument,       NULL, OPT_NUMA },
+    { "lease-dir",                 required_argument, NULL, OPT_LEASE_DIR },
+    { "shards",                    required_argument, NULL, OPT_SHARDS },
+    { "lease-time",                required_argument, NULL, OPT_LEASE_TIME },
+    { "samples",                   required_argument, NULL, OPT_SAMPLES },
     { "help",                      no_argument,       NULL, OPT_HELP },
     { "version",                   no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
@@ -207,16 +260,38 @@ int get_contig_length(const std::string& contig)
     return len;
 }
 
+// For each called SNP, calculate the fraction of reads that best support each of the
+// four possible bases at the site. The other calls are applied to the haplotype
+// and reads are only scored over a window of min_flanking_sequence around the site,
+// so every (variant, read) pair is independent and they are scored in parallel.
 void annotate_with_all_support(std::vector<Variant>& variants,
-                               Haplotype base_haplotype,
-                               const std::vector<HMMInputData>& input,
+                               const AlignmentDB& alignments,
                                const uint32_t alignment_flags)
 
 {
+    std::string contig = alignments.get_region_contig();
+
+    // Build the four test sequences and collect the events for each variant
+    std::vector<std::vector<std::string>> test_sequences(variants.size());
+    std::vector<std::vector<HMMInputData>> test_input(variants.size());
+    std::vector<std::pair<size_t, size_t>> tasks;
+
     for(size_t vi = 0; vi < variants.size(); vi++) {
+        const Variant& v = variants[vi];
+        if(v.ref_seq.size() != 1 || v.alt_seq.size() != 1) {
+            continue;
+        }
+
+        int calling_start = v.ref_position - opt::min_flanking_sequence;
+        int calling_end = v.ref_position + 1 + opt::min_flanking_sequence;
+        if(!alignments.are_coordinates_valid(contig, calling_start, calling_end)) {
+            continue;
+        }
 
         // Generate a haplotype containing every variant in the set except for vi
-        Haplotype test_haplotype = base_haplotype;
+        Haplotype test_haplotype(contig,
+                                 calling_start,
+                                 alignments.get_reference_substring(contig, calling_start, calling_end));
         for(size_t vj = 0; vj < variants.size(); vj++) {
 
             // do not apply the variant we are testing
@@ -226,62 +301,238 @@ void annotate_with_all_support(std::vector<Variant>& variants,
             test_haplotype.apply_variant(variants[vj]);
         }
 
-        // Make a vector of four haplotypes, one per base
-        std::vector<Haplotype> curr_haplotypes;
-        Variant tmp_variant = variants[vi];
+        // Make four haplotypes, one per base
+        Variant tmp_variant = v;
         for(size_t bi = 0; bi < 4; ++bi) {
             tmp_variant.alt_seq = "ACGT"[bi];
             Haplotype tmp = test_haplotype;
             tmp.apply_variant(tmp_variant);
-            curr_haplotypes.push_back(tmp);
+            test_sequences[vi].push_back(tmp.get_sequence());
+        }
+
+        test_input[vi] = alignments.get_event_subsequences(contig, calling_start, calling_end);
+        for(size_t input_idx = 0; input_idx < test_input[vi].size(); ++input_idx) {
+            tasks.push_back(std::make_pair(vi, input_idx));
         }
+    }
 
-        // Test all reads against the 4 haplotypes
-        std::vector<int> support_count(4, 0);
+    // Test all reads against the 4 haplotypes
+    std::vector<std::vector<int>> support_count(variants.size(), std::vector<int>(4, 0));
 
-        for(size_t input_idx = 0; input_idx < input.size(); ++input_idx) {
-            double best_score = -INFINITY;
-            size_t best_hap_idx = 0;
+    parallel_for(tasks.size(), [&](size_t ti) {
+        size_t vi = tasks[ti].first;
+        const HMMInputData& data = test_input[vi][tasks[ti].second];
 
-            // calculate which haplotype this read supports best
-            for(size_t hap_idx = 0; hap_idx < curr_haplotypes.size(); ++hap_idx) {
-                double score = profile_hmm_score(curr_haplotypes[hap_idx].get_sequence(), input[input_idx], alignment_flags);
-                if(score > best_score) {
-                    best_score = score;
-                    best_hap_idx = hap_idx;
-                }
+        double best_score = -INFINITY;
+        size_t best_hap_idx = 0;
+
+        // calculate which haplotype this read supports best
+        for(size_t hap_idx = 0; hap_idx < test_sequences[vi].size(); ++hap_idx) {
+            double score = profile_hmm_score(test_sequences[vi][hap_idx], data, alignment_flags);
+            if(score > best_score) {
+                best_score = score;
+                best_hap_idx = hap_idx;
             }
-            support_count[best_hap_idx] += 1;
+        }
+
+        #pragma omp atomic
+        support_count[vi][best_hap_idx] += 1;
+    }, "annotate_with_all_support");
+
+    for(size_t vi = 0; vi < variants.size(); vi++) {
+        if(test_input[vi].empty()) {
+            continue;
         }
 
         std::stringstream ss;
         for(size_t bi = 0; bi < 4; ++bi) {
-            ss << support_count[bi] / (double)input.size() << (bi != 3 ? "," : "");
+            ss << support_count[vi][bi] / (double)test_input[vi].size() << (bi != 3 ? "," : "");
         }
 
         variants[vi].add_info("AllSupportFractions", ss.str());
     }
 }
 
-// Given the input region, calculate all single base edits to the current assembly
-std::vector<Variant> generate_candidate_single_base_edits(const AlignmentDB& alignments,
-                                                          int region_start,
-                                                          int region_end,
-                                                          uint32_t alignment_flags)
+// Event-align the reads to a draft sequence and calculate, for each k-mer of the
+// draft, how poorly the draft explains the data there. The residual of a k-mer is
+// the excess of the mean squared event z-score over its expectation of 1, plus
+// the rate at which the k-mer was skipped and the excess of events over the
+// expected number of stays. K-mers that no read spans have a residual of 0.
+std::vector<double> calculate_kmer_residuals(const std::string& draft,
+                                             const std::vector<HMMInputData>& event_sequences,
+                                             uint32_t alignment_flags)
 {
-    std::vector<Variant> out_variants;
+    HMMInputSequence draft_sequence(draft);
+
+    size_t n_draft_kmers = draft.size();
+    std::vector<double> sum_z2(n_draft_kmers, 0.0f);
+    std::vector<int> num_match(n_draft_kmers, 0);
+    std::vector<int> num_events(n_draft_kmers, 0);
+    std::vector<int> num_skip(n_draft_kmers, 0);
+    std::vector<int> coverage(n_draft_kmers, 0);
+    std::vector<double> expected_events(n_draft_kmers, 0.0f);
+
+    for(size_t ri = 0; ri < event_sequences.size(); ++ri) {
+        const HMMInputData& data = event_sequences[ri];
+        if(abs((int)data.event_start_idx - (int)data.event_stop_idx) < 2) {
+            continue;
+        }
+
+        uint32_t k = data.read->pore_model[data.strand].k;
+        if(draft.size() < k) {
+            continue;
+        }
+
+        std::vector<HMMAlignmentState> alignment = profile_hmm_align(draft_sequence, data, alignment_flags);
+        if(alignment.empty()) {
+            continue;
+        }
+
+        for(size_t ai = 0; ai < alignment.size(); ++ai) {
+            const HMMAlignmentState& as = alignment[ai];
+            if(as.state == 'M') {
+                uint32_t rank = draft_sequence.get_kmer_rank(as.kmer_idx, k, data.rc);
+                float z = z_score(*data.read, rank, as.event_idx, data.strand);
+                sum_z2[as.kmer_idx] += z * z;
+                num_match[as.kmer_idx] += 1;
+                num_events[as.kmer_idx] += 1;
+            } else if(as.state == 'B') {
+                num_events[as.kmer_idx] += 1;
+            } else if(as.state == 'K') {
+                num_skip[as.kmer_idx] += 1;
+            }
+        }
+
+        // the read only provides evidence for the k-mers it spans
+        uint32_t first_kmer = alignment.front().kmer_idx;
+        uint32_t last_kmer = alignment.back().kmer_idx;
+        for(uint32_t ki = first_kmer; ki <= last_kmer; ++ki) {
+            coverage[ki] += 1;
+            expected_events[ki] += data.read->events_per_base[data.strand];
+        }
+    }
+
+    std::vector<double> kmer_residual(n_draft_kmers, 0.0f);
+    for(size_t ki = 0; ki < n_draft_kmers; ++ki) {
+        if(coverage[ki] == 0) {
+            continue;
+        }
+
+        double z2_excess = num_match[ki] > 0 ? std::max(sum_z2[ki] / num_match[ki] - 1.0, 0.0) : 0.0f;
+        double skip_rate = (double)num_skip[ki] / coverage[ki];
+        double stay_excess = std::max((num_events[ki] - expected_events[ki]) / expected_events[ki], 0.0);
+        kmer_residual[ki] = z2_excess + skip_rate + stay_excess;
+    }
+    return kmer_residual;
+}
+
+// Event-align every read to the current draft once and calculate, for each
+// base in [region_start, region_end), how poorly the draft explains the data there.
+// The residual of a base is the largest residual of the k-mers that contain it
+// plus the fraction of basecalled reads that disagree with the draft at that base.
+std::vector<double> calculate_draft_residuals(const AlignmentDB& alignments,
+                                              int region_start,
+                                              int region_end,
+                                              uint32_t alignment_flags)
+{
+    const int BLOCK_SIZE = 200;
+    const int BLOCK_FLANK = 10;
 
     std::string contig = alignments.get_region_contig();
+    size_t n = region_end - region_start;
+    std::vector<double> kmer_residual(n, 0.0f);
+
+    int num_blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // each block only writes the k-mers that start within it, so no synchronization is needed
+    parallel_for(num_blocks, [&](size_t bi) {
+        int block_start = region_start + bi * BLOCK_SIZE;
+        int block_end = std::min(block_start + BLOCK_SIZE, region_end);
 
-    // Add all positively-scoring single-base changes into the candidate set
-    for(size_t i = region_start; i < region_end; ++i) {
+        // align to a slightly larger window so the k-mers at the block boundary are well-placed
+        int align_start = std::max(block_start - BLOCK_FLANK, alignments.get_region_start());
+        int align_end = std::min(block_end + BLOCK_FLANK, alignments.get_region_end());
+        if(!alignments.are_coordinates_valid(contig, align_start, align_end)) {
+            return;
+        }
+
+        std::string draft = alignments.get_reference_substring(contig, align_start, align_end);
+        std::vector<HMMInputData> event_sequences =
+            alignments.get_event_subsequences(contig, align_start, align_end);
+        std::vector<double> window_residual = calculate_kmer_residuals(draft, event_sequences, alignment_flags);
+
+        for(int p = block_start; p < block_end; ++p) {
+            kmer_residual[p - region_start] = window_residual[p - align_start];
+        }
+    }, "calculate_draft_residuals");
+
+    // Project the k-mer residuals onto the bases they contain and add the basecall disagreement
+    std::vector<double> base_disagreement = alignments.get_base_disagreement(contig, region_start, region_end - 1);
+    const EventAlignmentRecord* any_record = alignments.get_eventalignment_records().empty() ?
+        NULL : &alignments.get_eventalignment_records().front();
+    int k = any_record != NULL ? any_record->sr->pore_model[any_record->strand].k : 1;
+
+    std::vector<double> residuals(n, 0.0f);
+    for(size_t i = 0; i < n; ++i) {
+        double max_kmer_residual = 0.0f;
+        for(int j = std::max((int)i - k + 1, 0); j <= (int)i; ++j) {
+            max_kmer_residual = std::max(max_kmer_residual, kmer_residual[j]);
+        }
+        residuals[i] = max_kmer_residual + base_disagreement[i];
+    }
+    return residuals;
+}
+
+// Mark the positions where edits should be proposed: those within neighbourhood
+// bases of a residual of at least threshold, or every position if threshold is 0
+std::vector<bool> select_edit_positions(const std::vector<double>& residuals,
+                                        double threshold,
+                                        int neighbourhood)
+{
+    std::vector<bool> propose(residuals.size(), threshold <= 0);
+    if(threshold <= 0) {
+        return propose;
+    }
+
+    for(int i = 0; i < (int)residuals.size(); ++i) {
+        if(residuals[i] < threshold) {
+            continue;
+        }
+
+        int start = std::max(i - neighbourhood, 0);
+        int end = std::min(i + neighbourhood, (int)propose.size() - 1);
+        for(int j = start; j <= end; ++j) {
+            propose[j] = true;
+        }
+    }
+    return propose;
+}
+
+// Calculate the single base edits to reference, which starts at reference_start,
+// at the positions of [region_start, region_end) that are marked in propose
+std::vector<Variant> generate_single_base_edits(const std::string& contig,
+                                                const std::string& reference,
+                                                int reference_start,
+                                                int region_start,
+                                                int region_end,
+                                                const std::vector<bool>& propose)
+{
+    assert(propose.size() == (size_t)(region_end - region_start));
+    assert(region_start > reference_start && region_end <= reference_start + (int)reference.size());
+
+    std::vector<Variant> out_variants;
+    for(int i = region_start; i < region_end; ++i) {
+
+        if(!propose[i - region_start]) {
+            continue;
+        }
 
         for(size_t j = 0; j < 4; ++j) {
             // Substitutions
             Variant v;
             v.ref_name = contig;
             v.ref_position = i;
-            v.ref_seq = alignments.get_reference_substring(contig, i, i);
+            v.ref_seq = reference.substr(i - reference_start, 1);
             v.alt_seq = "ACGT"[j];
 
             if(v.ref_seq != v.alt_seq) {
@@ -300,7 +551,7 @@ std::vector<Variant> generate_candidate_single_base_edits(const AlignmentDB& ali
         Variant del;
         del.ref_name = contig;
         del.ref_position = i - 1;
-        del.ref_seq = alignments.get_reference_substring(contig, i - 1, i);
+        del.ref_seq = reference.substr(i - 1 - reference_start, 2);
         del.alt_seq = del.ref_seq[0];
 
         // ignore deletions of the type "AA" -> "A" as these are redundant
@@ -311,10 +562,40 @@ std::vector<Variant> generate_candidate_single_base_edits(const AlignmentDB& ali
     return out_variants;
 }
 
+// Given the input region, calculate all single base edits to the current assembly
+std::vector<Variant> generate_candidate_single_base_edits(const AlignmentDB& alignments,
+                                                          int region_start,
+                                                          int region_end,
+                                                          uint32_t alignment_flags)
+{
+    // Only propose edits around positions where the draft does not explain the data well
+    std::vector<double> residuals(region_end - region_start, 0.0f);
+    if(opt::candidate_residual_threshold > 0) {
+        residuals = calculate_draft_residuals(alignments, region_start, region_end, alignment_flags);
+    }
+
+    std::vector<bool> propose = select_edit_positions(residuals,
+                                                      opt::candidate_residual_threshold,
+                                                      opt::candidate_neighbourhood);
+
+    if(opt::verbose > 1 && opt::candidate_residual_threshold > 0) {
+        size_t num_proposed = std::count(propose.begin(), propose.end(), true);
+        fprintf(stderr, "[candidates] proposing edits at %zu of %zu bases\n", num_proposed, propose.size());
+    }
+
+    return generate_single_base_edits(alignments.get_region_contig(),
+                                      alignments.get_reference(),
+                                      alignments.get_region_start(),
+                                      region_start,
+                                      region_end,
+                                      propose);
+}
+
 // Given the input set of variants, calculate the variants that have a positive score
 std::vector<Variant> screen_variants_by_score(const AlignmentDB& alignments,
                                               const std::vector<Variant>& candidate_variants,
-                                              uint32_t alignment_flags)
+                                              uint32_t alignment_flags,
+                                              ScreenedVariantCache* cache = NULL)
 {
     if(opt::verbose > 3) {
         fprintf(stderr, "==== Starting variant screening =====\n");
@@ -325,6 +606,17 @@ std::vector<Variant> screen_variants_by_score(const AlignmentDB& alignments,
     for(size_t vi = 0; vi < candidate_variants.size(); ++vi) {
         const Variant& v = candidate_variants[vi];
 
+        // re-use the score from a previous round
+        if(cache != NULL) {
+            auto iter = cache->find(v.key());
+            if(iter != cache->end()) {
+                if(iter->second.quality > 0) {
+                    out_variants.push_back(iter->second);
+                }
+                continue;
+            }
+        }
+
         int calling_start = v.ref_position - opt::min_flanking_sequence;
         int calling_end = v.ref_position + v.ref_seq.size() + opt::min_flanking_sequence;
 
@@ -345,6 +637,10 @@ std::vector<Variant> screen_variants_by_score(const AlignmentDB& alignments,
             out_variants.push_back(scored_variant);
         }
 
+        if(cache != NULL) {
+            cache->insert(std::make_pair(v.key(), scored_variant));
+        }
+
         if( (scored_variant.quality > 0 && opt::verbose > 3) || opt::verbose > 5) {
             scored_variant.write_vcf(stderr);
         }
@@ -723,11 +1019,20 @@ Haplotype fix_homopolymers(const Haplotype& input_haplotype,
 Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
                                          const std::vector<Variant>& candidate_variants,
                                          uint32_t alignment_flags,
-                                         FILE* vcf_out)
+                                         FILE* vcf_out,
+                                         CalledGroupCache* cache = NULL,
+                                         std::vector<Variant>* calls_out = NULL,
+                                         bool genotype_all_candidates = false)
 {
     Haplotype derived_haplotype(alignments.get_region_contig(), alignments.get_region_start(), alignments.get_reference());
     VariantDB variant_db;
 
+    // For each group, in order, either the index of the group in the variant DB
+    // or -1 and the calls made for an identical group in a previous round
+    std::vector<int> group_ids;
+    std::vector<std::string> group_keys;
+    std::vector<std::vector<Variant> > cached_calls;
+
     size_t curr_variant_idx = 0;
     while(curr_variant_idx < candidate_variants.size()) {
 
@@ -753,7 +1058,16 @@ Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
         }
 
         // Only try to call if the window is not too large
-        if(calling_size <= 200) {
+        std::string group_key;
+        for(size_t vi = curr_variant_idx; cache != NULL && vi < end_variant_idx; ++vi) {
+            group_key += candidate_variants[vi].key() + ";";
+        }
+
+        if(calling_size <= 200 && cache != NULL && cache->find(group_key) != cache->end()) {
+            group_ids.push_back(-1);
+            group_keys.push_back(group_key);
+            cached_calls.push_back(cache->find(group_key)->second);
+        } else if(calling_size <= 200) {
 
             // Subset the haplotype to the region we are calling
             Haplotype calling_haplotype =
@@ -766,6 +1080,9 @@ Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
             // Initialize a new group of variants
             size_t group_id = variant_db.add_new_group(std::vector<Variant>(candidate_variants.begin() + curr_variant_idx,
                                                                             candidate_variants.begin() + end_variant_idx));
+            group_ids.push_back(group_id);
+            group_keys.push_back(group_key);
+            cached_calls.push_back(std::vector<Variant>());
 
             // score the variants using the nanopolish model
             score_variant_group(variant_db.get_group(group_id),
@@ -801,14 +1118,33 @@ Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
         neighbors.push_back(&variant_db.get_group(1));
         std::vector<Variant> called_variants = multi_call(variant_db.get_group(2), neighbors, opt::ploidy, opt::genotype_only);
     } else {
-        for(size_t gi = 0; gi < variant_db.get_num_groups(); ++gi) {
+        for(size_t gi = 0; gi < group_ids.size(); ++gi) {
+
+            std::vector<Variant> called_variants;
+            if(group_ids[gi] == -1) {
+                called_variants = cached_calls[gi];
+            } else {
+                called_variants = simple_call(variant_db.get_group(group_ids[gi]), opt::ploidy,
+                                              opt::genotype_only || genotype_all_candidates);
+                if(opt::calculate_all_support) {
+                    annotate_with_all_support(called_variants, alignments, alignment_flags);
+                }
 
-            std::vector<Variant> called_variants = simple_call(variant_db.get_group(gi), opt::ploidy, opt::genotype_only);
+                if(cache != NULL) {
+                    cache->insert(std::make_pair(group_keys[gi], called_variants));
+                }
+            }
 
             // Apply them to the final haplotype
             for(size_t vi = 0; vi < called_variants.size(); vi++) {
                 derived_haplotype.apply_variant(called_variants[vi]);
-                called_variants[vi].write_vcf(vcf_out);
+                if(vcf_out != NULL) {
+                    called_variants[vi].write_vcf(vcf_out);
+                }
+            }
+
+            if(calls_out != NULL) {
+                calls_out->insert(calls_out->end(), called_variants.begin(), called_variants.end());
             }
         }
     }
@@ -847,27 +1183,24 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
 */
 
     // Step 1. Discover putative variants across the whole region
-    std::vector<Variant> candidate_variants;
+    // Equivalent indels are normalized to the same candidate so they are only scored once
+    CandidateStore candidates(contig, alignments.get_region_start(), alignments.get_reference(), region_start);
     if(opt::candidates_file.empty()) {
-        candidate_variants = alignments.get_variants_in_region(contig, region_start, region_end, opt::min_candidate_frequency, opt::min_candidate_depth);
+        candidates.add(alignments.get_variants_in_region(contig, region_start, region_end, opt::min_candidate_frequency, opt::min_candidate_depth), CS_READS);
     } else {
-        candidate_variants = read_variants_for_region(opt::candidates_file, contig, region_start, region_end);
+        candidates.add(read_variants_for_region(opt::candidates_file, contig, region_start, region_end), CS_INPUT);
     }
 
     if(opt::consensus_mode) {
 
         // generate single-base edits that have a positive haplotype score
-        std::vector<Variant> single_base_edits = generate_candidate_single_base_edits(alignments, region_start, region_end, alignment_flags);
-
-        // insert these into the candidate set
-        candidate_variants.insert(candidate_variants.end(), single_base_edits.begin(), single_base_edits.end());
+        candidates.add(generate_candidate_single_base_edits(alignments, region_start, region_end, alignment_flags), CS_EDITS);
+    }
 
-        // deduplicate variants
-        std::set<Variant, VariantKeyComp> dedup_set(candidate_variants.begin(), candidate_variants.end());
-        candidate_variants.clear();
-        candidate_variants.insert(candidate_variants.end(), dedup_set.begin(), dedup_set.end());
-        std::sort(candidate_variants.begin(), candidate_variants.end(), sortByPosition);
+    if(opt::verbose > 1) {
+        candidates.print_stats(stderr);
     }
+    std::vector<Variant> candidate_variants = candidates.get_variants();
 
     // Step 2. Call variants
 
@@ -878,6 +1211,10 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
                                alignments.get_region_start(),
                                alignments.get_reference());
 
+    ScreenedVariantCache screened_cache;
+    CalledGroupCache called_cache;
+    std::set<std::string> previous_called_keys;
+
     // Calling strategy in consensus mode
     while(opt::consensus_mode && round++ < opt::max_rounds) {
         assert(opt::consensus_mode);
@@ -888,22 +1225,47 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
         // Filter the variant set down by only including those that individually contribute a positive score
         std::vector<Variant> filtered_variants = screen_variants_by_score(alignments,
                                                                           candidate_variants,
-                                                                          alignment_flags);
+                                                                          alignment_flags,
+                                                                          &screened_cache);
 
         // Combine variants into sets that maximize their haplotype score
         called_haplotype = call_haplotype_from_candidates(alignments,
                                                           filtered_variants,
                                                           alignment_flags,
-                                                          out_fp);
+                                                          out_fp,
+                                                          &called_cache);
+
+        // The windows around variants that were added or removed this round are dirty.
+        // If there are none the next round would make exactly the same calls.
+        std::vector<Variant> called_variants = called_haplotype.get_variants();
+        std::set<std::string> called_keys;
+        for(size_t vi = 0; vi < called_variants.size(); ++vi) {
+            called_keys.insert(called_variants[vi].key());
+        }
+
+        std::vector<std::string> dirty_keys;
+        std::set_symmetric_difference(called_keys.begin(), called_keys.end(),
+                                      previous_called_keys.begin(), previous_called_keys.end(),
+                                      std::back_inserter(dirty_keys));
+
+        if(opt::verbose > 3) {
+            fprintf(stderr, "Round %zu changed %zu variants\n", round, dirty_keys.size());
+        }
+
+        if(round > 1 && dirty_keys.empty()) {
+            break;
+        }
+        previous_called_keys.swap(called_keys);
 
         if(opt::consensus_mode) {
             // Expand the called variant set by adding nearby variants
-            std::vector<Variant> called_variants = called_haplotype.get_variants();
-            candidate_variants = expand_variants(alignments,
-                                                 called_variants,
-                                                 region_start,
-                                                 region_end,
-                                                 alignment_flags);
+            CandidateStore expanded(contig, alignments.get_region_start(), alignments.get_reference(), region_start);
+            expanded.add(expand_variants(alignments,
+                                         called_variants,
+                                         region_start,
+                                         region_end,
+                                         alignment_flags), CS_EXPANDED);
+            candidate_variants = expanded.get_variants();
         }
     }
 
@@ -931,6 +1293,68 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
     return called_haplotype;
 }
 
+// Call the region in every sample of --samples against a shared candidate set,
+// the union of the candidates found in each sample, so that every sample is
+// genotyped at every site, including those where it has the reference allele.
+// The samples are loaded and called in parallel loops, whose inner loops are
+// run on the same threads.
+void call_samples_for_region(const std::string& contig, int region_start, int region_end, FILE* out_fp)
+{
+    const int BUFFER = opt::min_flanking_sequence + 10;
+    uint32_t alignment_flags = HAF_ALLOW_PRE_CLIP | HAF_ALLOW_POST_CLIP;
+
+    if(region_start < BUFFER)
+        region_start = BUFFER;
+
+    const size_t n_samples = input_samples.size();
+    std::vector<std::unique_ptr<AlignmentDB> > sample_alignments(n_samples);
+    std::vector<std::vector<Variant> > sample_candidates(n_samples);
+    parallel_for(n_samples, [&](size_t si) {
+        const SampleInput& sample = input_samples[si];
+        sample_alignments[si].reset(new AlignmentDB(sample.reads_file, opt::genome_file, sample.bam_file,
+                                                    sample.event_bam_file, opt::calibrate));
+        sample_alignments[si]->load_region(contig, region_start - BUFFER, region_end + BUFFER);
+
+        if(opt::candidates_file.empty()) {
+            int sample_region_end = sample_alignments[si]->get_region_end() - BUFFER;
+            sample_candidates[si] = sample_alignments[si]->get_variants_in_region(contig, region_start, sample_region_end,
+                                                                                  opt::min_candidate_frequency, opt::min_candidate_depth);
+        }
+    }, "call_variants_load_sample");
+
+    // the reference is the same for all samples so the region is clipped to the same end
+    region_end = sample_alignments[0]->get_region_end() - BUFFER;
+
+    const AlignmentDB& reference_db = *sample_alignments[0];
+    CandidateStore candidates(contig, reference_db.get_region_start(), reference_db.get_reference(), region_start);
+    if(opt::candidates_file.empty()) {
+        for(size_t si = 0; si < n_samples; ++si) {
+            candidates.add(sample_candidates[si], CS_READS);
+        }
+    } else {
+        candidates.add(read_variants_for_region(opt::candidates_file, contig, region_start, region_end), CS_INPUT);
+    }
+    std::vector<Variant> candidate_variants = candidates.get_variants();
+
+    if(opt::verbose > 0) {
+        fprintf(stderr, "[%s] %zu candidates in %s:%d-%d over %zu samples\n", SUBPROGRAM,
+            candidate_variants.size(), contig.c_str(), region_start, region_end, n_samples);
+    }
+
+    std::vector<std::vector<Variant> > sample_calls(n_samples);
+    parallel_for(n_samples, [&](size_t si) {
+        call_haplotype_from_candidates(*sample_alignments[si],
+                                       candidate_variants,
+                                       alignment_flags,
+                                       NULL,
+                                       NULL,
+                                       &sample_calls[si],
+                                       true);
+    }, "call_variants_call_sample");
+
+    write_multi_sample_vcf(out_fp, sample_calls, opt::genotype_only);
+}
+
 void parse_call_variants_options(int argc, char** argv)
 {
     bool die = false;
@@ -957,11 +1381,19 @@ void parse_call_variants_options(int argc, char** argv)
             case OPT_EFFORT: arg >> opt::screen_score_threshold; break;
             case OPT_FASTER: opt::screen_score_threshold = 25; break;
             case OPT_MAX_ROUNDS: arg >> opt::max_rounds; break;
+            case OPT_CANDIDATE_RESIDUAL: arg >> opt::candidate_residual_threshold; break;
+            case OPT_CANDIDATE_NEIGHBOURHOOD: arg >> opt::candidate_neighbourhood; break;
             case OPT_GENOTYPE: opt::genotype_only = 1; arg >> opt::candidates_file; break;
             case OPT_MODELS_FOFN: arg >> opt::models_fofn; break;
+            case OPT_CALIBRATIONS: arg >> opt::calibrations_file; break;
             case OPT_CALC_ALL_SUPPORT: opt::calculate_all_support = 1; break;
             case OPT_SNPS_ONLY: opt::snps_only = 1; break;
             case OPT_PROGRESS: opt::show_progress = 1; break;
+            case OPT_NUMA: opt::numa = 1; break;
+            case OPT_LEASE_DIR: arg >> opt::lease_dir; break;
+            case OPT_SHARDS: arg >> opt::shards_file; break;
+            case OPT_LEASE_TIME: arg >> opt::lease_seconds; break;
+            case OPT_SAMPLES: arg >> opt::samples_file; break;
             case OPT_P_SKIP: arg >> g_p_skip; break;
             case OPT_P_SKIP_SELF: arg >> g_p_skip_self; break;
             case OPT_P_BAD: arg >> g_p_bad; break;
@@ -988,7 +1420,7 @@ void parse_call_variants_options(int argc, char** argv)
         die = true;
     }
 
-    if(opt::reads_file.empty()) {
+    if(opt::samples_file.empty() && opt::reads_file.empty()) {
         std::cerr << SUBPROGRAM ": a --reads file must be provided\n";
         die = true;
     }
@@ -998,6 +1430,19 @@ void parse_call_variants_options(int argc, char** argv)
         die = true;
     }
 
+    if(!opt::samples_file.empty()) {
+        if(!opt::reads_file.empty() || !opt::bam_file.empty() || !opt::event_bam_file.empty()) {
+            std::cerr << SUBPROGRAM ": --reads, --bam and --event-bam cannot be used with --samples, each sample lists its own\n";
+            die = true;
+        }
+
+        if(opt::consensus_mode || opt::fix_homopolymers || !opt::alternative_basecalls_bam.empty() || opt::calculate_all_support) {
+            std::cerr << SUBPROGRAM ": --consensus, --fix-homopolymers, --alternative-basecalls-bam and --calculate-all-support cannot be used with --samples\n";
+            die = true;
+        }
+        input_samples = read_sample_sheet(opt::samples_file);
+    }
+
     if(!opt::consensus_mode && opt::ploidy == 0) {
         std::cerr << SUBPROGRAM ": --ploidy parameter must be provided\n";
         die = true;
@@ -1005,16 +1450,40 @@ void parse_call_variants_options(int argc, char** argv)
         opt::ploidy = 1;
     }
 
-    if(opt::bam_file.empty()) {
+    if(opt::samples_file.empty() && opt::bam_file.empty()) {
         std::cerr << SUBPROGRAM ": a --bam file must be provided\n";
         die = true;
     }
 
+    if(opt::candidate_neighbourhood < 0) {
+        std::cerr << SUBPROGRAM ": invalid --candidate-neighbourhood: " << opt::candidate_neighbourhood << "\n";
+        die = true;
+    }
+
+    if(!opt::lease_dir.empty() && (!opt::window.empty() || !opt::output_file.empty())) {
+        std::cerr << SUBPROGRAM ": --window and --outfile cannot be used with --lease-dir, the shards define the regions and outputs\n";
+        die = true;
+    }
+
+    if(opt::lease_dir.empty() && !opt::shards_file.empty()) {
+        std::cerr << SUBPROGRAM ": --shards requires --lease-dir\n";
+        die = true;
+    }
+
+    if(opt::lease_seconds <= 0) {
+        std::cerr << SUBPROGRAM ": invalid --lease-time: " << opt::lease_seconds << "\n";
+        die = true;
+    }
+
     if(!opt::models_fofn.empty()) {
         // initialize the model set from the fofn
         PoreModelSet::initialize(opt::models_fofn);
     }
 
+    if(!opt::calibrations_file.empty()) {
+        CalibrationStore::initialize(opt::calibrations_file);
+    }
+
     if (die)
     {
         std::cout << "\n" << CONSENSUS_USAGE_MESSAGE;
@@ -1025,12 +1494,130 @@ void parse_call_variants_options(int argc, char** argv)
 int call_variants_main(int argc, char** argv)
 {
     parse_call_variants_options(argc, argv);
-    omp_set_num_threads(opt::num_threads);
+    set_parallel_num_threads(opt::num_threads);
+    set_parallel_numa_binding(opt::numa);
+
+    // Build the VCF header
+    std::vector<std::string> tag_fields;
+
+    if(input_samples.empty()) {
+        //
+        tag_fields.push_back(
+            Variant::make_vcf_tag_string("INFO", "TotalReads", 1, "Integer",
+                                          "The number of event-space reads used to call the variant"));
+
+        tag_fields.push_back(
+            Variant::make_vcf_tag_string("INFO", "SupportFraction", 1, "Float",
+                                          "The fraction of event-space reads that support the variant"));
+
+        tag_fields.push_back(
+            Variant::make_vcf_tag_string("INFO", "BaseCalledReadsWithVariant", 1, "Integer",
+                                          "The number of base-space reads that support the variant"));
+
+        tag_fields.push_back(
+            Variant::make_vcf_tag_string("INFO", "BaseCalledFraction", 1, "Float",
+                                          "The fraction of base-space reads that support the variant"));
+
+        tag_fields.push_back(
+                Variant::make_vcf_tag_string("INFO", "AlleleCount", 1, "Integer",
+                    "The inferred number of copies of the allele"));
+        if(opt::calculate_all_support) {
+            tag_fields.push_back(
+                    Variant::make_vcf_tag_string("INFO", "AllSupportFractions", 4, "Float",
+                        "The fraction of event-space reads that best support each of A,C,G,T at the site"));
+        }
+
+        tag_fields.push_back(
+                Variant::make_vcf_tag_string("FORMAT", "GT", 1, "String",
+                    "Genotype"));
+    } else {
+        // the site's values are over all samples and the per-sample values are FORMAT fields
+        tag_fields.push_back(
+            Variant::make_vcf_tag_string("INFO", "TotalReads", 1, "Integer",
+                                          "The number of event-space reads used to call the variant, summed over the samples"));
+
+        tag_fields.push_back(
+            Variant::make_vcf_tag_string("INFO", "SupportFraction", 1, "Float",
+                                          "The fraction of event-space reads that support the variant, over all samples"));
+
+        tag_fields.push_back(
+                Variant::make_vcf_tag_string("INFO", "AlleleCount", 1, "Integer",
+                    "The inferred number of copies of the allele, summed over the samples"));
+
+        tag_fields.push_back(
+                Variant::make_vcf_tag_string("FORMAT", "GT", 1, "String",
+                    "Genotype"));
+
+        tag_fields.push_back(
+                Variant::make_vcf_tag_string("FORMAT", "DP", 1, "Integer",
+                    "The number of event-space reads used to call the sample"));
+
+        tag_fields.push_back(
+                Variant::make_vcf_tag_string("FORMAT", "SF", 1, "Float",
+                    "The fraction of the sample's event-space reads that support the variant"));
+
+        tag_fields.push_back(
+                Variant::make_vcf_tag_string("FORMAT", "SQ", 1, "Float",
+                    "The quality of the sample's call, QUAL is the highest over the samples"));
+    }
+
+    std::vector<std::string> sample_names(1, "sample");
+    if(!input_samples.empty()) {
+        sample_names.clear();
+        for(const SampleInput& sample : input_samples) {
+            sample_names.push_back(sample.name);
+        }
+    }
 
     std::string contig;
     int start_base;
     int end_base;
 
+    // In lease mode, call shards claimed from the shared directory until all are complete
+    if(!opt::lease_dir.empty()) {
+        std::vector<std::string> shards;
+        if(!opt::shards_file.empty()) {
+            shards = read_shard_file(opt::shards_file);
+        }
+
+        LeaseQueue queue(opt::lease_dir, opt::lease_seconds);
+        queue.initialize(shards);
+
+        size_t shard_idx;
+        while(queue.claim(shard_idx)) {
+            fprintf(stderr, "[%s] %s calling shard %zu (%s)\n", SUBPROGRAM, queue.get_worker_id().c_str(),
+                shard_idx, queue.get_shard(shard_idx).c_str());
+
+            parse_region_string(queue.get_shard(shard_idx), contig, start_base, end_base);
+            end_base = std::min(end_base, get_contig_length(contig) - 1);
+
+            std::vector<ShardOutput> outputs;
+            outputs.push_back({ "vcf", queue.get_output_path(shard_idx, "vcf") });
+            if(opt::consensus_mode) {
+                opt::consensus_output = queue.get_output_path(shard_idx, "fa");
+                outputs.push_back({ "fa", opt::consensus_output });
+            }
+
+            FILE* shard_fp = fopen(outputs[0].path.c_str(), "w");
+            if(shard_fp == NULL) {
+                fprintf(stderr, "[%s] error: could not write %s\n", SUBPROGRAM, outputs[0].path.c_str());
+                exit(EXIT_FAILURE);
+            }
+            Variant::write_vcf_header(shard_fp, tag_fields, sample_names);
+            if(input_samples.empty()) {
+                call_variants_for_region(contig, start_base, end_base, shard_fp);
+            } else {
+                call_samples_for_region(contig, start_base, end_base, shard_fp);
+            }
+            fclose(shard_fp);
+            CalibrationStore::write();
+
+            queue.complete(shard_idx, outputs);
+        }
+        print_parallel_numa_summary(stderr);
+        return 0;
+    }
+
     // If a window has been specified, only call variants/polish in that range
     if(!opt::window.empty()) {
         // Parse the window string
@@ -1050,36 +1637,15 @@ int call_variants_main(int argc, char** argv)
         out_fp = stdout;
     }
 
-    // Build the VCF header
-    std::vector<std::string> tag_fields;
-
-    //
-    tag_fields.push_back(
-        Variant::make_vcf_tag_string("INFO", "TotalReads", 1, "Integer",
-                                      "The number of event-space reads used to call the variant"));
-
-    tag_fields.push_back(
-        Variant::make_vcf_tag_string("INFO", "SupportFraction", 1, "Float",
-                                      "The fraction of event-space reads that support the variant"));
+    Variant::write_vcf_header(out_fp, tag_fields, sample_names);
 
-    tag_fields.push_back(
-        Variant::make_vcf_tag_string("INFO", "BaseCalledReadsWithVariant", 1, "Integer",
-                                      "The number of base-space reads that support the variant"));
-
-    tag_fields.push_back(
-        Variant::make_vcf_tag_string("INFO", "BaseCalledFraction", 1, "Float",
-                                      "The fraction of base-space reads that support the variant"));
-
-    tag_fields.push_back(
-            Variant::make_vcf_tag_string("INFO", "AlleleCount", 1, "Integer",
-                "The inferred number of copies of the allele"));
-    tag_fields.push_back(
-            Variant::make_vcf_tag_string("FORMAT", "GT", 1, "String",
-                "Genotype"));
-
-    Variant::write_vcf_header(out_fp, tag_fields);
-
-    Haplotype haplotype = call_variants_for_region(contig, start_base, end_base, out_fp);
+    if(input_samples.empty()) {
+        call_variants_for_region(contig, start_base, end_base, out_fp);
+    } else {
+        call_samples_for_region(contig, start_base, end_base, out_fp);
+    }
+    print_parallel_numa_summary(stderr);
+    CalibrationStore::write();
 
     if(out_fp != stdout) {
         fclose(out_fp);
@@ -8,6 +8,31 @@
 #ifndef NANOPOLISH_CALL_VARIANTS_H
 #define NANOPOLISH_CALL_VARIANTS_H
 
+#include <string>
+#include <vector>
+#include "nanopolish_variant.h"
+#include "nanopolish_profile_hmm.h"
+
 int call_variants_main(int argc, char** argv);
 
+// Calculate how poorly draft explains the events aligned to each of its k-mers
+std::vector<double> calculate_kmer_residuals(const std::string& draft,
+                                             const std::vector<HMMInputData>& event_sequences,
+                                             uint32_t alignment_flags);
+
+// Mark the positions within neighbourhood bases of a residual of at least threshold,
+// or every position if threshold is 0
+std::vector<bool> select_edit_positions(const std::vector<double>& residuals,
+                                        double threshold,
+                                        int neighbourhood);
+
+// Calculate the single base edits to reference at the positions of [region_start, region_end)
+// that are marked in propose
+std::vector<Variant> generate_single_base_edits(const std::string& contig,
+                                                const std::string& reference,
+                                                int reference_start,
+                                                int region_start,
+                                                int region_end,
+                                                const std::vector<bool>& propose);
+
 #endif
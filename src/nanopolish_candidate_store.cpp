@@ -0,0 +1,155 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_candidate_store -- a set of candidate
+// variants in a region, with equivalent representations
+// of the same edit merged into one candidate
+//
+#include <stdio.h>
+#include <algorithm>
+#include "nanopolish_candidate_store.h"
+
+void left_normalize_variant(Variant& v, const std::string& reference, int reference_start)
+{
+    // empty alleles and variants that do not change the sequence have no normal form
+    if(v.ref_seq.empty() || v.alt_seq.empty() || v.ref_seq == v.alt_seq) {
+        return;
+    }
+
+    int offset = (int)v.ref_position - reference_start;
+    if(offset < 0 || offset + v.ref_seq.size() > reference.size() ||
+       reference.compare(offset, v.ref_seq.size(), v.ref_seq) != 0) {
+        return;
+    }
+
+    std::string ref_seq = v.ref_seq;
+    std::string alt_seq = v.alt_seq;
+
+    // Remove the shared last base and, when that empties one of the alleles,
+    // prepend the preceding reference base to both. This moves an indel in
+    // a repeat one copy of the repeat to the left each time.
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        if(!ref_seq.empty() && !alt_seq.empty() && ref_seq.back() == alt_seq.back()) {
+            ref_seq.pop_back();
+            alt_seq.pop_back();
+            changed = true;
+        }
+
+        if(ref_seq.empty() || alt_seq.empty()) {
+            if(offset == 0) {
+                // the indel can not be moved past the start of the reference
+                // so restore the base it was anchored to
+                ref_seq.append(1, reference[offset + ref_seq.size()]);
+                alt_seq.append(1, reference[offset + ref_seq.size() - 1]);
+                break;
+            }
+            offset -= 1;
+            ref_seq.insert(0, 1, reference[offset]);
+            alt_seq.insert(0, 1, reference[offset]);
+            changed = true;
+        }
+    }
+
+    // Remove the shared first bases, keeping one base on each allele
+    while(ref_seq.size() > 1 && alt_seq.size() > 1 && ref_seq[0] == alt_seq[0]) {
+        ref_seq.erase(0, 1);
+        alt_seq.erase(0, 1);
+        offset += 1;
+    }
+
+    v.ref_position = offset + reference_start;
+    v.ref_seq = ref_seq;
+    v.alt_seq = alt_seq;
+}
+
+CandidateStore::CandidateStore(const std::string& contig,
+                               int reference_start,
+                               const std::string& reference,
+                               int region_start) : m_contig(contig),
+                                                   m_reference_start(reference_start),
+                                                   m_reference(reference),
+                                                   m_region_start(region_start),
+                                                   m_num_added(0),
+                                                   m_num_outside(0)
+{
+
+}
+
+size_t CandidateStore::add(const Variant& in_variant, uint32_t source)
+{
+    assert(in_variant.ref_name == m_contig);
+    Variant v = in_variant;
+    left_normalize_variant(v, m_reference, m_reference_start);
+    m_num_added += 1;
+
+    // An indel in a repeat that crosses the start of the region can be moved into the
+    // flanking sequence, where it can't be scored with enough sequence around it.
+    // The previous region finds it from its own reads, but the input candidates are
+    // split between regions by their given position so those keep that position.
+    if((int)v.ref_position < m_region_start) {
+        if((source & CS_INPUT) && (int)in_variant.ref_position >= m_region_start) {
+            v = in_variant;
+        } else {
+            m_num_outside += 1;
+            return INVALID_CANDIDATE_ID;
+        }
+    }
+
+    Key key = { (uint32_t)v.ref_position, (uint32_t)v.ref_seq.size(), v.alt_seq };
+    auto iter = m_ids.find(key);
+    if(iter != m_ids.end()) {
+        m_sources[iter->second] |= source;
+        return iter->second;
+    }
+
+    size_t id = m_variants.size();
+    m_ids.insert(std::make_pair(key, id));
+    m_variants.push_back(v);
+    m_sources.push_back(source);
+    return id;
+}
+
+void CandidateStore::add(const std::vector<Variant>& variants, uint32_t source)
+{
+    for(size_t vi = 0; vi < variants.size(); ++vi) {
+        add(variants[vi], source);
+    }
+}
+
+std::vector<Variant> CandidateStore::get_variants() const
+{
+    // sort by position, then by the key so the order does not depend on the order the candidates were added in
+    std::vector<Variant> out = m_variants;
+    std::sort(out.begin(), out.end(), [](const Variant& a, const Variant& b) {
+        if(a.ref_position != b.ref_position) {
+            return a.ref_position < b.ref_position;
+        }
+        return a.ref_seq.size() != b.ref_seq.size() ? a.ref_seq.size() < b.ref_seq.size() : a.alt_seq < b.alt_seq;
+    });
+    return out;
+}
+
+void CandidateStore::print_stats(FILE* fp) const
+{
+    const uint32_t sources[] = { CS_READS, CS_INPUT, CS_EDITS, CS_EXPANDED };
+    const char* names[] = { "reads", "input", "edits", "expanded" };
+    size_t counts[4] = { 0, 0, 0, 0 };
+    size_t num_shared = 0;
+    for(size_t i = 0; i < m_sources.size(); ++i) {
+        for(size_t si = 0; si < 4; ++si) {
+            counts[si] += (m_sources[i] & sources[si]) != 0;
+        }
+        num_shared += (m_sources[i] & (m_sources[i] - 1)) != 0;
+    }
+
+    fprintf(fp, "[candidates] %s: %zu variants added, %zu before the region, %zu distinct (",
+        m_contig.c_str(), m_num_added, m_num_outside, m_variants.size());
+    for(size_t si = 0; si < 4; ++si) {
+        fprintf(fp, "%s: %zu, ", names[si], counts[si]);
+    }
+    fprintf(fp, "from more than one source: %zu)\n", num_shared);
+}
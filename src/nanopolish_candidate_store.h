@@ -0,0 +1,114 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_candidate_store -- a set of candidate
+// variants in a region, with equivalent representations
+// of the same edit merged into one candidate
+//
+#ifndef NANOPOLISH_CANDIDATE_STORE_H
+#define NANOPOLISH_CANDIDATE_STORE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "nanopolish_variant.h"
+
+// Where a candidate was proposed, as bit flags as a candidate
+// can be proposed by more than one source
+enum CandidateSource
+{
+    CS_READS = 1,       // differences between the basecalled reads and the reference
+    CS_INPUT = 2,       // read from the --candidates vcf
+    CS_EDITS = 4,       // single-base edits proposed in consensus mode
+    CS_EXPANDED = 8     // indels extended by a base in consensus mode
+};
+
+// Shift an indel to its leftmost equivalent position on the reference and
+// trim the bases shared by ref_seq and alt_seq, keeping one anchor base
+// before an insertion or deletion as in vcf. reference is the sequence of
+// the contig starting at reference_start. Variants that are not within the
+// reference or whose ref_seq does not match it are not changed.
+void left_normalize_variant(Variant& v, const std::string& reference, int reference_start);
+
+// The id returned for a candidate that was not added to the store
+const size_t INVALID_CANDIDATE_ID = -1;
+
+// The candidates of a region, normalized against the reference of the
+// region so that every distinct edit is only scored once. The reference
+// must outlive the store. The reference usually extends past the start of
+// the region being called, and candidates that normalize to a position
+// before region_start are dropped as they belong to the previous region,
+// except for input candidates which are then kept as given.
+class CandidateStore
+{
+    public:
+        CandidateStore(const std::string& contig,
+                       int reference_start,
+                       const std::string& reference,
+                       int region_start);
+
+        // add a candidate, which is left-normalized first. Returns the
+        // id of the candidate, which is shared by all equivalent variants,
+        // or INVALID_CANDIDATE_ID if it was dropped
+        size_t add(const Variant& v, uint32_t source);
+        void add(const std::vector<Variant>& variants, uint32_t source);
+
+        // the candidates in position order
+        std::vector<Variant> get_variants() const;
+
+        // the sources of a candidate, a combination of CandidateSource flags
+        uint32_t get_sources(size_t id) const { return m_sources[id]; }
+        const Variant& get_variant(size_t id) const { return m_variants[id]; }
+
+        // the number of distinct candidates, of variants added and of those dropped
+        size_t size() const { return m_variants.size(); }
+        size_t get_num_added() const { return m_num_added; }
+        size_t get_num_outside() const { return m_num_outside; }
+
+        // write the number of candidates from each source to fp
+        void print_stats(FILE* fp) const;
+
+    private:
+
+        // the normalized variants are identified by their position, the length of
+        // ref_seq, which is determined by the reference, and alt_seq
+        struct Key
+        {
+            uint32_t position;
+            uint32_t ref_length;
+            std::string alt_seq;
+
+            bool operator==(const Key& other) const
+            {
+                return position == other.position &&
+                       ref_length == other.ref_length &&
+                       alt_seq == other.alt_seq;
+            }
+        };
+
+        struct KeyHash
+        {
+            size_t operator()(const Key& key) const
+            {
+                size_t h = std::hash<std::string>()(key.alt_seq);
+                h ^= ((size_t)key.position << 20) ^ key.ref_length;
+                return h * 0x9E3779B97F4A7C15ULL;
+            }
+        };
+
+        std::string m_contig;
+        int m_reference_start;
+        const std::string& m_reference;
+        int m_region_start;
+
+        std::unordered_map<Key, size_t, KeyHash> m_ids;
+        std::vector<Variant> m_variants;
+        std::vector<uint32_t> m_sources;
+        size_t m_num_added;
+        size_t m_num_outside;
+};
+
+#endif
@@ -28,6 +28,7 @@
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_hmm_input_sequence.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_parallel.h"
 #include "profiler.h"
 #include "progress.h"
 #include "stdaln.h"
@@ -250,12 +251,11 @@ void score_paths(PathConsVector& paths, const std::vector<HMMInputData>& input)
         std::vector<IndexedPathScore> result(paths.size());
 
         // Score all paths
-        #pragma omp parallel for
-        for(size_t pi = 0; pi < paths.size(); ++pi) {
+        parallel_for(paths.size(), [&](size_t pi) {
             double curr = score_sequence(paths[pi].path, input[ri]);
             result[pi].score = curr;
             result[pi].path_index = pi;
-        }
+        }, "consensus_score_paths");
 
         // Save score of first path
         double first_path_score = result[0].score;
@@ -855,7 +855,7 @@ void parse_consensus_options(int argc, char** argv)
 int consensus_main(int argc, char** argv)
 {
     parse_consensus_options(argc, argv);
-    omp_set_num_threads(opt::num_threads);
+    set_parallel_num_threads(opt::num_threads);
 
     Fast5Map name_map(opt::reads_file);
     
@@ -38,25 +38,36 @@ SUBPROGRAM " Version " PACKAGE_VERSION "\n"
 
 static const char *GETMODEL_USAGE_MESSAGE =
 "Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] read.fast5\n"
-"Write the pore models for the given read to stdout\n"
+"       " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] --convert -o out.model in.model\n"
+"Write the pore models for the given read to stdout, or convert a\n"
+"model file between the text and binary formats\n"
 "\n"
 "  -v, --verbose                        display verbose output\n"
 "      --version                        display version\n"
 "      --help                           display this help and exit\n"
+"  -c, --convert                        the input is a model file (text or binary) to convert\n"
+"  -o, --output=FILE                    write the converted model to FILE\n"
+"      --binary                         write the converted model in the binary format (default: text)\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
 {
     static unsigned int verbose;
     static std::string input_file;
+    static std::string output_file;
+    static int convert = 0;
+    static int binary = 0;
 }
 
-static const char* shortopts = "v";
+static const char* shortopts = "vco:";
 
-enum { OPT_HELP = 1, OPT_VERSION };
+enum { OPT_HELP = 1, OPT_VERSION, OPT_BINARY };
 
 static const struct option longopts[] = {
     { "verbose",     no_argument,       NULL, 'v' },
+    { "convert",     no_argument,       NULL, 'c' },
+    { "output",      required_argument, NULL, 'o' },
+    { "binary",      no_argument,       NULL, OPT_BINARY },
     { "help",        no_argument,       NULL, OPT_HELP },
     { "version",     no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
@@ -70,6 +81,9 @@ void parse_getmodel_options(int argc, char** argv)
         switch (c) {
             case '?': die = true; break;
             case 'v': opt::verbose++; break;
+            case 'c': opt::convert = 1; break;
+            case 'o': arg >> opt::output_file; break;
+            case OPT_BINARY: opt::binary = 1; break;
             case OPT_HELP:
                 std::cout << GETMODEL_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -89,19 +103,39 @@ void parse_getmodel_options(int argc, char** argv)
         die = true;
     }
 
-    opt::input_file = argv[optind++];
+    if (opt::convert && opt::output_file.empty()) {
+        std::cerr << SUBPROGRAM ": an output file (-o) must be given with --convert\n";
+        die = true;
+    }
+
+    if (!opt::convert && (!opt::output_file.empty() || opt::binary)) {
+        std::cerr << SUBPROGRAM ": -o and --binary can only be used with --convert\n";
+        die = true;
+    }
 
     if (die) 
     {
         std::cout << "\n" << GETMODEL_USAGE_MESSAGE;
         exit(EXIT_FAILURE);
     }
+
+    opt::input_file = argv[optind++];
 }
 
 int getmodel_main(int argc, char** argv)
 {
     parse_getmodel_options(argc, argv);
 
+    if(opt::convert) {
+        PoreModel pm(opt::input_file);
+        if(opt::binary) {
+            pm.write_binary(opt::output_file);
+        } else {
+            pm.write(opt::output_file);
+        }
+        return 0;
+    }
+
     fast5::File f(opt::input_file);
 
     printf("strand\tkmer\tmodel_mean\tmodel_stdv\n");
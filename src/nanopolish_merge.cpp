@@ -0,0 +1,233 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_merge.h - check that every shard of a
+// lease directory is complete and join their outputs
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <getopt.h>
+#include "nanopolish_common.h"
+#include "nanopolish_lease_queue.h"
+
+//
+// Getopt
+//
+#define SUBPROGRAM "merge"
+
+static const char *MERGE_VERSION_MESSAGE =
+SUBPROGRAM " Version " PACKAGE_VERSION "\n"
+"Written by Jared Simpson.\n"
+"\n"
+"Copyright 2017 Ontario Institute for Cancer Research\n";
+
+static const char *MERGE_USAGE_MESSAGE =
+"Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] lease_dir\n"
+"Join the outputs of the shards in lease_dir, written by variants or call-methylation\n"
+"workers run with --lease-dir. Fails, listing the missing shards, unless every shard is complete.\n"
+"\n"
+"  -v, --verbose                        display verbose output\n"
+"      --version                        display version\n"
+"      --help                           display this help and exit\n"
+"  -t, --type=STR                       join the outputs of type STR, e.g. vcf, tsv or fa (default: the first type in the manifests)\n"
+"  -o, --outfile=FILE                   write the joined output to FILE [default: stdout]\n"
+"      --status                         only report the state of each shard\n"
+"      --list                           only write the output files in shard order, one per line\n"
+"      --lease-time=SECONDS             report leases without a heartbeat for SECONDS as expired (default: 600)\n"
+"\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
+
+namespace opt
+{
+    static unsigned int verbose;
+    static std::string lease_dir;
+    static std::string type;
+    static std::string output_file;
+    static int status_only = 0;
+    static int list_only = 0;
+    static double lease_seconds = 600;
+}
+
+static const char* shortopts = "t:o:v";
+
+enum { OPT_HELP = 1, OPT_VERSION, OPT_STATUS, OPT_LIST, OPT_LEASE_TIME };
+
+static const struct option longopts[] = {
+    { "verbose",     no_argument,       NULL, 'v' },
+    { "type",        required_argument, NULL, 't' },
+    { "outfile",     required_argument, NULL, 'o' },
+    { "status",      no_argument,       NULL, OPT_STATUS },
+    { "list",        no_argument,       NULL, OPT_LIST },
+    { "lease-time",  required_argument, NULL, OPT_LEASE_TIME },
+    { "help",        no_argument,       NULL, OPT_HELP },
+    { "version",     no_argument,       NULL, OPT_VERSION },
+    { NULL, 0, NULL, 0 }
+};
+
+void parse_merge_options(int argc, char** argv)
+{
+    bool die = false;
+    for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case 't': arg >> opt::type; break;
+            case 'o': arg >> opt::output_file; break;
+            case '?': die = true; break;
+            case 'v': opt::verbose++; break;
+            case OPT_STATUS: opt::status_only = 1; break;
+            case OPT_LIST: opt::list_only = 1; break;
+            case OPT_LEASE_TIME: arg >> opt::lease_seconds; break;
+            case OPT_HELP:
+                std::cout << MERGE_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+            case OPT_VERSION:
+                std::cout << MERGE_VERSION_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (argc - optind < 1) {
+        std::cerr << SUBPROGRAM ": not enough arguments\n";
+        die = true;
+    } else if (argc - optind > 1) {
+        std::cerr << SUBPROGRAM ": too many arguments\n";
+        die = true;
+    } else {
+        opt::lease_dir = argv[optind++];
+    }
+
+    if(opt::lease_seconds <= 0) {
+        std::cerr << SUBPROGRAM ": invalid --lease-time: " << opt::lease_seconds << "\n";
+        die = true;
+    }
+
+    if (die)
+    {
+        std::cout << "\n" << MERGE_USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+    }
+}
+
+static const char* get_state_string(ShardState state)
+{
+    switch(state) {
+        case SS_PENDING: return "pending";
+        case SS_LEASED: return "leased";
+        case SS_EXPIRED: return "expired";
+        case SS_COMPLETE: return "complete";
+    }
+    return "unknown";
+}
+
+// Copy the lines of a shard output to out_fp. The header of the first
+// output (its leading lines that start with '#', or its first line if
+// there are none, like the column names of a tsv) is written once.
+static void append_output(FILE* out_fp, const std::string& filename, std::vector<std::string>& header)
+{
+    std::ifstream in_file(filename.c_str());
+    if(!in_file.good()) {
+        fprintf(stderr, "[%s] error: could not read %s\n", SUBPROGRAM, filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    bool first_output = header.empty();
+    bool in_header = true;
+    size_t line_idx = 0;
+    std::string line;
+    while(getline(in_file, line)) {
+        if(in_header) {
+            bool is_header = line[0] == '#' || (line_idx == 0 && (first_output || line == header[0]));
+            if(is_header) {
+                if(first_output) {
+                    header.push_back(line);
+                    fprintf(out_fp, "%s\n", line.c_str());
+                }
+                line_idx += 1;
+                continue;
+            }
+            in_header = false;
+        }
+        fprintf(out_fp, "%s\n", line.c_str());
+    }
+}
+
+int merge_main(int argc, char** argv)
+{
+    parse_merge_options(argc, argv);
+
+    LeaseQueue queue(opt::lease_dir, opt::lease_seconds);
+    queue.load();
+
+    // Check every shard has finished
+    size_t num_complete = 0;
+    for(size_t i = 0; i < queue.get_num_shards(); ++i) {
+        ShardStatus status = queue.get_status(i);
+        num_complete += status.state == SS_COMPLETE;
+
+        if(opt::status_only || (status.state != SS_COMPLETE && !opt::list_only) || opt::verbose > 0) {
+            fprintf(stderr, "[%s] shard %zu %s %s", SUBPROGRAM, i, queue.get_shard(i).c_str(), get_state_string(status.state));
+            if(status.state == SS_LEASED || status.state == SS_EXPIRED) {
+                fprintf(stderr, " by %s, last heartbeat %.0lfs ago", status.holder.c_str(), status.heartbeat_age);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    fprintf(stderr, "[%s] %zu of %zu shards complete\n", SUBPROGRAM, num_complete, queue.get_num_shards());
+    if(num_complete != queue.get_num_shards()) {
+        return EXIT_FAILURE;
+    }
+
+    if(opt::status_only) {
+        return EXIT_SUCCESS;
+    }
+
+    FILE* out_fp;
+    if(!opt::output_file.empty()) {
+        out_fp = fopen(opt::output_file.c_str(), "w");
+    } else {
+        out_fp = stdout;
+    }
+
+    // Join the outputs in the order of the shard list
+    std::vector<std::string> header;
+    for(size_t i = 0; i < queue.get_num_shards(); ++i) {
+        std::vector<ShardOutput> outputs;
+        queue.read_manifest(i, outputs);
+
+        if(opt::type.empty() && !outputs.empty()) {
+            opt::type = outputs.front().type;
+        }
+
+        bool found = false;
+        for(size_t oi = 0; oi < outputs.size(); ++oi) {
+            if(outputs[oi].type != opt::type) {
+                continue;
+            }
+
+            found = true;
+            if(opt::list_only) {
+                fprintf(out_fp, "%s\n", outputs[oi].path.c_str());
+            } else {
+                append_output(out_fp, outputs[oi].path, header);
+            }
+        }
+
+        if(!found) {
+            fprintf(stderr, "[%s] error: shard %zu (%s) has no output of type %s\n", SUBPROGRAM, i, queue.get_shard(i).c_str(), opt::type.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(out_fp != stdout) {
+        fclose(out_fp);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,14 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_merge.h - check that every shard of a
+// lease directory is complete and join their outputs
+//
+#ifndef NANOPOLISH_MERGE_H
+#define NANOPOLISH_MERGE_H
+
+int merge_main(int argc, char** argv);
+
+#endif
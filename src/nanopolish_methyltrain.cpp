@@ -35,14 +35,16 @@
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_model_names.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_calibration_store.h"
+#include "nanopolish_bam_processor.h"
 #include "training_core.hpp"
+#include "nanopolish_parallel.h"
 #include "H5pubconf.h"
 #include "profiler.h"
 #include "progress.h"
 #include "logger.hpp"
 
 #include "nanopolish_scorereads.h"
-#include "../eigen/Eigen/Dense"
 
 extern float g_p_skip, g_p_skip_self, g_p_bad, g_p_bad_self;
 
@@ -99,7 +101,13 @@ static const char *METHYLTRAIN_USAGE_MESSAGE =
 "  -m, --models-fofn=FILE               read the models to be trained from the FOFN\n"
 "      --train-kmers=STR                train methylated, unmethylated or all kmers\n"
 "  -c  --calibrate                      recalibrate aligned reads to model before training\n"
+"      --calibrate-loss=STR             weight the calibration residuals by ls (least squares), huber or t (default: ls);\n"
+"                                       with huber or t, reads whose calibration is unstable are realigned once\n"
+"      --min-posterior=P                only train on events whose alignment has a posterior probability of at least P\n"
+"                                       (R9 models only, events of R7 reads are not filtered)\n"
 "      --no-update-models               do not write out trained models\n"
+"      --binary-models                  write the trained models in the binary format\n"
+"      --calibrations=FILE              reuse the read calibrations stored in FILE and add new ones to it\n"
 "      --output-scores                  optionally output read scores during training\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
@@ -122,6 +130,7 @@ namespace opt
     static std::string bam_file;
     static std::string genome_file;
     static std::string models_fofn;
+    static std::string calibrations_file;
     static std::string region;
     static std::string out_suffix = ".trained";
     static std::string out_fofn = "trained.fofn";
@@ -130,6 +139,7 @@ namespace opt
 
     static TrainingTarget training_target = TT_METHYLATED_KMERS;
     static bool write_models = true;
+    static bool binary_models = false;
     static bool output_scores = false;
     static unsigned progress = 0;
     static unsigned num_threads = 1;
@@ -141,6 +151,9 @@ namespace opt
     static unsigned min_distance_from_alignment_end = 5;
     static unsigned min_number_of_events_to_train = 100;
     static unsigned num_training_rounds = 5;
+    static float min_posterior = 0.0f;
+
+    static CalibrationLoss calibration_loss = CL_LEAST_SQUARES;
 }
 
 static const char* shortopts = "r:b:g:t:m:vnc";
@@ -160,12 +173,17 @@ enum { OPT_HELP = 1,
        OPT_P_SKIP_SELF,
        OPT_P_BAD,
        OPT_P_BAD_SELF,
-       OPT_MAX_READS
+       OPT_MAX_READS,
+       OPT_CALIBRATE_LOSS,
+       OPT_MIN_POSTERIOR,
+       OPT_BINARY_MODELS,
+       OPT_CALIBRATIONS
      };
 
 static const struct option longopts[] = {
     { "verbose",            no_argument,       NULL, 'v' },
     { "calibrate",          no_argument,       NULL, 'c' },
+    { "calibrate-loss",     required_argument, NULL, OPT_CALIBRATE_LOSS },
     { "reads",              required_argument, NULL, 'r' },
     { "bam",                required_argument, NULL, 'b' },
     { "genome",             required_argument, NULL, 'g' },
@@ -181,6 +199,8 @@ static const struct option longopts[] = {
     { "p-bad-self",         required_argument, NULL, OPT_P_BAD_SELF },
     { "output-scores",      no_argument,       NULL, OPT_OUTPUT_SCORES },
     { "no-update-models",   no_argument,       NULL, OPT_NO_UPDATE_MODELS },
+    { "binary-models",      no_argument,       NULL, OPT_BINARY_MODELS },
+    { "calibrations",       required_argument, NULL, OPT_CALIBRATIONS },
     { "progress",           no_argument,       NULL, OPT_PROGRESS },
     { "help",               no_argument,       NULL, OPT_HELP },
     { "version",            no_argument,       NULL, OPT_VERSION },
@@ -188,125 +208,17 @@ static const struct option longopts[] = {
     { "filter-policy",      required_argument, NULL, OPT_FILTER_POLICY },
     { "rounds",             required_argument, NULL, OPT_NUM_ROUNDS },
     { "max-reads",          required_argument, NULL, OPT_MAX_READS },
+    { "min-posterior",      required_argument, NULL, OPT_MIN_POSTERIOR },
     { NULL, 0, NULL, 0 }
 };
 
-// recalculate shift, scale, drift, scale_sd from an alignment and the read
-// returns true if the recalibration was performed
-// in either case, sets residual to the L1 norm of the residual
-bool recalibrate_model(SquiggleRead &sr,
-                       const int strand_idx,
-                       const std::vector<EventAlignment> &alignment_output,
-                       const Alphabet* alphabet,
-                       const bool scale_var,
-                       const bool scale_drift)
+// The model k-mer of an event as a string, empty if there is no event
+static std::string get_model_kmer(const EventAlignment* ea, uint32_t k)
 {
-    std::vector<double> raw_events, times, level_means, level_stdvs;
-    uint32_t k = sr.pore_model[strand_idx].k;
-    const uint32_t num_equations = scale_drift ? 3 : 2;
-
-    //std::cout << "Previous pore model parameters: " << sr.pore_model[strand_idx].shift << ", "
-    //                                                << sr.pore_model[strand_idx].scale << ", "
-    //                                                << sr.pore_model[strand_idx].drift << ", "
-    //                                                << sr.pore_model[strand_idx].var   << std::endl;
-
-    // extract necessary vectors from the read and the pore model; note do not want scaled values
-    for(size_t ei = 0; ei < alignment_output.size(); ++ei) {
-        const auto& ea = alignment_output[ei];
-        if(ea.hmm_state == 'M') {
-            std::string model_kmer = ea.rc ? alphabet->reverse_complement(ea.ref_kmer) : ea.ref_kmer;
-            uint32_t rank = alphabet->kmer_rank(model_kmer.c_str(), k);
-
-            raw_events.push_back ( sr.get_uncorrected_level(ea.event_idx, strand_idx) );
-            level_means.push_back( sr.pore_model[strand_idx].states[rank].level_mean );
-            level_stdvs.push_back( sr.pore_model[strand_idx].states[rank].level_stdv );
-            if (scale_drift)
-                times.push_back  ( sr.get_time(ea.event_idx, strand_idx) );
-
-            /*
-            fprintf(stdout, "recalibrate ei: %zu level: %.2lf kmer: %s model: %.2lf\n", 
-                    ei, sr.get_uncorrected_level(ea.event_idx, strand_idx), model_kmer.c_str(), 
-                    sr.pore_model[strand_idx].states[rank].level_mean);
-            */
-        }
-    }
-
-    const int minNumEventsToRescale = 200;
-    bool recalibrated = false; 
-    if (raw_events.size() >= minNumEventsToRescale) {
-        // Assemble linear system corresponding to weighted least squares problem
-        // Can just directly call a weighted least squares solver, but there's enough
-        // structure in our problem it's a little faster just to build the normal eqn
-        // matrices ourselves
-        Eigen::MatrixXd A(num_equations, num_equations);
-        Eigen::VectorXd b(num_equations);
-
-        for (int i=0; i<num_equations; i++) {
-            b(i) = 0.;
-            for (int j=0; j<num_equations; j++)
-                A(i,j) = 0.;
-        }
-
-        for (size_t i=0; i<raw_events.size(); i++) {
-            double inv_var = 1./(level_stdvs[i]*level_stdvs[i]);
-            double mu = level_means[i];
-            double e  = raw_events[i];
-
-            A(0,0) += inv_var;  A(0,1) += mu*inv_var;
-                                A(1,1) += mu*mu*inv_var;
-
-            b(0) += e*inv_var;
-            b(1) += mu*e*inv_var;
-
-            if (scale_drift) {
-                double t  = times[i];
-                A(0,2) += t*inv_var;
-                A(1,2) += mu*t*inv_var;
-                A(2,2) += t*t*inv_var;
-                b(2) += t*e*inv_var;
-            }
-        }
-        A(1,0) = A(0,1);
-        if (scale_drift) {
-            A(2,0) = A(0,2);
-            A(2,1) = A(1,2);
-        }
-
-        // perform the linear solve
-        Eigen::VectorXd x = A.fullPivLu().solve(b);
-
-        double shift = x(0);
-        double scale = x(1);
-        double drift = scale_drift ? x(2) : 0.;
-
-        sr.pore_model[strand_idx].shift = shift;
-        sr.pore_model[strand_idx].scale = scale;
-        sr.pore_model[strand_idx].drift = drift;
-
-        if (scale_var) {
-            double var = 0.;
-            for (size_t i=0; i<raw_events.size(); i++) {
-                double yi = (raw_events[i] - shift - scale*level_means[i]);
-                if (scale_drift)
-                    yi -= drift*times[i];
-                var+= yi*yi/(level_stdvs[i]*level_stdvs[i]);
-            }
-            var /= raw_events.size();
-
-            sr.pore_model[strand_idx].var   = sqrt(var); // 'var' is really the scaling for std dev.
-        }
-
-        if (sr.pore_model[strand_idx].is_scaled)
-            sr.pore_model[strand_idx].bake_gaussian_parameters();
-
-        recalibrated = true;
-        //std::cout << "Updated pore model parameters:  " << sr.pore_model[strand_idx].shift << ", "
-        //                                                << sr.pore_model[strand_idx].scale << ", "
-        //                                                << sr.pore_model[strand_idx].drift << ", "
-        //                                                << sr.pore_model[strand_idx].var   << std::endl;
+    if(ea == NULL) {
+        return "";
     }
-
-    return recalibrated;
+    return ea->hmm_state != 'B' ? mtrain_alphabet->kmer_from_rank(ea->model_kmer_rank, k) : std::string(k, 'N');
 }
 
 // Update the training data with aligned events from a read
@@ -317,8 +229,8 @@ void add_aligned_events(const Fast5Map& name_map,
                         size_t read_idx,
                         int region_start,
                         int region_end,
-                        const std::string& training_kit,
-                        const std::string& training_alphabet,
+                        KitVersion training_kit,
+                        const Alphabet* training_alphabet,
                         size_t training_k,
                         size_t round,
                         ModelTrainingMap& training)
@@ -352,6 +264,7 @@ void add_aligned_events(const Fast5Map& name_map,
         params.strand_idx = strand_idx;
 
         params.alphabet = mtrain_alphabet;
+        params.compute_posterior = opt::min_posterior > 0.0f;
         params.read_idx = read_idx;
         params.region_start = region_start;
         params.region_end = region_end;
@@ -360,6 +273,16 @@ void add_aligned_events(const Fast5Map& name_map,
         if (alignment_output.size() == 0)
             return;
 
+        // The R7 HMM does not compute posteriors so these events can't be filtered
+        if(params.compute_posterior && std::isnan(alignment_output.front().posterior)) {
+            static bool warned = false;
+            #pragma omp critical(posterior_warning)
+            if(!warned) {
+                fprintf(stderr, "[methyltrain] warning: --min-posterior is ignored for reads with R7 models\n");
+                warned = true;
+            }
+        }
+
         // Update pore model based on alignment
         std::string model_key = PoreModelSet::get_model_key(sr.pore_model[strand_idx]);
 
@@ -368,18 +291,30 @@ void add_aligned_events(const Fast5Map& name_map,
         //
         double orig_score = -INFINITY;
         if (opt::output_scores) {
-            orig_score = model_score(sr, strand_idx, fai, alignment_output, 500, NULL);
+            orig_score = model_score(sr, strand_idx, fai, hdr, alignment_output, 500, NULL);
 
             #pragma omp critical(print)
             std::cout << round << " " << model_key << " " << read_idx << " " << strand_idx << " Original " << orig_score << std::endl;
         }
 
         if ( opt::calibrate ) {
-            double resid = 0.;
-            recalibrate_model(sr, strand_idx, alignment_output, mtrain_alphabet, resid, true);
+            CalibrationOptions calibration_options;
+            calibration_options.loss = opt::calibration_loss;
+            calibration_options.scale_var = false;
+
+            // a robust calibration that did not settle was pulled by misaligned
+            // events, so realign to the recalibrated model and calibrate again
+            CalibrationResiduals residuals;
+            bool calibrated = recalibrate_model(sr, strand_idx, alignment_output, mtrain_alphabet, calibration_options, &residuals);
+            if(calibrated && opt::calibration_loss != CL_LEAST_SQUARES && !calibration_is_stable(residuals)) {
+                alignment_output = align_read_to_ref(params);
+                if (alignment_output.size() == 0)
+                    return;
+                recalibrate_model(sr, strand_idx, alignment_output, mtrain_alphabet, calibration_options);
+            }
 
             if (opt::output_scores) {
-                double rescaled_score = model_score(sr, strand_idx, fai, alignment_output, 500, NULL);
+                double rescaled_score = model_score(sr, strand_idx, fai, hdr, alignment_output, 500, NULL);
                 #pragma omp critical(print)
                 {
                     std::cout << round << " " << model_key << " " << read_idx << " " << strand_idx << " Rescaled " << rescaled_score << std::endl;
@@ -397,16 +332,15 @@ void add_aligned_events(const Fast5Map& name_map,
 
         for(size_t i = 0; i < alignment_output.size(); ++i) {
             const EventAlignment& ea = alignment_output[i];
-            std::string model_kmer = ea.model_kmer;
 
-            // Grab the previous/next model kmer from the alignment_output table.
+            // Find the previous/next model kmer in the alignment_output table.
             // If the read is from the same strand as the reference
             // the next kmer comes from the next alignment_output (and vice-versa)
             // other the indices are swapped
             int next_stride = ea.rc ? -1 : 1;
 
-            std::string prev_kmer = "";
-            std::string next_kmer = "";
+            const EventAlignment* prev_ea = NULL;
+            const EventAlignment* next_ea = NULL;
 
             if(i > 0 && i < alignment_output.size() - 1) {
 
@@ -416,16 +350,16 @@ void add_aligned_events(const Fast5Map& name_map,
 
                 // only set the previous/next when there was exactly one base of movement along the referenc
                 if( std::abs(alignment_output[i + next_stride].ref_position - ea.ref_position) == 1) {
-                    next_kmer = alignment_output[i + next_stride].model_kmer;
+                    next_ea = &alignment_output[i + next_stride];
                 }
 
                 if( std::abs(alignment_output[i - next_stride].ref_position - ea.ref_position) == 1) {
-                    prev_kmer = alignment_output[i - next_stride].model_kmer;
+                    prev_ea = &alignment_output[i - next_stride];
                 }
             }
 
-            // Get the rank of the kmer that we aligned to (on the sequencing strand, = model_kmer)
-            uint32_t rank = mtrain_alphabet->kmer_rank(model_kmer.c_str(), k);
+            // The rank of the kmer that we aligned to (on the sequencing strand, = model_kmer)
+            uint32_t rank = ea.model_kmer_rank;
             assert(rank < emission_map.size());
             auto& kmer_summary = emission_map[rank];
 
@@ -435,11 +369,12 @@ void add_aligned_events(const Fast5Map& name_map,
             bool use_for_training = i > opt::min_distance_from_alignment_end &&
                 i + opt::min_distance_from_alignment_end < alignment_output.size() &&
                 alignment_output[i].hmm_state == 'M' &&
+                (std::isnan(alignment_output[i].posterior) || alignment_output[i].posterior >= opt::min_posterior) &&
                 sr.get_duration( alignment_output[i].event_idx, strand_idx) >= opt::min_event_duration &&
                 sr.get_fully_scaled_level(alignment_output[i].event_idx, strand_idx) >= 1.0;
 
             if(use_for_training) {
-                StateTrainingData std(sr, ea, rank, prev_kmer, next_kmer);
+                StateTrainingData std(sr, ea, rank, get_model_kmer(prev_ea, k), get_model_kmer(next_ea, k));
                 #pragma omp critical(kmer)
                 kmer_summary.events.push_back(std);
             }
@@ -479,12 +414,21 @@ void parse_methyltrain_options(int argc, char** argv)
             case OPT_TRAIN_KMERS: arg >> training_target_str; break;
             case OPT_FILTER_POLICY: arg >> filter_policy_str; break;
             case OPT_NO_UPDATE_MODELS: opt::write_models = false; break;
+            case OPT_BINARY_MODELS: opt::binary_models = true; break;
+            case OPT_CALIBRATIONS: arg >> opt::calibrations_file; break;
             case OPT_PROGRESS: opt::progress = true; break;
             case OPT_P_SKIP: arg >> g_p_skip; break;
             case OPT_P_SKIP_SELF: arg >> g_p_skip_self; break;
             case OPT_P_BAD: arg >> g_p_bad; break;
             case OPT_P_BAD_SELF: arg >> g_p_bad_self; break;
             case OPT_MAX_READS: arg >> opt::max_reads; break;
+            case OPT_MIN_POSTERIOR: arg >> opt::min_posterior; break;
+            case OPT_CALIBRATE_LOSS:
+                if(!parse_calibration_loss(arg.str(), opt::calibration_loss)) {
+                    std::cerr << SUBPROGRAM ": unknown --calibrate-loss: " << arg.str() << "\n";
+                    die = true;
+                }
+                break;
             case OPT_HELP:
                 std::cout << METHYLTRAIN_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -511,6 +455,11 @@ void parse_methyltrain_options(int argc, char** argv)
         die = true;
     }
 
+    if(opt::min_posterior < 0.0f || opt::min_posterior > 1.0f) {
+        std::cerr << SUBPROGRAM ": invalid --min-posterior: " << opt::min_posterior << "\n";
+        die = true;
+    }
+
     if(opt::reads_file.empty()) {
         std::cerr << SUBPROGRAM ": a --reads file must be provided\n";
         die = true;
@@ -594,8 +543,7 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
     assert(all_kmers.back() == std::string(k, 'T'));
 
     // Update means for each kmer
-    #pragma omp parallel for
-    for(size_t ki = 0; ki < summaries.size(); ++ki) {
+    parallel_for(summaries.size(), [&](size_t ki) {
         assert(ki < all_kmers.size());
         std::string kmer = all_kmers[ki];
 
@@ -643,7 +591,10 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
                     std::exp(mixture.log_weights[1]), mixture.params[1].level_mean, mixture.params[1].level_stdv);
             }
 
-            ParamMixture trained_mixture = train_gaussian_mixture(summaries[ki].events, mixture);
+            // the gaussian and inverse gaussian fits share one flat copy of the events
+            MixtureTrainingData flat_events;
+            flat_events.assign(summaries[ki].events);
+            ParamMixture trained_mixture = train_gaussian_mixture(flat_events, mixture);
 
             if(opt::verbose > 1) {
                 fprintf(stderr, "TRAIN_MIX %s\t%s\t[%.2lf %.2lf %.2lf]\t[%.2lf %.2lf %.2lf]\n", model_key.c_str(), kmer.c_str(),
@@ -665,7 +616,7 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
                     ig_mixture.params.emplace_back(current_model.get_parameters(um_ki));
                 }
                 // run training
-                auto trained_ig_mixture = train_invgaussian_mixture(summaries[ki].events, ig_mixture);
+                auto trained_ig_mixture = train_invgaussian_mixture(flat_events, ig_mixture);
 
                 LOG("methyltrain", debug)
                     << "IG_INIT__MIX " << model_key << " " << kmer.c_str() << " ["
@@ -693,20 +644,20 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
                                     summaries[ki].num_matches, summaries[ki].num_skips, summaries[ki].num_stays,
                                     summaries[ki].events.size(), trained, result.trained_model.states[ki].level_mean, result.trained_model.states[ki].level_stdv);
         }
-    }
+    }, "methyltrain_kmer");
 
     return result;
 }
 
 void train_one_round(const Fast5Map& name_map,
-                     const std::string& kit_name,
-                     const std::string& alphabet,
+                     KitVersion kit,
+                     const Alphabet* alphabet,
                      size_t k,
                      size_t round)
 {
 
     // Get a copy of the models for each strand for this datatype
-    const PoreModelMap current_models = PoreModelSet::copy_strand_models(kit_name, alphabet, k);
+    const PoreModelMap current_models = PoreModelSet::copy_strand_models(kit, alphabet, k);
 
     // Initialize the training summary stats for each kmer for each model
     ModelTrainingMap model_training_data;
@@ -776,17 +727,19 @@ void train_one_round(const Fast5Map& name_map,
 
         // realign if we've hit the max buffer size or reached the end of file
         if(num_records_buffered == records.size() || result < 0 || (num_records_buffered + num_reads_realigned == opt::max_reads)) {
-            #pragma omp parallel for
-            for(size_t i = 0; i < num_records_buffered; ++i) {
+            std::vector<size_t> order = get_records_by_decreasing_cost(records, num_records_buffered);
+
+            parallel_for(num_records_buffered, [&](size_t j) {
+                size_t i = order[j];
                 bam1_t* record = records[i];
                 size_t read_idx = num_reads_realigned + i;
                 if( (record->core.flag & BAM_FUNMAP) == 0) {
                     add_aligned_events(name_map, fai, hdr, record, read_idx,
                                        clip_start, clip_end,
-                                       kit_name, alphabet, k,
+                                       kit, alphabet, k,
                                        round, model_training_data);
                 }
-            }
+            }, "methyltrain");
 
             num_reads_realigned += num_records_buffered;
             num_records_buffered = 0;
@@ -833,7 +786,11 @@ void train_one_round(const Fast5Map& name_map,
         // write the updated model to disk
         if(opt::write_models && result.num_kmers_trained > 0) {
             std::string out_name = PoreModelSet::get_model_key(result.trained_model) + ".model";
-            result.trained_model.write(out_name, out_name);
+            if(opt::binary_models) {
+                result.trained_model.write_binary(out_name, out_name);
+            } else {
+                result.trained_model.write(out_name, out_name);
+            }
         }
     }
 
@@ -871,7 +828,7 @@ void write_models(const PoreModelMap& models, int round)
 int methyltrain_main(int argc, char** argv)
 {
     parse_methyltrain_options(argc, argv);
-    omp_set_num_threads(opt::num_threads);
+    set_parallel_num_threads(opt::num_threads);
 
     Fast5Map name_map(opt::reads_file);
 
@@ -880,17 +837,22 @@ int methyltrain_main(int argc, char** argv)
     std::vector<std::string> imported_model_keys = PoreModelSet::initialize(opt::models_fofn);
     assert(!imported_model_keys.empty());
 
+    if(!opt::calibrations_file.empty()) {
+        CalibrationStore::initialize(opt::calibrations_file);
+    }
+
     // Grab one of the pore models to extract the kit name from (they should all have the same one)
     const PoreModel& tmp_model = PoreModelSet::get_model_by_key(imported_model_keys.front());
 
-    std::string training_kit = tmp_model.metadata.get_kit_name();
+    KitVersion training_kit = tmp_model.metadata.kit;
     mtrain_alphabet = tmp_model.pmalphabet;
     size_t training_k = tmp_model.k;
-    fprintf(stderr, "Training %s for alphabet %s for %zu-mers\n", training_kit.c_str(), mtrain_alphabet->get_name().c_str(), training_k);
+    fprintf(stderr, "Training %s for alphabet %s for %zu-mers\n", tmp_model.metadata.get_kit_name().c_str(), mtrain_alphabet->get_name().c_str(), training_k);
 
     for(size_t round = 0; round < opt::num_training_rounds; round++) {
         fprintf(stderr, "Starting round %zu\n", round);
-        train_one_round(name_map, training_kit, mtrain_alphabet->get_name(), training_k, round);
+        train_one_round(name_map, training_kit, mtrain_alphabet, training_k, round);
+        CalibrationStore::write();
         /*
         if(opt::write_models) {
             write_models(training_kit, mtrain_alphabet->get_name(), training_k, round);
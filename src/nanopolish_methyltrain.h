@@ -14,16 +14,7 @@
 #include <vector>
 #include "nanopolish_eventalign.h"
 #include "nanopolish_squiggle_read.h"
-
-// recalculate shift, scale, drift, scale_sd from an alignment and the read
-// returns true if the recalibration was performed
-// in either case, sets residual to the L1 norm of the residual
-bool recalibrate_model(SquiggleRead &sr,
-                       const int strand_idx,
-                       const std::vector<EventAlignment> &alignment_output,
-                       const Alphabet* alphabet,
-                       bool scale_var=true,
-                       bool scale_drift=true);
+#include "nanopolish_calibration.h"
 
 int methyltrain_main(int argc, char** argv);
 
@@ -0,0 +1,460 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_partition.cpp - split a genome into windows
+// of roughly equal predicted polishing cost
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <inttypes.h>
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <sstream>
+#include <iostream>
+#include <getopt.h>
+#include "htslib/hts.h"
+#include "htslib/sam.h"
+#include "nanopolish_common.h"
+#include "nanopolish_partition.h"
+
+// Each event is scored against a haplotype of roughly 2 * 30bp of flanking
+// sequence plus the candidate itself, with 3 HMM states per k-mer
+#define PARTITION_HMM_CELLS_PER_EVENT 210.0
+
+// Approximate memory held per event while a window is being processed
+// (the event itself, its scaled copy and its entry in the event-to-base map)
+#define PARTITION_BYTES_PER_EVENT 48.0
+
+// Typical BGZF compression ratio of a BAM, used to weight the part
+// of an index chunk that lies within a single compressed block
+#define PARTITION_BGZF_RATIO 4.0
+
+// Read length assumed when a contig has no sampled alignments
+#define PARTITION_DEFAULT_READ_LENGTH 5000.0
+
+//
+// Getopt
+//
+#define SUBPROGRAM "partition"
+
+static const char *PARTITION_VERSION_MESSAGE =
+SUBPROGRAM " Version " PACKAGE_VERSION "\n"
+"Written by Jared Simpson.\n"
+"\n"
+"Copyright 2017 Ontario Institute for Cancer Research\n";
+
+static const char *PARTITION_USAGE_MESSAGE =
+"Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] --bam alignments.bam\n"
+"Split the genome into windows of balanced predicted polishing cost using the BAM index\n"
+"\n"
+"  -v, --verbose                        display verbose output\n"
+"      --version                        display version\n"
+"      --help                           display this help and exit\n"
+"  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"  -w, --window=STR                     only partition the region STR (format: ctg:start-end)\n"
+"  -n, --num-partitions=NUM             balance the cost over approximately NUM windows\n"
+"      --segment-length=NUM             without -n, use windows of NUM bases at median coverage (default: 50000)\n"
+"      --max-length=NUM                 never emit windows longer than NUM bases (default: 500000)\n"
+"      --overlap-length=NUM             extend each window by NUM bases into the next (default: 200)\n"
+"      --bin-size=NUM                   estimate the cost over bins of NUM bases (default: 10000)\n"
+"      --sample-reads=NUM               sample NUM alignments per contig to estimate read length, 0 to disable (default: 100)\n"
+"      --events-per-base=F              expect F events per sequenced base (default: 1.8)\n"
+"      --cells-per-second=F             assume one thread fills F HMM cells per second (default: 5e7)\n"
+"      --regions-only                   only write the region strings, one per line\n"
+"\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
+
+namespace opt
+{
+    static unsigned int verbose;
+    static std::string bam_file;
+    static std::string region;
+    static int num_partitions = 0;
+    static int segment_length = 50000;
+    static int max_length = 500000;
+    static int overlap_length = 200;
+    static int bin_size = 10000;
+    static int sample_reads = 100;
+    static double events_per_base = 1.8;
+    static double cells_per_second = 5e7;
+    static int regions_only = 0;
+}
+
+static const char* shortopts = "b:w:n:v";
+
+enum { OPT_HELP = 1,
+       OPT_VERSION,
+       OPT_SEGMENT_LENGTH,
+       OPT_MAX_LENGTH,
+       OPT_OVERLAP_LENGTH,
+       OPT_BIN_SIZE,
+       OPT_SAMPLE_READS,
+       OPT_EVENTS_PER_BASE,
+       OPT_CELLS_PER_SECOND,
+       OPT_REGIONS_ONLY };
+
+static const struct option longopts[] = {
+    { "verbose",          no_argument,       NULL, 'v' },
+    { "bam",              required_argument, NULL, 'b' },
+    { "window",           required_argument, NULL, 'w' },
+    { "num-partitions",   required_argument, NULL, 'n' },
+    { "segment-length",   required_argument, NULL, OPT_SEGMENT_LENGTH },
+    { "max-length",       required_argument, NULL, OPT_MAX_LENGTH },
+    { "overlap-length",   required_argument, NULL, OPT_OVERLAP_LENGTH },
+    { "bin-size",         required_argument, NULL, OPT_BIN_SIZE },
+    { "sample-reads",     required_argument, NULL, OPT_SAMPLE_READS },
+    { "events-per-base",  required_argument, NULL, OPT_EVENTS_PER_BASE },
+    { "cells-per-second", required_argument, NULL, OPT_CELLS_PER_SECOND },
+    { "regions-only",     no_argument,       NULL, OPT_REGIONS_ONLY },
+    { "help",             no_argument,       NULL, OPT_HELP },
+    { "version",          no_argument,       NULL, OPT_VERSION },
+    { NULL, 0, NULL, 0 }
+};
+
+void parse_partition_options(int argc, char** argv)
+{
+    bool die = false;
+    for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case '?': die = true; break;
+            case 'v': opt::verbose++; break;
+            case 'b': arg >> opt::bam_file; break;
+            case 'w': arg >> opt::region; break;
+            case 'n': arg >> opt::num_partitions; break;
+            case OPT_SEGMENT_LENGTH: arg >> opt::segment_length; break;
+            case OPT_MAX_LENGTH: arg >> opt::max_length; break;
+            case OPT_OVERLAP_LENGTH: arg >> opt::overlap_length; break;
+            case OPT_BIN_SIZE: arg >> opt::bin_size; break;
+            case OPT_SAMPLE_READS: arg >> opt::sample_reads; break;
+            case OPT_EVENTS_PER_BASE: arg >> opt::events_per_base; break;
+            case OPT_CELLS_PER_SECOND: arg >> opt::cells_per_second; break;
+            case OPT_REGIONS_ONLY: opt::regions_only = 1; break;
+            case OPT_HELP:
+                std::cout << PARTITION_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+            case OPT_VERSION:
+                std::cout << PARTITION_VERSION_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (argc - optind > 0) {
+        std::cerr << SUBPROGRAM ": too many arguments\n";
+        die = true;
+    }
+
+    if(opt::bam_file.empty()) {
+        std::cerr << SUBPROGRAM ": a --bam file must be provided\n";
+        die = true;
+    }
+
+    if(opt::bin_size <= 0 || opt::segment_length < opt::bin_size || opt::max_length < opt::segment_length) {
+        std::cerr << SUBPROGRAM ": --bin-size, --segment-length and --max-length must be positive and increasing\n";
+        die = true;
+    }
+
+    if(opt::num_partitions < 0 || opt::overlap_length < 0 || opt::sample_reads < 0) {
+        std::cerr << SUBPROGRAM ": --num-partitions, --overlap-length and --sample-reads must be non-negative\n";
+        die = true;
+    }
+
+    if(opt::events_per_base <= 0.0 || opt::cells_per_second <= 0.0) {
+        std::cerr << SUBPROGRAM ": --events-per-base and --cells-per-second must be positive\n";
+        die = true;
+    }
+
+    if (die)
+    {
+        std::cout << "\n" << PARTITION_USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// The predicted cost of one bin of a contig
+struct PartitionBin
+{
+    int start;
+    int end;
+    double cells;
+};
+
+struct PartitionContig
+{
+    int tid;
+    std::string name;
+    int length;
+
+    // mapped reads reported by the index and the amount
+    // of BAM data the index assigns to the whole contig
+    uint64_t mapped_reads;
+    double total_bytes;
+    double mean_read_length;
+
+    std::vector<PartitionBin> bins;
+};
+
+// Sum the size of the BAM chunks the index would read to
+// retrieve the alignments overlapping [start, end). This is
+// proportional to the number of reads overlapping the region
+// and does not touch the BAM itself.
+static double get_index_bytes(const hts_idx_t* bam_idx, int tid, int start, int end)
+{
+    hts_itr_t* itr = sam_itr_queryi(bam_idx, tid, start, end);
+    if(itr == NULL) {
+        return 0.0;
+    }
+
+    double bytes = 0.0;
+    for(int i = 0; i < itr->n_off; ++i) {
+        uint64_t u = itr->off[i].u;
+        uint64_t v = itr->off[i].v;
+        double compressed = (double)(v >> 16) - (double)(u >> 16);
+        double within_block = ((double)(v & 0xFFFF) - (double)(u & 0xFFFF)) / PARTITION_BGZF_RATIO;
+        bytes += std::max(compressed + within_block, 0.0);
+    }
+    sam_itr_destroy(itr);
+    return bytes;
+}
+
+// Estimate the mean aligned read length of a contig by taking
+// the first primary alignment at evenly spaced positions
+static double sample_read_length(htsFile* bam_fh, const hts_idx_t* bam_idx, int tid, int length, int num_samples)
+{
+    bam1_t* record = bam_init1();
+    double sum = 0.0;
+    int n = 0;
+
+    for(int si = 0; si < num_samples; ++si) {
+        int pos = (int)(((double)si + 0.5) / num_samples * length);
+        hts_itr_t* itr = sam_itr_queryi(bam_idx, tid, pos, pos + 1);
+        if(itr == NULL) {
+            continue;
+        }
+
+        while(sam_itr_next(bam_fh, itr, record) >= 0) {
+            if(record->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) {
+                continue;
+            }
+            sum += bam_endpos(record) - record->core.pos;
+            n += 1;
+            break;
+        }
+        sam_itr_destroy(itr);
+    }
+
+    bam_destroy1(record);
+    return n > 0 ? sum / n : PARTITION_DEFAULT_READ_LENGTH;
+}
+
+// Fill in the read, runtime and memory estimates of a window
+static void estimate_window(const hts_idx_t* bam_idx,
+                            const PartitionContig& contig,
+                            const PartitionParameters& params,
+                            double cells,
+                            PartitionWindow& window)
+{
+    double reads = 0.0;
+    if(contig.total_bytes > 0.0) {
+        double bytes = get_index_bytes(bam_idx, contig.tid, window.start, window.end);
+        reads = std::min(contig.mapped_reads * bytes / contig.total_bytes, (double)contig.mapped_reads);
+    }
+
+    window.estimated_reads = reads;
+    window.estimated_cells = cells;
+    window.estimated_events = cells / PARTITION_HMM_CELLS_PER_EVENT;
+    window.estimated_seconds = cells / params.cells_per_second;
+
+    // every read overlapping the window is loaded in full
+    window.estimated_memory_mb = reads * contig.mean_read_length * params.events_per_base * PARTITION_BYTES_PER_EVENT / (1024.0 * 1024.0);
+}
+
+std::vector<PartitionWindow> partition_by_cost(const std::string& bam_file,
+                                               const std::string& region,
+                                               const PartitionParameters& params)
+{
+    htsFile* bam_fh = sam_open(bam_file.c_str(), "r");
+    if(bam_fh == NULL) {
+        fprintf(stderr, "Error: could not open %s\n", bam_file.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::string index_filename = bam_file + ".bai";
+    hts_idx_t* bam_idx = bam_index_load(index_filename.c_str());
+    if(bam_idx == NULL) {
+        fprintf(stderr, "Error: could not load the index %s, please run samtools index\n", index_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
+
+    // Restrict to a single region if requested
+    std::string region_contig;
+    int region_start = 0;
+    int region_end = -1;
+    if(!region.empty()) {
+        parse_region_string(region, region_contig, region_start, region_end);
+        if(bam_name2id(hdr, region_contig.c_str()) < 0) {
+            fprintf(stderr, "Error: contig %s is not in the BAM header\n", region_contig.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Estimate the cost of every bin from the index
+    std::vector<PartitionContig> contigs;
+    std::vector<double> nonempty_bin_costs;
+    double total_cells = 0.0;
+
+    for(int tid = 0; tid < hdr->n_targets; ++tid) {
+        if(!region_contig.empty() && region_contig != hdr->target_name[tid]) {
+            continue;
+        }
+
+        PartitionContig contig;
+        contig.tid = tid;
+        contig.name = hdr->target_name[tid];
+        contig.length = hdr->target_len[tid];
+
+        uint64_t unmapped_reads = 0;
+        contig.mapped_reads = 0;
+        hts_idx_get_stat(bam_idx, tid, &contig.mapped_reads, &unmapped_reads);
+
+        contig.total_bytes = get_index_bytes(bam_idx, tid, 0, contig.length);
+        contig.mean_read_length = params.sample_reads > 0 && contig.mapped_reads > 0 ?
+            sample_read_length(bam_fh, bam_idx, tid, contig.length, params.sample_reads) :
+            PARTITION_DEFAULT_READ_LENGTH;
+
+        if(opt::verbose > 0) {
+            fprintf(stderr, "[partition] %s length: %d mapped reads: %" PRIu64 " mean aligned length: %.0lf\n",
+                contig.name.c_str(), contig.length, contig.mapped_reads, contig.mean_read_length);
+        }
+
+        int start = region_contig.empty() ? 0 : std::max(region_start, 0);
+        int end = region_contig.empty() || region_end < 0 ? contig.length : std::min(region_end, contig.length);
+
+        for(int bin_start = start; bin_start < end; bin_start += params.bin_size) {
+            PartitionBin bin;
+            bin.start = bin_start;
+            bin.end = std::min(bin_start + params.bin_size, end);
+
+            double reads = 0.0;
+            if(contig.total_bytes > 0.0) {
+                reads = contig.mapped_reads * get_index_bytes(bam_idx, tid, bin.start, bin.end) / contig.total_bytes;
+            }
+
+            // convert overlapping reads into sequenced bases within the bin
+            double bin_length = bin.end - bin.start;
+            double L = contig.mean_read_length;
+            double depth = reads * L / (bin_length + L);
+            double events = depth * bin_length * params.events_per_base;
+            bin.cells = events * PARTITION_HMM_CELLS_PER_EVENT;
+
+            total_cells += bin.cells;
+            if(bin.cells > 0.0) {
+                nonempty_bin_costs.push_back(bin.cells * params.bin_size / bin_length);
+            }
+            contig.bins.push_back(bin);
+        }
+        contigs.push_back(contig);
+    }
+
+    // Set the cost each window should reach. By default this is the cost
+    // of a segment_length window at median coverage so regions of typical
+    // depth are split as before while deep or empty regions are resized
+    double target_cells = 0.0;
+    if(params.num_partitions > 0) {
+        target_cells = total_cells / params.num_partitions;
+    } else if(!nonempty_bin_costs.empty()) {
+        size_t mid = nonempty_bin_costs.size() / 2;
+        std::nth_element(nonempty_bin_costs.begin(), nonempty_bin_costs.begin() + mid, nonempty_bin_costs.end());
+        target_cells = nonempty_bin_costs[mid] * params.segment_length / params.bin_size;
+    }
+
+    // Greedily merge adjacent bins until the window reaches the target cost
+    std::vector<PartitionWindow> windows;
+    for(const PartitionContig& contig : contigs) {
+        size_t bi = 0;
+        while(bi < contig.bins.size()) {
+            int window_start = contig.bins[bi].start;
+            double cells = 0.0;
+            size_t bj = bi;
+            while(bj < contig.bins.size()) {
+                const PartitionBin& bin = contig.bins[bj];
+                bool have_bins = bj > bi;
+                if(have_bins && cells + bin.cells > target_cells) {
+                    break;
+                }
+                if(have_bins && bin.end - window_start > params.max_length) {
+                    break;
+                }
+                cells += bin.cells;
+                bj += 1;
+            }
+
+            // Extend the window into the next one as nanopolish_makerange.py does
+            int window_end = contig.bins[bj - 1].end;
+            int extended_end = window_end + params.overlap_length;
+
+            PartitionWindow window;
+            window.contig = contig.name;
+            window.start = window_start;
+            window.end = extended_end < contig.length ? extended_end : contig.length - 1;
+            estimate_window(bam_idx, contig, params, cells, window);
+            windows.push_back(window);
+
+            bi = bj;
+        }
+    }
+
+    bam_hdr_destroy(hdr);
+    hts_idx_destroy(bam_idx);
+    sam_close(bam_fh);
+    return windows;
+}
+
+int partition_main(int argc, char** argv)
+{
+    parse_partition_options(argc, argv);
+
+    PartitionParameters params;
+    params.bin_size = opt::bin_size;
+    params.segment_length = opt::segment_length;
+    params.max_length = opt::max_length;
+    params.overlap_length = opt::overlap_length;
+    params.num_partitions = opt::num_partitions;
+    params.sample_reads = opt::sample_reads;
+    params.events_per_base = opt::events_per_base;
+    params.cells_per_second = opt::cells_per_second;
+
+    std::vector<PartitionWindow> windows = partition_by_cost(opt::bam_file, opt::region, params);
+
+    if(!opt::regions_only) {
+        printf("region\testimated_reads\testimated_events\testimated_cells\testimated_seconds\testimated_memory_mb\n");
+    }
+
+    double total_seconds = 0.0;
+    double max_seconds = 0.0;
+    for(const PartitionWindow& w : windows) {
+        if(opt::regions_only) {
+            printf("%s:%d-%d\n", w.contig.c_str(), w.start, w.end);
+        } else {
+            printf("%s:%d-%d\t%.0lf\t%.0lf\t%.3g\t%.1lf\t%.1lf\n",
+                w.contig.c_str(), w.start, w.end,
+                w.estimated_reads, w.estimated_events, w.estimated_cells,
+                w.estimated_seconds, w.estimated_memory_mb);
+        }
+        total_seconds += w.estimated_seconds;
+        max_seconds = std::max(max_seconds, w.estimated_seconds);
+    }
+
+    if(opt::verbose > 0) {
+        fprintf(stderr, "[partition] %zu windows, estimated total %.1lfs, longest window %.1lfs\n",
+            windows.size(), total_seconds, max_seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_partition.h - split a genome into windows
+// of roughly equal predicted polishing cost
+//
+#ifndef NANOPOLISH_PARTITION_H
+#define NANOPOLISH_PARTITION_H
+
+#include <string>
+#include <vector>
+
+// A window of the reference along with the predicted
+// amount of work required to process it
+struct PartitionWindow
+{
+    std::string contig;
+    int start;
+    int end;
+
+    double estimated_reads;
+    double estimated_events;
+    double estimated_cells;
+    double estimated_seconds;
+    double estimated_memory_mb;
+};
+
+struct PartitionParameters
+{
+    // size of the bins the index is queried over
+    int bin_size;
+
+    // length of a window at typical coverage when num_partitions is not set
+    int segment_length;
+
+    // hard limit on the length of a window
+    int max_length;
+
+    // number of bases each window is extended by into the next
+    int overlap_length;
+
+    // if non-zero, balance the cost over exactly this many windows
+    int num_partitions;
+
+    // number of alignments sampled per contig to estimate read lengths
+    int sample_reads;
+
+    // cost model
+    double events_per_base;
+    double cells_per_second;
+};
+
+// Partition the contigs of an indexed BAM (or a single region of it,
+// if region is non-empty) into windows of balanced predicted cost
+std::vector<PartitionWindow> partition_by_cost(const std::string& bam_file,
+                                               const std::string& region,
+                                               const PartitionParameters& params);
+
+int partition_main(int argc, char** argv);
+
+#endif
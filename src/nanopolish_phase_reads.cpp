@@ -35,6 +35,7 @@
 #include "nanopolish_alignment_db.h"
 #include "nanopolish_bam_processor.h"
 #include "nanopolish_bam_utils.h"
+#include "nanopolish_parallel.h"
 #include "H5pubconf.h"
 #include "profiler.h"
 #include "progress.h"
@@ -339,7 +340,7 @@ void phase_single_read(const Fast5Map& name_map,
 int phase_reads_main(int argc, char** argv)
 {
     parse_phase_reads_options(argc, argv);
-    omp_set_num_threads(opt::num_threads);
+    set_parallel_num_threads(opt::num_threads);
 
     Fast5Map name_map(opt::reads_file);
     
@@ -372,7 +373,7 @@ int phase_reads_main(int argc, char** argv)
     // bam record, read index, etc passed as parameters
     // bind the other parameters the worker function needs here
     auto f = std::bind(phase_single_read, name_map, fai, std::ref(variants), sam_out, _1, _2, _3, _4, _5);
-    BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
+    BamProcessor processor(opt::bam_file, opt::region);
     
     // Copy the bam header to std
     sam_hdr_write(sam_out, processor.get_bam_header());
@@ -11,8 +11,44 @@
 #include <sstream>
 #include <cstring>
 #include <bits/stl_algo.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fast5.hpp>
 
+//
+// The binary model format is this header followed by num_states
+// PoreModelStateParams in k-mer rank order, in native byte order. The
+// header records the byte order and the size of a state so files written
+// on an incompatible machine or build are rejected rather than misread.
+//
+#define BINARY_MODEL_MAGIC "NPMODEL"
+#define BINARY_MODEL_VERSION 2
+#define BINARY_MODEL_BYTE_ORDER 0x01020304
+#define BINARY_MODEL_MAX_K 16
+
+struct BinaryModelHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t state_size;
+    uint32_t k;
+    uint32_t kit;
+    uint32_t model_idx;
+    uint32_t strand_idx;
+    uint32_t num_states;
+    double shift_offset;
+    double scale_offset;
+    char alphabet[32];
+    char name[256];
+    char type[32];
+};
+
+static_assert(sizeof(PoreModelStateParams) == 7 * sizeof(double), "unexpected padding in PoreModelStateParams");
+static_assert(sizeof(BinaryModelHeader) % sizeof(double) == 0, "the states must be aligned after the header");
+
 void PoreModel::bake_gaussian_parameters()
 {
     scaled_params.resize(states.size());
@@ -53,6 +89,11 @@ void add_found_bases(char *known, const char *kmer) {
 PoreModel::PoreModel(const std::string filename, const Alphabet *alphabet) : is_scaled(false), pmalphabet(alphabet)
 {
     model_filename = filename;
+    if(is_binary_model_file(filename)) {
+        load_binary(filename);
+        return;
+    }
+
     std::ifstream model_reader(filename);
     std::string model_line;
 
@@ -245,6 +286,7 @@ void PoreModel::write(const std::string filename, const std::string modelname) c
     writer << "#type\t" << this->type << std::endl;
     writer << "#kit\t" << this->metadata.get_kit_name() << std::endl;
     writer << "#strand\t" << this->metadata.get_strand_model_name() << std::endl;
+    writer << "#alphabet\t" << this->pmalphabet->get_name() << std::endl;
     writer << "#shift_offset\t" << this->shift_offset << std::endl;
     writer << "#scale_offset\t" << this->scale_offset << std::endl;
 
@@ -257,6 +299,151 @@ void PoreModel::write(const std::string filename, const std::string modelname) c
     writer.close();
 }
 
+// Copy str into a fixed-size field of the binary header
+static void copy_header_string(char* dst, size_t dst_size, const std::string& str, const char* field)
+{
+    if(str.size() >= dst_size) {
+        fprintf(stderr, "Error: the model %s %s is too long for the binary format\n", field, str.c_str());
+        exit(EXIT_FAILURE);
+    }
+    memset(dst, 0, dst_size);
+    memcpy(dst, str.c_str(), str.size());
+}
+
+void PoreModel::write_binary(const std::string filename, const std::string modelname) const
+{
+    std::string outmodelname = modelname;
+    if(modelname.empty())
+        outmodelname = name;
+
+    BinaryModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MODEL_MAGIC, sizeof(BINARY_MODEL_MAGIC));
+    header.version = BINARY_MODEL_VERSION;
+    header.byte_order = BINARY_MODEL_BYTE_ORDER;
+    header.state_size = sizeof(PoreModelStateParams);
+    header.k = this->k;
+    header.kit = this->metadata.kit;
+    header.model_idx = this->metadata.model_idx;
+    header.strand_idx = this->metadata.strand_idx;
+    header.num_states = this->states.size();
+    header.shift_offset = this->shift_offset;
+    header.scale_offset = this->scale_offset;
+    copy_header_string(header.alphabet, sizeof(header.alphabet), this->pmalphabet->get_name(), "alphabet");
+    copy_header_string(header.name, sizeof(header.name), outmodelname, "name");
+    copy_header_string(header.type, sizeof(header.type), this->type, "type");
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if(fp == NULL) {
+        fprintf(stderr, "Error: could not open %s for writing\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if(!this->states.empty()) {
+        ok = ok && fwrite(this->states.data(), sizeof(PoreModelStateParams), this->states.size(), fp) == this->states.size();
+    }
+    ok = fclose(fp) == 0 && ok;
+
+    if(!ok) {
+        fprintf(stderr, "Error: could not write %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool PoreModel::is_binary_model_file(const std::string& filename)
+{
+    char magic[sizeof(BINARY_MODEL_MAGIC)];
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if(fp == NULL) {
+        return false;
+    }
+    bool is_binary = fread(magic, sizeof(magic), 1, fp) == 1 &&
+                     memcmp(magic, BINARY_MODEL_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return is_binary;
+}
+
+void PoreModel::load_binary(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: could not read %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = st.st_size;
+    if(size < sizeof(BinaryModelHeader)) {
+        fprintf(stderr, "Error: the binary model %s is truncated\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    const char* data = (const char*)p;
+
+    BinaryModelHeader header;
+    memcpy(&header, data, sizeof(header));
+    header.alphabet[sizeof(header.alphabet) - 1] = '\0';
+    header.name[sizeof(header.name) - 1] = '\0';
+    header.type[sizeof(header.type) - 1] = '\0';
+
+    if(header.byte_order != BINARY_MODEL_BYTE_ORDER) {
+        fprintf(stderr, "Error: the binary model %s was written with a different byte order\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    if(header.version != BINARY_MODEL_VERSION) {
+        fprintf(stderr, "Error: the binary model %s has version %u, expected %u\n", filename.c_str(), header.version, BINARY_MODEL_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    if(header.state_size != sizeof(PoreModelStateParams)) {
+        fprintf(stderr, "Error: the binary model %s has %u byte states, expected %zu\n", filename.c_str(),
+            header.state_size, sizeof(PoreModelStateParams));
+        exit(EXIT_FAILURE);
+    }
+
+    if(header.kit >= NUM_KITS || header.model_idx >= 3 || header.strand_idx >= 2 ||
+       header.k == 0 || header.k > BINARY_MODEL_MAX_K) {
+        fprintf(stderr, "Error: the binary model %s has invalid metadata\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    this->pmalphabet = get_alphabet_by_name(header.alphabet);
+    this->k = header.k;
+    if(size != sizeof(header) + (size_t)header.num_states * sizeof(PoreModelStateParams) ||
+       header.num_states != this->pmalphabet->get_num_strings(this->k)) {
+        fprintf(stderr, "Error: the binary model %s does not have the expected number of states\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    this->states.resize(header.num_states);
+    memcpy(this->states.data(), data + sizeof(header), header.num_states * sizeof(PoreModelStateParams));
+    munmap(p, size);
+
+    this->name = header.name;
+    this->type = header.type;
+    this->metadata.kit = (KitVersion)header.kit;
+    this->metadata.model_idx = header.model_idx;
+    this->metadata.strand_idx = header.strand_idx;
+    this->shift_offset = header.shift_offset;
+    this->scale_offset = header.scale_offset;
+
+    this->shift = 0.0;
+    this->scale = 1.0;
+    this->drift = 0.0;
+    this->var = 1.0;
+    this->scale_sd = 1.0;
+    this->var_sd = 1.0;
+    this->is_scaled = false;
+}
+
 void PoreModel::update_states( const PoreModel &other )
 {
     k = other.k;
@@ -94,6 +94,14 @@ class PoreModel
 
         void write(const std::string filename, const std::string modelname="") const;
 
+        // Write the model in the binary format, which stores the states along with
+        // their derived values so that loading does not need to parse or recompute them.
+        // Files in this format are recognized by the filename constructor.
+        void write_binary(const std::string filename, const std::string modelname="") const;
+
+        // returns true if the file starts with the magic number of the binary format
+        static bool is_binary_model_file(const std::string& filename);
+
         inline GaussianParameters get_scaled_parameters(const uint32_t kmer_rank) const
         {
             assert(is_scaled);
@@ -156,6 +164,11 @@ class PoreModel
         std::vector<PoreModelStateParams> states;
         std::vector<PoreModelStateParams> scaled_states;
         std::vector<GaussianParameters> scaled_params;
+
+    private:
+
+        // Read a model written by write_binary
+        void load_binary(const std::string& filename);
 };
 
 #endif
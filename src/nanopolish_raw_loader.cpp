@@ -0,0 +1,276 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_raw_loader -- map events detected from the
+// raw signal to the k-mers of the basecalled sequence
+//
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include "nanopolish_raw_loader.h"
+
+//#define DEBUG_ADAPTIVE 1
+
+// Moves into a cell of the dynamic programming matrix
+enum BandMove
+{
+    BM_NONE = 0,
+    BM_STEP,  // next event, next k-mer
+    BM_STAY,  // next event, same k-mer
+    BM_SKIP   // same event, next k-mer
+};
+
+static const int BAND_WIDTH = 100;
+
+std::vector<AlignedPair> adaptive_banded_event_align(const std::vector<SquiggleEvent>& events,
+                                                     const std::string& sequence,
+                                                     const PoreModel& pore_model)
+{
+    std::vector<AlignedPair> alignment;
+    const uint32_t k = pore_model.k;
+    if(sequence.size() < k || events.empty()) {
+        return alignment;
+    }
+
+    const int n_events = events.size();
+    const int n_kmers = sequence.size() - k + 1;
+
+    // Precompute the model level of each k-mer of the sequence
+    const Alphabet* alphabet = pore_model.pmalphabet;
+    std::vector<float> kmer_mean(n_kmers);
+    std::vector<float> kmer_stdv(n_kmers);
+    std::vector<float> kmer_log_stdv(n_kmers);
+    for(int ki = 0; ki < n_kmers; ++ki) {
+        uint32_t rank = alphabet->kmer_rank(sequence.c_str() + ki, k);
+        const PoreModelStateParams& state = pore_model.states[rank];
+        kmer_mean[ki] = state.level_mean;
+        kmer_stdv[ki] = state.level_stdv;
+        kmer_log_stdv[ki] = log(state.level_stdv);
+    }
+
+    // Method of moments estimate of shift and scale
+    double event_sum = 0.0, event_sumsq = 0.0;
+    for(int ei = 0; ei < n_events; ++ei) {
+        event_sum += events[ei].mean;
+        event_sumsq += events[ei].mean * events[ei].mean;
+    }
+
+    double kmer_sum = 0.0, kmer_sumsq = 0.0;
+    for(int ki = 0; ki < n_kmers; ++ki) {
+        kmer_sum += kmer_mean[ki];
+        kmer_sumsq += kmer_mean[ki] * kmer_mean[ki];
+    }
+
+    double event_level_mean = event_sum / n_events;
+    double event_level_stdv = sqrt(std::max(event_sumsq / n_events - event_level_mean * event_level_mean, 1e-6));
+    double kmer_level_mean = kmer_sum / n_kmers;
+    double kmer_level_stdv = sqrt(std::max(kmer_sumsq / n_kmers - kmer_level_mean * kmer_level_mean, 1e-6));
+    double scale = event_level_stdv / kmer_level_stdv;
+    double shift = event_level_mean - scale * kmer_level_mean;
+
+    std::vector<float> scaled_levels(n_events);
+    for(int ei = 0; ei < n_events; ++ei) {
+        scaled_levels[ei] = (events[ei].mean - shift) / scale;
+    }
+
+    // Transition probabilities. Staying in a k-mer is parameterized by the
+    // observed number of events per k-mer, skipping a k-mer is rare and
+    // events before the first k-mer (e.g. the adapter) are trimmed.
+    double events_per_kmer = (double)n_events / n_kmers;
+    double p_stay = 1 - (1 / (events_per_kmer + 1));
+    double p_skip = 1e-10;
+    float lp_stay = log(p_stay);
+    float lp_skip = log(p_skip);
+    float lp_step = log(1.0 - p_stay - p_skip);
+    float lp_trim = log(0.01);
+    static const float log_inv_sqrt_2pi = log(0.3989422804014327);
+
+    // Band b holds the cells (e, k) of the matrix with e + k = b, where row
+    // e = 0 and column k = 0 are the empty prefixes. The cell at offset o of
+    // the band is (band_event[b] - o, b - band_event[b] + o).
+    const int n_bands = n_events + n_kmers + 1;
+    std::vector<float> scores((size_t)n_bands * BAND_WIDTH, -INFINITY);
+    std::vector<uint8_t> moves((size_t)n_bands * BAND_WIDTH, BM_NONE);
+    std::vector<int> band_event(n_bands);
+
+    auto offset_of = [&](int band, int event_row) -> int {
+        int o = band_event[band] - event_row;
+        return o >= 0 && o < BAND_WIDTH ? o : -1;
+    };
+
+    // the first band is centered on the origin
+    band_event[0] = BAND_WIDTH / 2;
+
+    float best_end_score = -INFINITY;
+    int best_end_band = -1;
+    int best_end_event = -1;
+
+    for(int b = 0; b < n_bands; ++b) {
+
+        // Place this band below or to the right of the previous one, moving
+        // toward whichever end of the previous band scores higher
+        if(b > 0) {
+            int prev_event = band_event[b - 1];
+            int prev_top_kmer = (b - 1) - (prev_event - (BAND_WIDTH - 1));
+            bool move_down;
+            if(prev_event > n_events) {
+                move_down = false;
+            } else if(prev_top_kmer > n_kmers) {
+                move_down = true;
+            } else {
+                float lower_score = scores[(size_t)(b - 1) * BAND_WIDTH];
+                float upper_score = scores[(size_t)(b - 1) * BAND_WIDTH + BAND_WIDTH - 1];
+                move_down = lower_score > upper_score;
+            }
+            band_event[b] = prev_event + (move_down ? 1 : 0);
+        }
+
+        float* band_scores = &scores[(size_t)b * BAND_WIDTH];
+        uint8_t* band_moves = &moves[(size_t)b * BAND_WIDTH];
+
+        for(int o = 0; o < BAND_WIDTH; ++o) {
+            int e = band_event[b] - o;
+            int ki = b - e;
+            if(e < 0 || e > n_events || ki < 0 || ki > n_kmers) {
+                continue;
+            }
+
+            // events before the first k-mer are trimmed
+            if(ki == 0) {
+                band_scores[o] = e * lp_trim;
+                continue;
+            }
+
+            float best = -INFINITY;
+            uint8_t best_move = BM_NONE;
+
+            // skip the k-mer without using an event
+            int o_skip = b >= 1 ? offset_of(b - 1, e) : -1;
+            if(o_skip >= 0) {
+                float s = scores[(size_t)(b - 1) * BAND_WIDTH + o_skip] + lp_skip;
+                if(s > best) {
+                    best = s;
+                    best_move = BM_SKIP;
+                }
+            }
+
+            if(e > 0) {
+                float level = scaled_levels[e - 1];
+                float a = (level - kmer_mean[ki - 1]) / kmer_stdv[ki - 1];
+                float lp_emission = log_inv_sqrt_2pi - kmer_log_stdv[ki - 1] - 0.5f * a * a;
+
+                int o_stay = b >= 1 ? offset_of(b - 1, e - 1) : -1;
+                if(o_stay >= 0) {
+                    float s = scores[(size_t)(b - 1) * BAND_WIDTH + o_stay] + lp_stay + lp_emission;
+                    if(s > best) {
+                        best = s;
+                        best_move = BM_STAY;
+                    }
+                }
+
+                int o_step = b >= 2 ? offset_of(b - 2, e - 1) : -1;
+                if(o_step >= 0) {
+                    float s = scores[(size_t)(b - 2) * BAND_WIDTH + o_step] + lp_step + lp_emission;
+                    if(s > best) {
+                        best = s;
+                        best_move = BM_STEP;
+                    }
+                }
+            }
+
+            band_scores[o] = best;
+            band_moves[o] = best_move;
+
+            // events after the last k-mer are trimmed
+            if(ki == n_kmers && best_move != BM_NONE) {
+                float end_score = best + (n_events - e) * lp_trim;
+                if(end_score > best_end_score) {
+                    best_end_score = end_score;
+                    best_end_band = b;
+                    best_end_event = e;
+                }
+            }
+        }
+    }
+
+    if(best_end_band < 0) {
+        return alignment;
+    }
+
+    // Traceback from the best end cell
+    int b = best_end_band;
+    int e = best_end_event;
+    int ki = b - e;
+    size_t n_aligned_kmers = 0;
+    int prev_ki = -1;
+    double sum_emission = 0.0;
+
+    while(ki > 0) {
+        int o = offset_of(b, e);
+        assert(o >= 0);
+        uint8_t move = moves[(size_t)b * BAND_WIDTH + o];
+        assert(move != BM_NONE);
+
+        if(move == BM_STEP || move == BM_STAY) {
+            AlignedPair ap = { ki - 1, e - 1 };
+            alignment.push_back(ap);
+            n_aligned_kmers += ki != prev_ki;
+            prev_ki = ki;
+
+            float a = (scaled_levels[e - 1] - kmer_mean[ki - 1]) / kmer_stdv[ki - 1];
+            sum_emission += log_inv_sqrt_2pi - kmer_log_stdv[ki - 1] - 0.5f * a * a;
+        }
+
+        if(move == BM_STEP) {
+            b -= 2;
+            e -= 1;
+        } else if(move == BM_STAY) {
+            b -= 1;
+            e -= 1;
+        } else {
+            b -= 1;
+        }
+        ki = b - e;
+    }
+    std::reverse(alignment.begin(), alignment.end());
+
+    // Reject alignments that fit the model poorly or leave much of the sequence without events
+    double avg_emission = alignment.empty() ? -INFINITY : sum_emission / alignment.size();
+    double kmer_fraction = (double)n_aligned_kmers / n_kmers;
+
+#ifdef DEBUG_ADAPTIVE
+    fprintf(stderr, "[adaptive] events: %d kmers: %d shift: %.2lf scale: %.2lf aligned pairs: %zu kmer fraction: %.3lf avg emission: %.2lf\n",
+        n_events, n_kmers, shift, scale, alignment.size(), kmer_fraction, avg_emission);
+#endif
+
+    const double MIN_AVERAGE_LOG_EMISSION = -5.0;
+    const double MIN_KMER_FRACTION = 0.8;
+    if(avg_emission < MIN_AVERAGE_LOG_EMISSION || kmer_fraction < MIN_KMER_FRACTION) {
+        alignment.clear();
+    }
+    return alignment;
+}
+
+std::vector<EventRangeForBase> build_event_map_from_alignment(const std::vector<AlignedPair>& alignment,
+                                                              size_t n_kmers,
+                                                              uint32_t strand)
+{
+    std::vector<EventRangeForBase> out_event_map;
+    if(alignment.empty()) {
+        return out_event_map;
+    }
+
+    out_event_map.resize(n_kmers);
+    for(size_t i = 0; i < alignment.size(); ++i) {
+        const AlignedPair& ap = alignment[i];
+        assert(ap.ref_pos >= 0 && ap.ref_pos < (int)n_kmers);
+        IndexPair& range = out_event_map[ap.ref_pos].indices[strand];
+        if(range.start == -1) {
+            range.start = ap.read_pos;
+        }
+        range.stop = ap.read_pos;
+    }
+    return out_event_map;
+}
@@ -0,0 +1,34 @@
+//---------------------------------------------------------
+// Copyright 2017 Ontario Institute for Cancer Research
+// Written by Jared Simpson (jared.simpson@oicr.on.ca)
+//---------------------------------------------------------
+//
+// nanopolish_raw_loader -- map events detected from the
+// raw signal to the k-mers of the basecalled sequence
+//
+#ifndef NANOPOLISH_RAW_LOADER_H
+#define NANOPOLISH_RAW_LOADER_H
+
+#include <string>
+#include <vector>
+#include "nanopolish_anchor.h"
+#include "nanopolish_squiggle_read.h"
+
+// Align events to the k-mers of the sequence. The events are scaled to the
+// model by matching the mean and standard deviation of their levels to those
+// of the sequence's k-mers. The dynamic programming is restricted to a band
+// of cells along the anti-diagonals, which moves down or right to follow the
+// best scoring path, so the time is linear in the length of the read.
+// The result is a list of (k-mer, event) pairs in event order; read_pos is
+// the event index and ref_pos the k-mer index. The list is empty if the events
+// do not fit the sequence well enough to be used.
+std::vector<AlignedPair> adaptive_banded_event_align(const std::vector<SquiggleEvent>& events,
+                                                     const std::string& sequence,
+                                                     const PoreModel& pore_model);
+
+// Convert an event alignment into the range of events for each k-mer of the sequence
+std::vector<EventRangeForBase> build_event_map_from_alignment(const std::vector<AlignedPair>& alignment,
+                                                              size_t n_kmers,
+                                                              uint32_t strand);
+
+#endif
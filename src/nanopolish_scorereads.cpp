@@ -34,6 +34,8 @@
 #include "nanopolish_anchor.h"
 #include "nanopolish_fast5_map.h"
 #include "nanopolish_pore_model_set.h"
+#include "nanopolish_calibration_store.h"
+#include "nanopolish_parallel.h"
 #include "H5pubconf.h"
 
 //
@@ -57,6 +59,9 @@ static const char *SCOREREADS_USAGE_MESSAGE =
 "  -m, --models-fofn=FILE               optionally use these models rather than models in fast5\n"
 "  -c  --calibrate                      recalibrate aligned reads to model before scoring\n"
 "  -z  --zero-drift                     if recalibrating, keep drift at 0\n"
+"      --calibrate-loss=STR             weight the calibration residuals by ls (least squares), huber or t (default: ls)\n"
+"      --calibrate-rounds=NUM           if recalibrating, realign and recalibrate up to NUM times, stopping early\n"
+"                                       once the calibration has converged with few outliers (default: 1)\n"
 "  -i  --individual-reads=READ,READ     optional comma-delimited list of readnames to score\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
@@ -65,6 +70,7 @@ static const char *SCOREREADS_USAGE_MESSAGE =
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
 "      --train-transitions              train new transition parameters from the input reads\n"
 "      --learn-model-offset             learn the scaling offsets for the alternative pore models\n"
+"      --calibrations=FILE              reuse the read calibrations stored in FILE and add new ones to it\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -75,6 +81,7 @@ namespace opt
     static std::string bam_file;
     static std::string genome_file;
     static std::string models_fofn;
+    static std::string calibrations_file;
     static std::string region;
     static std::vector<std::string> readnames;
     static std::string alternative_model_type = "ONT";
@@ -93,16 +100,20 @@ namespace opt
     static double lm_shift_offset_stride = 0.1;
 
     static bool scale_drift = true;
+    static CalibrationLoss calibration_loss = CL_LEAST_SQUARES;
+    static int calibration_rounds = 1;
 }
 
 static const char* shortopts = "i:r:b:g:t:m:w:vcz";
 
-enum { OPT_HELP = 1, OPT_VERSION, OPT_TRAIN_TRANSITIONS, OPT_LEARN_MODEL_OFFSET };
+enum { OPT_HELP = 1, OPT_VERSION, OPT_TRAIN_TRANSITIONS, OPT_LEARN_MODEL_OFFSET, OPT_CALIBRATE_LOSS, OPT_CALIBRATE_ROUNDS, OPT_CALIBRATIONS };
 
 static const struct option longopts[] = {
     { "verbose",            no_argument,       NULL, 'v' },
     { "calibrate",          no_argument,       NULL, 'c' },
     { "zero-drift",         no_argument,       NULL, 'z' },
+    { "calibrate-loss",     required_argument, NULL, OPT_CALIBRATE_LOSS },
+    { "calibrate-rounds",   required_argument, NULL, OPT_CALIBRATE_ROUNDS },
     { "reads",              required_argument, NULL, 'r' },
     { "bam",                required_argument, NULL, 'b' },
     { "genome",             required_argument, NULL, 'g' },
@@ -112,6 +123,7 @@ static const struct option longopts[] = {
     { "window",             required_argument, NULL, 'w' },
     { "train-transitions",  no_argument,       NULL, OPT_TRAIN_TRANSITIONS },
     { "learn-model-offset", no_argument,       NULL, OPT_LEARN_MODEL_OFFSET },
+    { "calibrations",       required_argument, NULL, OPT_CALIBRATIONS },
     { "help",               no_argument,       NULL, OPT_HELP },
     { "version",            no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
@@ -120,6 +132,7 @@ static const struct option longopts[] = {
 double model_score(SquiggleRead &sr,
                    const size_t strand_idx,
                    const faidx_t *fai, 
+                   const bam_hdr_t* hdr,
                    const std::vector<EventAlignment> &alignment_output,
                    const size_t events_per_segment,
                    TransitionParameters* transition_training)
@@ -133,7 +146,7 @@ double model_score(SquiggleRead &sr,
 
         const EventAlignment& align_start = alignment_output[align_start_idx];
         const EventAlignment& align_end = alignment_output[align_start_idx + events_per_segment];
-        std::string contig = alignment_output.front().ref_name.c_str();
+        std::string contig = get_ref_name(hdr, alignment_output.front());
 
         // Set up event data
         HMMInputData data;
@@ -177,7 +190,7 @@ double model_score(SquiggleRead &sr,
         double curr_drift = sr.pore_model[strand_idx].drift;
         double curr_var = sr.pore_model[strand_idx].var;
             
-        recalibrate_model(sr, strand_idx, event_alignment_sub, &gDNAAlphabet, true, opt::scale_drift);
+        recalibrate_model(sr, strand_idx, event_alignment_sub, alphabet, true, opt::scale_drift);
 
         fprintf(stdout, "SEGMENT\t%s\t%zu\t%.3lf\t%d\t%.2lf\t%.2lf\t%.2lf\t%.2lf\n", 
                     sr.read_name.c_str(), 
@@ -218,6 +231,7 @@ void sweep_offset_parameters(SquiggleRead &sr,
                              const size_t strand_idx,
                              const size_t read_idx,
                              const faidx_t *fai,
+                             const bam_hdr_t* hdr,
                              const std::vector<EventAlignment> &alignment_output,
                              const size_t events_per_segment,
                              const std::string alternative_model_type,
@@ -234,7 +248,7 @@ void sweep_offset_parameters(SquiggleRead &sr,
 
     const EventAlignment& align_start = alignment_output[align_start_idx];
     const EventAlignment& align_end = alignment_output[align_start_idx + events_per_segment];
-    std::string contig = alignment_output.front().ref_name.c_str();
+    std::string contig = get_ref_name(hdr, alignment_output.front());
 
     // Set up event data
     HMMInputData data;
@@ -354,6 +368,7 @@ void parse_scorereads_options(int argc, char** argv)
             case 'g': arg >> opt::genome_file; break;
             case 't': arg >> opt::num_threads; break;
             case 'm': arg >> opt::models_fofn; break;
+            case OPT_CALIBRATIONS: arg >> opt::calibrations_file; break;
             case 'w': arg >> opt::region; break;
             case 'i': arg >> readlist; break;
             case 'v': opt::verbose++; break;
@@ -362,6 +377,13 @@ void parse_scorereads_options(int argc, char** argv)
             case '?': die = true; break;
             case OPT_TRAIN_TRANSITIONS: opt::train_transitions = 1; break;
             case OPT_LEARN_MODEL_OFFSET: opt::learn_model_offset = 1; break;
+            case OPT_CALIBRATE_LOSS:
+                if(!parse_calibration_loss(arg.str(), opt::calibration_loss)) {
+                    std::cerr << SUBPROGRAM ": unknown --calibrate-loss: " << arg.str() << "\n";
+                    die = true;
+                }
+                break;
+            case OPT_CALIBRATE_ROUNDS: arg >> opt::calibration_rounds; break;
             case OPT_HELP:
                 std::cout << SCOREREADS_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -376,6 +398,11 @@ void parse_scorereads_options(int argc, char** argv)
         die = true;
     }
 
+    if(opt::calibration_rounds <= 0) {
+        std::cerr << SUBPROGRAM ": invalid --calibrate-rounds: " << opt::calibration_rounds << "\n";
+        die = true;
+    }
+
     if(opt::num_threads <= 0) {
         std::cerr << SUBPROGRAM ": invalid number of threads: " << opt::num_threads << "\n";
         die = true;
@@ -404,6 +431,10 @@ void parse_scorereads_options(int argc, char** argv)
         PoreModelSet::initialize(opt::models_fofn);
     }
 
+    if(!opt::calibrations_file.empty()) {
+        CalibrationStore::initialize(opt::calibrations_file);
+    }
+
     // this is much cleaner with sregex_token_iterator, which isn't implemented in gcc until 4.9
     if (!readlist.empty()) {
         size_t start = readlist.find_first_not_of(","), end=start;
@@ -425,7 +456,7 @@ void parse_scorereads_options(int argc, char** argv)
 int scorereads_main(int argc, char** argv)
 {
     parse_scorereads_options(argc, argv);
-    omp_set_num_threads(opt::num_threads);
+    set_parallel_num_threads(opt::num_threads);
 
     Fast5Map name_map(opt::reads_file);
 
@@ -507,8 +538,7 @@ int scorereads_main(int argc, char** argv)
 
         // realign if we've hit the max buffer size or reached the end of file
         if(num_records_buffered == records.size() || result < 0) {
-            #pragma omp parallel for schedule(dynamic)
-            for(size_t i = 0; i < num_records_buffered; ++i) {
+            parallel_for(num_records_buffered, [&](size_t i) {
                 bam1_t* record = records[i];
                 size_t read_idx = num_reads_realigned + i;
                 if( (record->core.flag & BAM_FUNMAP) == 0) {
@@ -521,7 +551,7 @@ int scorereads_main(int argc, char** argv)
                     // TODO: early exit when have processed all of the reads in readnames
                     if (!opt::readnames.empty() &&
                          std::find(opt::readnames.begin(), opt::readnames.end(), read_name) == opt::readnames.end() )
-                            continue;
+                            return;
 
                     for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
                         
@@ -539,16 +569,37 @@ int scorereads_main(int argc, char** argv)
                         if (ao.size() == 0)
                             continue;
 
-                        // Update pore model based on alignment
+                        // Update pore model based on alignment. A calibration that has converged
+                        // with few outliers is used as is, otherwise the read is realigned to the
+                        // recalibrated model and calibrated again.
                         if( opt::calibrate ) {
-                            recalibrate_model(sr, strand_idx, ao, &gDNAAlphabet, true, opt::scale_drift);
+                            CalibrationOptions calibration_options;
+                            calibration_options.loss = opt::calibration_loss;
+                            calibration_options.scale_drift = opt::scale_drift;
+
+                            for(int round = 0; round < opt::calibration_rounds; ++round) {
+                                CalibrationResiduals residuals;
+                                if(!recalibrate_model(sr, strand_idx, ao, sr.pore_model[strand_idx].pmalphabet, calibration_options, &residuals) ||
+                                   calibration_is_stable(residuals) || round + 1 == opt::calibration_rounds) {
+                                    break;
+                                }
+
+                                ao = alignment_from_read(sr, strand_idx, read_idx, model_type_for_alignment,
+                                                         fai, hdr, record, clip_start, clip_end);
+                                if(ao.empty()) {
+                                    break;
+                                }
+                            }
                         }
 
+                        if (ao.size() == 0)
+                            continue;
+
                         if(opt::learn_model_offset) {
-                            sweep_offset_parameters(sr, strand_idx, read_idx, fai, ao, 500, opt::alternative_model_type, offset_fp);
+                            sweep_offset_parameters(sr, strand_idx, read_idx, fai, hdr, ao, 500, opt::alternative_model_type, offset_fp);
                         }
 
-                        double score = model_score(sr, strand_idx, fai, ao, 500, transition_training[strand_idx]);
+                        double score = model_score(sr, strand_idx, fai, hdr, ao, 500, transition_training[strand_idx]);
                         if(score > 0)
                             continue;
 
@@ -559,7 +610,7 @@ int scorereads_main(int argc, char** argv)
                                   " drift " << sr.pore_model[strand_idx].drift << " var " << sr.pore_model[strand_idx].var << std::endl;
                     }
                 }
-            }
+            }, "scorereads");
 
             num_reads_realigned += num_records_buffered;
             num_records_buffered = 0;
@@ -588,6 +639,8 @@ int scorereads_main(int argc, char** argv)
     fai_destroy(fai);
     sam_close(bam_fh);
     hts_idx_destroy(bam_idx);
+
+    CalibrationStore::write();
     return 0;
 }
 
@@ -23,6 +23,7 @@ std::vector<EventAlignment> alignment_from_read(SquiggleRead& sr,
 double model_score(SquiggleRead &sr,
                    const size_t strand_idx,
                    const faidx_t *fai, 
+                   const bam_hdr_t* hdr,
                    const std::vector<EventAlignment> &alignment_output,
                    const size_t events_per_segment,
                    TransitionParameters* transition_training);
@@ -12,6 +12,10 @@
 #include "nanopolish_pore_model_set.h"
 #include "nanopolish_methyltrain.h"
 #include "nanopolish_extract.h"
+#include "nanopolish_fast5_reader.h"
+#include "nanopolish_event_detection.h"
+#include "nanopolish_raw_loader.h"
+#include "nanopolish_calibration_store.h"
 #include <fast5.hpp>
 
 //#define DEBUG_MODEL_SELECTION 1
@@ -33,6 +37,19 @@ SquiggleRead::SquiggleRead(const std::string& name, const std::string& path, con
     f_p(nullptr)
 {
     events_per_base[0] = events_per_base[1] = 0.0f;
+    have_native_events[0] = have_native_events[1] = false;
+    have_native_samples = false;
+    detected_events[0] = detected_events[1] = false;
+
+    #pragma omp critical(sr_load_fast5)
+    {
+        open_fast5();
+    }
+
+    // The event tables and raw signal are most of the data in the file. They are
+    // decoded outside of the HDF5 lock by the native reader so that many reads can
+    // load at once. Anything the native reader can't parse is read through HDF5 below.
+    load_native_datasets(flags);
 
     #pragma omp critical(sr_load_fast5)
     {
@@ -95,13 +112,119 @@ void SquiggleRead::transform()
 }
 
 //
-void SquiggleRead::load_from_fast5(const uint32_t flags)
+void SquiggleRead::open_fast5()
 {
     f_p = new fast5::File(fast5_path);
     assert(f_p->is_open());
     detect_pore_type();
     detect_basecall_group();
     assert(not basecall_group.empty());
+}
+
+// Copy a basecaller event table into fast5 library events. Tables that
+// give event times in samples rather than seconds are left to the library.
+static bool read_native_events(Fast5Reader& reader,
+                               const std::string& path,
+                               std::vector<fast5::Basecall_Event>& out)
+{
+    Fast5Dataset ds;
+    if(!reader.read_dataset(path, ds)) {
+        return false;
+    }
+
+    const Fast5Member* start_member = ds.get_member("start");
+    const Fast5Member* length_member = ds.get_member("length");
+    const Fast5Member* model_state_member = ds.get_member("model_state");
+    if(start_member == NULL || start_member->type_class != F5T_FLOAT ||
+       length_member == NULL || length_member->type_class != F5T_FLOAT ||
+       model_state_member == NULL || model_state_member->type_class != F5T_STRING) {
+        return false;
+    }
+
+    std::vector<double> mean, stdv, start, length, p_model_state, move;
+    if(!ds.get_numeric_column("mean", mean) ||
+       !ds.get_numeric_column("stdv", stdv) ||
+       !ds.get_numeric_column("start", start) ||
+       !ds.get_numeric_column("length", length) ||
+       !ds.get_numeric_column("p_model_state", p_model_state) ||
+       !ds.get_numeric_column("move", move)) {
+        return false;
+    }
+
+    out.resize(mean.size());
+    for(size_t ei = 0; ei < out.size(); ++ei) {
+        fast5::Basecall_Event& e = out[ei];
+        e.mean = mean[ei];
+        e.stdv = stdv[ei];
+        e.start = start[ei];
+        e.length = length[ei];
+        e.p_model_state = p_model_state[ei];
+        e.move = static_cast<decltype(e.move)>(move[ei]);
+
+        const char* ms = (const char*)&ds.data[ei * ds.type.size + model_state_member->offset];
+        size_t ms_len = std::min(strnlen(ms, model_state_member->size), sizeof(e.model_state) - 1);
+        memset(&e.model_state[0], 0, sizeof(e.model_state));
+        memcpy(&e.model_state[0], ms, ms_len);
+    }
+    return true;
+}
+
+void SquiggleRead::load_native_datasets(const uint32_t flags)
+{
+    Fast5Reader reader;
+    if(!reader.open(fast5_path)) {
+        return;
+    }
+
+    for(size_t si = 0; si < 2; ++si) {
+        if(! (read_type == SRT_2D || read_type == si) ) {
+            continue;
+        }
+
+        std::string path = "/Analyses/Basecall_" + basecall_group + "/BaseCalled_" +
+                           (si == 0 ? "template" : "complement") + "/Events";
+        have_native_events[si] = read_native_events(reader, path, native_events[si]);
+    }
+
+    if(flags & SRF_LOAD_RAW_SAMPLES) {
+        // we assume the first raw sample read is the one we're after, as below
+        std::vector<std::string> sample_read_names;
+        if(!reader.list_group("/Raw/Reads", sample_read_names) || sample_read_names.empty()) {
+            return;
+        }
+
+        std::string read_path = "/Raw/Reads/" + sample_read_names.front();
+        std::string channel_path = "/UniqueGlobalKey/channel_id";
+        Fast5Dataset signal;
+        double start_time, digitisation, offset, range, sampling_rate;
+        if(!reader.read_dataset(read_path + "/Signal", signal) ||
+           signal.type.type_class != F5T_FIXED || signal.type.size != 2 || !signal.type.is_signed ||
+           !reader.read_numeric_attribute(read_path, "start_time", start_time) ||
+           !reader.read_numeric_attribute(channel_path, "digitisation", digitisation) ||
+           !reader.read_numeric_attribute(channel_path, "offset", offset) ||
+           !reader.read_numeric_attribute(channel_path, "range", range) ||
+           !reader.read_numeric_attribute(channel_path, "sampling_rate", sampling_rate)) {
+            return;
+        }
+
+        // convert the raw DAC values to picoamps
+        size_t n = signal.get_num_elements();
+        samples.resize(n);
+        for(size_t i = 0; i < n; ++i) {
+            int16_t raw;
+            memcpy(&raw, &signal.data[2 * i], 2);
+            samples[i] = (raw + offset) * range / digitisation;
+        }
+        sample_start_time = start_time;
+        sample_rate = sampling_rate;
+        have_native_samples = true;
+    }
+}
+
+//
+void SquiggleRead::load_from_fast5(const uint32_t flags)
+{
+    assert(f_p and f_p->is_open());
 
     read_sequence = f_p->get_basecall_seq(read_type, basecall_group);
 
@@ -116,8 +239,29 @@ void SquiggleRead::load_from_fast5(const uint32_t flags)
             continue;
         }
 
+        // Reads basecalled without an event table are segmented from the raw signal
+        if(!have_native_events[si] && !f_p->have_basecall_events(si, basecall_group)) {
+            read_sequences_1d[si] = f_p->get_basecall_seq(si == 0 ? SRT_TEMPLATE : SRT_COMPLEMENT,
+                                                          f_p->get_basecall_1d_group(basecall_group));
+            event_maps_1d[si] = detect_events_from_samples(read_sequences_1d[si], si);
+
+            if(!event_maps_1d[si].empty()) {
+                // the detected events carry no basecaller confidence so none are filtered for calibration
+                std::vector<double> p_model_states(events[si].size(), 1.0);
+                _load_R9(si, read_sequences_1d[si], event_maps_1d[si], p_model_states, flags);
+            } else {
+                events[si].clear();
+            }
+            continue;
+        }
+
         // Load the events for this strand
-        auto f5_events = f_p->get_basecall_events(si, basecall_group);
+        std::vector<fast5::Basecall_Event> f5_events;
+        if(have_native_events[si]) {
+            f5_events.swap(native_events[si]);
+        } else {
+            f5_events = f_p->get_basecall_events(si, basecall_group);
+        }
 
         // copy events
         events[si].resize(f5_events.size());
@@ -175,22 +319,12 @@ void SquiggleRead::load_from_fast5(const uint32_t flags)
 
     // Load raw samples if requested
     if(flags & SRF_LOAD_RAW_SAMPLES) {
-
-        auto& sample_read_names = f_p->get_raw_samples_read_name_list();
-        if(sample_read_names.empty()) {
-            fprintf(stderr, "Error, no raw samples found\n");
-            exit(EXIT_FAILURE);
+        if(samples.empty()) {
+            load_raw_samples();
         }
-
-        // we assume the first raw sample read is the one we're after
-        std::string sample_read_name = sample_read_names.front();
-
-        samples = f_p->get_raw_samples(sample_read_name);
-        sample_start_time = f_p->get_raw_samples_params(sample_read_name).start_time;
-
-        // retreive parameters
-        auto channel_params = f_p->get_channel_id_params();
-        sample_rate = channel_params.sampling_rate;
+    } else if(!samples.empty()) {
+        // the samples were only needed for event detection
+        std::vector<float>().swap(samples);
     }
 
     // Filter poor quality reads that have too many "stays"
@@ -204,6 +338,68 @@ void SquiggleRead::load_from_fast5(const uint32_t flags)
     f_p = nullptr;
 }
 
+void SquiggleRead::load_raw_samples()
+{
+    assert(f_p and f_p->is_open());
+
+    auto& sample_read_names = f_p->get_raw_samples_read_name_list();
+    if(sample_read_names.empty()) {
+        fprintf(stderr, "Error, no raw samples found\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // we assume the first raw sample read is the one we're after
+    std::string sample_read_name = sample_read_names.front();
+
+    samples = f_p->get_raw_samples(sample_read_name);
+    sample_start_time = f_p->get_raw_samples_params(sample_read_name).start_time;
+
+    // retreive parameters
+    auto channel_params = f_p->get_channel_id_params();
+    sample_rate = channel_params.sampling_rate;
+}
+
+std::vector<EventRangeForBase> SquiggleRead::detect_events_from_samples(const std::string& read_sequence_1d,
+                                                                        uint32_t strand)
+{
+    // only 1D R9 reads are basecalled without events
+    if(pore_type != PT_R9 || read_type != SRT_TEMPLATE || strand != T_IDX) {
+        g_unparseable_reads += 1;
+        return std::vector<EventRangeForBase>();
+    }
+
+    if(samples.empty()) {
+        load_raw_samples();
+    }
+
+    std::vector<DetectedEvent> detected = detect_events(samples);
+    events[strand].resize(detected.size());
+    for(size_t ei = 0; ei < detected.size(); ++ei) {
+        const DetectedEvent& de = detected[ei];
+        events[strand][ei] = { de.mean,
+                               de.stdv,
+                               (sample_start_time + de.start) / sample_rate,
+                               static_cast<float>(de.length / sample_rate),
+                               static_cast<float>(log(de.stdv))
+                             };
+    }
+    detected_events[strand] = true;
+
+    // The events are placed on the sequence by aligning them to the calibration
+    // model's levels. The kit is not known yet, so the 450bps model is used;
+    // the levels are close enough across R9 kits for this purpose.
+    static const PoreModelHandle calibration_model = PoreModelSet::get_model_handle("r9.4_450bps", "nucleotide", "template", 5);
+    const PoreModel& model = PoreModelSet::get_model(calibration_model);
+    std::vector<AlignedPair> alignment = adaptive_banded_event_align(events[strand], read_sequence_1d, model);
+
+    g_total_reads += 1;
+    if(alignment.empty()) {
+        g_unparseable_reads += 1;
+        return std::vector<EventRangeForBase>();
+    }
+    return build_event_map_from_alignment(alignment, read_sequence_1d.size() - model.k + 1, strand);
+}
+
 void SquiggleRead::_load_R7(uint32_t si)
 {
     assert(f_p and f_p->is_open());
@@ -243,7 +439,8 @@ void SquiggleRead::_load_R9(uint32_t si,
     }
 
     // Parse kit name and label_shift from the model type encoded in the fast5
-    std::string kit = "";
+    std::string kit_name = "";
+    KitVersion kit = KV_R9_4_450BPS;
     int label_shift = 0;
     if( (flags & SRF_NO_MODEL) == 0) {
 
@@ -266,107 +463,83 @@ void SquiggleRead::_load_R9(uint32_t si,
             mt = config["general/model_type"];
         }
 
-        kit = "r9.4_450bps";
+        kit_name = "r9.4_450bps";
         // all 250bps data should use this model (according to ONT see
         // https://github.com/nanoporetech/kmer_models/issues/3)
         if(mt == "r9_250bps_nn" || mt == "r9_250bps" || mt == "r94_250bps" || mt == "r94_250bps_nn" || mt == "r9.4_250bps") {
             label_shift = 0;
-            kit = "r9_250bps";
+            kit_name = "r9_250bps";
+            kit = KV_R9_250BPS;
         } else if(mt == "r94_450bps" || mt == "r9_450bps" || mt == "r9.4_450bps" || mt == "r9.5_450bps") {
             label_shift = is_albacore_1_or_later ? -1 : 0;
-            kit = "r9.4_450bps";
+            kit_name = "r9.4_450bps";
+            kit = KV_R9_4_450BPS;
         } else {
             fprintf(stderr, "Unknown model type string: %s, please report on github.\n", mt.c_str());
             exit(1);
         }
-    }
 
-    std::vector<EventAlignment> alignment =
-        get_eventalignment_for_1d_basecalls(read_sequence_1d, event_map_1d, calibration_k, si, label_shift);
-
-    // JTS Hack: blacklist bad k-mer and filter out events with low p_model_state
-    double keep_fraction = 0.75;
-    std::vector<double> sorted_p_model_states = p_model_states;
-    std::sort(sorted_p_model_states.begin(), sorted_p_model_states.end());
-    double p_model_state_threshold = sorted_p_model_states[sorted_p_model_states.size() * (1 - keep_fraction)];
-
-    std::string blacklist_kmer = "CCTAG";
-    std::vector<EventAlignment> filtered;
-    filtered.reserve(alignment.size());
-
-    assert(p_model_states.size() == events[si].size());
-
-    // This vector tracks the number of events observed (by the basecaller) for each kmer
-    std::vector<size_t> event_counts;
-    event_counts.reserve(read_sequence_1d.length());
-    std::string prev_kmer = "";
-
-    for(const auto& ea : alignment) {
-        if((!ea.rc && ea.ref_kmer == blacklist_kmer) ||
-           (ea.rc && ea.ref_kmer == gDNAAlphabet.reverse_complement(blacklist_kmer)))
-        {
-            continue;
+        // detected events were aligned to the k-mers of the model directly
+        if(detected_events[si]) {
+            label_shift = 0;
         }
+    }
 
-        if(ea.ref_kmer != prev_kmer) {
-            prev_kmer = ea.ref_kmer;
-            event_counts.push_back(1);
-        } else {
-            assert(!event_counts.empty());
-            event_counts.back() += 1;
+    // For the template strand we only have one candidate model
+    // For complement we need to select between the two possible models
+    const Alphabet* alphabet = &gDNAAlphabet; // always calibrate with the nucleotide alphabet
+    std::vector<PoreModelHandle> candidate_models;
+    uint64_t candidate_fingerprint = 0;
+    if( (flags & SRF_NO_MODEL) == 0) {
+        for(size_t model_idx = (si == 0 ? 0 : 1); model_idx < (si == 0 ? 1 : 3); ++model_idx) {
+            PoreModelHandle handle = PoreModelSet::find_model(kit, alphabet, model_idx, calibration_k);
+            if(handle != INVALID_PORE_MODEL_HANDLE) {
+                candidate_models.push_back(handle);
+                candidate_fingerprint = candidate_fingerprint * 31 + PoreModelSet::get_model_fingerprint(handle);
+            } else if(si == 0) {
+                fprintf(stderr, "Error: cannot find the template model for kit %s\n", kit_name.c_str());
+                exit(EXIT_FAILURE);
+            }
         }
-
-        if(p_model_states[ea.event_idx] < p_model_state_threshold)
-            continue;
-
-        filtered.push_back(ea);
     }
 
+    // Reuse the stored calibration of this strand if it was made from the same events and models
+    StoredCalibration stored;
+    bool have_stored = !candidate_models.empty() &&
+                       CalibrationStore::is_enabled() &&
+                       CalibrationStore::find(read_name, si, stored) &&
+                       stored.matches(kit, candidate_fingerprint, events[si].size(), read_sequence_1d.size());
 
-    // Estimate the events-per-base sequencing rate
-    // This is used for QC and to parameterize the HMM
-    // We trim off the lowest and highest trim_frac event counts
-    // to avoid the extremely long stays that occasionally occur
-    std::sort(event_counts.begin(), event_counts.end());
-    double trim_frac = 0.05;
-    size_t trim_start_idx = trim_frac * (float)event_counts.size();
-    size_t trim_end_idx = (1 - trim_frac) * (float)event_counts.size();
-    size_t event_count_sum = 0;
-    for(size_t i = trim_start_idx; i < trim_end_idx; ++i) {
-        event_count_sum += event_counts[i];
+    std::vector<EventAlignment> filtered;
+    if(have_stored) {
+        events_per_base[si] = stored.events_per_base;
+    } else {
+        filtered = _get_calibration_events(si, read_sequence_1d, event_map_1d, p_model_states, calibration_k, label_shift);
     }
 
-    // Estimate sequencing rate
-    double total_duration = get_time(events[0].size() - 1, 0);
-    double rate = read_sequence_1d.size() / total_duration;
-
-    events_per_base[si] = (float)event_count_sum / (trim_end_idx - trim_start_idx);
-    //fprintf(stderr, "events per base: %.2lf rate: %.2lf\n", events_per_base[si], rate);
-
     // Load the pore model (if requested) and calibrate it
     if( (flags & SRF_NO_MODEL) == 0) {
 
-        std::string alphabet = "nucleotide"; // always calibrate with the nucleotide alphabet
+        PoreModel best_model;
+        double best_model_var = INFINITY;
 
-        // For the template strad we only have one candidate model
-        // For complement we need to select between the two possible models
-        std::vector<const PoreModel*> candidate_models;
-        if(si == 0) {
-            candidate_models.push_back(&PoreModelSet::get_model(kit, alphabet, "template", calibration_k));
-        } else {
-            for(const std::string& cmn : { "complement.pop1", "complement.pop2" } ) {
-                if(PoreModelSet::has_model(kit, alphabet, cmn, calibration_k)) {
-                   candidate_models.push_back(&PoreModelSet::get_model(kit, alphabet, cmn, calibration_k));
-                }
+        if(have_stored) {
+            PoreModelHandle stored_model = PoreModelSet::find_model(kit, alphabet, stored.model_idx, calibration_k);
+            if(stored.calibrated && stored_model != INVALID_PORE_MODEL_HANDLE) {
+                best_model = PoreModelSet::get_model(stored_model);
+                best_model.shift = stored.shift;
+                best_model.scale = stored.scale;
+                best_model.drift = stored.drift;
+                best_model.var = stored.var;
+                best_model.scale_sd = stored.scale_sd;
+                best_model.var_sd = stored.var_sd;
+                best_model_var = stored.var;
             }
         }
 
-        PoreModel best_model;
-        double best_model_var = INFINITY;
-
-        for(size_t model_idx = 0; model_idx < candidate_models.size(); model_idx++) {
+        for(size_t model_idx = 0; !have_stored && model_idx < candidate_models.size(); model_idx++) {
 
-            pore_model[si] = *candidate_models[model_idx];
+            pore_model[si] = PoreModelSet::get_model(candidate_models[model_idx]);
 
             // Initialize to default scaling parameters
             pore_model[si].shift = 0.0;
@@ -396,7 +569,28 @@ void SquiggleRead::_load_R9(uint32_t si,
 #endif
         }
 
-        if(best_model_var < 2.5) {
+        bool calibrated = best_model_var < 2.5;
+
+        // Save the calibration so later runs can skip it
+        if(!have_stored && CalibrationStore::is_enabled()) {
+            StoredCalibration c;
+            c.kit = kit;
+            c.model_fingerprint = candidate_fingerprint;
+            c.n_events = events[si].size();
+            c.read_length = read_sequence_1d.size();
+            c.calibrated = calibrated;
+            c.model_idx = calibrated ? best_model.metadata.model_idx : 0;
+            c.events_per_base = events_per_base[si];
+            c.shift = calibrated ? best_model.shift : 0.0;
+            c.scale = calibrated ? best_model.scale : 1.0;
+            c.drift = calibrated ? best_model.drift : 0.0;
+            c.var = calibrated ? best_model.var : INFINITY;
+            c.scale_sd = calibrated ? best_model.scale_sd : 1.0;
+            c.var_sd = calibrated ? best_model.var_sd : 1.0;
+            CalibrationStore::add(read_name, si, c);
+        }
+
+        if(calibrated) {
 #ifdef DEBUG_MODEL_SELECTION
             fprintf(stderr, "[calibration] selected model with var %.4lf\n", best_model_var);
 #endif
@@ -411,11 +605,16 @@ void SquiggleRead::_load_R9(uint32_t si,
             double var_sd = pore_model[si].var_sd;
 
             // Replace model
-            PoreModel final_model = PoreModelSet::get_model(kit,
-                                                            alphabet,
-                                                            best_model.metadata.get_strand_model_name(),
-                                                            final_model_k);
-            pore_model[si] = final_model;
+            PoreModelHandle final_model = PoreModelSet::find_model(kit,
+                                                                   alphabet,
+                                                                   best_model.metadata.model_idx,
+                                                                   final_model_k);
+            if(final_model == INVALID_PORE_MODEL_HANDLE) {
+                fprintf(stderr, "Error: cannot find the %s model for kit %s\n",
+                    best_model.metadata.get_strand_model_name().c_str(), kit_name.c_str());
+                exit(EXIT_FAILURE);
+            }
+            pore_model[si] = PoreModelSet::get_model(final_model);
 
             // Copy calibration params
             pore_model[si].shift = shift;
@@ -438,6 +637,85 @@ void SquiggleRead::_load_R9(uint32_t si,
     }
 }
 
+// Align the events of the strand to its 1D basecalls and keep the events
+// that are reliable enough to calibrate against. This also estimates the
+// events-per-base rate of the strand.
+std::vector<EventAlignment> SquiggleRead::_get_calibration_events(uint32_t si,
+                                                                  const std::string& read_sequence_1d,
+                                                                  const std::vector<EventRangeForBase>& event_map_1d,
+                                                                  const std::vector<double>& p_model_states,
+                                                                  size_t calibration_k,
+                                                                  int label_shift)
+{
+    std::vector<EventAlignment> alignment =
+        get_eventalignment_for_1d_basecalls(read_sequence_1d, event_map_1d, calibration_k, si, label_shift);
+
+    // JTS Hack: blacklist bad k-mer and filter out events with low p_model_state
+    double keep_fraction = 0.75;
+    std::vector<double> sorted_p_model_states = p_model_states;
+    std::sort(sorted_p_model_states.begin(), sorted_p_model_states.end());
+    double p_model_state_threshold = sorted_p_model_states[sorted_p_model_states.size() * (1 - keep_fraction)];
+
+    std::string blacklist_kmer = "CCTAG";
+    uint32_t blacklist_rank = gDNAAlphabet.kmer_rank(blacklist_kmer.c_str(), blacklist_kmer.size());
+    uint32_t rc_blacklist_rank = gDNAAlphabet.kmer_rank(gDNAAlphabet.reverse_complement(blacklist_kmer).c_str(), blacklist_kmer.size());
+    bool check_blacklist = calibration_k == blacklist_kmer.size();
+    std::vector<EventAlignment> filtered;
+    filtered.reserve(alignment.size());
+
+    assert(p_model_states.size() == events[si].size());
+
+    // This vector tracks the number of events observed (by the basecaller) for each kmer
+    std::vector<size_t> event_counts;
+    event_counts.reserve(read_sequence_1d.length());
+    int64_t prev_kmer_rank = -1;
+
+    for(const auto& ea : alignment) {
+        if(check_blacklist &&
+           ((!ea.rc && ea.ref_kmer_rank == blacklist_rank) ||
+            (ea.rc && ea.ref_kmer_rank == rc_blacklist_rank)))
+        {
+            continue;
+        }
+
+        if(ea.ref_kmer_rank != prev_kmer_rank) {
+            prev_kmer_rank = ea.ref_kmer_rank;
+            event_counts.push_back(1);
+        } else {
+            assert(!event_counts.empty());
+            event_counts.back() += 1;
+        }
+
+        if(p_model_states[ea.event_idx] < p_model_state_threshold)
+            continue;
+
+        filtered.push_back(ea);
+    }
+
+
+    // Estimate the events-per-base sequencing rate
+    // This is used for QC and to parameterize the HMM
+    // We trim off the lowest and highest trim_frac event counts
+    // to avoid the extremely long stays that occasionally occur
+    std::sort(event_counts.begin(), event_counts.end());
+    double trim_frac = 0.05;
+    size_t trim_start_idx = trim_frac * (float)event_counts.size();
+    size_t trim_end_idx = (1 - trim_frac) * (float)event_counts.size();
+    size_t event_count_sum = 0;
+    for(size_t i = trim_start_idx; i < trim_end_idx; ++i) {
+        event_count_sum += event_counts[i];
+    }
+
+    // Estimate sequencing rate
+    double total_duration = get_time(events[0].size() - 1, 0);
+    double rate = read_sequence_1d.size() / total_duration;
+
+    events_per_base[si] = (float)event_count_sum / (trim_end_idx - trim_start_idx);
+    //fprintf(stderr, "events per base: %.2lf rate: %.2lf\n", events_per_base[si], rate);
+
+    return filtered;
+}
+
 inline size_t search_for_event_kmer(const std::string sequence,
                                     size_t start,
                                     size_t num_seq_kmers,
@@ -818,26 +1096,32 @@ hack:
     }
 }
 
-void SquiggleRead::replace_strand_model(size_t strand_idx, const std::string& kit_name, const std::string& alphabet, size_t k)
+void SquiggleRead::replace_strand_model(size_t strand_idx, PoreModelHandle handle)
 {
     // only replace this model if the strand was loaded
     if( !(read_type == SRT_2D || read_type == strand_idx) || !has_events_for_strand(strand_idx)) {
         return;
     }
 
-    PoreModel incoming_model =
-        PoreModelSet::get_model(kit_name,
-                                alphabet,
-                                this->pore_model[strand_idx].metadata.get_strand_model_name(),
-                                k);
-
-    replace_model(strand_idx, incoming_model);
+    replace_model(strand_idx, PoreModelSet::get_model(handle));
 }
 
-void SquiggleRead::replace_models(const std::string& kit_name, const std::string& alphabet, size_t k)
+void SquiggleRead::replace_models(KitVersion kit, const Alphabet* alphabet, size_t k)
 {
     for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
-        replace_strand_model(strand_idx, kit_name, alphabet, k);
+        if( !(read_type == SRT_2D || read_type == strand_idx) || !has_events_for_strand(strand_idx)) {
+            continue;
+        }
+
+        ModelMetadata metadata = this->pore_model[strand_idx].metadata;
+        metadata.kit = kit;
+        PoreModelHandle handle = PoreModelSet::find_model(kit, alphabet, metadata.model_idx, k);
+        if(handle == INVALID_PORE_MODEL_HANDLE) {
+            fprintf(stderr, "Error: cannot find model %s.%s.%zumer.%s\n", metadata.get_kit_name().c_str(),
+                alphabet->get_name().c_str(), k, metadata.get_strand_model_name().c_str());
+            exit(EXIT_FAILURE);
+        }
+        replace_model(strand_idx, PoreModelSet::get_model(handle));
     }
 }
 
@@ -892,19 +1176,19 @@ std::vector<EventAlignment> SquiggleRead::get_eventalignment_for_1d_basecalls(co
             assert(event_idx < this->events[strand_idx].size());
 
             // since we use the 1D read seqence here we never have to reverse complement
-            std::string kmer = read_sequence_1d.substr(ki + shift_offset, k);
-            size_t kmer_rank = alphabet->kmer_rank(kmer.c_str(), k);
+            size_t kmer_rank = alphabet->kmer_rank(read_sequence_1d.c_str() + ki + shift_offset, k);
 
             EventAlignment ea;
             // ref data
-            //ea.ref_name = "read";
+            ea.ref_id = -1; // aligned to the read
             ea.read_idx = -1; // not needed
-            ea.ref_kmer = kmer;
+            ea.ref_kmer_rank = kmer_rank;
             ea.ref_position = ki;
             ea.strand_idx = strand_idx;
             ea.event_idx = event_idx;
             ea.rc = false;
-            ea.model_kmer = kmer;
+            ea.model_kmer_rank = kmer_rank;
+            ea.posterior = 1.0f;
             ea.hmm_state = prev_kmer_rank != kmer_rank ? 'M' : 'E';
             alignment.push_back(ea);
             prev_kmer_rank = kmer_rank;
@@ -961,8 +1245,10 @@ bool SquiggleRead::check_basecall_group() const
     assert(f_p and f_p->is_open());
     assert(not basecall_group.empty());
     if (not f_p->have_basecall_seq(read_type, basecall_group)) return false;
+    // 1D reads without an event table are segmented from the raw signal
+    bool can_detect_events = read_type == SRT_TEMPLATE and not f_p->get_raw_samples_read_name_list().empty();
     if ((read_type == SRT_2D or read_type == SRT_TEMPLATE)
-        and not f_p->have_basecall_events(0, basecall_group)) return false;
+        and not f_p->have_basecall_events(0, basecall_group) and not can_detect_events) return false;
     if ((read_type == SRT_2D or read_type == SRT_COMPLEMENT)
         and not f_p->have_basecall_events(1, basecall_group)) return false;
     return true;
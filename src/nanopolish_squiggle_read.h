@@ -11,6 +11,7 @@
 
 #include "nanopolish_common.h"
 #include "nanopolish_poremodel.h"
+#include "nanopolish_pore_model_set.h"
 #include "nanopolish_transition_parameters.h"
 #include "nanopolish_eventalign.h"
 #include <string>
@@ -148,9 +149,10 @@ class SquiggleRead
         // get the index of the event that is nearest to the given kmer 
         int get_closest_event_to(int k_idx, uint32_t strand) const;
 
-        // replace the pore models with the models specified in the map or by a string
-        void replace_strand_model(size_t strand_idx, const std::string& kit_name, const std::string& alphabet, size_t k);
-        void replace_models(const std::string& kit_name, const std::string& alphabet, size_t k);
+        // replace the pore models with the models specified by a handle or by a
+        // kit, alphabet and k. The models must exist for the read's strand models.
+        void replace_strand_model(size_t strand_idx, PoreModelHandle handle);
+        void replace_models(KitVersion kit, const Alphabet* alphabet, size_t k);
         void replace_model(size_t strand_idx, const std::string& model_type);
         void replace_model(size_t strand_idx, const PoreModel& model);
 
@@ -216,11 +218,34 @@ class SquiggleRead
         fast5::File* f_p;
         std::string basecall_group;
 
+        // event tables and raw samples decoded by the native fast5 reader
+        std::vector<fast5::Basecall_Event> native_events[2];
+        bool have_native_events[2];
+        bool have_native_samples;
+
+        // true if the events of the strand were segmented from the raw signal by nanopolish,
+        // rather than taken from the basecaller's event table
+        bool detected_events[2];
+
         SquiggleRead(const SquiggleRead&) {}
 
+        // Open the fast5 file and find the basecall group for the read
+        void open_fast5();
+
+        // Decode the event tables and raw samples without going through the HDF5 library
+        void load_native_datasets(const uint32_t flags);
+
         // Load all the read data from a fast5 file
         void load_from_fast5(const uint32_t flags);
 
+        // Load the raw signal in picoamps through the HDF5 library
+        void load_raw_samples();
+
+        // Segment the raw signal into events and map them to the 1D basecalls,
+        // for reads that have no event table
+        std::vector<EventRangeForBase> detect_events_from_samples(const std::string& read_sequence_1d,
+                                                                  uint32_t strand);
+
         // Version-specific intialization functions
         void _load_R7(uint32_t si);
         void _load_R9(uint32_t si,
@@ -229,6 +254,13 @@ class SquiggleRead
                       const std::vector<double>& p_model_states,
                       const uint32_t flags);
 
+        std::vector<EventAlignment> _get_calibration_events(uint32_t si,
+                                                            const std::string& read_sequence_1d,
+                                                            const std::vector<EventRangeForBase>& event_map_1d,
+                                                            const std::vector<double>& p_model_states,
+                                                            size_t calibration_k,
+                                                            int label_shift);
+
         // make a map from a base of the 1D read sequence to the range of events supporting that base
         std::vector<EventRangeForBase> build_event_map_1d(const std::string& read_sequence_1d,
                                                           uint32_t strand, 
@@ -191,7 +191,7 @@ void alignment_to_training_data(const SquiggleRead* read,
                                 FILE* tsv_writer)
 {
     for(auto const& a : alignment) {
-        size_t kmer_rank = gDNAAlphabet.kmer_rank(a.model_kmer.c_str(), k);
+        size_t kmer_rank = a.model_kmer_rank;
         assert(kmer_rank < out_data->size());
         assert(a.strand_idx == 0);
         assert(a.event_idx < read->events[a.strand_idx].size());
@@ -207,7 +207,7 @@ void alignment_to_training_data(const SquiggleRead* read,
         }
 
         if(tsv_writer) {
-            fprintf(tsv_writer, "%zu\t%s\t%.2lf\t%.5lf\n", read_idx, a.model_kmer.c_str(), level, read->events[a.strand_idx][a.event_idx].duration);
+            fprintf(tsv_writer, "%zu\t%s\t%.2lf\t%.5lf\n", read_idx, gDNAAlphabet.kmer_from_rank(kmer_rank, k).c_str(), level, read->events[a.strand_idx][a.event_idx].duration);
         }
     }
 }
@@ -317,7 +317,7 @@ int train_poremodel_from_basecalls_main(int argc, char** argv)
             // filter the alignment to only contain k-mers that have a distribution
             std::vector<EventAlignment> filtered_alignment;
             for(size_t i = 0; i < alignment.size(); ++i) {
-                size_t kmer_rank = gDNAAlphabet.kmer_rank(alignment[i].model_kmer.c_str(), basecalled_k);
+                size_t kmer_rank = alignment[i].model_kmer_rank;
                 if(trained_kmers[kmer_rank]) {
                     filtered_alignment.push_back(alignment[i]);
                 }
@@ -29,7 +29,7 @@ SizeTVecVec cartesian_product(const SizeTVecVec& input)
 
 Combinations::Combinations(size_t N, size_t k, CombinationOption option) 
 { 
-    assert(k <= N);
+    assert(option == CO_WITH_REPLACEMENT || k <= N);
     m_rank = 0;
     m_option = option;
 
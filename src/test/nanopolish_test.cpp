@@ -7,10 +7,16 @@
 //
 #define CATCH_CONFIG_MAIN
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <array>
 #include <vector>
 #include <random>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/wait.h>
 
 #include "logsum.h"
 #include "catch.hpp"
@@ -18,7 +24,23 @@
 #include "nanopolish_alphabet.h"
 #include "nanopolish_emissions.h"
 #include "nanopolish_profile_hmm.h"
+#include "nanopolish_profile_hmm_r9.h"
+#include "nanopolish_pore_model_set.h"
+#include "nanopolish_raw_loader.h"
+#include "nanopolish_call_variants.h"
+#include "nanopolish_eventalign.h"
+#include "nanopolish_parallel.h"
 #include "nanopolish_variant_db.h"
+#include "nanopolish_candidate_store.h"
+#include "nanopolish_sample_sheet.h"
+#include "nanopolish_bam_name_index.h"
+#include "nanopolish_lease_queue.h"
+#include "nanopolish_output_buffer.h"
+#include "nanopolish_event_detection.h"
+#include "nanopolish_calibration.h"
+#include "nanopolish_calibration_store.h"
+#include "nanopolish_fast5_reader.h"
+#include "fast5.hpp"
 #include "training_core.hpp"
 #include "invgauss.hpp"
 #include "logger.hpp"
@@ -68,6 +90,7 @@ TEST_CASE( "alphabet", "[alphabet]" ) {
         int rank_diff = mc_alphabet.kmer_rank(next.c_str(), k) - 
                         mc_alphabet.kmer_rank(kmer.c_str(), k);
         REQUIRE( rank_diff == 1);
+        REQUIRE( mc_alphabet.kmer_from_rank(mc_alphabet.kmer_rank(next.c_str(), k), k) == next );
         kmer = next;
     }
     REQUIRE(kmer == "TTT");
@@ -242,6 +265,7 @@ TEST_CASE( "string functions", "[string_functions]" ) {
     REQUIRE( dna_alphabet.kmer_rank("AAAAA", 5) == 0 );
     REQUIRE( dna_alphabet.kmer_rank("GATGA", 5) == 568 );
     REQUIRE( dna_alphabet.kmer_rank("TTTTT", 5) == 1023 );
+    REQUIRE( dna_alphabet.kmer_from_rank(568, 5) == "GATGA" );
 
     // lexicographic increment
     std::string str = "AAAAA";
@@ -263,6 +287,41 @@ TEST_CASE( "string functions", "[string_functions]" ) {
     REQUIRE( ends_with("abcd", "") );
 }
 
+// the output of printf("%.<precision>f", value)
+std::string printf_fixed(double value, int precision)
+{
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer), "%.*f", precision, value);
+    return buffer;
+}
+
+TEST_CASE( "output buffer", "[output_buffer]") {
+    OutputBuffer out;
+    out.append_int(-42).append('\t').append_uint(18446744073709551615ULL).append('\t').append_int(0);
+    REQUIRE( std::string(out.data(), out.size()) == "-42\t18446744073709551615\t0" );
+
+    // the fixed precision output is identical to printf, including ties and signed zeros
+    std::vector<double> values = { 0.0, -0.0, -0.001, 0.125, 0.25, 2.5, 99.995, 1e300, 123456.789, 1e-7 };
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> level(-200.0, 200.0);
+    for(size_t i = 0; i < 10000; ++i) {
+        values.push_back(level(rng));
+        values.push_back((float)level(rng));
+    }
+
+    for(double value : values) {
+        for(int precision = 0; precision <= MAX_FAST_FIXED_PRECISION + 1; ++precision) {
+            out.clear();
+            out.append_fixed(value, precision);
+            REQUIRE( std::string(out.data(), out.size()) == printf_fixed(value, precision) );
+        }
+    }
+
+    out.clear();
+    out.append_general(0.1f).append(',').append_general(85.25);
+    REQUIRE( std::string(out.data(), out.size()) == "0.1,85.25" );
+}
+
 TEST_CASE( "math", "[math]") {
     GaussianParameters params;
     params.mean = 4;
@@ -273,6 +332,142 @@ TEST_CASE( "math", "[math]") {
     REQUIRE( log_normal_pdf(2.25, params) == Approx(log(normal_pdf(2.25, params))) );
 }
 
+TEST_CASE( "event detection", "[event_detection]") {
+    // three levels of 50, 30 and 40 samples
+    std::vector<float> levels = { 80.0f, 100.0f, 90.0f };
+    std::vector<size_t> lengths = { 50, 30, 40 };
+    std::vector<float> samples;
+    for(size_t i = 0; i < levels.size(); ++i) {
+        samples.insert(samples.end(), lengths[i], levels[i]);
+    }
+
+    std::vector<DetectedEvent> events = detect_events(samples);
+    REQUIRE( events.size() == 3 );
+    REQUIRE( events[1].start == 50 );
+    REQUIRE( events[1].length == 30 );
+    REQUIRE( events[2].start == 80 );
+    REQUIRE( events[1].mean == Approx(100.0f) );
+    REQUIRE( events[2].stdv == Approx(0.0f) );
+
+    // with noise, the level changes are still boundaries
+    std::mt19937 rng(1);
+    std::normal_distribution<float> noise(0.0f, 0.5f);
+    for(size_t i = 0; i < samples.size(); ++i) {
+        samples[i] += noise(rng);
+    }
+
+    events = detect_events(samples);
+    size_t n_boundaries = 0;
+    for(size_t i = 0; i < events.size(); ++i) {
+        n_boundaries += events[i].start == 50 || events[i].start == 80;
+        REQUIRE( events[i].length > 0 );
+    }
+    REQUIRE( n_boundaries == 2 );
+}
+
+TEST_CASE( "calibration", "[calibration]") {
+    // levels generated from known parameters, with noise proportional to the model stdv
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> model_mean(60.0f, 120.0f);
+    std::uniform_real_distribution<float> model_stdv(1.0f, 3.0f);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+
+    CalibrationData data;
+    data.n = 5000;
+    data.level.resize(data.n);
+    data.time.resize(data.n);
+    data.mean.resize(data.n);
+    data.inv_var.resize(data.n);
+    for(size_t i = 0; i < data.n; ++i) {
+        float stdv = model_stdv(rng);
+        data.mean[i] = model_mean(rng);
+        data.inv_var[i] = 1.0f / (stdv * stdv);
+        data.time[i] = i * 0.01f;
+        data.level[i] = 5.0f + 1.1f * data.mean[i] + 0.02f * data.time[i] + 1.3f * stdv * noise(rng);
+    }
+
+    CalibrationParameters params;
+    REQUIRE( fit_calibration(data, true, true, params) );
+    REQUIRE( params.shift == Approx(5.0).epsilon(0.1) );
+    REQUIRE( params.scale == Approx(1.1).epsilon(0.01) );
+    REQUIRE( params.drift == Approx(0.02).epsilon(0.05) );
+    REQUIRE( params.var == Approx(1.3).epsilon(0.05) );
+
+    // replace a tenth of the levels with events from other k-mers, as from a poor alignment
+    for(size_t i = 0; i < data.n; i += 10) {
+        data.level[i] = 5.0f + 1.1f * model_mean(rng) + 0.02f * data.time[i];
+    }
+
+    CalibrationOptions options;
+    options.loss = CL_STUDENT_T;
+    CalibrationResiduals residuals;
+    REQUIRE( fit_calibration(data, options, params, &residuals) );
+    REQUIRE( residuals.converged );
+    REQUIRE( residuals.iterations > 1 );
+    REQUIRE( params.scale == Approx(1.1).epsilon(0.02) );
+    REQUIRE( params.var == Approx(1.3).epsilon(0.15) );
+    REQUIRE( residuals.outlier_fraction > 0.05 );
+    REQUIRE( !calibration_is_stable(residuals) );
+
+    // too few events to calibrate
+    data.n = 100;
+    REQUIRE( !fit_calibration(data, true, true, params) );
+}
+
+TEST_CASE( "calibration store", "[calibration_store]") {
+    const char* filename = "test_calibrations.tsv";
+    remove(filename);
+
+    StoredCalibration c;
+    c.kit = KV_R9_4_450BPS;
+    c.model_fingerprint = 0x0123456789abcdefULL;
+    c.n_events = 5000;
+    c.read_length = 2500;
+    c.calibrated = true;
+    c.model_idx = 0;
+    c.events_per_base = 1.8f;
+    c.shift = 5.123456789;
+    c.scale = 1.1;
+    c.drift = 0.0002;
+    c.var = 1.3;
+    c.scale_sd = 1.0;
+    c.var_sd = 1.4;
+
+    CalibrationStore::initialize(filename);
+    CalibrationStore::add("read1", 0, c);
+    CalibrationStore::write();
+
+    // a partial line left by a killed process is skipped when loading and removed by the next append
+    FILE* fp = fopen(filename, "a");
+    fputs("read2\t0\t3", fp);
+    fclose(fp);
+
+    CalibrationStore::initialize(filename);
+    StoredCalibration stored;
+    REQUIRE( CalibrationStore::find("read1", 0, stored) );
+    REQUIRE( !CalibrationStore::find("read1", 1, stored) );
+    REQUIRE( !CalibrationStore::find("read2", 0, stored) );
+    REQUIRE( stored.shift == c.shift );
+    REQUIRE( stored.drift == c.drift );
+    REQUIRE( stored.var_sd == c.var_sd );
+    REQUIRE( stored.events_per_base == c.events_per_base );
+
+    // stored calibrations are only reused for the same data
+    REQUIRE( stored.matches(c.kit, c.model_fingerprint, c.n_events, c.read_length) );
+    REQUIRE( !stored.matches(c.kit, c.model_fingerprint, c.n_events + 1, c.read_length) );
+    REQUIRE( !stored.matches(c.kit, c.model_fingerprint + 1, c.n_events, c.read_length) );
+
+    CalibrationStore::add("read1", 1, c);
+    CalibrationStore::write();
+    CalibrationStore::initialize(filename);
+    REQUIRE( CalibrationStore::find("read1", 0, stored) );
+    REQUIRE( CalibrationStore::find("read1", 1, stored) );
+
+    CalibrationStore::initialize("");
+    REQUIRE( !CalibrationStore::is_enabled() );
+    remove(filename);
+}
+
 size_t factorial(size_t n)
 {
     if(n == 0 || n == 1) {
@@ -326,6 +521,288 @@ TEST_CASE( "combinations", "[combinations]") {
     test_combinations(3, 2, CO_WITH_REPLACEMENT, { "0,0", "0,1", "0,2", "1,1", "1,2", "2,2"});
 }
 
+// Build a group with a single SNP where n_ref reads support the reference
+// and n_alt reads support the alternative allele, then call it. Each read
+// scores the allele it doesn't support separation log units lower.
+std::string call_test_genotype(size_t n_ref, size_t n_alt, int ploidy, double separation = 20.0)
+{
+    Variant v;
+    v.ref_name = "test";
+    v.ref_position = 100;
+    v.ref_seq = "A";
+    v.alt_seq = "C";
+
+    VariantGroup group(0, std::vector<Variant>(1, v));
+    size_t ref_hap = group.add_combination(VariantCombination(std::vector<size_t>()));
+    size_t alt_hap = group.add_combination(VariantCombination(std::vector<size_t>(1, 0)));
+
+    for(size_t ri = 0; ri < n_ref + n_alt; ++ri) {
+        std::string read_id = "read" + std::to_string(ri);
+        bool supports_alt = ri >= n_ref;
+        group.set_combination_read_score(ref_hap, read_id, supports_alt ? -10.0 - separation : -10.0);
+        group.set_combination_read_score(alt_hap, read_id, supports_alt ? -10.0 : -10.0 - separation);
+    }
+
+    std::vector<Variant> calls = simple_call(group, ploidy, true);
+    return calls.size() == 1 ? calls[0].genotype : "";
+}
+
+TEST_CASE( "genotyping", "[genotyping]") {
+    REQUIRE( call_test_genotype(0, 20, 1) == "1" );
+    REQUIRE( call_test_genotype(20, 0, 1) == "0" );
+    REQUIRE( call_test_genotype(10, 10, 2) == "0/1" );
+    REQUIRE( call_test_genotype(0, 20, 2) == "1/1" );
+    REQUIRE( call_test_genotype(5, 15, 4) == "0/1/1/1" );
+
+    // reads that disagree by more than exp() can represent
+    REQUIRE( call_test_genotype(5, 15, 1, 1000.0) == "1" );
+    REQUIRE( call_test_genotype(15, 5, 1, 1000.0) == "0" );
+    REQUIRE( call_test_genotype(10, 10, 2, 1000.0) == "0/1" );
+    REQUIRE( call_test_genotype(2, 18, 2, 1000.0) == "0/1" );
+}
+
+Variant make_test_variant(size_t position, const std::string& ref_seq, const std::string& alt_seq)
+{
+    Variant v;
+    v.ref_name = "test";
+    v.ref_position = position;
+    v.ref_seq = ref_seq;
+    v.alt_seq = alt_seq;
+    v.quality = 0;
+    return v;
+}
+
+TEST_CASE( "candidates", "[candidates]") {
+    //                      0123456789012
+    std::string reference = "GCAAAATCACACT";
+
+    // indels in repeats are moved to their leftmost position
+    Variant v = make_test_variant(4, "AA", "A");
+    left_normalize_variant(v, reference, 0);
+    REQUIRE( v.ref_position == 1 );
+    REQUIRE( v.ref_seq == "CA" );
+    REQUIRE( v.alt_seq == "C" );
+
+    v = make_test_variant(8, "ACA", "A");
+    left_normalize_variant(v, reference, 0);
+    REQUIRE( v.key() == "test:6:TCA:T" );
+
+    v = make_test_variant(10, "A", "ACA");
+    left_normalize_variant(v, reference, 0);
+    REQUIRE( v.key() == "test:6:T:TCA" );
+
+    // shared bases are trimmed from substitutions
+    v = make_test_variant(2, "AAAAT", "AAAAG");
+    left_normalize_variant(v, reference, 0);
+    REQUIRE( v.key() == "test:6:T:G" );
+
+    // an indel at the start of the reference keeps its anchor base
+    v = make_test_variant(2, "AA", "A");
+    left_normalize_variant(v, reference.substr(2), 2);
+    REQUIRE( v.key() == "test:2:AA:A" );
+
+    // equivalent candidates are merged and keep the sources of both
+    CandidateStore store("test", 0, reference, 0);
+    size_t id1 = store.add(make_test_variant(4, "AA", "A"), CS_READS);
+    size_t id2 = store.add(make_test_variant(2, "AA", "A"), CS_EDITS);
+    store.add(make_test_variant(1, "C", "G"), CS_READS);
+    REQUIRE( id1 == id2 );
+    REQUIRE( store.size() == 2 );
+    REQUIRE( store.get_num_added() == 3 );
+    REQUIRE( store.get_sources(id1) == (CS_READS | CS_EDITS) );
+
+    std::vector<Variant> variants = store.get_variants();
+    REQUIRE( variants[0].key() == "test:1:C:G" );
+    REQUIRE( variants[1].key() == "test:1:CA:C" );
+
+    // a deletion in a repeat that crosses the start of the region is moved out of it and dropped
+    CandidateStore window("test", 0, reference, 3);
+    REQUIRE( window.add(make_test_variant(4, "AA", "A"), CS_READS) == INVALID_CANDIDATE_ID );
+    REQUIRE( window.add(make_test_variant(8, "ACA", "A"), CS_READS) != INVALID_CANDIDATE_ID );
+    REQUIRE( window.size() == 1 );
+    REQUIRE( window.get_num_outside() == 1 );
+    REQUIRE( window.get_variants()[0].ref_position >= 3 );
+
+    // unless it was an input candidate
+    size_t input_id = window.add(make_test_variant(4, "AA", "A"), CS_INPUT);
+    REQUIRE( input_id != INVALID_CANDIDATE_ID );
+    REQUIRE( window.get_variant(input_id).key() == "test:4:AA:A" );
+}
+
+TEST_CASE( "sample sheet", "[samples]") {
+    const char* filename = "test_samples.tsv";
+    FILE* fp = fopen(filename, "w");
+    fprintf(fp, "# name\treads\tbam\tevent bam\n");
+    fprintf(fp, "a\ta.fastq\ta.bam\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "b\tb.fastq\tb.bam\tb.eventalign.bam\n");
+    fclose(fp);
+
+    std::vector<SampleInput> samples = read_sample_sheet(filename);
+    REQUIRE( samples.size() == 2 );
+    REQUIRE( samples[0].name == "a" );
+    REQUIRE( samples[0].reads_file == "a.fastq" );
+    REQUIRE( samples[0].bam_file == "a.bam" );
+    REQUIRE( samples[0].event_bam_file.empty() );
+    REQUIRE( samples[1].name == "b" );
+    REQUIRE( samples[1].event_bam_file == "b.eventalign.bam" );
+
+    // a repeated name, a missing bam and an empty sheet are rejected
+    const char* bad_sheets[] = { "a\ta.fastq\ta.bam\na\tb.fastq\tb.bam\n",
+                                 "a\ta.fastq\n",
+                                 "# no samples\n" };
+    for(size_t ti = 0; ti < 3; ++ti) {
+        fp = fopen(filename, "w");
+        fprintf(fp, "%s", bad_sheets[ti]);
+        fclose(fp);
+
+        pid_t pid = fork();
+        REQUIRE( pid >= 0 );
+        if(pid == 0) {
+            freopen("/dev/null", "w", stderr);
+            read_sample_sheet(filename);
+            _exit(0);
+        }
+        int status;
+        REQUIRE( waitpid(pid, &status, 0) == pid );
+        REQUIRE( WIFEXITED(status) );
+        REQUIRE( WEXITSTATUS(status) == EXIT_FAILURE );
+    }
+    remove(filename);
+}
+
+Variant make_test_call(size_t position, const std::string& ref_seq, const std::string& alt_seq,
+                       const std::string& genotype, double quality,
+                       int total_reads, double support_fraction, int allele_count)
+{
+    Variant v = make_test_variant(position, ref_seq, alt_seq);
+    v.genotype = genotype;
+    v.quality = quality;
+    v.total_reads = total_reads;
+    v.support_fraction = support_fraction;
+    v.allele_count = allele_count;
+    return v;
+}
+
+// Write the calls with write_multi_sample_vcf and return the records
+std::vector<std::string> write_test_multi_sample_vcf(const std::vector<std::vector<Variant> >& sample_calls,
+                                                     bool write_reference_sites)
+{
+    const char* filename = "test_multi_sample.vcf";
+    FILE* fp = fopen(filename, "w");
+    write_multi_sample_vcf(fp, sample_calls, write_reference_sites);
+    fclose(fp);
+
+    std::vector<std::string> records;
+    std::ifstream in(filename);
+    std::string line;
+    while(getline(in, line)) {
+        records.push_back(line);
+    }
+    remove(filename);
+    return records;
+}
+
+TEST_CASE( "multi-sample vcf", "[samples]") {
+    std::vector<std::vector<Variant> > sample_calls(2);
+
+    // a site where one sample is homozygous reference and the other has no call
+    sample_calls[0].push_back(make_test_call(10, "A", "G", "0/0", 0.0, 12, 0.1, 0));
+
+    // a site where the reference call has a higher quality than the alternative call
+    sample_calls[0].push_back(make_test_call(20, "C", "T", "0/0", 60.0, 10, 0.1, 0));
+    sample_calls[1].push_back(make_test_call(20, "C", "T", "0/1", 25.0, 20, 0.55, 1));
+
+    std::vector<std::string> records = write_test_multi_sample_vcf(sample_calls, true);
+    REQUIRE( records.size() == 2 );
+    REQUIRE( records[0] == "test\t11\t.\tA\tG\t0.0\tPASS\tTotalReads=12;AlleleCount=0;SupportFraction=0.1\t"
+                           "GT:DP:SF:SQ\t0/0:12:0.100:0.0\t.:.:.:." );
+    REQUIRE( records[1] == "test\t21\t.\tC\tT\t25.0\tPASS\tTotalReads=30;AlleleCount=1;SupportFraction=0.4\t"
+                           "GT:DP:SF:SQ\t0/0:10:0.100:60.0\t0/1:20:0.550:25.0" );
+
+    // sites without the alternative allele in any sample are only written on request
+    records = write_test_multi_sample_vcf(sample_calls, false);
+    REQUIRE( records.size() == 1 );
+    REQUIRE( records[0].compare(0, 8, "test\t21\t") == 0 );
+}
+
+TEST_CASE( "bam name index", "[bam_name_index]") {
+    const char* sam_filename = "test_name_index.sam";
+    const char* bam_filename = "test_name_index.bam";
+
+    // r1 has a primary and a supplementary record, r3 is unmapped
+    FILE* fp = fopen(sam_filename, "w");
+    fprintf(fp, "@HD\tVN:1.0\tSO:coordinate\n");
+    fprintf(fp, "@SQ\tSN:chr1\tLN:1000\n");
+    fprintf(fp, "@SQ\tSN:chr2\tLN:1000\n");
+    fprintf(fp, "r1\t0\tchr1\t11\t60\t8M\t*\t0\t0\tACGTACGT\t*\n");
+    fprintf(fp, "r2\t0\tchr1\t101\t10\t4M2D4M\t*\t0\t0\tACGTACGT\t*\n");
+    fprintf(fp, "r1\t2048\tchr2\t51\t30\t4M\t*\t0\t0\tACGT\t*\n");
+    fprintf(fp, "r3\t4\t*\t0\t0\t*\t*\t0\t0\tACGT\t*\n");
+    fclose(fp);
+
+    htsFile* sam_fh = sam_open(sam_filename, "r");
+    REQUIRE( sam_fh != NULL );
+    bam_hdr_t* hdr = sam_hdr_read(sam_fh);
+    htsFile* out_fh = sam_open(bam_filename, "wb");
+    REQUIRE( sam_hdr_write(out_fh, hdr) == 0 );
+    bam1_t* record = bam_init1();
+    while(sam_read1(sam_fh, hdr, record) >= 0) {
+        REQUIRE( sam_write1(out_fh, hdr, record) >= 0 );
+    }
+    sam_close(out_fh);
+    bam_hdr_destroy(hdr);
+    sam_close(sam_fh);
+
+    const BamNameIndex& index = BamNameIndex::get(bam_filename);
+    REQUIRE( &BamNameIndex::get(bam_filename) == &index );
+    REQUIRE( index.get_num_records() == 3 );
+    REQUIRE( index.find("r3") == NULL );
+    REQUIRE( index.find("r4") == NULL );
+
+    const std::vector<BamNameIndexEntry>* r1 = index.find("r1");
+    REQUIRE( r1 != NULL );
+    REQUIRE( r1->size() == 2 );
+    REQUIRE( (*r1)[0].tid == 0 );
+    REQUIRE( (*r1)[0].pos == 10 );
+    REQUIRE( (*r1)[0].end_pos == 18 );
+    REQUIRE( (*r1)[0].mapq == 60 );
+    REQUIRE( (*r1)[1].tid == 1 );
+    REQUIRE( (*r1)[1].pos == 50 );
+    REQUIRE( (*r1)[1].mapq == 30 );
+
+    const std::vector<BamNameIndexEntry>* r2 = index.find("r2");
+    REQUIRE( r2 != NULL );
+    REQUIRE( r2->size() == 1 );
+    REQUIRE( (*r2)[0].pos == 100 );
+    REQUIRE( (*r2)[0].end_pos == 110 );
+    REQUIRE( (*r2)[0].mapq == 10 );
+
+    // fetch records out of file order
+    htsFile* bam_fh = sam_open(bam_filename, "r");
+    hdr = sam_hdr_read(bam_fh);
+    BamNameIndex::read_record(bam_fh, hdr, (*r1)[1].offset, record);
+    REQUIRE( std::string(bam_get_qname(record)) == "r1" );
+    REQUIRE( record->core.tid == 1 );
+    REQUIRE( record->core.pos == 50 );
+
+    BamNameIndex::read_record(bam_fh, hdr, (*r2)[0].offset, record);
+    REQUIRE( std::string(bam_get_qname(record)) == "r2" );
+    REQUIRE( record->core.pos == 100 );
+    REQUIRE( bam_endpos(record) == 110 );
+
+    BamNameIndex::read_record(bam_fh, hdr, (*r1)[0].offset, record);
+    REQUIRE( std::string(bam_get_qname(record)) == "r1" );
+    REQUIRE( record->core.tid == 0 );
+    REQUIRE( record->core.pos == 10 );
+
+    bam_destroy1(record);
+    bam_hdr_destroy(hdr);
+    sam_close(bam_fh);
+    remove(sam_filename);
+    remove(bam_filename);
+}
+
 std::string event_alignment_to_string(const std::vector<HMMAlignmentState>& alignment)
 {
     std::string out;
@@ -335,6 +812,401 @@ std::string event_alignment_to_string(const std::vector<HMMAlignmentState>& alig
     return out;
 }
 
+// Complete shards until none are left, as a worker process of the lease queue test
+void run_test_lease_worker(const std::string& directory, const std::vector<std::string>& shards)
+{
+    LeaseQueue queue(directory, 5.0);
+    queue.initialize(shards);
+
+    size_t idx;
+    while(queue.claim(idx)) {
+        ShardOutput output;
+        output.type = "txt";
+        output.path = queue.get_output_path(idx, output.type);
+        FILE* fp = fopen(output.path.c_str(), "w");
+        fprintf(fp, "%s\n", queue.get_shard(idx).c_str());
+        fclose(fp);
+        queue.complete(idx, std::vector<ShardOutput>(1, output));
+    }
+}
+
+TEST_CASE( "lease queue", "[lease_queue]") {
+    std::string directory = "test_lease_dir";
+    REQUIRE( system(("rm -rf " + directory).c_str()) == 0 );
+
+    std::vector<std::string> shards;
+    for(int i = 0; i < 20; ++i) {
+        shards.push_back("test:" + std::to_string(i * 1000) + "-" + std::to_string((i + 1) * 1000 + 200));
+    }
+
+    // shard 0 was leased by a worker that stopped heartbeating long ago
+    LeaseQueue queue(directory, 5.0);
+    queue.initialize(shards);
+    std::string stale_lease = directory + "/leases/0.0";
+    FILE* fp = fopen(stale_lease.c_str(), "w");
+    fprintf(fp, "dead-host-1\n");
+    fclose(fp);
+
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - 1000;
+    REQUIRE( utime(stale_lease.c_str(), &times) == 0 );
+    REQUIRE( queue.get_status(0).state == SS_EXPIRED );
+    REQUIRE( queue.get_status(1).state == SS_PENDING );
+
+    // two workers share the directory
+    pid_t workers[2];
+    for(size_t i = 0; i < 2; ++i) {
+        workers[i] = fork();
+        REQUIRE( workers[i] >= 0 );
+        if(workers[i] == 0) {
+            run_test_lease_worker(directory, shards);
+            _exit(0);
+        }
+    }
+
+    for(size_t i = 0; i < 2; ++i) {
+        int status;
+        REQUIRE( waitpid(workers[i], &status, 0) == workers[i] );
+        REQUIRE( WIFEXITED(status) );
+        REQUIRE( WEXITSTATUS(status) == 0 );
+    }
+
+    // the expired lease was taken over
+    REQUIRE( access((directory + "/leases/0.1").c_str(), F_OK) == 0 );
+    REQUIRE( access((directory + "/leases/0.2").c_str(), F_OK) != 0 );
+
+    // every shard was completed by exactly one worker
+    std::vector<int> outputs_per_shard(shards.size(), 0);
+    DIR* dir = opendir((directory + "/output").c_str());
+    REQUIRE( dir != NULL );
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] != '.') {
+            size_t idx = atoi(entry->d_name);
+            REQUIRE( idx < shards.size() );
+            outputs_per_shard[idx] += 1;
+        }
+    }
+    closedir(dir);
+
+    for(size_t i = 0; i < shards.size(); ++i) {
+        REQUIRE( outputs_per_shard[i] == 1 );
+        REQUIRE( queue.get_status(i).state == SS_COMPLETE );
+
+        std::vector<ShardOutput> outputs;
+        REQUIRE( queue.read_manifest(i, outputs) );
+        REQUIRE( outputs.size() == 1 );
+        REQUIRE( access(outputs[0].path.c_str(), F_OK) == 0 );
+    }
+
+    REQUIRE( system(("rm -rf " + directory).c_str()) == 0 );
+}
+
+TEST_CASE( "fast5 reader", "[fast5_reader]") {
+
+    // the native reader must agree with the fast5 library on everything
+    // SquiggleRead loads through it
+    std::string filename = "test/data/LomanLabz_PC_Ecoli_K12_R7.3_2549_1_ch8_file30_strand.fast5";
+    fast5::File f5(filename);
+    REQUIRE( f5.is_open() );
+
+    Fast5Reader reader;
+    REQUIRE( reader.open(filename) );
+
+    // event tables
+    for(size_t si = 0; si < 2; ++si) {
+        std::vector<fast5::Basecall_Event> f5_events = f5.get_basecall_events(si, "2D_000");
+        REQUIRE( !f5_events.empty() );
+
+        std::string path = std::string("/Analyses/Basecall_2D_000/BaseCalled_") +
+                           (si == 0 ? "template" : "complement") + "/Events";
+        Fast5Dataset ds;
+        REQUIRE( reader.read_dataset(path, ds) );
+        REQUIRE( ds.get_num_elements() == f5_events.size() );
+
+        std::vector<double> mean, stdv, start, length, p_model_state, move;
+        REQUIRE( ds.get_numeric_column("mean", mean) );
+        REQUIRE( ds.get_numeric_column("stdv", stdv) );
+        REQUIRE( ds.get_numeric_column("start", start) );
+        REQUIRE( ds.get_numeric_column("length", length) );
+        REQUIRE( ds.get_numeric_column("p_model_state", p_model_state) );
+        REQUIRE( ds.get_numeric_column("move", move) );
+
+        const Fast5Member* model_state = ds.get_member("model_state");
+        REQUIRE( model_state != NULL );
+
+        size_t n_mismatch = 0;
+        for(size_t ei = 0; ei < f5_events.size(); ++ei) {
+            const fast5::Basecall_Event& e = f5_events[ei];
+            const char* ms = (const char*)&ds.data[ei * ds.type.size + model_state->offset];
+            std::string native_state(ms, strnlen(ms, model_state->size));
+            n_mismatch += e.mean != mean[ei] || e.stdv != stdv[ei] ||
+                          e.start != start[ei] || e.length != length[ei] ||
+                          e.p_model_state != p_model_state[ei] || e.move != move[ei] ||
+                          native_state != std::string(e.model_state.data());
+        }
+        REQUIRE( n_mismatch == 0 );
+    }
+
+    // raw samples, this R7 file has none so both readers must report that
+    const std::vector<std::string>& f5_read_names = f5.get_raw_samples_read_name_list();
+    std::vector<std::string> read_names;
+    reader.list_group("/Raw/Reads", read_names);
+    REQUIRE( read_names == f5_read_names );
+    for(size_t ri = 0; ri < read_names.size(); ++ri) {
+        std::vector<float> f5_samples = f5.get_raw_samples(read_names[ri]);
+        Fast5Dataset signal;
+        REQUIRE( reader.read_dataset("/Raw/Reads/" + read_names[ri] + "/Signal", signal) );
+        REQUIRE( signal.get_num_elements() == f5_samples.size() );
+        REQUIRE( signal.type.size == sizeof(int16_t) );
+
+        const int16_t* raw = (const int16_t*)signal.data.data();
+        auto channel_params = f5.get_channel_id_params();
+        double raw_unit = channel_params.range / channel_params.digitisation;
+        size_t n_mismatch = 0;
+        for(size_t i = 0; i < f5_samples.size(); ++i) {
+            n_mismatch += fabs((raw[i] + channel_params.offset) * raw_unit - f5_samples[i]) > 1e-3;
+        }
+        REQUIRE( n_mismatch == 0 );
+    }
+
+    // attributes
+    auto channel_params = f5.get_channel_id_params();
+    std::string channel_path = "/UniqueGlobalKey/channel_id";
+    double digitisation, offset, range, sampling_rate;
+    REQUIRE( reader.read_numeric_attribute(channel_path, "digitisation", digitisation) );
+    REQUIRE( reader.read_numeric_attribute(channel_path, "offset", offset) );
+    REQUIRE( reader.read_numeric_attribute(channel_path, "range", range) );
+    REQUIRE( reader.read_numeric_attribute(channel_path, "sampling_rate", sampling_rate) );
+    REQUIRE( digitisation == channel_params.digitisation );
+    REQUIRE( offset == channel_params.offset );
+    REQUIRE( range == channel_params.range );
+    REQUIRE( sampling_rate == channel_params.sampling_rate );
+
+    std::string channel_number;
+    REQUIRE( reader.read_string_attribute(channel_path, "channel_number", channel_number) );
+    REQUIRE( channel_number == channel_params.channel_number );
+    REQUIRE( channel_number == "8" );
+}
+
+TEST_CASE( "binary model", "[binary_model]") {
+    const char* filename = "test_model.bin";
+    const char* bad_filename = "test_bad_model.bin";
+
+    const char* alphabets[] = { "nucleotide", "cpg" };
+    for(size_t ai = 0; ai < 2; ++ai) {
+        remove(filename);
+        const PoreModel& model = PoreModelSet::get_model("r9.4_450bps", alphabets[ai], "template", 6);
+        model.write_binary(filename);
+        REQUIRE( PoreModel::is_binary_model_file(filename) );
+
+        PoreModel loaded(filename);
+        REQUIRE( loaded.k == model.k );
+        REQUIRE( loaded.pmalphabet == model.pmalphabet );
+        REQUIRE( loaded.name == model.name );
+        REQUIRE( loaded.type == model.type );
+        REQUIRE( loaded.metadata.kit == model.metadata.kit );
+        REQUIRE( loaded.metadata.model_idx == model.metadata.model_idx );
+        REQUIRE( loaded.metadata.strand_idx == model.metadata.strand_idx );
+        REQUIRE( loaded.shift_offset == model.shift_offset );
+        REQUIRE( loaded.scale_offset == model.scale_offset );
+        REQUIRE( loaded.states.size() == model.states.size() );
+
+        size_t n_mismatch = 0;
+        for(size_t i = 0; i < model.states.size(); ++i) {
+            const PoreModelStateParams& a = loaded.states[i];
+            const PoreModelStateParams& b = model.states[i];
+            n_mismatch += a.level_mean != b.level_mean || a.level_stdv != b.level_stdv ||
+                          a.sd_mean != b.sd_mean || a.sd_stdv != b.sd_stdv ||
+                          a.level_log_stdv != b.level_log_stdv || a.sd_lambda != b.sd_lambda ||
+                          a.sd_log_lambda != b.sd_log_lambda;
+        }
+        REQUIRE( n_mismatch == 0 );
+    }
+
+    // a copy of the model with one 32-bit header field replaced must be rejected
+    // fields: byte order, state size, k
+    size_t offsets[] = { 12, 16, 20 };
+    uint32_t values[] = { 0x04030201, 48, 40 };
+    for(size_t ti = 0; ti < 3; ++ti) {
+        std::ifstream in(filename, std::ios::binary);
+        std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        memcpy(&bytes[offsets[ti]], &values[ti], sizeof(uint32_t));
+        std::ofstream out(bad_filename, std::ios::binary);
+        out << bytes;
+        out.close();
+
+        pid_t pid = fork();
+        REQUIRE( pid >= 0 );
+        if(pid == 0) {
+            freopen("/dev/null", "w", stderr);
+            PoreModel bad(bad_filename);
+            _exit(0);
+        }
+        int status;
+        REQUIRE( waitpid(pid, &status, 0) == pid );
+        REQUIRE( WIFEXITED(status) );
+        REQUIRE( WEXITSTATUS(status) == EXIT_FAILURE );
+    }
+    remove(filename);
+    remove(bad_filename);
+}
+
+TEST_CASE( "pore model set", "[pore_model_set]") {
+
+    // every model is found by the same handle from its key and from its metadata
+    size_t n_models = 0;
+    std::vector<const Alphabet*> alphabets = get_alphabet_list();
+    for(int kit = 0; kit < NUM_KITS; ++kit) {
+        for(size_t ai = 0; ai < alphabets.size(); ++ai) {
+            for(size_t k = 5; k <= 6; ++k) {
+                PoreModelMap models = PoreModelSet::copy_strand_models((KitVersion)kit, alphabets[ai], k);
+                for(const auto& kv : models) {
+                    const PoreModel& model = kv.second;
+                    std::string kit_name = model.metadata.get_kit_name();
+                    std::string strand = model.metadata.get_strand_model_name();
+
+                    PoreModelHandle handle = PoreModelSet::get_model_handle(kit_name, alphabets[ai]->get_name(), strand, k);
+                    REQUIRE( handle != INVALID_PORE_MODEL_HANDLE );
+                    REQUIRE( PoreModelSet::find_model((KitVersion)kit, alphabets[ai], model.metadata.model_idx, k) == handle );
+                    REQUIRE( &PoreModelSet::get_model(handle) == &PoreModelSet::get_model_by_key(kv.first) );
+                    REQUIRE( PoreModelSet::get_model_key(PoreModelSet::get_model(handle)) == kv.first );
+                    REQUIRE( PoreModelSet::get_model(handle).name == model.name );
+                    n_models += 1;
+                }
+            }
+        }
+    }
+    REQUIRE( n_models > 0 );
+
+    PoreModelHandle handle = PoreModelSet::get_model_handle("r9.4_450bps", "nucleotide", "template", 6);
+    REQUIRE( &PoreModelSet::get_model(handle) == &PoreModelSet::get_model("r9.4_450bps", "nucleotide", "template", 6) );
+
+    // unknown models are not found
+    const Alphabet* nucleotide = get_alphabet_by_name("nucleotide");
+    REQUIRE( !PoreModelSet::has_model("r9.4_450bps", "nucleotide", "template", 7) );
+    REQUIRE( PoreModelSet::find_model(KV_R9_4_450BPS, nucleotide, 0, 7) == INVALID_PORE_MODEL_HANDLE );
+    REQUIRE( PoreModelSet::find_model(KV_R9_4_450BPS, nucleotide, 3, 6) == INVALID_PORE_MODEL_HANDLE );
+    REQUIRE( PoreModelSet::find_model(KV_R9_4_450BPS, nucleotide, 0, MAX_INDEXED_MODEL_K + 1) == INVALID_PORE_MODEL_HANDLE );
+
+    pid_t pid = fork();
+    REQUIRE( pid >= 0 );
+    if(pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        PoreModelSet::get_model_handle("r9.4_450bps", "nucleotide", "template", 7);
+        _exit(0);
+    }
+    int status;
+    REQUIRE( waitpid(pid, &status, 0) == pid );
+    REQUIRE( WIFEXITED(status) );
+    REQUIRE( WEXITSTATUS(status) == EXIT_FAILURE );
+
+    // replacing a model keeps its handle and changes its fingerprint
+    PoreModel original = PoreModelSet::get_model(handle);
+    uint64_t fingerprint = PoreModelSet::get_model_fingerprint(handle);
+    PoreModel replacement = original;
+    replacement.states[0].level_mean += 1.0;
+    PoreModelSet::add_model(replacement);
+    REQUIRE( PoreModelSet::get_model_handle("r9.4_450bps", "nucleotide", "template", 6) == handle );
+    REQUIRE( PoreModelSet::get_model(handle).states[0].level_mean == replacement.states[0].level_mean );
+    REQUIRE( PoreModelSet::get_model_fingerprint(handle) != fingerprint );
+
+    PoreModelSet::add_model(original);
+    REQUIRE( PoreModelSet::get_model_fingerprint(handle) == fingerprint );
+}
+
+TEST_CASE( "adaptive banded alignment", "[raw_loader]") {
+    const PoreModel& model = PoreModelSet::get_model("r9.4_450bps", "nucleotide", "template", 6);
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> base(0, 3);
+    std::uniform_int_distribution<int> events_per_kmer(1, 3);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+
+    std::string sequence;
+    for(size_t i = 0; i < 2000; ++i) {
+        sequence.push_back("ACGT"[base(rng)]);
+    }
+    size_t n_kmers = sequence.size() - model.k + 1;
+
+    // simulate events with a read specific shift and scale, remembering
+    // the k-mer that emitted each one
+    std::vector<SquiggleEvent> events;
+    std::vector<int> event_kmer;
+    for(size_t ki = 0; ki < n_kmers; ++ki) {
+        const PoreModelStateParams& state = model.states[model.pmalphabet->kmer_rank(sequence.c_str() + ki, model.k)];
+        for(int j = events_per_kmer(rng); j > 0; --j) {
+            SquiggleEvent e;
+            e.mean = 10.0f + 1.2f * (state.level_mean + state.level_stdv * noise(rng));
+            e.stdv = state.sd_mean;
+            e.log_stdv = log(e.stdv);
+            e.start_time = events.size() * 0.002;
+            e.duration = 0.002;
+            events.push_back(e);
+            event_kmer.push_back(ki);
+        }
+    }
+
+    std::vector<AlignedPair> alignment = adaptive_banded_event_align(events, sequence, model);
+    REQUIRE( !alignment.empty() );
+    REQUIRE( alignment.front().ref_pos == 0 );
+    REQUIRE( alignment.back().ref_pos == (int)n_kmers - 1 );
+
+    // events are used at most once, in order, and the k-mers never move backwards
+    size_t n_out_of_order = 0;
+    size_t n_correct = 0;
+    for(size_t i = 0; i < alignment.size(); ++i) {
+        if(i > 0) {
+            n_out_of_order += alignment[i].read_pos <= alignment[i - 1].read_pos ||
+                              alignment[i].ref_pos < alignment[i - 1].ref_pos;
+        }
+        n_correct += event_kmer[alignment[i].read_pos] == alignment[i].ref_pos;
+    }
+    REQUIRE( n_out_of_order == 0 );
+    REQUIRE( n_correct > 0.9 * events.size() );
+
+    // the same events in a random order do not fit the sequence
+    std::shuffle(events.begin(), events.end(), rng);
+    REQUIRE( adaptive_banded_event_align(events, sequence, model).empty() );
+}
+
+// Fill read with template events simulated from sequence with the unscaled
+// r9.4 6-mer model, with every other k-mer emitting two events
+void simulate_r9_read(SquiggleRead& read, const std::string& sequence, std::mt19937& rng)
+{
+    read.read_type = SRT_TEMPLATE;
+    read.events_per_base[0] = 1.5;
+    read.drift_correction_performed = true; // simulated without drift
+
+    PoreModel& model = read.pore_model[0];
+    model = PoreModelSet::get_model("r9.4_450bps", "nucleotide", "template", 6);
+    model.shift = 0.0;
+    model.scale = 1.0;
+    model.drift = 0.0;
+    model.var = 1.0;
+    model.scale_sd = 1.0;
+    model.var_sd = 1.0;
+    model.bake_gaussian_parameters();
+
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::vector<SquiggleEvent>& events = read.events[0];
+    events.clear();
+    uint32_t n_kmers = sequence.size() - model.k + 1;
+    for(uint32_t ki = 0; ki < n_kmers; ++ki) {
+        uint32_t rank = gDNAAlphabet.kmer_rank(sequence.c_str() + ki, model.k);
+        const PoreModelStateParams& state = model.states[rank];
+        for(uint32_t j = 0; j <= ki % 2; ++j) {
+            SquiggleEvent e;
+            e.mean = state.level_mean + state.level_stdv * noise(rng);
+            e.stdv = state.sd_mean;
+            e.log_stdv = log(e.stdv);
+            e.start_time = events.size() * 0.002;
+            e.duration = 0.002;
+            events.push_back(e);
+        }
+    }
+}
+
 TEST_CASE( "hmm", "[hmm]") {
 
     // read the FAST5
@@ -391,7 +1263,259 @@ TEST_CASE( "hmm", "[hmm]") {
         // forward algorithm
         double lp = profile_hmm_score(ref_subseq, input[si]);
         REQUIRE(lp == Approx(expected_forward[si]));
+
+        // posteriors are only computed by the R9 HMM
+        std::vector<HMMAlignmentState> r7_alignment = profile_hmm_align(ref_subseq, input[si], HAF_COMPUTE_POSTERIOR);
+        REQUIRE( r7_alignment.size() == event_alignment.size() );
+        for(size_t i = 0; i < r7_alignment.size(); ++i) {
+            REQUIRE( std::isnan(r7_alignment[i].l_posterior) );
+        }
+    }
+
+    // The backward algorithm is R9 only so use a simulated read
+    SquiggleRead r9_read;
+    std::mt19937 rng(1);
+    simulate_r9_read(r9_read, ref_subseq, rng);
+    const PoreModel& r9_model = r9_read.pore_model[0];
+    const std::vector<SquiggleEvent>& r9_events = r9_read.events[0];
+    uint32_t n_kmers = ref_subseq.size() - r9_model.k + 1;
+
+    HMMInputData r9_input;
+    r9_input.read = &r9_read;
+    r9_input.event_start_idx = 0;
+    r9_input.event_stop_idx = r9_events.size() - 1;
+    r9_input.event_stride = 1;
+    r9_input.rc = false;
+    r9_input.strand = 0;
+
+    HMMInputSequence r9_sequence(ref_subseq);
+    uint32_t n_rows = r9_events.size() + 1;
+    uint32_t n_states = PSR9_NUM_STATES * (n_kmers + 2);
+
+    FloatMatrix fm;
+    allocate_matrix(fm, n_rows, n_states);
+    profile_hmm_forward_initialize_r9(fm);
+    ProfileHMMForwardOutputR9 forward_output(&fm);
+    float lp_forward = profile_hmm_fill_generic_r9(r9_sequence, r9_input, 0, 0, forward_output);
+    REQUIRE( lp_forward == Approx(profile_hmm_score(r9_sequence, r9_input)) );
+    REQUIRE( lp_forward > -INFINITY );
+
+    FloatMatrix bm;
+    allocate_matrix(bm, n_rows, n_states);
+    profile_hmm_backward_r9(r9_sequence, r9_input, 0, bm);
+
+    // the start state can only emit the first event from the first k-mer
+    uint32_t first_rank = r9_sequence.get_kmer_rank(0, r9_model.k, false);
+    float lp_backward = make_pre_flanking(r9_input, 0, r9_events.size())[0] +
+                        log_probability_match_r9(r9_read, first_rank, 0, 0) +
+                        get(bm, 1, PSR9_NUM_STATES + PSR9_MATCH);
+    REQUIRE( lp_backward == Approx(lp_forward) );
+
+    // each event is emitted by exactly one match or bad event state
+    for(uint32_t row = 1; row < n_rows; ++row) {
+        double sum = 0.0;
+        for(uint32_t col = PSR9_NUM_STATES; col < n_states - PSR9_NUM_STATES; ++col) {
+            double posterior = exp(get(fm, row, col) + get(bm, row, col) - lp_forward);
+            REQUIRE( posterior >= 0.0 );
+            REQUIRE( posterior <= 1.0 + 1e-3 );
+            if(col % PSR9_NUM_STATES != PSR9_KMER_SKIP) {
+                sum += posterior;
+            }
+        }
+        REQUIRE( sum == Approx(1.0).epsilon(1e-3) );
+    }
+    free_matrix(fm);
+    free_matrix(bm);
+
+    std::vector<HMMAlignmentState> r9_alignment = profile_hmm_align(r9_sequence, r9_input, HAF_COMPUTE_POSTERIOR);
+    REQUIRE( !r9_alignment.empty() );
+    for(size_t i = 0; i < r9_alignment.size(); ++i) {
+        REQUIRE( !std::isnan(r9_alignment[i].l_posterior) );
+        REQUIRE( r9_alignment[i].l_posterior <= 0.0f );
+    }
+}
+
+TEST_CASE( "candidate edits", "[candidate_edits]") {
+    std::mt19937 rng(3);
+    std::uniform_int_distribution<int> base(0, 3);
+    std::string truth;
+    for(size_t i = 0; i < 300; ++i) {
+        truth.push_back("ACGT"[base(rng)]);
+    }
+
+    // the draft has one substitution, which changes the k-mers starting at 145 to 150
+    const int error_position = 150;
+    std::string draft = truth;
+    draft[error_position] = draft[error_position] == 'A' ? 'C' : 'A';
+
+    const size_t n_reads = 20;
+    SquiggleRead reads[n_reads];
+    std::vector<HMMInputData> event_sequences(n_reads);
+    for(size_t ri = 0; ri < n_reads; ++ri) {
+        simulate_r9_read(reads[ri], truth, rng);
+        HMMInputData& data = event_sequences[ri];
+        data.read = &reads[ri];
+        data.event_start_idx = 0;
+        data.event_stop_idx = reads[ri].events[0].size() - 1;
+        data.event_stride = 1;
+        data.rc = false;
+        data.strand = 0;
+    }
+
+    uint32_t alignment_flags = HAF_ALLOW_PRE_CLIP | HAF_ALLOW_POST_CLIP;
+    std::vector<double> residuals = calculate_kmer_residuals(draft, event_sequences, alignment_flags);
+    REQUIRE( residuals.size() == draft.size() );
+    REQUIRE( calculate_kmer_residuals(truth, event_sequences, alignment_flags) != residuals );
+
+    const double threshold = 2.0;
+    const int neighbourhood = 3;
+    int k = reads[0].pore_model[0].k;
+    for(int i = 0; i < (int)residuals.size(); ++i) {
+        if(i > error_position - k && i <= error_position) {
+            continue;
+        }
+        REQUIRE( residuals[i] < threshold );
+    }
+    REQUIRE( *std::max_element(residuals.begin() + error_position - k + 1,
+                               residuals.begin() + error_position + 1) >= threshold );
+
+    // edits over the middle of the draft
+    const int region_start = 20;
+    const int region_end = 280;
+    std::vector<double> region_residuals(residuals.begin() + region_start, residuals.begin() + region_end);
+
+    // a threshold of 0 proposes every edit
+    std::vector<bool> propose_all = select_edit_positions(region_residuals, 0.0, neighbourhood);
+    REQUIRE( std::count(propose_all.begin(), propose_all.end(), true) == region_end - region_start );
+    std::vector<Variant> all_edits = generate_single_base_edits("draft", draft, 0, region_start, region_end, propose_all);
+
+    size_t expected_edits = 0;
+    for(int i = region_start; i < region_end; ++i) {
+        expected_edits += 3 + 3 + (draft[i - 1] != draft[i]); // substitutions, insertions, deletion
+    }
+    REQUIRE( all_edits.size() == expected_edits );
+
+    // a positive threshold only proposes edits around the high residual k-mers
+    std::vector<bool> propose = select_edit_positions(region_residuals, threshold, neighbourhood);
+    REQUIRE( propose[error_position - region_start] );
+    std::vector<Variant> edits = generate_single_base_edits("draft", draft, 0, region_start, region_end, propose);
+    REQUIRE( !edits.empty() );
+    REQUIRE( edits.size() < all_edits.size() );
+
+    bool has_fix = false;
+    for(size_t i = 0; i < edits.size(); ++i) {
+        // deletions are anchored on the preceding base
+        int position = edits[i].ref_position + (edits[i].ref_seq.size() == 2);
+        REQUIRE( position >= error_position - k + 1 - neighbourhood );
+        REQUIRE( position <= error_position + neighbourhood );
+        has_fix = has_fix || (edits[i].ref_position == error_position &&
+                              edits[i].alt_seq == truth.substr(error_position, 1));
+    }
+    REQUIRE( has_fix );
+}
+
+TEST_CASE( "eventalign chunks", "[eventalign]") {
+
+    // a read spanning two and a half chunks, aligned to the reference without gaps
+    std::mt19937 rng(5);
+    std::uniform_int_distribution<int> base(0, 3);
+    std::string reference;
+    for(int i = 0; i < 5 * EVENTALIGN_CHUNK_SIZE / 2 + 200; ++i) {
+        reference.push_back("ACGT"[base(rng)]);
     }
+    const int read_start = 100;
+    std::string read_sequence = reference.substr(read_start, reference.size() - 2 * read_start);
+
+    const char* fasta_filename = "test_eventalign.fa";
+    const char* sam_filename = "test_eventalign.sam";
+    remove("test_eventalign.fa.fai");
+    FILE* fp = fopen(fasta_filename, "w");
+    fprintf(fp, ">ref\n%s\n", reference.c_str());
+    fclose(fp);
+
+    fp = fopen(sam_filename, "w");
+    fprintf(fp, "@SQ\tSN:ref\tLN:%zu\n", reference.size());
+    fprintf(fp, "read\t0\tref\t%d\t60\t%zuM\t*\t0\t0\t%s\t*\n", read_start + 1, read_sequence.size(), read_sequence.c_str());
+    fclose(fp);
+
+    faidx_t* fai = fai_load(fasta_filename);
+    REQUIRE( fai != NULL );
+    samFile* sam_fp = sam_open(sam_filename, "r");
+    REQUIRE( sam_fp != NULL );
+    bam_hdr_t* hdr = sam_hdr_read(sam_fp);
+    REQUIRE( hdr != NULL );
+    bam1_t* record = bam_init1();
+    REQUIRE( sam_read1(sam_fp, hdr, record) >= 0 );
+
+    SquiggleRead sr;
+    simulate_r9_read(sr, read_sequence, rng);
+    sr.read_sequence = read_sequence;
+
+    // map each k-mer to the events simulate_r9_read made for it
+    size_t n_kmers = read_sequence.size() - sr.pore_model[0].k + 1;
+    sr.base_to_event_map.resize(n_kmers);
+    int n_events = 0;
+    for(size_t ki = 0; ki < n_kmers; ++ki) {
+        sr.base_to_event_map[ki].indices[0].start = n_events;
+        n_events += 1 + ki % 2;
+        sr.base_to_event_map[ki].indices[0].stop = n_events - 1;
+    }
+    REQUIRE( n_events == (int)sr.events[0].size() );
+
+    EventAlignmentParameters params;
+    params.sr = &sr;
+    params.fai = fai;
+    params.hdr = hdr;
+    params.record = record;
+    params.strand_idx = 0;
+    params.read_idx = 0;
+
+    // the output must not depend on the run or the number of threads
+    int saved_num_threads = get_parallel_num_threads();
+    std::vector<EventAlignment> alignment;
+    int thread_counts[] = { 1, 4, 4 };
+    for(size_t ti = 0; ti < 3; ++ti) {
+        set_parallel_num_threads(thread_counts[ti]);
+        std::vector<EventAlignment> run = align_read_to_ref(params);
+        if(ti == 0) {
+            alignment = run;
+            continue;
+        }
+
+        REQUIRE( run.size() == alignment.size() );
+        size_t n_different = 0;
+        for(size_t ai = 0; ai < run.size(); ++ai) {
+            n_different += run[ai].event_idx != alignment[ai].event_idx ||
+                           run[ai].ref_position != alignment[ai].ref_position ||
+                           run[ai].model_kmer_rank != alignment[ai].model_kmer_rank ||
+                           run[ai].hmm_state != alignment[ai].hmm_state;
+        }
+        REQUIRE( n_different == 0 );
+    }
+    set_parallel_num_threads(saved_num_threads);
+
+    // every event after the first, which anchors the alignment, is output once
+    // and in order, including those at the seams between chunks
+    REQUIRE( !alignment.empty() );
+    REQUIRE( alignment.front().event_idx == 1 );
+    REQUIRE( alignment.back().event_idx == sr.base_to_event_map[n_kmers - 1].indices[0].start );
+    size_t n_out_of_order = 0;
+    for(size_t ai = 1; ai < alignment.size(); ++ai) {
+        n_out_of_order += alignment[ai].event_idx != alignment[ai - 1].event_idx + 1 ||
+                          alignment[ai].ref_position < alignment[ai - 1].ref_position;
+    }
+    REQUIRE( n_out_of_order == 0 );
+    int k = sr.pore_model[0].k;
+    REQUIRE( alignment.front().ref_position >= read_start );
+    REQUIRE( alignment.back().ref_position >= read_start + (int)n_kmers - k );
+
+    bam_destroy1(record);
+    bam_hdr_destroy(hdr);
+    sam_close(sam_fp);
+    fai_destroy(fai);
+    remove(fasta_filename);
+    remove("test_eventalign.fa.fai");
+    remove(sam_filename);
 }
 
 std::vector< StateTrainingData >
@@ -1,147 +1,215 @@
 #include "training_core.hpp"
 #include "nanopolish_emissions.h"
-#include "logsumset.hpp"
 #include "logger.hpp"
 
 using std::string;
 using std::vector;
-using std::multiset;
 using std::endl;
 
-const bool use_multiset_logsum = 
-#ifndef USE_MULTISET_LOGSUM
-    false;
-#else
-    true;
-#endif
+// The EM passes work through the events in blocks small enough that the
+// per-component terms of a block stay in the L1 cache, so computing the
+// responsibilities and accumulating the sufficient statistics is a single
+// pass over the data
+static const size_t EM_BLOCK_SIZE = 256;
 
-ParamMixture train_gaussian_mixture(const vector< StateTrainingData >& data, const ParamMixture& input_mixture)
+// keep a component's stdv from collapsing to zero on degenerate data
+static const double MIN_COMPONENT_VAR = 1e-6;
+
+void MixtureTrainingData::assign(const vector< StateTrainingData >& data)
+{
+    size_t n = data.size();
+    level.resize(n);
+    read_var.resize(n);
+    log_read_var.resize(n);
+    stdv.resize(n);
+    log_stdv.resize(n);
+    sd_scale.resize(n);
+    log_sd_scale.resize(n);
+
+    for(size_t i = 0; i < n; ++i) {
+        level[i] = data[i].level_mean;
+        read_var[i] = data[i].scaled_read_var;
+        log_read_var[i] = data[i].log_scaled_read_var;
+        stdv[i] = data[i].level_stdv;
+        log_stdv[i] = data[i].log_level_stdv;
+        sd_scale[i] = data[i].read_var_sd / data[i].read_scale_sd;
+        log_sd_scale[i] = data[i].log_read_var_sd - data[i].log_read_scale_sd;
+    }
+}
+
+// Normalize the joint log terms of a block over the components. On return
+// lp holds the log responsibilities, or the responsibilities themselves if
+// exponentiate is set. Returns the log-likelihood of the block.
+static double normalize_block(float lp[][EM_BLOCK_SIZE], size_t n_components, size_t n, bool exponentiate)
+{
+    double ll = 0.0;
+    #pragma omp simd reduction(+:ll)
+    for(size_t i = 0; i < n; ++i) {
+        float m = lp[0][i];
+        for(size_t j = 1; j < n_components; ++j) {
+            m = std::max(m, lp[j][i]);
+        }
+
+        float sum = 0.0f;
+        for(size_t j = 0; j < n_components; ++j) {
+            sum += std::exp(lp[j][i] - m);
+        }
+
+        float lse = m + std::log(sum);
+        for(size_t j = 0; j < n_components; ++j) {
+            lp[j][i] = exponentiate ? std::exp(lp[j][i] - lse) : lp[j][i] - lse;
+        }
+        ll += lse;
+    }
+    return ll;
+}
+
+// Write the joint log terms w_j * gauss(mu_j, sigma_j * scaled_read_var_i, level_mean_i)
+// of a block of events into lp
+static void gaussian_block_terms(const MixtureTrainingData& data, size_t start, size_t n,
+                                 const ParamMixture& mixture, float lp[][EM_BLOCK_SIZE])
+{
+    const float* x = data.level.data() + start;
+    const float* s = data.read_var.data() + start;
+    const float* log_s = data.log_read_var.data() + start;
+
+    for(size_t j = 0; j < mixture.params.size(); ++j) {
+        const float mu = mixture.params[j].level_mean;
+        const float inv_sd = 1.0f / mixture.params[j].level_stdv;
+        const float c = mixture.log_weights[j] + log_inv_sqrt_2pi - mixture.params[j].level_log_stdv;
+        float* lp_j = lp[j];
+
+        #pragma omp simd
+        for(size_t i = 0; i < n; ++i) {
+            float a = (x[i] - mu) * inv_sd / s[i];
+            lp_j[i] = c - log_s[i] - 0.5f * a * a;
+        }
+    }
+}
+
+ParamMixture train_gaussian_mixture(const MixtureTrainingData& data,
+                                    const ParamMixture& input_mixture,
+                                    const MixtureTrainingOptions& options)
 {
     size_t n_components = input_mixture.params.size();
     size_t n_data = data.size();
-    float log_n_data = std::log(n_data);
     assert(input_mixture.log_weights.size() == n_components);
+    assert(n_components > 0 && n_components <= MAX_MIXTURE_COMPONENTS);
     ParamMixture curr_mixture = input_mixture;
+    if(n_data == 0) {
+        return curr_mixture;
+    }
 
-    for(size_t iteration = 0; iteration < 10; ++iteration) {
-        ParamMixture new_mixture = curr_mixture;
+    float resp[MAX_MIXTURE_COMPONENTS][EM_BLOCK_SIZE];
+    double prev_ll = -INFINITY;
 
-        // compute log_pdfs
-        //
-        //   pdf[i][j] := gauss(mu_j, sigma_j * read_var_i, level_mean_i)
-        //
-        vector< vector< float > > log_pdf(n_data);
-        for(size_t i = 0; i < n_data; ++i) {
-            log_pdf[i].resize(n_components);
-            for(size_t j = 0; j < n_components; ++j) {
-                // We need to scale the mixture component parameters by the per-read var factor
-                PoreModelStateParams scaled_state = curr_mixture.params[j];
-                scaled_state.level_stdv *= data[i].scaled_read_var;
-                scaled_state.level_log_stdv += data[i].log_scaled_read_var;
-                log_pdf[i][j] = log_normal_pdf(data[i].level_mean, scaled_state);
-                assert(not std::isnan(log_pdf[i][j]));
-                LOG("training_core", debug1)
-                    << "pdf " << i << " " << j << " "
-                    << std::scientific << std::exp(log_pdf[i][j]) << " ("
-                    << std::fixed << std::setprecision(2) << log_pdf[i][j] << ")" << endl;
-            }
-        }
+    for(size_t iteration = 0; iteration < options.max_iterations; ++iteration) {
 
-        // compute responsibilities
+        // sufficient statistics
         //
-        //   resp[i][j] := ( w_j * pdf[i][j] ) / sum_k ( w_k * pdf[i][k] )
+        //   r_j       := sum_i resp[i][j]
+        //   rx_j      := sum_i resp[i][j] * level_mean_i
+        //   rs_j      := sum_i resp[i][j] / scaled_read_var_i^2
+        //   rsx_j     := sum_i resp[i][j] * level_mean_i / scaled_read_var_i^2
+        //   rsxx_j    := sum_i resp[i][j] * level_mean_i^2 / scaled_read_var_i^2
         //
-        vector< vector< float > > log_resp(n_data);
-        for(size_t i = 0; i < n_data; ++i) {
-            log_resp[i].resize(n_components);
-            logsumset< float > denom_terms(use_multiset_logsum);
-            for(size_t j = 0; j < n_components; ++j) {
-                float v = curr_mixture.log_weights[j] + log_pdf[i][j];
-                log_resp[i][j] = v;
-                denom_terms.add(v);
-                LOG("training_core", debug1)
-                    << "resp_numer " << i << " " << j << " "
-                    << std::scientific << std::exp(v) << " ("
-                    << std::fixed << std::setprecision(2) << v << ")" << endl;
-            }
-            float log_denom = denom_terms.val();
-            LOG("training_core", debug1) << "resp_denom " << i << " "
-                << std::scientific << log_denom << " " << std::exp(log_denom) << std::endl;
+        double r[MAX_MIXTURE_COMPONENTS] = { 0.0 };
+        double rx[MAX_MIXTURE_COMPONENTS] = { 0.0 };
+        double rs[MAX_MIXTURE_COMPONENTS] = { 0.0 };
+        double rsx[MAX_MIXTURE_COMPONENTS] = { 0.0 };
+        double rsxx[MAX_MIXTURE_COMPONENTS] = { 0.0 };
+        double ll = 0.0;
+
+        for(size_t start = 0; start < n_data; start += EM_BLOCK_SIZE) {
+            size_t n = std::min(EM_BLOCK_SIZE, n_data - start);
+
+            // compute responsibilities
+            //
+            //   resp[i][j] := ( w_j * pdf[i][j] ) / sum_k ( w_k * pdf[i][k] )
+            //
+            gaussian_block_terms(data, start, n, curr_mixture, resp);
+            ll += normalize_block(resp, n_components, n, true);
+
+            const float* x = data.level.data() + start;
+            const float* s = data.read_var.data() + start;
             for(size_t j = 0; j < n_components; ++j) {
-                log_resp[i][j] -= log_denom;
-                LOG("training_core", debug1)
-                    << "resp " << i << " " << j << " "
-                    << std::fixed << std::setprecision(5) << std::exp(log_resp[i][j]) << " ("
-                    << std::fixed << std::setprecision(2) << log_resp[i][j] << ")" << endl;
-            }
-        }
+                const float* resp_j = resp[j];
+                double b_r = 0.0, b_rx = 0.0, b_rs = 0.0, b_rsx = 0.0, b_rsxx = 0.0;
 
-        // update weights
-        //
-        //   w'[j] := sum_i resp[i][j] / n_data
-        //
-        for (size_t j = 0; j < n_components; ++j) {
-            logsumset< float > numer_terms(use_multiset_logsum);
-            for (size_t i = 0; i < n_data; ++i) {
-                numer_terms.add(log_resp[i][j]);
-            }
-            float log_numer = numer_terms.val();
-            new_mixture.log_weights[j] = log_numer - log_n_data;
-        }
+                #pragma omp simd reduction(+:b_r,b_rx,b_rs,b_rsx,b_rsxx)
+                for(size_t i = 0; i < n; ++i) {
+                    double ri = resp_j[i];
+                    double xi = x[i];
+                    double rsi = ri / ((double)s[i] * s[i]);
+                    b_r += ri;
+                    b_rx += ri * xi;
+                    b_rs += rsi;
+                    b_rsx += rsi * xi;
+                    b_rsxx += rsi * xi * xi;
+                }
 
-        // update means
-        //
-        //   mu_j := sum_i ( resp[i][j] * level_mean_i ) / sum_i resp[i][j]
-        //         = sum_i ( resp[i][j] * level_mean_i ) / ( w'[j] * n_data )
-        //
-        vector< float > new_log_mean(2);
-        for (size_t j = 0; j < n_components; ++j) {
-            logsumset< float > numer_terms(use_multiset_logsum);
-            for (size_t i = 0; i < n_data; ++i) {
-                numer_terms.add(log_resp[i][j] + data[i].log_level_mean);
+                r[j] += b_r;
+                rx[j] += b_rx;
+                rs[j] += b_rs;
+                rsx[j] += b_rsx;
+                rsxx[j] += b_rsxx;
             }
-            float log_numer = numer_terms.val();
-            new_log_mean[j] = log_numer - (log_n_data + new_mixture.log_weights[j]);
         }
 
-        // update stdvs
+        // update weights, means and stdvs
         //
-        //   var_j := sum_i ( resp[i][j] * ( ( level_mean_i - mu_j ) / scaled_read_var_i )^2 ) / sum_i resp[i][j]
-        //          = sum_i ( resp[i][j] * ( ( level_mean_i - mu_j ) / scaled_read_var_i )^2 ) / ( w'[j] * n_data )
+        //   w'[j] := r_j / n_data
+        //   mu_j  := rx_j / r_j
+        //   var_j := sum_i ( resp[i][j] * ( ( level_mean_i - mu_j ) / scaled_read_var_i )^2 ) / r_j
+        //          = ( rsxx_j - 2 * mu_j * rsx_j + mu_j^2 * rs_j ) / r_j
         //
-        vector< float > new_log_var(2);
-        for (size_t j = 0; j < n_components; ++j) {
-            logsumset< float > numer_terms(use_multiset_logsum);
-            for (size_t i = 0; i < n_data; ++i) {
-                float v = std::abs(data[i].level_mean - std::exp(new_log_mean[j]));
-                numer_terms.add(log_resp[i][j] + (not std::isnan(v) and v > 0? 2.0 * (std::log(v) - data[i].log_scaled_read_var) : 0.0));
+        ParamMixture new_mixture = curr_mixture;
+        for(size_t j = 0; j < n_components; ++j) {
+            if(!(r[j] > 0.0)) {
+                // this component has no support, it keeps its parameters and drops out
+                new_mixture.log_weights[j] = -INFINITY;
+                continue;
             }
-            float log_numer = numer_terms.val();
-            new_log_var[j] = log_numer - (log_n_data + new_mixture.log_weights[j]);
-        }
 
-        for(size_t j = 0; j < n_components; ++j) {
-            new_mixture.params[j].level_mean = std::exp(new_log_mean[j]);
-            new_mixture.params[j].level_log_stdv = .5 * new_log_var[j];
-            new_mixture.params[j].level_stdv = std::exp(new_mixture.params[j].level_log_stdv);
+            double mu = rx[j] / r[j];
+            double var = (rsxx[j] - 2.0 * mu * rsx[j] + mu * mu * rs[j]) / r[j];
+            var = std::max(var, MIN_COMPONENT_VAR);
+
+            new_mixture.log_weights[j] = std::log(r[j] / n_data);
+            new_mixture.params[j].level_mean = mu;
+            new_mixture.params[j].level_log_stdv = .5 * std::log(var);
+            new_mixture.params[j].level_stdv = std::sqrt(var);
             LOG("training_core", debug)
                 << "new_mixture " << iteration << " " << j << " "
                 << std::fixed << std::setprecision(5) << std::exp(new_mixture.log_weights[j]) << " "
                 << std::setprecision(3) << new_mixture.params[j].level_mean << " "
                 << new_mixture.params[j].level_stdv << endl;
         }
-
         curr_mixture = new_mixture;
+
+        // ll is the likelihood of the mixture this iteration started from
+        LOG("training_core", debug)
+            << "log_likelihood " << iteration << " " << std::fixed << std::setprecision(3) << ll << endl;
+        if(ll - prev_ll < options.tolerance * n_data) {
+            break;
+        }
+        prev_ll = ll;
     }
     return curr_mixture;
 }
 
-ParamMixture train_invgaussian_mixture(const vector< StateTrainingData >& data, const ParamMixture& in_mixture)
+ParamMixture train_invgaussian_mixture(const MixtureTrainingData& data,
+                                       const ParamMixture& in_mixture,
+                                       const MixtureTrainingOptions& options)
 {
     size_t n_components = in_mixture.params.size();
     assert(in_mixture.log_weights.size() == n_components);
+    assert(n_components > 0 && n_components <= MAX_MIXTURE_COMPONENTS);
     size_t n_data = data.size();
     auto crt_mixture = in_mixture;
+    if(n_data == 0) {
+        return crt_mixture;
+    }
 
     for (size_t j = 0; j < n_components; ++j) {
         LOG("training_core", debug)
@@ -150,107 +218,78 @@ ParamMixture train_invgaussian_mixture(const vector< StateTrainingData >& data,
             << std::setprecision(5) << in_mixture.params[j].sd_mean << endl;
     }
 
-    // compute gaussian pdfs
-    //
-    //   pdf[i][j].first = gauss(mu_j, sigma_j * scaled_read_var_i, level_mean_i)
-    //
-    vector< vector< std::pair< float, float > > > log_pdf(n_data);
-    for (size_t i = 0; i < n_data; ++i) {
-        log_pdf[i].resize(n_components);
-        for (size_t j = 0; j < n_components; ++j) {
-            PoreModelStateParams scaled_state = in_mixture.params[j];
-            scaled_state.level_stdv *= data[i].scaled_read_var;
-            scaled_state.level_log_stdv += data[i].log_scaled_read_var;
-            log_pdf[i][j].first = log_normal_pdf(data[i].level_mean, scaled_state);
-            assert(not std::isnan(log_pdf[i][j].first));
-            LOG("training_core", debug1)
-                << "gauss_pdf " << i << " " << j << " "
-                << std::scientific << std::exp(log_pdf[i][j].first) << " ("
-                << std::fixed << std::setprecision(2) << log_pdf[i][j].first << ")" << endl;
-        }
-    }
+    static const float log_2pi = std::log(2 * M_PI);
+    float log_g_weights[MAX_MIXTURE_COMPONENTS][EM_BLOCK_SIZE];
+    float ig_weights[MAX_MIXTURE_COMPONENTS][EM_BLOCK_SIZE];
+    double prev_ll = -INFINITY;
 
-    // compute gaussian weights
-    //
-    //   g_weights[i][j] := ( w_j * pdf[i][j].first ) / sum_k ( w_k * pdf[i][k].first )
-    //
-    vector< vector< float > > log_g_weights(n_data);
-    for (size_t i = 0; i < n_data; ++i) {
-        log_g_weights[i].resize(n_components);
-        logsumset< float > denom_terms(use_multiset_logsum);
-        for (size_t j = 0; j < n_components; ++j) {
-            float v = in_mixture.log_weights[j] + log_pdf[i][j].first;
-            log_g_weights[i][j] = v;
-            denom_terms.add(v);
-        }
-        float log_denom = denom_terms.val();
-        for (size_t j = 0; j < n_components; ++j) {
-            log_g_weights[i][j] -= log_denom;
-            LOG("training_core", debug1)
-                << "g_weights " << i << " " << j << " "
-                << std::fixed << std::setprecision(5) << std::exp(log_g_weights[i][j]) << " ("
-                << std::fixed << std::setprecision(2) << log_g_weights[i][j] << ")" << endl;
-        }
-    }
+    for (size_t iteration = 0; iteration < options.max_iterations; ++iteration) {
 
-    for (size_t iteration = 0; iteration < 10; ++iteration) {
-        // compute inverse gaussian pdfs
-        //
-        //   pdf[i][j].second = invgauss(eta_j, lambda_j * ( read_var_sd_i / read_var_scale_i ), level_stdv_i)
-        //
-        for (size_t i = 0; i < n_data; ++i) {
-            for (size_t j = 0; j < n_components; ++j) {
-                PoreModelStateParams scaled_state = crt_mixture.params[j];
-                scaled_state.sd_lambda *= data[i].read_var_sd / data[i].read_scale_sd;
-                scaled_state.sd_log_lambda += data[i].log_read_var_sd - data[i].log_read_scale_sd;
-                log_pdf[i][j].second = log_invgauss_pdf(data[i].level_stdv, data[i].log_level_stdv, scaled_state);
-                assert(not std::isnan(log_pdf[i][j].second));
-                LOG("training_core", debug1)
-                    << "invgauss_pdf " << i << " " << j << " "
-                    << std::scientific << std::exp(log_pdf[i][j].second) << " ("
-                    << std::fixed << std::setprecision(2) << log_pdf[i][j].second << ")" << endl;
-            }
-        }
-        // compute inverse gaussian weights (responsibilities)
-        //
-        //   ig_weights[i][j] := ( g_weights[i][j] * pdf[i][j].second ) / sum_k ( g_weights[i][k] * pdf[i][k].second )
+        //   eta_j := sum_i ( ig_weights[i][j] * lambda'_ij * level_stdv_i ) / sum_i ( ig_weights[i][j] * lambda'_ij )
+        //   lambda'_ij := lambda_j * ( read_var_sd_i / read_var_scale_i )
         //
-        vector< vector< float > > log_ig_weights(n_data);
-        for (size_t i = 0; i < n_data; ++i) {
-            log_ig_weights[i].resize(n_components);
-            logsumset< float > denom_terms(use_multiset_logsum);
-            for (size_t j = 0; j < n_components; ++j) {
-                float v = log_g_weights[i][j] + log_pdf[i][j].second;
-                log_ig_weights[i][j] = v;
-                denom_terms.add(v);
+        // lambda_j is common to the numerator and denominator so only the per-read factor is summed
+        double numer[MAX_MIXTURE_COMPONENTS] = { 0.0 };
+        double denom[MAX_MIXTURE_COMPONENTS] = { 0.0 };
+        double ll = 0.0;
+
+        for(size_t start = 0; start < n_data; start += EM_BLOCK_SIZE) {
+            size_t n = std::min(EM_BLOCK_SIZE, n_data - start);
+
+            // compute gaussian weights, which do not change between iterations
+            //
+            //   g_weights[i][j] := ( w_j * pdf[i][j].first ) / sum_k ( w_k * pdf[i][k].first )
+            //
+            gaussian_block_terms(data, start, n, in_mixture, log_g_weights);
+            normalize_block(log_g_weights, n_components, n, false);
+
+            // compute inverse gaussian weights (responsibilities)
+            //
+            //   pdf[i][j].second = invgauss(eta_j, lambda_j * ( read_var_sd_i / read_var_scale_i ), level_stdv_i)
+            //   ig_weights[i][j] := ( g_weights[i][j] * pdf[i][j].second ) / sum_k ( g_weights[i][k] * pdf[i][k].second )
+            //
+            const float* x = data.stdv.data() + start;
+            const float* log_x = data.log_stdv.data() + start;
+            const float* c = data.sd_scale.data() + start;
+            const float* log_c = data.log_sd_scale.data() + start;
+            for(size_t j = 0; j < n_components; ++j) {
+                const float eta = crt_mixture.params[j].sd_mean;
+                const float lambda = crt_mixture.params[j].sd_lambda;
+                const float log_lambda = crt_mixture.params[j].sd_log_lambda;
+                const float* lg_j = log_g_weights[j];
+                float* ig_j = ig_weights[j];
+
+                #pragma omp simd
+                for(size_t i = 0; i < n; ++i) {
+                    float a = (x[i] - eta) / eta;
+                    float log_pdf = (log_lambda + log_c[i] - log_2pi - 3 * log_x[i] - lambda * c[i] * a * a / x[i]) / 2;
+                    ig_j[i] = lg_j[i] + log_pdf;
+                }
             }
-            float log_denom = denom_terms.val();
-            for (size_t j = 0; j < n_components; ++j) {
-                log_ig_weights[i][j] -= log_denom;
-                LOG("training_core", debug1)
-                    << "ig_weights " << i << " " << j << " "
-                    << std::fixed << std::setprecision(5) << std::exp(log_ig_weights[i][j]) << " ("
-                    << std::fixed << std::setprecision(2) << log_ig_weights[i][j] << ")" << endl;
+            ll += normalize_block(ig_weights, n_components, n, true);
+
+            for(size_t j = 0; j < n_components; ++j) {
+                const float* ig_j = ig_weights[j];
+                double b_numer = 0.0, b_denom = 0.0;
+
+                #pragma omp simd reduction(+:b_numer,b_denom)
+                for(size_t i = 0; i < n; ++i) {
+                    double v = (double)ig_j[i] * c[i];
+                    b_numer += v * x[i];
+                    b_denom += v;
+                }
+                numer[j] += b_numer;
+                denom[j] += b_denom;
             }
         }
 
         // update eta
-        //
-        //   eta_j := sum_i ( ig_weigts[i][j] * lambda'_ij * level_stdv_i ) / sum_i ( ig_weights[i][j] * lambda'_ij )
-        //   lambda'_ij := lambda_j * ( read_var_sd_i / read_var_scale_i )
-        //
         auto new_mixture = crt_mixture;
         for (size_t j = 0; j < n_components; ++j) {
-            logsumset< float > numer_terms(use_multiset_logsum);
-            logsumset< float > denom_terms(use_multiset_logsum);
-            for (size_t i = 0; i < n_data; ++i) {
-                float v = log_ig_weights[i][j] + crt_mixture.params[j].sd_log_lambda + (data[i].log_read_var_sd - data[i].log_read_scale_sd);
-                numer_terms.add(v + data[i].log_level_stdv);
-                denom_terms.add(v);
+            if(!(denom[j] > 0.0)) {
+                continue;
             }
-            float log_numer = numer_terms.val();
-            float log_denom = denom_terms.val();
-            new_mixture.params[j].sd_mean = std::exp(log_numer - log_denom);
+            new_mixture.params[j].sd_mean = numer[j] / denom[j];
             new_mixture.params[j].update_sd_stdv();
             new_mixture.params[j].update_logs();
             LOG("training_core", debug)
@@ -259,7 +298,28 @@ ParamMixture train_invgaussian_mixture(const vector< StateTrainingData >& data,
                 << std::setprecision(5) << new_mixture.params[j].sd_mean << endl;
         }
         std::swap(crt_mixture, new_mixture);
+
+        LOG("training_core", debug)
+            << "log_likelihood " << iteration << " " << std::fixed << std::setprecision(3) << ll << endl;
+        if(ll - prev_ll < options.tolerance * n_data) {
+            break;
+        }
+        prev_ll = ll;
     } // for iteration
 
     return crt_mixture;
 } // train_ig_mixture
+
+ParamMixture train_gaussian_mixture(const vector< StateTrainingData >& data, const ParamMixture& input_mixture)
+{
+    MixtureTrainingData flat_data;
+    flat_data.assign(data);
+    return train_gaussian_mixture(flat_data, input_mixture);
+}
+
+ParamMixture train_invgaussian_mixture(const vector< StateTrainingData >& data, const ParamMixture& in_mixture)
+{
+    MixtureTrainingData flat_data;
+    flat_data.assign(data);
+    return train_invgaussian_mixture(flat_data, in_mixture);
+}
@@ -182,7 +182,42 @@ struct ParamMixture
     std::vector< PoreModelStateParams > params;
 }; // struct ParamMixture
 
+// The training data of a mixture in flat arrays, one entry per event, so the
+// EM iterations stream through contiguous memory
+struct MixtureTrainingData
+{
+    void assign(const std::vector< StateTrainingData >& data);
+    size_t size() const { return level.size(); }
+
+    // for the gaussian components
+    std::vector< float > level;
+    std::vector< float > read_var;      // the per-read scaling of the level stdv
+    std::vector< float > log_read_var;
+
+    // for the inverse gaussian components
+    std::vector< float > stdv;
+    std::vector< float > log_stdv;
+    std::vector< float > sd_scale;      // read_var_sd / read_scale_sd, the per-read scaling of lambda
+    std::vector< float > log_sd_scale;
+}; // struct MixtureTrainingData
+
+// The EM iterations stop when an iteration improves the log-likelihood
+// by less than tolerance per event, or after max_iterations
+struct MixtureTrainingOptions
+{
+    MixtureTrainingOptions() : max_iterations(100), tolerance(1e-6) {}
+    size_t max_iterations;
+    double tolerance;
+}; // struct MixtureTrainingOptions
+
+#define MAX_MIXTURE_COMPONENTS 4
+
 // training functions
+ParamMixture train_gaussian_mixture   (const MixtureTrainingData& data, const ParamMixture& input_mixture,
+                                       const MixtureTrainingOptions& options = MixtureTrainingOptions());
+ParamMixture train_invgaussian_mixture(const MixtureTrainingData& data, const ParamMixture& input_mixture,
+                                       const MixtureTrainingOptions& options = MixtureTrainingOptions());
+
 ParamMixture train_gaussian_mixture   (const std::vector< StateTrainingData >& data, const ParamMixture& input_mixture);
 ParamMixture train_invgaussian_mixture(const std::vector< StateTrainingData >& data, const ParamMixture& input_mixture);
 